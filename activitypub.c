@@ -541,17 +541,16 @@ int timeline_request(snac *snac, const char **id, xs_str **wrk, int level)
 }
 
 
-int send_to_inbox_raw(const char *keyid, const char *seckey,
-                  const xs_str *inbox, const xs_dict *msg,
+static int _send_body_to_inbox(const char *keyid, const char *seckey,
+                  const xs_str *inbox, const char *body,
                   xs_val **payload, int *p_size, int timeout)
-/* sends a message to an Inbox */
+/* sends an already serialized message to an Inbox */
 {
     int status;
     xs_dict *response;
-    xs *j_msg = xs_json_dumps((xs_dict *)msg, 4);
 
     response = http_signed_request_raw(keyid, seckey, "POST", inbox,
-        NULL, j_msg, strlen(j_msg), &status, payload, p_size, timeout);
+        NULL, body, strlen(body), &status, payload, p_size, timeout);
 
     xs_free(response);
 
@@ -559,6 +558,17 @@ int send_to_inbox_raw(const char *keyid, const char *seckey,
 }
 
 
+int send_to_inbox_raw(const char *keyid, const char *seckey,
+                  const xs_str *inbox, const xs_dict *msg,
+                  xs_val **payload, int *p_size, int timeout)
+/* sends a message to an Inbox */
+{
+    xs *j_msg = xs_json_dumps((xs_dict *)msg, 4);
+
+    return _send_body_to_inbox(keyid, seckey, inbox, j_msg, payload, p_size, timeout);
+}
+
+
 int send_to_inbox(snac *snac, const xs_str *inbox, const xs_dict *msg,
                   xs_val **payload, int *p_size, int timeout)
 /* sends a message to an Inbox */
@@ -905,6 +915,145 @@ int is_msg_for_me(snac *snac, const xs_dict *c_msg)
 }
 
 
+static void _shared_input_ref(xs_set *md5s, const char *ref)
+/* adds the local users related to a reference (actor or object id) */
+{
+    if (!xs_is_string(ref))
+        return;
+
+    xs *base = xs_fmt("%s/", srv_baseurl);
+
+    if (xs_startswith(ref, base)) {
+        /* something local: take the user id from the path */
+        const char *uid = ref + strlen(base);
+
+        if (xs_startswith(uid, "users/"))
+            uid += 6;
+
+        xs *l      = xs_split_n(uid, "/", 1);
+        xs *actor  = xs_fmt("%s/%s", srv_baseurl, xs_list_get(l, 0));
+        xs *md5    = xs_md5_hex(actor, strlen(actor));
+
+        xs_set_add(md5s, md5);
+    }
+    else {
+        xs *list = rfollow_users(ref);
+        const char *md5;
+
+        xs_list_foreach(list, md5)
+            xs_set_add(md5s, md5);
+    }
+}
+
+
+static void _shared_input_tags(xs_set *md5s, const xs_dict *obj)
+/* adds the local users following any of the hashtags of an object */
+{
+    const xs_list *tags = xs_dict_get(obj, "tag");
+    const xs_dict *te;
+
+    if (!xs_is_list(tags))
+        return;
+
+    xs_list_foreach(tags, te) {
+        if (xs_is_dict(te)) {
+            const char *type = xs_dict_get(te, "type");
+            const char *name = xs_dict_get(te, "name");
+
+            if (xs_is_string(type) && xs_is_string(name) && strcmp(type, "Hashtag") == 0) {
+                xs *lc_name = xs_utf8_to_lower(name);
+                xs *list    = rfollow_tag_users(lc_name);
+                const char *md5;
+
+                xs_list_foreach(list, md5)
+                    xs_set_add(md5s, md5);
+            }
+        }
+    }
+}
+
+
+xs_list *shared_input_users(const xs_dict *msg)
+/* returns the local users that may accept a message from the shared
+   inbox (a superset of what is_msg_for_me() accepts), or NULL if
+   all of them must be checked */
+{
+    const char *type   = xs_dict_get(msg, "type");
+    const char *actor  = xs_dict_get(msg, "actor");
+    const xs_val *object = xs_dict_get(msg, "object");
+    xs *rfdir = xs_fmt("%s/rfollow", srv_basedir);
+
+    /* any other type is accepted by everybody */
+    if (!xs_is_string(type) || !xs_is_string(actor) ||
+        !xs_match(type, "Create|Update|Like|Announce|EmojiReact|Undo|Accept|Follow|Ping"))
+        return NULL;
+
+    /* no index? */
+    if (mtime(rfdir) == 0.0)
+        return NULL;
+
+    xs_set md5s;
+    xs *obj = NULL;
+    const char *v;
+
+    xs_set_init(&md5s);
+
+    _shared_input_ref(&md5s, actor);
+
+    if (xs_is_dict(object)) {
+        obj = xs_dup(object);
+        object = xs_dict_get(object, "id");
+    }
+
+    _shared_input_ref(&md5s, object);
+
+    if (xs_is_string(object) && !xs_is_dict(obj) && xs_match(type, "Like|Announce|EmojiReact"))
+        object_get(object, &obj);
+
+    /* direct recipients */
+    xs *rcpts = recipient_list(NULL, msg, 0);
+    xs_list_foreach(rcpts, v)
+        _shared_input_ref(&md5s, v);
+
+    if (xs_is_dict(obj)) {
+        xs *o_rcpts = recipient_list(NULL, obj, 0);
+        xs_list_foreach(o_rcpts, v)
+            _shared_input_ref(&md5s, v);
+
+        _shared_input_ref(&md5s, get_atto(obj));
+
+        /* the author of the replied message */
+        const char *irt = get_in_reply_to(obj);
+        xs *r_msg = NULL;
+
+        if (xs_is_string(irt) && valid_status(object_get(irt, &r_msg)))
+            _shared_input_ref(&md5s, get_atto(r_msg));
+
+        _shared_input_tags(&md5s, obj);
+    }
+
+    xs *md5_l = xs_set_result(&md5s);
+    xs *md5_d = xs_dict_new();
+
+    xs_list_foreach(md5_l, v)
+        md5_d = xs_dict_set(md5_d, v, xs_stock(XSTYPE_TRUE));
+
+    /* convert to user ids */
+    xs *users  = user_list();
+    xs_list *l = xs_list_new();
+
+    xs_list_foreach(users, v) {
+        xs *u_actor = xs_fmt("%s/%s", srv_baseurl, v);
+        xs *u_md5   = xs_md5_hex(u_actor, strlen(u_actor));
+
+        if (xs_dict_get(md5_d, u_md5) != NULL)
+            l = xs_list_append(l, v);
+    }
+
+    return l;
+}
+
+
 xs_str *process_tags(snac *snac, const char *content, xs_list **tag)
 /* parses mentions and tags from content */
 {
@@ -3348,10 +3497,13 @@ void process_user_queue_item(snac *user, xs_dict *q_item)
 
         xs_set_init(&inboxes);
 
+        /* the message is serialized and stored once for all inboxes */
+        xs *pl_id = payload_add(user, msg);
+
         /* add this shared inbox first */
         xs *this_shared_inbox = xs_fmt("%s/shared-inbox", srv_baseurl);
         xs_set_add(&inboxes, this_shared_inbox);
-        enqueue_output(user, msg, this_shared_inbox, 0, 0);
+        enqueue_output_payload(pl_id, this_shared_inbox, 0, 0);
 
         /* iterate the recipients */
         xs_list_foreach(rcpts, actor) {
@@ -3361,8 +3513,8 @@ void process_user_queue_item(snac *user, xs_dict *q_item)
 
                 if (inbox != NULL) {
                     /* add to the set and, if it's not there, send message */
-                    if (xs_set_add(&inboxes, inbox) == 1)
-                        enqueue_output(user, msg, inbox, 0, 0);
+                    if (xs_set_add(&inboxes, inbox) == 1 && !is_msg_mine(user, inbox))
+                        enqueue_output_payload(pl_id, inbox, 0, 0);
                 }
                 else
                     snac_log(user, xs_fmt("cannot find inbox for %s", actor));
@@ -3376,8 +3528,8 @@ void process_user_queue_item(snac *user, xs_dict *q_item)
                 const xs_str *inbox;
 
                 xs_list_foreach(shibx, inbox) {
-                    if (xs_set_add(&inboxes, inbox) == 1)
-                        enqueue_output(user, msg, inbox, 0, 0);
+                    if (xs_set_add(&inboxes, inbox) == 1 && !is_msg_mine(user, inbox))
+                        enqueue_output_payload(pl_id, inbox, 0, 0);
                 }
             }
         }
@@ -3588,13 +3740,29 @@ void process_queue_item(xs_dict *q_item)
         const xs_str *keyid  = xs_dict_get(q_item, "keyid");
         const xs_str *seckey = xs_dict_get(q_item, "seckey");
         const xs_dict *msg   = xs_dict_get(q_item, "message");
+        const xs_str *pl_id  = xs_dict_get(q_item, "payload");
+        const xs_str *body   = NULL;
         int retries    = xs_number_get(xs_dict_get(q_item, "retries"));
         int p_status   = xs_number_get(xs_dict_get(q_item, "p_status"));
         xs *payload    = NULL;
+        xs *pl         = NULL;
         int p_size     = 0;
         int timeout    = 0;
 
-        if (xs_is_null(inbox) || xs_is_null(msg) || xs_is_null(keyid) || xs_is_null(seckey)) {
+        /* a delivery of a shared payload? */
+        if (xs_is_string(pl_id)) {
+            if ((pl = payload_get(pl_id)) == NULL) {
+                srv_log(xs_fmt("output message error: missing payload %s", pl_id));
+                return;
+            }
+
+            keyid  = xs_dict_get(pl, "keyid");
+            seckey = xs_dict_get(pl, "seckey");
+            body   = xs_dict_get(pl, "body");
+        }
+
+        if (xs_is_null(inbox) || (xs_is_null(msg) && xs_is_null(body)) ||
+            xs_is_null(keyid) || xs_is_null(seckey)) {
             srv_log(xs_fmt("output message error: missing fields"));
             return;
         }
@@ -3618,10 +3786,23 @@ void process_queue_item(xs_dict *q_item)
         if (timeout == 0)
             timeout = 6;
 
-        status = send_to_inbox_raw(keyid, seckey, inbox, msg, &payload, &p_size, timeout);
+        if (lane_blocked(inbox)) {
+            /* the host's circuit breaker is open: don't even try */
+            status = HTTP_STATUS_SERVICE_UNAVAILABLE;
+        }
+        else {
+            double t0 = ftime();
 
-        /* register or clear a value for this instance */
-        instance_failure(inbox, valid_status(status) ? 2 : 1);
+            if (body != NULL)
+                status = _send_body_to_inbox(keyid, seckey, inbox, body, &payload, &p_size, timeout);
+            else
+                status = send_to_inbox_raw(keyid, seckey, inbox, msg, &payload, &p_size, timeout);
+
+            lane_result(inbox, status, (int)((ftime() - t0) * 1000));
+
+            /* register or clear a value for this instance */
+            instance_failure(inbox, valid_status(status) ? 2 : 1);
+        }
 
         if (payload) {
             if (p_size > 1024) {
@@ -3666,7 +3847,10 @@ void process_queue_item(xs_dict *q_item)
                 srv_log(xs_fmt("output message: giving up %s (%s)", inbox, s_status));
             else {
                 /* requeue */
-                enqueue_output_raw(keyid, seckey, msg, inbox, retries, status);
+                if (body != NULL)
+                    enqueue_output_payload(pl_id, inbox, retries, status);
+                else
+                    enqueue_output_raw(keyid, seckey, msg, inbox, retries, status);
                 srv_log(xs_fmt("output message: requeue %s #%d", inbox, retries));
             }
         }
@@ -3750,6 +3934,10 @@ void process_queue_item(xs_dict *q_item)
         srv_log(xs_dup("purge end"));
     }
     else
+    if (strcmp(type, "purge_step") == 0) {
+        purge_step();
+    }
+    else
     if (strcmp(type, "input") == 0) {
         const xs_dict *msg = xs_dict_get(q_item, "message");
         const xs_dict *req = xs_dict_get(q_item, "req");
@@ -3776,11 +3964,16 @@ void process_queue_item(xs_dict *q_item)
             FILE *f;
 
             if ((f = fopen(tmpfn, "w")) != NULL) {
-                xs_json_dump(q_item, 4, f);
+                xs_json_dump(q_item, storage_json_indent(), f);
                 fclose(f);
             }
 
-            xs *users = user_list();
+            /* only check the users that may be interested */
+            xs *users = shared_input_users(msg);
+
+            if (users == NULL)
+                users = user_list();
+
             xs_list *p = users;
             const char *v;
             int cnt = 0;
@@ -3837,6 +4030,10 @@ void process_queue_item(xs_dict *q_item)
         rss_poll_hashtags();
     }
     else
+    if (strcmp(type, "queue_log_compact") == 0) {
+        queue_log_compact();
+    }
+    else
     if (strcmp(type, "fsck") == 0) {
         srv_log(xs_fmt("started deferred data integrity check"));
         data_fsck();
@@ -3847,11 +4044,11 @@ void process_queue_item(xs_dict *q_item)
 }
 
 
-int process_queue(void)
-/* processes the global queue */
+int process_queue(int max)
+/* processes (up to max items of) the global queue */
 {
     int cnt = 0;
-    xs *list = queue();
+    xs *list = queue(max);
 
     xs_list *p = list;
     const xs_str *fn;
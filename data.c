@@ -24,11 +24,15 @@
 #include <sys/time.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
 
 double disk_layout = 2.7;
 
-/* storage serializer */
-pthread_mutex_t data_mutex = {0};
+/* storage serializers: striped locks, selected by a hash of the file
+   path, so that writes to unrelated indexes don't wait for each other */
+#define DATA_LOCK_STRIPES 64
+static pthread_mutex_t data_locks[DATA_LOCK_STRIPES];
 
 int snac_upgrade(xs_str **error);
 
@@ -55,7 +59,8 @@ int srv_open(const char *basedir, int auto_upgrade)
     months[10] = LL("Nov");
     months[11] = LL("Dec");
 
-    pthread_mutex_init(&data_mutex, NULL);
+    for (int n = 0; n < DATA_LOCK_STRIPES; n++)
+        pthread_mutex_init(&data_locks[n], NULL);
 
     srv_basedir = xs_str_new(basedir);
 
@@ -130,12 +135,11 @@ int srv_open(const char *basedir, int auto_upgrade)
     xs *faildir = xs_fmt("%s/failure", srv_basedir);
     mkdirx(faildir);
 
-#ifdef __APPLE__
-/* Apple uses st_atimespec instead of st_atim etc */
-#define st_atim st_atimespec
-#define st_ctim st_ctimespec
-#define st_mtim st_mtimespec
-#endif
+    xs *pldir = xs_fmt("%s/payload", srv_basedir);
+    mkdirx(pldir);
+
+    xs *qldir = xs_fmt("%s/queue/log", srv_basedir);
+    mkdirx(qldir);
 
     sbox_enter(srv_basedir);
 
@@ -203,7 +207,36 @@ void srv_free(void)
     xs_free(srv_config);
     xs_free(srv_baseurl);
 
-    pthread_mutex_destroy(&data_mutex);
+    for (int n = 0; n < DATA_LOCK_STRIPES; n++)
+        pthread_mutex_destroy(&data_locks[n]);
+}
+
+
+static pthread_mutex_t *data_lock(const char *fn)
+/* locks the stripe of a file and returns it, accounting the wait */
+{
+    pthread_mutex_t *m = &data_locks[xs_hash_func(fn, strlen(fn)) % DATA_LOCK_STRIPES];
+
+    if (pthread_mutex_trylock(m) != 0) {
+        double t = ftime();
+
+        pthread_mutex_lock(m);
+
+        if (p_state != NULL) {
+            int us = (int)((ftime() - t) * 1000000);
+
+            __atomic_add_fetch(&p_state->data_lock_waits, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&p_state->data_lock_wait_us, us, __ATOMIC_RELAXED);
+
+            if (us > p_state->data_lock_peak_us)
+                p_state->data_lock_peak_us = us;
+        }
+    }
+
+    if (p_state != NULL)
+        __atomic_add_fetch(&p_state->data_lock_count, 1, __ATOMIC_RELAXED);
+
+    return m;
 }
 
 
@@ -222,6 +255,200 @@ void user_free(snac *snac)
 }
 
 
+/** user cache **/
+
+/* Parsed user.json, key.json, user_o.json and links.json files, validated
+   by their stat data. As callers freely modify their snac structures,
+   user_open() always gets copies */
+
+#define USER_CACHE_SIZE 256
+
+static const char *user_cache_files[] = { "user.json", "key.json", "user_o.json", "links.json" };
+
+typedef struct {
+    xs_str *uid;
+    struct stat st[4];
+    xs_dict *config;
+    xs_dict *key;
+    xs_dict *config_o;
+    xs_dict *links;
+    unsigned long used;
+} user_cache_ent;
+
+static user_cache_ent user_cache[USER_CACHE_SIZE];
+static unsigned long user_cache_tick = 0;
+static xs_dict *user_lc_uids = NULL;
+static struct timespec user_lc_mtim = {0};
+static pthread_mutex_t user_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void _user_cache_stat(const char *basedir, struct stat st[4])
+/* gets the stat data of the user files (zeroed if they don't exist) */
+{
+    int n;
+
+    for (n = 0; n < 4; n++) {
+        xs *fn = xs_fmt("%s/%s", basedir, user_cache_files[n]);
+
+        if (stat(fn, &st[n]) == -1)
+            memset(&st[n], '\0', sizeof(st[n]));
+    }
+}
+
+
+static int _user_cache_same(const struct stat *a, const struct stat *b)
+{
+    return a->st_ino == b->st_ino && a->st_size == b->st_size &&
+        a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+
+static user_cache_ent *_user_cache_slot(const char *uid)
+/* returns the entry for a user, or the least recently used one */
+{
+    user_cache_ent *lru = &user_cache[0];
+    int n;
+
+    for (n = 0; n < USER_CACHE_SIZE; n++) {
+        user_cache_ent *e = &user_cache[n];
+
+        if (e->uid && strcmp(e->uid, uid) == 0)
+            return e;
+
+        if (e->used < lru->used)
+            lru = e;
+    }
+
+    return lru;
+}
+
+
+static void _user_cache_free(user_cache_ent *e)
+{
+    xs_free(e->uid);
+    xs_free(e->config);
+    xs_free(e->key);
+    xs_free(e->config_o);
+    xs_free(e->links);
+
+    *e = (user_cache_ent){0};
+}
+
+
+static int _user_cache_get(snac *user, struct stat st[4])
+/* fills the user data from the cache, if still valid */
+{
+    int ret = 0;
+    int n;
+
+    pthread_mutex_lock(&user_cache_mutex);
+
+    user_cache_ent *e = _user_cache_slot(user->uid);
+
+    if (e->uid && strcmp(e->uid, user->uid) == 0) {
+        for (n = 0; n < 4 && _user_cache_same(&e->st[n], &st[n]); n++);
+
+        if (n == 4) {
+            user->config   = xs_dup(e->config);
+            user->key      = xs_dup(e->key);
+            user->config_o = xs_dup(e->config_o);
+            user->links    = e->links ? xs_dup(e->links) : NULL;
+            e->used        = ++user_cache_tick;
+            ret = 1;
+        }
+        else
+            _user_cache_free(e);
+    }
+
+    if (p_state != NULL) {
+        if (ret)
+            p_state->user_cache_hits++;
+        else
+            p_state->user_cache_misses++;
+    }
+
+    pthread_mutex_unlock(&user_cache_mutex);
+
+    return ret;
+}
+
+
+static void _user_cache_put(const snac *user, const struct stat st[4])
+/* stores copies of the user data in the cache */
+{
+    pthread_mutex_lock(&user_cache_mutex);
+
+    user_cache_ent *e = _user_cache_slot(user->uid);
+
+    _user_cache_free(e);
+
+    e->uid      = xs_dup(user->uid);
+    memcpy(e->st, st, sizeof(e->st));
+    e->config   = xs_dup(user->config);
+    e->key      = xs_dup(user->key);
+    e->config_o = xs_dup(user->config_o);
+    e->links    = user->links ? xs_dup(user->links) : NULL;
+    e->used     = ++user_cache_tick;
+
+    pthread_mutex_unlock(&user_cache_mutex);
+}
+
+
+static void _user_cache_del(const char *uid)
+/* invalidates the cached data of a user */
+{
+    pthread_mutex_lock(&user_cache_mutex);
+
+    user_cache_ent *e = _user_cache_slot(uid);
+
+    if (e->uid && strcmp(e->uid, uid) == 0)
+        _user_cache_free(e);
+
+    pthread_mutex_unlock(&user_cache_mutex);
+}
+
+
+static xs_str *_user_uid_by_case(const char *uid)
+/* finds a user id by a case-insensitive search */
+{
+    xs *dir = xs_fmt("%s/user", srv_basedir);
+    xs_str *ret = NULL;
+    struct stat st;
+
+    if (stat(dir, &st) == -1)
+        return NULL;
+
+    pthread_mutex_lock(&user_cache_mutex);
+
+    /* rebuild the map if users were added or deleted */
+    if (user_lc_uids == NULL || st.st_mtim.tv_sec != user_lc_mtim.tv_sec ||
+        st.st_mtim.tv_nsec != user_lc_mtim.tv_nsec) {
+        xs *ulist = user_list();
+        const char *v;
+
+        xs_free(user_lc_uids);
+        user_lc_uids = xs_dict_new();
+
+        xs_list_foreach(ulist, v) {
+            xs *v2 = xs_tolower_i(xs_dup(v));
+            user_lc_uids = xs_dict_set(user_lc_uids, v2, v);
+        }
+
+        user_lc_mtim = st.st_mtim;
+    }
+
+    xs *lcuid = xs_tolower_i(xs_dup(uid));
+    const char *v = xs_dict_get(user_lc_uids, lcuid);
+
+    if (v != NULL)
+        ret = xs_dup(v);
+
+    pthread_mutex_unlock(&user_cache_mutex);
+
+    return ret;
+}
+
+
 int user_open(snac *user, const char *uid)
 /* opens a user */
 {
@@ -237,19 +464,7 @@ int user_open(snac *user, const char *uid)
 
         if (mtime(t) == 0.0) {
             /* user folder does not exist; try with a different case */
-            xs *lcuid = xs_tolower_i(xs_dup(uid));
-            xs *ulist = user_list();
-            xs_list *p = ulist;
-            const xs_str *v;
-
-            while (xs_list_iter(&p, &v)) {
-                xs *v2 = xs_tolower_i(xs_dup(v));
-
-                if (strcmp(lcuid, v2) == 0) {
-                    user->uid = xs_dup(v);
-                    break;
-                }
-            }
+            user->uid = _user_uid_by_case(uid);
         }
         else
             user->uid = xs_str_new(uid);
@@ -259,6 +474,18 @@ int user_open(snac *user, const char *uid)
 
         user->basedir = xs_fmt("%s/user/%s", srv_basedir, user->uid);
 
+        struct stat st[4];
+        _user_cache_stat(user->basedir, st);
+
+        if (_user_cache_get(user, st)) {
+            user->actor     = xs_fmt("%s/%s", srv_baseurl, user->uid);
+            user->actor_alt = xs_fmt("%s/users/%s", srv_baseurl ,user->uid);
+            user->md5       = xs_md5_hex(user->actor, strlen(user->actor));
+            user->tz        = xs_dict_get_def(user->config, "tz", "UTC");
+
+            return 1;
+        }
+
         cfg_file = xs_fmt("%s/user.json", user->basedir);
 
         if ((f = fopen(cfg_file, "r")) != NULL) {
@@ -315,6 +542,9 @@ int user_open(snac *user, const char *uid)
             user->links = xs_json_load(f);
             fclose(f);
         }
+
+        if (ret)
+            _user_cache_put(user, st);
     }
     else
         srv_debug(2, xs_fmt("invalid user '%s'", uid));
@@ -387,10 +617,6 @@ int user_persist(snac *snac, int publish)
 
                 if (!nw)
                     publish = 0;
-                else {
-                    /* uncache the actor object */
-                    object_del(snac->actor);
-                }
             }
         }
     }
@@ -407,6 +633,13 @@ int user_persist(snac *snac, int publish)
     history_del(snac, "timeline.html_");
     timeline_touch(snac);
 
+    _user_cache_del(snac->uid);
+
+    /* uncache the actor object, as any setting may affect it */
+    object_del(snac->actor);
+
+    rfollow_tags_update(snac);
+
     if (publish) {
         xs *a_msg = msg_actor(snac);
         xs *u_msg = msg_update(snac, a_msg);
@@ -457,6 +690,13 @@ double f_ctime(const char *fn)
 }
 
 
+int storage_json_indent(void)
+/* returns the indentation of stored JSON files (objects, queue items, etc.) */
+{
+    return xs_is_true(xs_dict_get(srv_config, "compact_json")) ? 0 : 4;
+}
+
+
 int is_md5_hex(const char *md5)
 {
     return xs_is_hex(md5) && strlen(md5) == MD5_HEX_SIZE - 1;
@@ -467,3206 +707,4831 @@ int is_md5_hex(const char *md5)
 
 /** indexes **/
 
+/* indexes can be stored in two formats: the classic text one, with
+   one 32 char hex md5 per line, and a binary one, with a 16 byte header
+   (BIDX_MAGIC + reserved) followed by 16 byte raw md5 digests. The format
+   of each file is detected from its first bytes, so both can coexist.
+   New indexes are created in binary format if "binary_indexes" is set */
 
-int index_add_md5(const char *fn, const char *md5)
-/* adds an md5 to an index */
+#define BIDX_MAGIC      "SNACIDX1"
+#define BIDX_HDR_SIZE   16
+#define BIDX_REC_SIZE   16
+
+/* deleted binary entries are overwritten with all 0xff (not zeros,
+   because that's the value of MD5_ALREADY_SEEN_MARK) */
+static const unsigned char bidx_deleted[BIDX_REC_SIZE] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+
+static int _index_is_binary_fd(int fd)
+/* checks if an open index is in binary format */
 {
-    int status = HTTP_STATUS_CREATED;
-    FILE *f;
+    char magic[sizeof(BIDX_MAGIC) - 1];
 
-    if (!is_md5_hex(md5)) {
-        srv_log(xs_fmt("index_add_md5: bad md5 %s %s", fn, md5));
-        return HTTP_STATUS_BAD_REQUEST;
-    }
+    return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+        memcmp(magic, BIDX_MAGIC, sizeof(magic)) == 0;
+}
 
-    pthread_mutex_lock(&data_mutex);
 
-    if ((f = fopen(fn, "a")) != NULL) {
-        flock(fileno(f), LOCK_EX);
+static int _index_is_binary(FILE *f)
+{
+    return _index_is_binary_fd(fileno(f));
+}
 
-        /* ensure the position is at the end after getting the lock */
-        fseek(f, 0, SEEK_END);
 
-        fprintf(f, "%s\n", md5);
-        fclose(f);
+static int _md5_to_raw(const char *md5, unsigned char raw[BIDX_REC_SIZE])
+/* converts an hex md5 to raw bytes */
+{
+    return is_md5_hex(md5) &&
+        _xs_hex_dec((char *)raw, md5, MD5_HEX_SIZE - 1) != NULL;
+}
+
+
+static void _raw_to_md5(const unsigned char raw[BIDX_REC_SIZE], char md5[MD5_HEX_SIZE])
+/* converts raw bytes to an hex md5 */
+{
+    if (memcmp(raw, bidx_deleted, BIDX_REC_SIZE) == 0) {
+        /* mimic what a deleted text entry looks like */
+        memset(md5, 'f', MD5_HEX_SIZE - 1);
+        md5[0] = '-';
     }
     else
-        status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
-
-    pthread_mutex_unlock(&data_mutex);
+        _xs_hex_enc(md5, (const char *)raw, BIDX_REC_SIZE);
 
-    return status;
+    md5[MD5_HEX_SIZE - 1] = '\0';
 }
 
 
-int index_add(const char *fn, const char *id)
-/* adds an id to an index */
+static int _index_read_rec(FILE *f, char md5[MD5_HEX_SIZE], int binary)
+/* reads an entry from an index in any format */
 {
-    xs *md5 = xs_md5_hex(id, strlen(id));
-    return index_add_md5(fn, md5);
+    if (binary) {
+        unsigned char raw[BIDX_REC_SIZE];
+
+        if (!fread(raw, sizeof(raw), 1, f))
+            return 0;
+
+        _raw_to_md5(raw, md5);
+    }
+    else {
+        if (!fread(md5, MD5_HEX_SIZE, 1, f))
+            return 0;
+
+        md5[MD5_HEX_SIZE - 1] = '\0';
+    }
+
+    return 1;
 }
 
 
-int index_del_md5(const char *fn, const char *md5)
-/* deletes an md5 from an index */
-{
-    int status = HTTP_STATUS_NOT_FOUND;
-    FILE *f;
+/** binary index lookup cache **/
 
-    pthread_mutex_lock(&data_mutex);
+/* lookups in big binary indexes are done over a memory map of the
+   file with an open addressing hash table of its record numbers.
+   The tables are kept in a small process-wide cache and are validated
+   by inode and size; appended records are just added to the table,
+   and deletions are seen directly because they are done in place */
 
-    if ((f = fopen(fn, "r+")) != NULL) {
-        char line[256];
+#define BIDX_MIN_HASHED     256
+#define BIDX_CACHE_SIZE     64
 
-        while (fgets(line, sizeof(line), f) != NULL) {
-            line[MD5_HEX_SIZE - 1] = '\0';
+typedef struct {
+    char *fn;
+    dev_t dev;
+    ino_t ino;
+    size_t size;                    /* size of the mapped (and hashed) part */
+    const unsigned char *map;
+    uint32_t *slots;                /* record number + 1 (0: empty) */
+    uint32_t n_slots;               /* always a power of 2 */
+    uint32_t n_recs;
+    unsigned long used;             /* for LRU eviction */
+} bidx_cache_ent;
 
-            if (strcmp(line, md5) == 0) {
-                /* found! just rewind, overwrite it with garbage
-                   and an eventual call to index_gc() will clean it
-                   [yes: this breaks index_len()] */
-                fseek(f, -MD5_HEX_SIZE, SEEK_CUR);
-                fwrite("-", 1, 1, f);
-                status = HTTP_STATUS_OK;
+static bidx_cache_ent bidx_cache[BIDX_CACHE_SIZE];
+static unsigned long bidx_cache_tick = 0;
+static pthread_mutex_t bidx_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-                break;
-            }
-        }
 
-        fclose(f);
-    }
-    else
-        status = HTTP_STATUS_GONE;
+static uint32_t _bidx_hash(const unsigned char *raw)
+{
+    /* md5s are already uniformly distributed */
+    uint32_t h;
+    memcpy(&h, raw, sizeof(h));
+    return h;
+}
 
-    pthread_mutex_unlock(&data_mutex);
 
-    return status;
+static void _bidx_cache_free(bidx_cache_ent *e)
+{
+    if (e->map != NULL)
+        munmap((void *)e->map, e->size);
+
+    free(e->slots);
+    free(e->fn);
+
+    memset(e, '\0', sizeof(*e));
 }
 
 
-int index_del(const char *fn, const char *id)
-/* deletes an id from an index */
+static void _bidx_hash_add(bidx_cache_ent *e, uint32_t rec)
 {
-    xs *md5 = xs_md5_hex(id, strlen(id));
-    return index_del_md5(fn, md5);
+    uint32_t mask = e->n_slots - 1;
+    uint32_t i = _bidx_hash(e->map + BIDX_HDR_SIZE + (size_t)rec * BIDX_REC_SIZE) & mask;
+
+    while (e->slots[i])
+        i = (i + 1) & mask;
+
+    e->slots[i] = rec + 1;
 }
 
 
-int index_gc(const char *fn)
-/* garbage-collects an index, deleting objects that are not here */
+static int _bidx_cache_update(bidx_cache_ent *e, const struct stat *st)
+/* maps and hashes the new records of an index */
 {
-    FILE *i, *o;
-    int gc = -1;
+    size_t size = BIDX_HDR_SIZE +
+        (st->st_size - BIDX_HDR_SIZE) / BIDX_REC_SIZE * BIDX_REC_SIZE;
+    uint32_t n_recs = (size - BIDX_HDR_SIZE) / BIDX_REC_SIZE;
+    const unsigned char *map;
+    int fd;
 
-    pthread_mutex_lock(&data_mutex);
+    /* the map is done from its own open file, as it would otherwise
+       keep alive the flock() the caller may hold on its descriptor */
+    struct stat nst;
 
-    if ((i = fopen(fn, "r")) != NULL) {
-        xs *nfn = xs_fmt("%s.new", fn);
-        char line[256];
+    if ((fd = open(e->fn, O_RDONLY)) == -1)
+        return 0;
 
-        if ((o = fopen(nfn, "w")) != NULL) {
-            gc = 0;
+    /* (it must still be the same file) */
+    if (fstat(fd, &nst) == -1 || nst.st_ino != e->ino || nst.st_dev != e->dev)
+        map = MAP_FAILED;
+    else
+        map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
 
-            while (fgets(line, sizeof(line), i) != NULL) {
-                line[MD5_HEX_SIZE - 1] = '\0';
+    close(fd);
 
-                if (line[0] != '-' && object_here_by_md5(line))
-                    fprintf(o, "%s\n", line);
-                else
-                    gc++;
-            }
+    if (map == MAP_FAILED)
+        return 0;
 
-            fclose(o);
+    if (e->map != NULL)
+        munmap((void *)e->map, e->size);
 
-            xs *ofn = xs_fmt("%s.bak", fn);
+    e->map  = map;
+    e->size = size;
 
-            unlink(ofn);
-            link(fn, ofn);
-            rename(nfn, fn);
-        }
+    if (n_recs * 2 > e->n_slots) {
+        /* (re)build the table from scratch */
+        uint32_t n_slots = 1024;
 
-        fclose(i);
+        while (n_slots < n_recs * 2)
+            n_slots *= 2;
+
+        free(e->slots);
+        e->slots   = calloc(n_slots, sizeof(uint32_t));
+        e->n_slots = n_slots;
+        e->n_recs  = 0;
+
+        if (e->slots == NULL)
+            return 0;
     }
 
-    pthread_mutex_unlock(&data_mutex);
+    while (e->n_recs < n_recs)
+        _bidx_hash_add(e, e->n_recs++);
 
-    return gc;
+    return 1;
 }
 
 
-int index_in_md5(const char *fn, const char *md5)
-/* checks if the md5 is already in the index */
+static off_t _bidx_find(const char *fn, int fd, const unsigned char *raw)
+/* finds the offset of a raw md5 in a binary index, or -1 */
 {
-    FILE *f;
-    int ret = 0;
+    struct stat st;
+    off_t ret = -1;
 
-    if ((f = fopen(fn, "r")) != NULL) {
-        flock(fileno(f), LOCK_SH);
+    if (fstat(fd, &st) == -1 || st.st_size < BIDX_HDR_SIZE)
+        return -1;
 
-        char line[256];
+    uint32_t n_recs = (st.st_size - BIDX_HDR_SIZE) / BIDX_REC_SIZE;
 
-        while (!ret && fgets(line, sizeof(line), f) != NULL) {
-            line[MD5_HEX_SIZE - 1] = '\0';
+    if (n_recs < BIDX_MIN_HASHED) {
+        /* small index: just scan it */
+        unsigned char buf[BIDX_MIN_HASHED * BIDX_REC_SIZE];
+        ssize_t r = pread(fd, buf, (size_t)n_recs * BIDX_REC_SIZE, BIDX_HDR_SIZE);
+        int n;
 
-            if (strcmp(line, md5) == 0)
-                ret = 1;
+        for (n = 0; n < r / BIDX_REC_SIZE; n++) {
+            if (memcmp(buf + n * BIDX_REC_SIZE, raw, BIDX_REC_SIZE) == 0)
+                return BIDX_HDR_SIZE + n * BIDX_REC_SIZE;
         }
 
-        fclose(f);
+        return -1;
     }
 
-    return ret;
-}
+    pthread_mutex_lock(&bidx_mutex);
 
+    bidx_cache_ent *e = NULL;
+    bidx_cache_ent *lru = &bidx_cache[0];
+    int n;
 
-int index_in(const char *fn, const char *id)
-/* checks if the object id is already in the index */
-{
-    xs *md5 = xs_md5_hex(id, strlen(id));
-    return index_in_md5(fn, md5);
-}
+    for (n = 0; n < BIDX_CACHE_SIZE; n++) {
+        if (bidx_cache[n].fn && strcmp(bidx_cache[n].fn, fn) == 0) {
+            e = &bidx_cache[n];
+            break;
+        }
 
+        if (bidx_cache[n].used < lru->used)
+            lru = &bidx_cache[n];
+    }
 
-int index_first(const char *fn, char md5[MD5_HEX_SIZE])
-/* reads the first entry of an index */
-{
-    FILE *f;
-    int ret = 0;
+    if (e != NULL && (e->dev != st.st_dev || e->ino != st.st_ino || (off_t)e->size > st.st_size)) {
+        /* replaced (e.g. by index_gc()) or truncated */
+        _bidx_cache_free(e);
+        e = NULL;
+        lru = &bidx_cache[n];
+    }
 
-    if ((f = fopen(fn, "r")) != NULL) {
-        if (fread(md5, MD5_HEX_SIZE, 1, f)) {
-            md5[MD5_HEX_SIZE - 1] = '\0';
-            ret = 1;
-        }
+    if (e == NULL) {
+        e = lru;
+        _bidx_cache_free(e);
 
-        fclose(f);
+        e->fn  = strdup(fn);
+        e->dev = st.st_dev;
+        e->ino = st.st_ino;
     }
 
-    return ret;
-}
+    e->used = ++bidx_cache_tick;
 
+    if ((e->size < BIDX_HDR_SIZE + (size_t)n_recs * BIDX_REC_SIZE &&
+        e->fn != NULL && !_bidx_cache_update(e, &st)) || e->fn == NULL) {
+        _bidx_cache_free(e);
+    }
+    else {
+        uint32_t mask = e->n_slots - 1;
+        uint32_t i = _bidx_hash(raw) & mask;
+        uint32_t rec;
 
-int index_len(const char *fn)
-/* returns the number of elements in an index */
-{
-    struct stat st;
-    int len = 0;
+        while ((rec = e->slots[i]) != 0) {
+            const unsigned char *p = e->map + BIDX_HDR_SIZE + (size_t)(rec - 1) * BIDX_REC_SIZE;
 
-    if (stat(fn, &st) != -1)
-        len = st.st_size / MD5_HEX_SIZE;
+            if (memcmp(p, raw, BIDX_REC_SIZE) == 0) {
+                ret = p - e->map;
+                break;
+            }
 
-    return len;
+            i = (i + 1) & mask;
+        }
+    }
+
+    pthread_mutex_unlock(&bidx_mutex);
+
+    return ret;
 }
 
 
-xs_list *index_list(const char *fn, int max)
-/* returns an index as a list */
+int index_add_md5(const char *fn, const char *md5)
+/* adds an md5 to an index */
 {
-    xs_list *list = xs_list_new();
+    int status = HTTP_STATUS_CREATED;
     FILE *f;
-    int n = 0;
 
-    if ((f = fopen(fn, "r")) != NULL) {
-        flock(fileno(f), LOCK_SH);
+    if (!is_md5_hex(md5)) {
+        srv_log(xs_fmt("index_add_md5: bad md5 %s %s", fn, md5));
+        return HTTP_STATUS_BAD_REQUEST;
+    }
 
-        char line[256];
+    pthread_mutex_t *dm = data_lock(fn);
 
-        while (n < max && fgets(line, sizeof(line), f) != NULL) {
-            if (line[0] != '-') {
-                line[MD5_HEX_SIZE - 1] = '\0';
-                list = xs_list_append(list, line);
-                n++;
-            }
+    if ((f = fopen(fn, "a+")) != NULL) {
+        flock(fileno(f), LOCK_EX);
+
+        /* ensure the position is at the end after getting the lock */
+        fseek(f, 0, SEEK_END);
+
+        /* new index? create it in the configured format */
+        if (ftell(f) == 0 && xs_is_true(xs_dict_get(srv_config, "binary_indexes"))) {
+            char hdr[BIDX_HDR_SIZE] = BIDX_MAGIC;
+            fwrite(hdr, sizeof(hdr), 1, f);
+            fflush(f);
+        }
+
+        if (_index_is_binary(f)) {
+            unsigned char raw[BIDX_REC_SIZE];
+
+            _md5_to_raw(md5, raw);
+            fwrite(raw, sizeof(raw), 1, f);
         }
+        else
+            fprintf(f, "%s\n", md5);
 
         fclose(f);
     }
+    else
+        status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
 
-    return list;
+    pthread_mutex_unlock(dm);
+
+    return status;
 }
 
 
-int index_desc_next(FILE *f, char md5[MD5_HEX_SIZE])
-/* reads the next entry of a desc index */
+int index_add(const char *fn, const char *id)
+/* adds an id to an index */
 {
-    for (;;) {
-        /* move backwards 2 entries */
-        if (fseek(f, MD5_HEX_SIZE * -2, SEEK_CUR) == -1)
-            return 0;
+    xs *md5 = xs_md5_hex(id, strlen(id));
+    return index_add_md5(fn, md5);
+}
 
-        /* read and md5 */
-        if (!fread(md5, MD5_HEX_SIZE, 1, f))
-            return 0;
 
-        if (md5[0] != '-')
-            break;
-    }
+int index_del_md5(const char *fn, const char *md5)
+/* deletes an md5 from an index */
+{
+    int status = HTTP_STATUS_NOT_FOUND;
+    FILE *f;
 
-    md5[MD5_HEX_SIZE - 1] = '\0';
+    pthread_mutex_t *dm = data_lock(fn);
 
-    return 1;
-}
+    if ((f = fopen(fn, "r+")) != NULL) {
+        char line[256];
 
+        if (_index_is_binary(f)) {
+            unsigned char raw[BIDX_REC_SIZE];
+            off_t pos;
 
-int index_desc_first(FILE *f, char md5[MD5_HEX_SIZE], int skip)
-/* reads the first entry of a desc index */
-{
-    /* try to position at the end and then back to the first element */
-    if (fseek(f, 0, SEEK_END) || fseek(f, (skip + 1) * -MD5_HEX_SIZE, SEEK_CUR))
-        return 0;
+            if (_md5_to_raw(md5, raw) && (pos = _bidx_find(fn, fileno(f), raw)) != -1) {
+                /* overwrite it in place; index_gc() will clean it */
+                pwrite(fileno(f), bidx_deleted, BIDX_REC_SIZE, pos);
+                status = HTTP_STATUS_OK;
+            }
+        }
+        else {
+            while (fgets(line, sizeof(line), f) != NULL) {
+                line[MD5_HEX_SIZE - 1] = '\0';
 
-    /* try to read an md5 */
-    if (!fread(md5, MD5_HEX_SIZE, 1, f))
-        return 0;
+                if (strcmp(line, md5) == 0) {
+                    /* found! just rewind, overwrite it with garbage
+                       and an eventual call to index_gc() will clean it
+                       [yes: this breaks index_len()] */
+                    fseek(f, -MD5_HEX_SIZE, SEEK_CUR);
+                    fwrite("-", 1, 1, f);
+                    status = HTTP_STATUS_OK;
 
-    /* null-terminate */
-    md5[MD5_HEX_SIZE - 1] = '\0';
+                    break;
+                }
+            }
+        }
 
-    /* deleted? retry next */
-    if (md5[0] == '-')
-        return index_desc_next(f, md5);
+        fclose(f);
+    }
+    else
+        status = HTTP_STATUS_GONE;
 
-    return 1;
+    pthread_mutex_unlock(dm);
+
+    return status;
 }
 
-int index_asc_first(FILE *f,char md5[MD5_HEX_SIZE], const char *seek_md5)
-/* reads the first entry of an ascending index, starting from a given md5 */
+
+int index_del(const char *fn, const char *id)
+/* deletes an id from an index */
 {
-    fseek(f, SEEK_SET, 0);
-    while (fread(md5, MD5_HEX_SIZE, 1, f)) {
-        md5[MD5_HEX_SIZE - 1] = '\0';
-        if (strcmp(md5,seek_md5) == 0) {
-            return index_asc_next(f, md5);
-        }
-    }
-    return 0;
+    xs *md5 = xs_md5_hex(id, strlen(id));
+    return index_del_md5(fn, md5);
 }
 
-int index_asc_next(FILE *f, char md5[MD5_HEX_SIZE])
-/* reads the next entry of an ascending index */
+
+static int _index_rewrite(const char *fn, int binary, int gc)
+/* rewrites an index in the given format, dropping deleted
+   entries and, if gc is set, those of objects that are not here */
 {
-    for (;;) {
-        /* read an md5 */
-        if (!fread(md5, MD5_HEX_SIZE, 1, f))
-            return 0;
+    FILE *i, *o;
+    int cnt = -1;
 
-        /* deleted, skip */
-        if (md5[0] != '-')
-            break;
-    }
+    pthread_mutex_t *dm = data_lock(fn);
 
-    md5[MD5_HEX_SIZE - 1] = '\0';
+    if ((i = fopen(fn, "r")) != NULL) {
+        xs *nfn = xs_fmt("%s.new", fn);
+        int i_binary = _index_is_binary(i);
 
-    return 1;
-}
+        if (binary == -1)
+            binary = i_binary;
 
+        if ((o = fopen(nfn, "w")) != NULL) {
+            char md5[MD5_HEX_SIZE];
+            char line[256];
 
-xs_list *index_list_desc(const char *fn, int skip, int show)
-/* returns an index as a list, in reverse order */
-{
-    xs_list *list = xs_list_new();
-    FILE *f;
+            cnt = 0;
 
-    if ((f = fopen(fn, "r")) != NULL) {
-        char md5[MD5_HEX_SIZE];
+            if (binary) {
+                char hdr[BIDX_HDR_SIZE] = BIDX_MAGIC;
+                fwrite(hdr, sizeof(hdr), 1, o);
+            }
 
-        if (index_desc_first(f, md5, skip)) {
-            int n = 1;
+            if (i_binary)
+                fseek(i, BIDX_HDR_SIZE, SEEK_SET);
 
-            do {
-                list = xs_list_append(list, md5);
-            } while (n++ < show && index_desc_next(f, md5));
-        }
+            for (;;) {
+                if (i_binary) {
+                    if (!_index_read_rec(i, md5, 1))
+                        break;
+                }
+                else {
+                    if (fgets(line, sizeof(line), i) == NULL)
+                        break;
 
-        fclose(f);
-    }
+                    line[MD5_HEX_SIZE - 1] = '\0';
+                    memcpy(md5, line, MD5_HEX_SIZE);
+                }
 
-    return list;
-}
+                if (md5[0] != '-' && (!gc || object_here_by_md5(md5))) {
+                    if (binary) {
+                        unsigned char raw[BIDX_REC_SIZE];
 
+                        if (_md5_to_raw(md5, raw))
+                            fwrite(raw, sizeof(raw), 1, o);
+                    }
+                    else
+                        fprintf(o, "%s\n", md5);
+                }
+                else
+                    cnt++;
+            }
 
-/** objects **/
+            fclose(o);
 
-static xs_str *_object_fn_by_md5(const char *md5, const char *func)
-{
-    xs *bfn = xs_fmt("%s/object/%c%c", srv_basedir, md5[0], md5[1]);
-    xs_str *ret;
-    int ok = 1;
+            xs *ofn = xs_fmt("%s.bak", fn);
 
-    /* an object deleted from an index; fail but don't bark */
-    if (md5[0] == '-')
-        ok = 0;
-    else
-    if (!is_md5_hex(md5)) {
-        srv_log(xs_fmt("_object_fn_by_md5() [from %s()]: bad md5 '%s'", func, md5));
-        ok = 0;
-    }
+            unlink(ofn);
+            link(fn, ofn);
+            rename(nfn, fn);
+        }
 
-    if (ok) {
-        mkdirx(bfn);
-        ret = xs_fmt("%s/%s.json", bfn, md5);
+        fclose(i);
     }
-    else
-        ret = xs_fmt("%s/object/invalid/invalid.json", srv_basedir);
 
-    return ret;
+    pthread_mutex_unlock(dm);
+
+    return cnt;
 }
 
 
-static xs_str *_object_fn(const char *id)
+int index_gc(const char *fn)
+/* garbage-collects an index, deleting objects that are not here */
 {
-    xs *md5 = xs_md5_hex(id, strlen(id));
-    return _object_fn_by_md5(md5, "_object_fn");
+    return _index_rewrite(fn, -1, 1);
 }
 
 
-int object_here_by_md5(const char *id)
-/* checks if an object is already downloaded */
+int index_convert(const char *fn, int binary)
+/* converts an index to binary or text format (returns 1 if converted) */
 {
-    xs *fn = _object_fn_by_md5(id, "object_here_by_md5");
-    return mtime(fn) > 0.0;
-}
+    FILE *f;
+    int is_binary;
 
+    if ((f = fopen(fn, "r")) == NULL)
+        return 0;
 
-int object_here(const char *id)
-/* checks if an object is already downloaded */
-{
-    xs *fn = _object_fn(id);
-    return mtime(fn) > 0.0;
+    is_binary = _index_is_binary(f);
+    fclose(f);
+
+    if (!is_binary == !binary)
+        return 0;
+
+    return _index_rewrite(fn, binary, 0) != -1;
 }
 
 
-int object_get_by_md5(const char *md5, xs_dict **obj)
-/* returns a stored object, optionally of the requested type */
+int index_in_md5(const char *fn, const char *md5)
+/* checks if the md5 is already in the index */
 {
-    int status = HTTP_STATUS_NOT_FOUND;
-    xs *fn     = _object_fn_by_md5(md5, "object_get_by_md5");
     FILE *f;
+    int ret = 0;
 
     if ((f = fopen(fn, "r")) != NULL) {
-        *obj = xs_json_load(f);
-        fclose(f);
+        flock(fileno(f), LOCK_SH);
 
-        if (*obj)
-            status = HTTP_STATUS_OK;
+        if (_index_is_binary(f)) {
+            unsigned char raw[BIDX_REC_SIZE];
+
+            if (_md5_to_raw(md5, raw))
+                ret = _bidx_find(fn, fileno(f), raw) != -1;
+        }
+        else {
+            char line[256];
+
+            while (!ret && fgets(line, sizeof(line), f) != NULL) {
+                line[MD5_HEX_SIZE - 1] = '\0';
+
+                if (strcmp(line, md5) == 0)
+                    ret = 1;
+            }
+        }
+
+        fclose(f);
     }
-    else
-        *obj = NULL;
 
-    return status;
+    return ret;
 }
 
 
-int object_get(const char *id, xs_dict **obj)
-/* returns a stored object, optionally of the requested type */
+int index_in(const char *fn, const char *id)
+/* checks if the object id is already in the index */
 {
     xs *md5 = xs_md5_hex(id, strlen(id));
-    return object_get_by_md5(md5, obj);
+    return index_in_md5(fn, md5);
 }
 
 
-int _object_add(const char *id, const xs_dict *obj, int ow)
-/* stores an object */
+int index_first(const char *fn, char md5[MD5_HEX_SIZE])
+/* reads the first entry of an index */
 {
-    int status = HTTP_STATUS_CREATED; /* Created */
-    xs *fn     = _object_fn(id);
     FILE *f;
+    int ret = 0;
 
-    if (mtime(fn) > 0.0) {
-        if (!ow) {
-            /* object already here */
-            srv_debug(1, xs_fmt("object_add object already here %s", id));
-            return HTTP_STATUS_NO_CONTENT;
-        }
-        else
-            status = HTTP_STATUS_OK;
-    }
+    if ((f = fopen(fn, "r")) != NULL) {
+        int binary = _index_is_binary(f);
 
-    if ((f = fopen(fn, "w")) != NULL) {
-        flock(fileno(f), LOCK_EX);
+        if (binary)
+            fseek(f, BIDX_HDR_SIZE, SEEK_SET);
 
-        xs_json_dump(obj, 4, f);
-        fclose(f);
+        ret = _index_read_rec(f, md5, binary);
 
-        /* does this object has a parent? */
-        const char *in_reply_to = get_in_reply_to(obj);
-
-        if (!xs_is_null(in_reply_to) && *in_reply_to) {
-            /* update the children index of the parent */
-            xs *c_idx = _object_fn(in_reply_to);
+        fclose(f);
+    }
 
-            c_idx = xs_replace_i(c_idx, ".json", "_c.idx");
+    return ret;
+}
 
-            if (!index_in(c_idx, id)) {
-                index_add(c_idx, id);
-                srv_debug(1, xs_fmt("object_add added child %s to %s", id, c_idx));
-            }
-            else
-                srv_debug(1, xs_fmt("object_add %s child already in %s", id, c_idx));
 
-            /* create a one-element index with the parent */
-            xs *p_idx = xs_replace(fn, ".json", "_p.idx");
+int index_len(const char *fn)
+/* returns the number of elements in an index */
+{
+    struct stat st;
+    int len = 0;
+    int fd;
 
-            if (mtime(p_idx) == 0.0) {
-                index_add(p_idx, in_reply_to);
-                srv_debug(1, xs_fmt("object_add added parent %s to %s", in_reply_to, p_idx));
-            }
+    if ((fd = open(fn, O_RDONLY)) != -1) {
+        if (fstat(fd, &st) != -1) {
+            if (_index_is_binary_fd(fd))
+                len = (st.st_size - BIDX_HDR_SIZE) / BIDX_REC_SIZE;
+            else
+                len = st.st_size / MD5_HEX_SIZE;
         }
-    }
-    else {
-        srv_log(xs_fmt("object_add error writing %s (errno: %d)", fn, errno));
-        status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
-    }
-
-    srv_debug(1, xs_fmt("object_add %s %s %d", id, fn, status));
-
-    return status;
-}
 
+        close(fd);
+    }
 
-int object_add(const char *id, const xs_dict *obj)
-/* stores an object */
-{
-    return _object_add(id, obj, 0);
+    return len;
 }
 
 
-int object_add_ow(const char *id, const xs_dict *obj)
-/* stores an object (overwriting allowed) */
+xs_list *index_list(const char *fn, int max)
+/* returns an index as a list */
 {
-    return _object_add(id, obj, 1);
-}
+    xs_list *list = xs_list_new();
+    FILE *f;
+    int n = 0;
 
+    if ((f = fopen(fn, "r")) != NULL) {
+        flock(fileno(f), LOCK_SH);
 
-int object_del_by_md5(const char *md5)
-/* deletes an object by its md5 */
-{
-    int status = HTTP_STATUS_NOT_FOUND;
-    xs *fn     = _object_fn_by_md5(md5, "object_del_by_md5");
+        if (_index_is_binary(f)) {
+            char md5[MD5_HEX_SIZE];
 
-    if (unlink(fn) != -1) {
-        status = HTTP_STATUS_OK;
+            fseek(f, BIDX_HDR_SIZE, SEEK_SET);
 
-        /* also delete associated indexes */
-        xs *spec  = xs_dup(fn);
-        spec      = xs_replace_i(spec, ".json", "*.idx");
-        xs *files = xs_glob(spec, 0, 0);
-        char *p;
-        const char *v;
+            while (n < max && _index_read_rec(f, md5, 1)) {
+                if (md5[0] != '-') {
+                    list = xs_list_append(list, md5);
+                    n++;
+                }
+            }
+        }
+        else {
+            char line[256];
 
-        p = files;
-        while (xs_list_iter(&p, &v)) {
-            srv_debug(1, xs_fmt("object_del index %s", v));
-            unlink(v);
+            while (n < max && fgets(line, sizeof(line), f) != NULL) {
+                if (line[0] != '-') {
+                    line[MD5_HEX_SIZE - 1] = '\0';
+                    list = xs_list_append(list, line);
+                    n++;
+                }
+            }
         }
-    }
 
-    srv_debug(1, xs_fmt("object_del %s %d", fn, status));
+        fclose(f);
+    }
 
-    return status;
+    return list;
 }
 
 
-int object_del(const char *id)
-/* deletes an object */
-{
-    xs *md5 = xs_md5_hex(id, strlen(id));
-    return object_del_by_md5(md5);
-}
+/* format of the indexes being iterated by this thread, detected by
+   index_desc_first() and index_asc_first() so that the _next()
+   functions don't have to check it for every entry */
+#define IDX_FMT_SLOTS 4
 
+static __thread struct {
+    FILE *f;
+    int fd;
+    int binary;
+} idx_fmt[IDX_FMT_SLOTS];
 
-int object_del_if_unref(const char *id)
-/* deletes an object if its n_links < 2 */
-{
-    xs *fn = _object_fn(id);
-    int n_links;
-    int ret = 0;
+static __thread int idx_fmt_next = 0;
 
-    if (mtime_nl(fn, &n_links) > 0.0 && n_links < 2)
-        ret = object_del(id);
 
-    return ret;
-}
+static int _index_fmt_set(FILE *f)
+/* detects the format of an index that starts being iterated */
+{
+    int fd = fileno(f);
+    int binary = _index_is_binary_fd(fd);
+    int n;
 
+    for (n = 0; n < IDX_FMT_SLOTS; n++) {
+        if (idx_fmt[n].f == f)
+            break;
+    }
 
-double object_ctime_by_md5(const char *md5)
-{
-    xs *fn = _object_fn_by_md5(md5, "object_ctime_by_md5");
-    return f_ctime(fn);
-}
+    if (n == IDX_FMT_SLOTS) {
+        n = idx_fmt_next;
+        idx_fmt_next = (idx_fmt_next + 1) % IDX_FMT_SLOTS;
+    }
 
+    idx_fmt[n].f      = f;
+    idx_fmt[n].fd     = fd;
+    idx_fmt[n].binary = binary;
 
-double object_ctime(const char *id)
-{
-    xs *md5 = xs_md5_hex(id, strlen(id));
-    return object_ctime_by_md5(md5);
+    return binary;
 }
 
 
-double object_mtime_by_md5(const char *md5)
+static int _index_fmt_get(FILE *f)
+/* returns the format of an index being iterated */
 {
-    xs *fn = _object_fn_by_md5(md5, "object_mtime_by_md5");
-    return mtime(fn);
-}
+    int n;
 
+    for (n = 0; n < IDX_FMT_SLOTS; n++) {
+        if (idx_fmt[n].f == f && idx_fmt[n].fd == fileno(f))
+            return idx_fmt[n].binary;
+    }
 
-double object_mtime(const char *id)
-{
-    xs *md5 = xs_md5_hex(id, strlen(id));
-    return object_mtime_by_md5(md5);
+    /* not started with a _first() function */
+    return _index_fmt_set(f);
 }
 
 
-void object_touch(const char *id)
+int index_desc_next(FILE *f, char md5[MD5_HEX_SIZE])
+/* reads the next entry of a desc index */
 {
-    xs *md5 = xs_md5_hex(id, strlen(id));
-    xs *fn = _object_fn_by_md5(md5, "object_touch");
+    int binary = _index_fmt_get(f);
+    long rsize = binary ? BIDX_REC_SIZE : MD5_HEX_SIZE;
 
-    if (mtime(fn))
-        utimes(fn, NULL);
-}
+    for (;;) {
+        /* don't go back into the header of binary indexes */
+        if (binary && ftell(f) < BIDX_HDR_SIZE + rsize * 2)
+            return 0;
 
+        /* move backwards 2 entries */
+        if (fseek(f, rsize * -2, SEEK_CUR) == -1)
+            return 0;
 
-xs_str *_object_index_fn(const char *id, const char *idxsfx)
-/* returns the filename of an object's index */
-{
-    xs_str *fn = _object_fn(id);
-    return xs_replace_i(fn, ".json", idxsfx);
-}
+        /* read and md5 */
+        if (!_index_read_rec(f, md5, binary))
+            return 0;
 
+        if (md5[0] != '-')
+            break;
+    }
 
-int object_likes_len(const char *id)
-/* returns the number of likes (without reading the index) */
-{
-    xs *fn = _object_index_fn(id, "_l.idx");
-    return index_len(fn);
+    return 1;
 }
 
 
-int object_announces_len(const char *id)
-/* returns the number of announces (without reading the index) */
+int index_desc_first(FILE *f, char md5[MD5_HEX_SIZE], int skip)
+/* reads the first entry of a desc index */
 {
-    xs *fn = _object_index_fn(id, "_a.idx");
-    return index_len(fn);
-}
+    int binary = _index_fmt_set(f);
+    long rsize = binary ? BIDX_REC_SIZE : MD5_HEX_SIZE;
 
+    /* try to position at the end and then back to the first element */
+    if (fseek(f, 0, SEEK_END))
+        return 0;
 
-int object_emojireacts_len(const char *id)
-/* returns the number of emojireacts (without reading the index) */
-{
-    xs *fn = _object_index_fn(id, "_e.idx");
-    return index_len(fn);
-}
+    if (binary && ftell(f) < BIDX_HDR_SIZE + (skip + 1) * rsize)
+        return 0;
 
+    if (fseek(f, (skip + 1) * -rsize, SEEK_CUR))
+        return 0;
 
-xs_list *object_children(const char *id)
-/* returns the list of an object's children */
-{
-    xs *fn = _object_index_fn(id, "_c.idx");
-    return index_list(fn, XS_ALL);
-}
+    /* try to read an md5 */
+    if (!_index_read_rec(f, md5, binary))
+        return 0;
 
+    /* deleted? retry next */
+    if (md5[0] == '-')
+        return index_desc_next(f, md5);
 
-xs_list *object_get_emoji_reacts(const char *id)
-/* returns the list of an object's emoji reactions */
-{
-    xs *fn = _object_index_fn(id, "_e.idx");
-    return index_list(fn, XS_ALL);
+    return 1;
 }
 
-
-xs_list *object_likes(const char *id)
+int index_asc_first(FILE *f,char md5[MD5_HEX_SIZE], const char *seek_md5)
+/* reads the first entry of an ascending index, starting from a given md5 */
 {
-    xs *fn = _object_index_fn(id, "_l.idx");
-    return index_list(fn, XS_ALL);
-}
+    int binary = _index_fmt_set(f);
 
+    fseek(f, binary ? BIDX_HDR_SIZE : 0, SEEK_SET);
+    while (_index_read_rec(f, md5, binary)) {
+        if (strcmp(md5,seek_md5) == 0) {
+            return index_asc_next(f, md5);
+        }
+    }
+    return 0;
+}
 
-xs_list *object_announces(const char *id)
+int index_asc_next(FILE *f, char md5[MD5_HEX_SIZE])
+/* reads the next entry of an ascending index */
 {
-    xs *fn = _object_index_fn(id, "_a.idx");
-    return index_list(fn, XS_ALL);
-}
+    int binary = _index_fmt_get(f);
 
+    for (;;) {
+        /* read an md5 */
+        if (!_index_read_rec(f, md5, binary))
+            return 0;
 
-int object_parent(const char *md5, char parent[MD5_HEX_SIZE])
-/* returns the object parent, if any */
-{
-    xs *fn = _object_fn_by_md5(md5, "object_parent");
+        /* deleted, skip */
+        if (md5[0] != '-')
+            break;
+    }
 
-    fn = xs_replace_i(fn, ".json", "_p.idx");
-    return index_first(fn, parent);
+    return 1;
 }
 
 
-int object_admire(const char *id, const char *actor, int like)
-/* actor likes or announces this object */
+xs_list *index_list_desc(const char *fn, int skip, int show)
+/* returns an index as a list, in reverse order */
 {
-    int status = HTTP_STATUS_OK;
-    xs *fn     = _object_fn(id);
+    xs_list *list = xs_list_new();
+    FILE *f;
 
-    fn = xs_replace_i(fn, ".json", like ? "_l.idx" : "_a.idx");
+    if ((f = fopen(fn, "r")) != NULL) {
+        char md5[MD5_HEX_SIZE];
 
-    if (!index_in(fn, actor)) {
-        status = index_add(fn, actor);
+        if (index_desc_first(f, md5, skip)) {
+            int n = 1;
 
-        srv_debug(1, xs_fmt("object_admire (%s) %s %s", like ? "Like" : "Announce", actor, fn));
+            do {
+                list = xs_list_append(list, md5);
+            } while (n++ < show && index_desc_next(f, md5));
+        }
+
+        fclose(f);
     }
 
-    return status;
+    return list;
 }
 
 
-int object_unadmire(const char *id, const char *actor, int like)
-/* actor retrives their likes, announces or emojis this object */
+/** objects **/
+
+static xs_str *_object_fn_by_md5(const char *md5, const char *func)
 {
-    switch (like) {
-    case 0:
-        like = 'a';
-        break;
-    case 1:
-        like = 'l';
-        break;
-    case 2:
-        like = 'e';
-        break;
-    }
-    int status;
-    xs *fn = _object_fn(id);
-
-    char sfx[7] = "_x.idx";
-    sfx[1] = like;
-
-    fn = xs_replace_i(fn, ".json", sfx);
-
-    status = index_del(fn, actor);
-
-    if (valid_status(status))
-        index_gc(fn);
-
-    srv_debug(0,
-        xs_fmt("object_unadmire (%s) %s %s %d", like >= 'e' ?
-            (like == 'l' ? "Like" : "EmojiReact") : "Announce" , actor, fn, status));
-
-    return status;
-}
-
-int object_emoji_react(const char *mid, const char *eid)
-/* actor reacts w/ an emoji */
-{
-    int status = HTTP_STATUS_OK;
-    xs *fn     = _object_fn(mid);
-
-    fn = xs_replace_i(fn, ".json", "_e.idx");
+    xs *bfn = xs_fmt("%s/object/%c%c", srv_basedir, md5[0], md5[1]);
+    xs_str *ret;
+    int ok = 1;
 
-    if (!index_in(fn, eid)) {
-        status = index_add(fn, eid);
+    /* an object deleted from an index; fail but don't bark */
+    if (md5[0] == '-')
+        ok = 0;
+    else
+    if (!is_md5_hex(md5)) {
+        srv_log(xs_fmt("_object_fn_by_md5() [from %s()]: bad md5 '%s'", func, md5));
+        ok = 0;
+    }
 
-        srv_debug(1, xs_fmt("object_emoji_react (%s) added %s to %s", "EmojiReact", eid, fn));
+    if (ok) {
+        mkdirx(bfn);
+        ret = xs_fmt("%s/%s.json", bfn, md5);
     }
+    else
+        ret = xs_fmt("%s/object/invalid/invalid.json", srv_basedir);
 
-    return status;
+    return ret;
 }
 
 
-int object_rm_emoji_react(const char *mid, const char *eid)
-/* actor retrives their emoji reaction */
+static xs_str *_object_fn(const char *id)
 {
-    int status;
-    xs *fn = _object_fn(mid);
+    xs *md5 = xs_md5_hex(id, strlen(id));
+    return _object_fn_by_md5(md5, "_object_fn");
+}
 
-    fn = xs_replace_i(fn, ".json", "_e.idx");
 
-    status = index_del(fn, eid);
-    object_del(eid);
+/** parsed object cache **/
 
-    if (valid_status(status))
-        index_gc(fn);
+/* A bounded LRU of parsed objects, keyed by md5 and validated against
+   the file's inode, size and mtime (so changes made by other processes,
+   like the command line tools, are also detected). The budget is set
+   in megabytes with "object_cache_mb" (0 disables it) */
 
-    srv_debug(0,
-        xs_fmt("object_unadmire (EmojiReact) %s %s %d", eid, fn, status));
+#define OBJ_CACHE_BUCKETS 4096
 
-    return status;
-}
+typedef struct obj_cache_ent {
+    struct obj_cache_ent *prev;     /* LRU list (most recent first) */
+    struct obj_cache_ent *next;
+    struct obj_cache_ent *h_next;   /* hash chain */
+    char md5[MD5_HEX_SIZE];
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtim;
+    xs_dict *obj;
+    int o_size;
+} obj_cache_ent;
 
+static obj_cache_ent *obj_cache_buckets[OBJ_CACHE_BUCKETS];
+static obj_cache_ent *obj_cache_first = NULL;
+static obj_cache_ent *obj_cache_last  = NULL;
+static long obj_cache_bytes = 0;
+static long obj_cache_budget = -1;
+static pthread_mutex_t obj_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-xs_str *object_user_cache_fn_by_md5(snac *user, const char *md5, const char *cachedir)
+
+static obj_cache_ent **_obj_cache_slot(const char *md5)
+/* returns the hash chain slot where an md5 is (or would be) */
 {
-    return xs_fmt("%s/%s/%s.json", user->basedir, cachedir, md5);
-}
+    obj_cache_ent **e = &obj_cache_buckets[xs_hash_func(md5, MD5_HEX_SIZE - 1) % OBJ_CACHE_BUCKETS];
 
+    while (*e && strcmp((*e)->md5, md5) != 0)
+        e = &(*e)->h_next;
 
-xs_str *object_user_cache_fn(snac *user, const char *id, const char *cachedir)
-{
-    xs *md5 = xs_md5_hex(id, strlen(id));
-    return object_user_cache_fn_by_md5(user, md5, cachedir);
+    return e;
 }
 
 
-xs_str *object_user_cache_index_fn(snac *user, const char *cachedir)
+static void _obj_cache_unlink(obj_cache_ent *e)
+/* removes an entry from the LRU list */
 {
-    return xs_fmt("%s/%s.idx", user->basedir, cachedir);
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        obj_cache_first = e->next;
+
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        obj_cache_last = e->prev;
 }
 
 
-int _object_user_cache(snac *user, const char *id, const char *cachedir, int del)
-/* adds or deletes from a user cache */
+static void _obj_cache_drop(obj_cache_ent **slot)
+/* deletes the entry in a hash chain slot */
 {
-    xs *ofn = _object_fn(id);
-    xs *cfn = object_user_cache_fn(user, id, cachedir);
-    xs *idx = object_user_cache_index_fn(user, cachedir);
-    int ret;
+    obj_cache_ent *e = *slot;
 
-    if (del) {
-        ret = unlink(cfn);
-        index_del(idx, id);
-    }
-    else {
-        /* create the subfolder, if it does not exist */
-        xs *dir = xs_fmt("%s/%s/", user->basedir, cachedir);
-        mkdirx(dir);
+    *slot = e->h_next;
+    _obj_cache_unlink(e);
 
-        if ((ret = link(ofn, cfn)) != -1)
-            index_add(idx, id);
-    }
+    obj_cache_bytes -= e->o_size;
 
-    return ret;
+    xs_free(e->obj);
+    xs_free(e);
 }
 
 
-int object_user_cache_add(snac *user, const char *id, const char *cachedir)
-/* caches an object into a user cache */
+static void _obj_cache_del(const char *md5)
+/* invalidates a cached object */
 {
-    return _object_user_cache(user, id, cachedir, 0);
-}
+    pthread_mutex_lock(&obj_cache_mutex);
 
+    obj_cache_ent **slot = _obj_cache_slot(md5);
 
-int object_user_cache_del(snac *user, const char *id, const char *cachedir)
-/* deletes an object from a user cache */
-{
-    return _object_user_cache(user, id, cachedir, 1);
+    if (*slot)
+        _obj_cache_drop(slot);
+
+    pthread_mutex_unlock(&obj_cache_mutex);
 }
 
 
-int object_user_cache_in(snac *user, const char *id, const char *cachedir)
-/* checks if an object is stored in a cache */
+static xs_dict *_obj_cache_get(const char *md5, const struct stat *st)
+/* returns a copy of a cached object, if it's still valid */
 {
-    xs *cfn = object_user_cache_fn(user, id, cachedir);
-    return !!(mtime(cfn) != 0.0);
-}
+    xs_dict *obj = NULL;
 
+    pthread_mutex_lock(&obj_cache_mutex);
 
-int object_user_cache_in_by_md5(snac *user, const char *md5, const char *cachedir)
-/* checks if an object is stored in a cache */
-{
-    xs *cfn = object_user_cache_fn_by_md5(user, md5, cachedir);
-    return !!(mtime(cfn) != 0.0);
-}
+    obj_cache_ent **slot = _obj_cache_slot(md5);
+    obj_cache_ent *e = *slot;
 
+    if (e != NULL) {
+        if (e->dev == st->st_dev && e->ino == st->st_ino && e->size == st->st_size &&
+            e->mtim.tv_sec == st->st_mtim.tv_sec && e->mtim.tv_nsec == st->st_mtim.tv_nsec) {
+            obj = xs_dup(e->obj);
 
-xs_list *object_user_cache_list(snac *user, const char *cachedir, int max, int inv)
-/* returns the objects in a cache as a list */
-{
-    xs *idx = xs_fmt("%s/%s.idx", user->basedir, cachedir);
-    return inv ? index_list_desc(idx, 0, max) : index_list(idx, max);
-}
+            /* move to the front */
+            _obj_cache_unlink(e);
 
+            e->prev = NULL;
+            e->next = obj_cache_first;
 
-/** specialized functions **/
+            if (obj_cache_first)
+                obj_cache_first->prev = e;
+            else
+                obj_cache_last = e;
 
-/** followers **/
+            obj_cache_first = e;
+        }
+        else
+            _obj_cache_drop(slot);
+    }
 
-int follower_add(snac *snac, const char *actor)
-/* adds a follower */
-{
-    int ret = object_user_cache_add(snac, actor, "followers");
+    /* (the server state is not available in command line tools) */
+    if (p_state != NULL) {
+        if (obj)
+            p_state->obj_cache_hits++;
+        else
+            p_state->obj_cache_misses++;
+    }
 
-    snac_debug(snac, 2, xs_fmt("follower_add %s", actor));
+    pthread_mutex_unlock(&obj_cache_mutex);
 
-    return ret == -1 ? HTTP_STATUS_INTERNAL_SERVER_ERROR : HTTP_STATUS_OK;
+    return obj;
 }
 
 
-int follower_del(snac *snac, const char *actor)
-/* deletes a follower */
+static void _obj_cache_put(const char *md5, const struct stat *st, const xs_dict *obj)
+/* stores a copy of an object in the cache */
 {
-    int ret = object_user_cache_del(snac, actor, "followers");
-
-    snac_debug(snac, 2, xs_fmt("follower_del %s", actor));
+    pthread_mutex_lock(&obj_cache_mutex);
 
-    return ret == -1 ? HTTP_STATUS_NOT_FOUND : HTTP_STATUS_OK;
-}
+    if (obj_cache_budget == -1)
+        obj_cache_budget = 1024 * 1024 *
+            xs_number_get(xs_dict_get_def(srv_config, "object_cache_mb", "16"));
 
+    int o_size = xs_size(obj);
 
-int follower_check(snac *snac, const char *actor)
-/* checks if someone is a follower */
-{
-    return object_user_cache_in(snac, actor, "followers");
-}
+    if (o_size < obj_cache_budget) {
+        obj_cache_ent **slot = _obj_cache_slot(md5);
 
+        if (*slot)
+            _obj_cache_drop(slot);
 
-int follower_list_len(snac *snac)
-/* returns the number of followers */
-{
-    xs *list = object_user_cache_list(snac, "followers", XS_ALL, 0);
-    return xs_list_len(list);
-}
+        obj_cache_ent *e = xs_realloc(NULL, sizeof(obj_cache_ent));
 
+        *e = (obj_cache_ent){ NULL, obj_cache_first, NULL, "",
+            st->st_dev, st->st_ino, st->st_size, st->st_mtim, xs_dup(obj), o_size };
+        strncpy(e->md5, md5, sizeof(e->md5) - 1);
 
-xs_list *follower_list(snac *snac)
-/* returns the list of followers */
-{
-    xs *list       = object_user_cache_list(snac, "followers", XS_ALL, 0);
-    xs_list *fwers = xs_list_new();
-    char *p;
-    const char *v;
+        if (obj_cache_first)
+            obj_cache_first->prev = e;
+        else
+            obj_cache_last = e;
 
-    /* resolve the list of md5 to be a list of actors */
-    p = list;
-    while (xs_list_iter(&p, &v)) {
-        xs *a_obj = NULL;
+        obj_cache_first = e;
+        *slot = e;
 
-        if (valid_status(object_get_by_md5(v, &a_obj))) {
-            const char *actor = xs_dict_get(a_obj, "id");
+        obj_cache_bytes += o_size;
 
-            if (!xs_is_null(actor)) {
-                /* check if the actor is still cached */
-                xs *fn = xs_fmt("%s/followers/%s.json", snac->basedir, v);
+        /* evict the least recently used ones */
+        while (obj_cache_bytes > obj_cache_budget) {
+            _obj_cache_drop(_obj_cache_slot(obj_cache_last->md5));
 
-                if (mtime(fn) > 0.0)
-                    fwers = xs_list_append(fwers, actor);
-            }
+            if (p_state != NULL)
+                p_state->obj_cache_evictions++;
         }
     }
 
-    return fwers;
+    pthread_mutex_unlock(&obj_cache_mutex);
 }
 
 
-/** pending followers **/
-
-int pending_add(snac *user, const char *actor, const xs_dict *msg)
-/* stores the follow message for later confirmation */
+static xs_dict *_obj_cache_load(const char *md5, const char *fn)
+/* loads an object file (a hard link of it is also valid), using the cache */
 {
-    xs *dir = xs_fmt("%s/pending", user->basedir);
-    xs *md5 = xs_md5_hex(actor, strlen(actor));
-    xs *fn  = xs_fmt("%s/%s.json", dir, md5);
+    xs_dict *obj = NULL;
+    struct stat st;
     FILE *f;
 
-    mkdirx(dir);
+    if (stat(fn, &st) == -1)
+        return NULL;
 
-    if ((f = fopen(fn, "w")) == NULL)
-        return -1;
+    if ((obj = _obj_cache_get(md5, &st)) != NULL)
+        return obj;
 
-    xs_json_dump(msg, 4, f);
-    fclose(f);
+    if ((f = fopen(fn, "r")) != NULL) {
+        obj = xs_json_load(f);
 
-    return 0;
+        /* cache it with the attributes of what was really read */
+        if (obj != NULL && fstat(fileno(f), &st) != -1)
+            _obj_cache_put(md5, &st, obj);
+
+        fclose(f);
+    }
+
+    return obj;
 }
 
 
-int pending_check(snac *user, const char *actor)
-/* checks if there is a pending follow confirmation for the actor */
+int object_here_by_md5(const char *id)
+/* checks if an object is already downloaded */
 {
-    xs *md5 = xs_md5_hex(actor, strlen(actor));
-    xs *fn = xs_fmt("%s/pending/%s.json", user->basedir, md5);
+    xs *fn = _object_fn_by_md5(id, "object_here_by_md5");
+    return mtime(fn) > 0.0;
+}
 
-    return mtime(fn) != 0;
+
+int object_here(const char *id)
+/* checks if an object is already downloaded */
+{
+    xs *fn = _object_fn(id);
+    return mtime(fn) > 0.0;
 }
 
 
-xs_dict *pending_get(snac *user, const char *actor)
-/* returns the pending follow confirmation for the actor */
+int object_get_by_md5(const char *md5, xs_dict **obj)
+/* returns a stored object, optionally of the requested type */
 {
-    xs *md5 = xs_md5_hex(actor, strlen(actor));
-    xs *fn = xs_fmt("%s/pending/%s.json", user->basedir, md5);
-    xs_dict *msg = NULL;
-    FILE *f;
+    int status = HTTP_STATUS_NOT_FOUND;
+    xs *fn     = _object_fn_by_md5(md5, "object_get_by_md5");
 
-    if ((f = fopen(fn, "r")) != NULL) {
-        msg = xs_json_load(f);
-        fclose(f);
-    }
+    if ((*obj = _obj_cache_load(md5, fn)) != NULL)
+        status = HTTP_STATUS_OK;
 
-    return msg;
+    return status;
 }
 
 
-void pending_del(snac *user, const char *actor)
-/* deletes a pending follow confirmation for the actor */
+int object_get(const char *id, xs_dict **obj)
+/* returns a stored object, optionally of the requested type */
 {
-    xs *md5 = xs_md5_hex(actor, strlen(actor));
-    xs *fn = xs_fmt("%s/pending/%s.json", user->basedir, md5);
-
-    unlink(fn);
+    xs *md5 = xs_md5_hex(id, strlen(id));
+    return object_get_by_md5(md5, obj);
 }
 
 
-xs_list *pending_list(snac *user)
-/* returns a list of pending follow confirmations */
+int _object_add(const char *id, const xs_dict *obj, int ow)
+/* stores an object */
 {
-    xs *spec = xs_fmt("%s/pending/""*.json", user->basedir);
-    xs *l = xs_glob(spec, 0, 0);
-    xs_list *r = xs_list_new();
-    const char *v;
+    int status = HTTP_STATUS_CREATED; /* Created */
+    xs *fn     = _object_fn(id);
+    FILE *f;
 
-    xs_list_foreach(l, v) {
-        FILE *f;
-        xs *msg = NULL;
+    if (mtime(fn) > 0.0) {
+        if (!ow) {
+            /* object already here */
+            srv_debug(1, xs_fmt("object_add object already here %s", id));
+            return HTTP_STATUS_NO_CONTENT;
+        }
+        else
+            status = HTTP_STATUS_OK;
+    }
 
-        if ((f = fopen(v, "r")) == NULL)
-            continue;
+    if ((f = fopen(fn, "w")) != NULL) {
+        flock(fileno(f), LOCK_EX);
 
-        msg = xs_json_load(f);
+        xs_json_dump(obj, storage_json_indent(), f);
         fclose(f);
 
-        if (msg == NULL)
-            continue;
-
-        const char *actor = xs_dict_get(msg, "actor");
-
-        if (xs_type(actor) == XSTYPE_STRING)
-            r = xs_list_append(r, actor);
-    }
-
-    return r;
-}
+        xs *md5 = xs_md5_hex(id, strlen(id));
+        _obj_cache_del(md5);
 
+        /* does this object has a parent? */
+        const char *in_reply_to = get_in_reply_to(obj);
 
-int pending_count(snac *user)
-/* returns the number of pending follow confirmations */
-{
-    xs *spec = xs_fmt("%s/pending/""*.json", user->basedir);
-    xs *l = xs_glob(spec, 0, 0);
+        if (!xs_is_null(in_reply_to) && *in_reply_to) {
+            /* update the children index of the parent */
+            xs *c_idx = _object_fn(in_reply_to);
 
-    return xs_list_len(l);
-}
+            c_idx = xs_replace_i(c_idx, ".json", "_c.idx");
 
+            if (!index_in(c_idx, id)) {
+                index_add(c_idx, id);
+                srv_debug(1, xs_fmt("object_add added child %s to %s", id, c_idx));
+            }
+            else
+                srv_debug(1, xs_fmt("object_add %s child already in %s", id, c_idx));
 
-int is_msg_mine(snac *user, const char *id)
-/* returns true if a post id is by the given user */
-{
-    int ret = 0;
+            /* create a one-element index with the parent */
+            xs *p_idx = xs_replace(fn, ".json", "_p.idx");
 
-    if (xs_is_string(id)) {
-        xs *s1 = xs_fmt("%s/", user->actor);
-        ret = xs_startswith(id, s1);
+            if (mtime(p_idx) == 0.0) {
+                index_add(p_idx, in_reply_to);
+                srv_debug(1, xs_fmt("object_add added parent %s to %s", in_reply_to, p_idx));
+            }
+        }
+    }
+    else {
+        srv_log(xs_fmt("object_add error writing %s (errno: %d)", fn, errno));
+        status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
     }
 
-    return ret;
-}
+    srv_debug(1, xs_fmt("object_add %s %s %d", id, fn, status));
 
+    return status;
+}
 
-/** timeline **/
 
-double timeline_mtime(snac *snac)
+int object_add(const char *id, const xs_dict *obj)
+/* stores an object */
 {
-    xs *fn = xs_fmt("%s/private.idx", snac->basedir);
-    return mtime(fn);
+    return _object_add(id, obj, 0);
 }
 
 
-int timeline_touch(snac *snac)
-/* changes the date of the timeline index */
+int object_add_ow(const char *id, const xs_dict *obj)
+/* stores an object (overwriting allowed) */
 {
-    xs *fn = xs_fmt("%s/private.idx", snac->basedir);
-    return utimes(fn, NULL);
+    return _object_add(id, obj, 1);
 }
 
 
-xs_str *timeline_fn_by_md5(snac *snac, const char *md5)
-/* get the filename of an entry by md5 from any timeline */
+int object_del_by_md5(const char *md5)
+/* deletes an object by its md5 */
 {
-    xs_str *fn = NULL;
+    int status = HTTP_STATUS_NOT_FOUND;
+    xs *fn     = _object_fn_by_md5(md5, "object_del_by_md5");
 
-    if (is_md5_hex(md5)) {
-        fn = xs_fmt("%s/private/%s.json", snac->basedir, md5);
+    _obj_cache_del(md5);
 
-        if (mtime(fn) == 0.0) {
-            fn = xs_free(fn);
-            fn = xs_fmt("%s/public/%s.json", snac->basedir, md5);
+    if (unlink(fn) != -1) {
+        status = HTTP_STATUS_OK;
 
-            if (mtime(fn) == 0.0)
-                fn = xs_free(fn);
+        /* also delete associated indexes */
+        xs *spec  = xs_dup(fn);
+        spec      = xs_replace_i(spec, ".json", "*.idx");
+        xs *files = xs_glob(spec, 0, 0);
+        char *p;
+        const char *v;
+
+        p = files;
+        while (xs_list_iter(&p, &v)) {
+            srv_debug(1, xs_fmt("object_del index %s", v));
+            unlink(v);
         }
     }
 
-    return fn;
-}
-
-
-int timeline_here_by_md5(snac *snac, const char *md5)
-/* checks if an object is in the user cache */
-{
-    xs *fn = timeline_fn_by_md5(snac, md5);
+    srv_debug(1, xs_fmt("object_del %s %d", fn, status));
 
-    return !(fn == NULL);
+    return status;
 }
 
 
-int timeline_here(snac *user, const char *id)
+int object_del(const char *id)
+/* deletes an object */
 {
     xs *md5 = xs_md5_hex(id, strlen(id));
-
-    return timeline_here_by_md5(user, md5);
+    return object_del_by_md5(md5);
 }
 
 
-int timeline_get_by_md5(snac *snac, const char *md5, xs_dict **msg)
-/* gets a message from the timeline */
+int object_del_if_unref(const char *id)
+/* deletes an object if its n_links < 2 */
 {
-    int status = HTTP_STATUS_NOT_FOUND;
-    FILE *f    = NULL;
-
-    xs *fn = timeline_fn_by_md5(snac, md5);
-
-    if (fn != NULL && (f = fopen(fn, "r")) != NULL) {
-        *msg = xs_json_load(f);
-        fclose(f);
+    xs *fn = _object_fn(id);
+    int n_links;
+    int ret = 0;
 
-        if (*msg != NULL)
-            status = HTTP_STATUS_OK;
-    }
+    if (mtime_nl(fn, &n_links) > 0.0 && n_links < 2)
+        ret = object_del(id);
 
-    return status;
+    return ret;
 }
 
 
-int timeline_del(snac *snac, const char *id)
-/* deletes a message from the timeline */
+double object_ctime_by_md5(const char *md5)
 {
-    /* delete from the user's caches */
-    object_user_cache_del(snac, id, "public");
-    object_user_cache_del(snac, id, "private");
+    xs *fn = _object_fn_by_md5(md5, "object_ctime_by_md5");
+    return f_ctime(fn);
+}
 
-    unpin(snac, id);
-    unbookmark(snac, id);
 
-    /* try to delete the object if it's not used elsewhere */
-    return object_del_if_unref(id);
+double object_ctime(const char *id)
+{
+    xs *md5 = xs_md5_hex(id, strlen(id));
+    return object_ctime_by_md5(md5);
 }
 
 
-void timeline_update_indexes(snac *snac, const char *id)
-/* updates the indexes */
+double object_mtime_by_md5(const char *md5)
 {
-    object_user_cache_add(snac, id, "private");
-
-    if (is_msg_mine(snac, id)) {
-        xs *msg = NULL;
+    xs *fn = _object_fn_by_md5(md5, "object_mtime_by_md5");
+    return mtime(fn);
+}
 
-        if (valid_status(object_get(id, &msg))) {
-            const int scope = get_msg_visibility(msg);
-            /* if its ours and is public, also store in public */
-            if (scope == SCOPE_PUBLIC) {
-                if (object_user_cache_add(snac, id, "public") >= 0) {
-                    /* also add it to the instance public timeline */
-                    xs *ipt = xs_fmt("%s/public.idx", srv_basedir);
-                    index_add(ipt, id);
-                }
-                else
-                    srv_debug(1, xs_fmt("Not added to public instance index %s, visibility %d", id, scope));
-            }
-            else
-                /* also add it to public, it will be discarded later */
-                object_user_cache_add(snac, id, "public");
 
-            /* if `keep_replied_posts` is `true` and a local post is a reply to a remote post, add the parent remote post to the public */
-            if (xs_is_true(xs_dict_get(srv_config, "keep_replied_posts"))) {
-                const char *in_reply_to = get_in_reply_to(msg);
+double object_mtime(const char *id)
+{
+    xs *md5 = xs_md5_hex(id, strlen(id));
+    return object_mtime_by_md5(md5);
+}
 
-                if (xs_is_string(in_reply_to) && *in_reply_to &&
-                    !is_msg_mine(snac, in_reply_to)) {
-                    if (object_user_cache_add(snac, in_reply_to, "public") >= 0) {
-                        snac_debug(snac, 1,
-                            xs_fmt("keep_replied_posts: added parent %s to public", in_reply_to));
-                    }
-                }
-            }
-        }
-    }
-    else {
-        /* if `keep_replied_me` is `true` and a remote post is a reply to one of local posts, add it to public */
-        if (xs_is_true(xs_dict_get(srv_config, "keep_replied_me"))) {
-            xs *msg = NULL;
 
-            if (valid_status(object_get(id, &msg))) {
-                const char *in_reply_to = get_in_reply_to(msg);
+void object_touch(const char *id)
+{
+    xs *md5 = xs_md5_hex(id, strlen(id));
+    xs *fn = _object_fn_by_md5(md5, "object_touch");
 
-                if (xs_is_string(in_reply_to) && *in_reply_to &&
-                    is_msg_mine(snac, in_reply_to)) {
-                    if (object_user_cache_add(snac, id, "public") >= 0) {
-                        snac_debug(snac, 1,
-                            xs_fmt("keep_replied_me: added reply %s to public", id));
-                    }
-                }
-            }
-        }
+    if (mtime(fn)) {
+        utimes(fn, NULL);
+        _obj_cache_del(md5);
     }
 }
 
 
-int timeline_add(snac *snac, const char *id, const xs_dict *o_msg)
-/* adds a message to the timeline */
+xs_str *_object_index_fn(const char *id, const char *idxsfx)
+/* returns the filename of an object's index */
 {
-    int ret = object_add(id, o_msg);
-    timeline_update_indexes(snac, id);
+    xs_str *fn = _object_fn(id);
+    return xs_replace_i(fn, ".json", idxsfx);
+}
 
-    tag_index(id, o_msg);
 
-    list_distribute(snac, NULL, o_msg);
+int object_likes_len(const char *id)
+/* returns the number of likes (without reading the index) */
+{
+    xs *fn = _object_index_fn(id, "_l.idx");
+    return index_len(fn);
+}
 
-    snac_debug(snac, 1, xs_fmt("timeline_add %s", id));
 
-    return ret;
+int object_announces_len(const char *id)
+/* returns the number of announces (without reading the index) */
+{
+    xs *fn = _object_index_fn(id, "_a.idx");
+    return index_len(fn);
 }
 
 
-int timeline_emoji_react(const char *act, const char *id, const xs_dict *msg_o)
-/* adds an emoji reaction to a message */
-{
-    xs *msg = xs_dup(msg_o);
-    msg = xs_dict_append(msg, "attributedTo", act);
-    msg = xs_dict_set(msg, "type", "EmojiReact");
-    const char *emote_id = xs_dict_get(msg, "id");
-
-    int ret = object_add(emote_id, msg);
-    if (ret == HTTP_STATUS_OK || ret == HTTP_STATUS_CREATED)
-        ret = object_emoji_react(id, emote_id);
-
-    return ret;
+int object_emojireacts_len(const char *id)
+/* returns the number of emojireacts (without reading the index) */
+{
+    xs *fn = _object_index_fn(id, "_e.idx");
+    return index_len(fn);
 }
 
 
-int timeline_admire(snac *snac, const char *id,
-                    const char *admirer, int like, const xs_dict *msg)
-/* updates a timeline entry with a new admiration or emoji reaction */
+xs_list *object_children(const char *id)
+/* returns the list of an object's children */
 {
-    int ret;
-    const char *content = xs_dict_get_path(msg, "content");
-    const char *type = xs_dict_get_path(msg, "type");
-
-    /* if we are admiring this, add to both timelines, and store for later */
-    if (!like && strcmp(admirer, snac->actor) == 0) {
-        object_user_cache_add(snac, id, "public");
-        object_user_cache_add(snac, id, "private");
-    }
+    xs *fn = _object_index_fn(id, "_c.idx");
+    return index_list(fn, XS_ALL);
+}
 
-    if (strcmp(admirer, snac->actor) == 0)
-        object_user_cache_add(snac, id, "admire");
 
-    /* use utf <3 as a like, as it is ugly */
-    if (type && xs_match(type, "Like|EmojiReact|Emoji") &&
-            content && strcmp(content, "❤") != 0) {
-        ret = timeline_emoji_react(snac->actor, id, msg);
-        snac_debug(snac, 1, xs_fmt("timeline_emoji_react %s", id));
-    }
+xs_list *object_get_emoji_reacts(const char *id)
+/* returns the list of an object's emoji reactions */
+{
+    xs *fn = _object_index_fn(id, "_e.idx");
+    return index_list(fn, XS_ALL);
+}
 
-    else {
-        ret = object_admire(id, admirer, like);
-        snac_debug(snac, 1, xs_fmt("timeline_admire (%s) %s %s",
-                like ? "Like" : "Announce", id, admirer));
-    }
 
-    return ret;
+xs_list *object_likes(const char *id)
+{
+    xs *fn = _object_index_fn(id, "_l.idx");
+    return index_list(fn, XS_ALL);
 }
 
 
-xs_list *timeline_top_level(snac *snac, const xs_list *list)
-/* returns the top level md5 entries from this index */
+xs_list *object_announces(const char *id)
 {
-    xs_set seen;
-    const xs_str *v;
+    xs *fn = _object_index_fn(id, "_a.idx");
+    return index_list(fn, XS_ALL);
+}
 
-    xs_set_init(&seen);
 
-    int c = 0;
-    while (xs_list_next(list, &v, &c)) {
-        char line[MD5_HEX_SIZE] = "";
+int object_parent(const char *md5, char parent[MD5_HEX_SIZE])
+/* returns the object parent, if any */
+{
+    xs *fn = _object_fn_by_md5(md5, "object_parent");
 
-        strncpy(line, v, sizeof(line));
+    fn = xs_replace_i(fn, ".json", "_p.idx");
+    return index_first(fn, parent);
+}
 
-        for (;;) {
-            char line2[MD5_HEX_SIZE];
 
-            /* if it doesn't have a parent, use this */
-            if (!object_parent(line, line2))
-                break;
+int object_admire(const char *id, const char *actor, int like)
+/* actor likes or announces this object */
+{
+    int status = HTTP_STATUS_OK;
+    xs *fn     = _object_fn(id);
 
-            /* well, there is a parent... but is it here? */
-            if (!timeline_here_by_md5(snac, line2))
-                break;
+    fn = xs_replace_i(fn, ".json", like ? "_l.idx" : "_a.idx");
 
-            /* it's here! try again with its own parent */
-            strncpy(line, line2, sizeof(line));
-        }
+    if (!index_in(fn, actor)) {
+        status = index_add(fn, actor);
 
-        xs_set_add(&seen, line);
+        srv_debug(1, xs_fmt("object_admire (%s) %s %s", like ? "Like" : "Announce", actor, fn));
     }
 
-    return xs_set_result(&seen);
+    return status;
 }
 
 
-xs_str *user_index_fn(snac *user, const char *idx_name)
-/* returns the filename of a user index */
+int object_unadmire(const char *id, const char *actor, int like)
+/* actor retrives their likes, announces or emojis this object */
 {
-    return xs_fmt("%s/%s.idx", user->basedir, idx_name);
-}
+    switch (like) {
+    case 0:
+        like = 'a';
+        break;
+    case 1:
+        like = 'l';
+        break;
+    case 2:
+        like = 'e';
+        break;
+    }
+    int status;
+    xs *fn = _object_fn(id);
+
+    char sfx[7] = "_x.idx";
+    sfx[1] = like;
 
+    fn = xs_replace_i(fn, ".json", sfx);
 
-xs_list *timeline_simple_list(snac *user, const char *idx_name, int skip, int show, int *more)
-/* returns a timeline (with all entries) */
+    status = index_del(fn, actor);
+
+    if (valid_status(status))
+        index_gc(fn);
+
+    srv_debug(0,
+        xs_fmt("object_unadmire (%s) %s %s %d", like >= 'e' ?
+            (like == 'l' ? "Like" : "EmojiReact") : "Announce" , actor, fn, status));
+
+    return status;
+}
+
+int object_emoji_react(const char *mid, const char *eid)
+/* actor reacts w/ an emoji */
 {
-    xs *idx = user_index_fn(user, idx_name);
+    int status = HTTP_STATUS_OK;
+    xs *fn     = _object_fn(mid);
 
-    /* if a more flag is sent, request one more */
-    xs_list *lst = index_list_desc(idx, skip, show + (more != NULL ? 1 : 0));
+    fn = xs_replace_i(fn, ".json", "_e.idx");
 
-    if (more != NULL) {
-        if (xs_list_len(lst) > show) {
-            *more = 1;
-            lst = xs_list_del(lst, -1);
-        }
-        else
-            *more = 0;
+    if (!index_in(fn, eid)) {
+        status = index_add(fn, eid);
+
+        srv_debug(1, xs_fmt("object_emoji_react (%s) added %s to %s", "EmojiReact", eid, fn));
     }
 
-    return lst;
+    return status;
 }
 
 
-xs_list *timeline_list(snac *snac, const char *idx_name, int skip, int show, int *more)
-/* returns a timeline (only top level entries) */
+int object_rm_emoji_react(const char *mid, const char *eid)
+/* actor retrives their emoji reaction */
 {
-    int c_max;
+    int status;
+    xs *fn = _object_fn(mid);
 
-    /* maximum number of items in the timeline */
-    c_max = xs_number_get(xs_dict_get(srv_config, "max_timeline_entries"));
+    fn = xs_replace_i(fn, ".json", "_e.idx");
 
-    /* never more timeline entries than the configured maximum */
-    if (show > c_max)
-        show = c_max;
+    status = index_del(fn, eid);
+    object_del(eid);
 
-    xs *list = timeline_simple_list(snac, idx_name, skip, show, more);
+    if (valid_status(status))
+        index_gc(fn);
 
-    return timeline_top_level(snac, list);
+    srv_debug(0,
+        xs_fmt("object_unadmire (EmojiReact) %s %s %d", eid, fn, status));
+
+    return status;
 }
 
 
-void timeline_add_mark(snac *user)
-/* adds an "already seen" mark to the private timeline */
+xs_str *object_user_cache_fn_by_md5(snac *user, const char *md5, const char *cachedir)
 {
-    xs *fn = xs_fmt("%s/private.idx", user->basedir);
-    char last_entry[MD5_HEX_SIZE] = "";
-    FILE *f;
+    return xs_fmt("%s/%s/%s.json", user->basedir, cachedir, md5);
+}
 
-    /* get the last entry in the index */
-    if ((f = fopen(fn, "r")) != NULL) {
-        index_desc_first(f, last_entry, 0);
-        fclose(f);
-    }
 
-    /* is the last entry *not* a mark? */
-    if (strcmp(last_entry, MD5_ALREADY_SEEN_MARK) != 0) {
-        /* add it */
-        index_add_md5(fn, MD5_ALREADY_SEEN_MARK);
-    }
+xs_str *object_user_cache_fn(snac *user, const char *id, const char *cachedir)
+{
+    xs *md5 = xs_md5_hex(id, strlen(id));
+    return object_user_cache_fn_by_md5(user, md5, cachedir);
 }
 
 
-xs_str *instance_index_fn(void)
+xs_str *object_user_cache_index_fn(snac *user, const char *cachedir)
 {
-    return xs_fmt("%s/public.idx", srv_basedir);
+    return xs_fmt("%s/%s.idx", user->basedir, cachedir);
 }
 
 
-xs_list *timeline_instance_list(int skip, int show)
-/* returns the timeline for the full instance */
+int _object_user_cache(snac *user, const char *id, const char *cachedir, int del)
+/* adds or deletes from a user cache */
 {
-    xs *idx = instance_index_fn();
-    xs *lst = index_list_desc(idx, skip, show);
+    xs *ofn = _object_fn(id);
+    xs *cfn = object_user_cache_fn(user, id, cachedir);
+    xs *idx = object_user_cache_index_fn(user, cachedir);
+    int ret;
 
-    /* make the list unique */
-    xs_set rep;
-    xs_set_init(&rep);
-    const char *md5;
+    if (del) {
+        ret = unlink(cfn);
+        index_del(idx, id);
+    }
+    else {
+        /* create the subfolder, if it does not exist */
+        xs *dir = xs_fmt("%s/%s/", user->basedir, cachedir);
+        mkdirx(dir);
 
-    xs_list_foreach(lst, md5)
-        xs_set_add(&rep, md5);
+        if ((ret = link(ofn, cfn)) != -1)
+            index_add(idx, id);
+    }
 
-    return xs_set_result(&rep);
+    return ret;
 }
 
 
-/** following **/
+int object_user_cache_add(snac *user, const char *id, const char *cachedir)
+/* caches an object into a user cache */
+{
+    return _object_user_cache(user, id, cachedir, 0);
+}
 
-/* this needs special treatment and cannot use the object db as is,
-   with a link to a cached author, because we need the Follow object
-   in case we need to unfollow (Undo + original Follow) */
 
-xs_str *_following_fn(snac *snac, const char *actor)
+int object_user_cache_del(snac *user, const char *id, const char *cachedir)
+/* deletes an object from a user cache */
 {
-    xs *md5 = xs_md5_hex(actor, strlen(actor));
-    return xs_fmt("%s/following/%s.json", snac->basedir, md5);
+    return _object_user_cache(user, id, cachedir, 1);
 }
 
 
-int following_add(snac *snac, const char *actor, const xs_dict *msg)
-/* adds to the following list */
+int object_user_cache_in(snac *user, const char *id, const char *cachedir)
+/* checks if an object is stored in a cache */
 {
-    int ret = HTTP_STATUS_CREATED;
-    xs *fn = _following_fn(snac, actor);
-    FILE *f;
-    xs *p_object = NULL;
-
-    if (valid_status(following_get(snac, actor, &p_object))) {
-        /* object already exists; if it's of type Accept,
-           the actor is already being followed and confirmed,
-           so do nothing */
-        const char *type = xs_dict_get(p_object, "type");
+    xs *cfn = object_user_cache_fn(user, id, cachedir);
+    return !!(mtime(cfn) != 0.0);
+}
 
-        if (!xs_is_null(type) && strcmp(type, "Accept") == 0) {
-            snac_debug(snac, 1, xs_fmt("following_add actor already confirmed %s", actor));
-            return HTTP_STATUS_OK;
-        }
-    }
 
-    if ((f = fopen(fn, "w")) != NULL) {
-        xs_json_dump(msg, 4, f);
-        fclose(f);
+int object_user_cache_in_by_md5(snac *user, const char *md5, const char *cachedir)
+/* checks if an object is stored in a cache */
+{
+    xs *cfn = object_user_cache_fn_by_md5(user, md5, cachedir);
+    return !!(mtime(cfn) != 0.0);
+}
 
-        /* get the filename of the actor object */
-        xs *actor_fn = _object_fn(actor);
 
-        /* increase its reference count */
-        fn = xs_replace_i(fn, ".json", "_a.json");
-        link(actor_fn, fn);
-    }
-    else
-        ret = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+xs_list *object_user_cache_list(snac *user, const char *cachedir, int max, int inv)
+/* returns the objects in a cache as a list */
+{
+    xs *idx = xs_fmt("%s/%s.idx", user->basedir, cachedir);
+    return inv ? index_list_desc(idx, 0, max) : index_list(idx, max);
+}
 
-    snac_debug(snac, 2, xs_fmt("following_add %s %s", actor, fn));
 
-    return ret;
-}
+/** specialized functions **/
 
+/** followers **/
 
-int following_del(snac *snac, const char *actor)
-/* we're not following this actor any longer */
+int follower_add(snac *snac, const char *actor)
+/* adds a follower */
 {
-    xs *fn = _following_fn(snac, actor);
-
-    snac_debug(snac, 2, xs_fmt("following_del %s %s", actor, fn));
+    int ret = object_user_cache_add(snac, actor, "followers");
 
-    unlink(fn);
+    rfollow_update(snac, actor);
 
-    /* also delete the reference to the author */
-    fn = xs_replace_i(fn, ".json", "_a.json");
-    unlink(fn);
+    snac_debug(snac, 2, xs_fmt("follower_add %s", actor));
 
-    return HTTP_STATUS_OK;
+    return ret == -1 ? HTTP_STATUS_INTERNAL_SERVER_ERROR : HTTP_STATUS_OK;
 }
 
 
-int following_check(snac *snac, const char *actor)
-/* checks if we are following this actor */
+int follower_del(snac *snac, const char *actor)
+/* deletes a follower */
 {
-    xs *fn = _following_fn(snac, actor);
+    int ret = object_user_cache_del(snac, actor, "followers");
 
-    return !!(mtime(fn) != 0.0);
-}
+    rfollow_update(snac, actor);
 
+    snac_debug(snac, 2, xs_fmt("follower_del %s", actor));
 
-int following_get(snac *snac, const char *actor, xs_dict **data)
-/* returns the 'Follow' object */
-{
-    xs *fn = _following_fn(snac, actor);
-    FILE *f;
-    int status = HTTP_STATUS_OK;
+    return ret == -1 ? HTTP_STATUS_NOT_FOUND : HTTP_STATUS_OK;
+}
 
-    if ((f = fopen(fn, "r")) != NULL) {
-        *data = xs_json_load(f);
-        fclose(f);
-    }
-    else
-        status = HTTP_STATUS_NOT_FOUND;
 
-    return status;
+int follower_check(snac *snac, const char *actor)
+/* checks if someone is a follower */
+{
+    return object_user_cache_in(snac, actor, "followers");
 }
 
 
-int following_list_len(snac *snac)
-/* returns number of people being followed */
+int follower_list_len(snac *snac)
+/* returns the number of followers */
 {
-    xs *spec = xs_fmt("%s/following/" "*_a.json", snac->basedir);
-    xs *glist = xs_glob(spec, 0, 0);
-    return xs_list_len(glist);
+    xs *list = object_user_cache_list(snac, "followers", XS_ALL, 0);
+    return xs_list_len(list);
 }
 
 
-xs_list *following_list(snac *snac)
-/* returns the list of people being followed */
+xs_list *follower_list(snac *snac)
+/* returns the list of followers */
 {
-    xs *spec = xs_fmt("%s/following/" "*.json", snac->basedir);
-    xs *glist = xs_glob(spec, 0, 0);
-    xs_list *p;
-    const xs_str *v;
-    xs_list *list = xs_list_new();
+    xs *list       = object_user_cache_list(snac, "followers", XS_ALL, 0);
+    xs_list *fwers = xs_list_new();
+    char *p;
+    const char *v;
 
-    /* iterate the list of files */
-    p = glist;
+    /* resolve the list of md5 to be a list of actors */
+    p = list;
     while (xs_list_iter(&p, &v)) {
-        FILE *f;
-
-        /* load the follower data */
-        if ((f = fopen(v, "r")) != NULL) {
-            xs *o = xs_json_load(f);
-            fclose(f);
-
-            if (o != NULL) {
-                const char *type = xs_dict_get(o, "type");
-
-                if (!xs_is_null(type) && strcmp(type, "Accept") == 0) {
-                    const char *actor = xs_dict_get(o, "actor");
+        xs *a_obj = NULL;
 
-                    if (!xs_is_null(actor)) {
-                        list = xs_list_append(list, actor);
+        if (valid_status(object_get_by_md5(v, &a_obj))) {
+            const char *actor = xs_dict_get(a_obj, "id");
 
-                        /* check if there is a link to the actor object */
-                        xs *v2 = xs_replace(v, ".json", "_a.json");
+            if (!xs_is_null(actor)) {
+                /* check if the actor is still cached */
+                xs *fn = xs_fmt("%s/followers/%s.json", snac->basedir, v);
 
-                        if (mtime(v2) == 0.0) {
-                            /* no; add a link to it */
-                            xs *actor_fn = _object_fn(actor);
-                            link(actor_fn, v2);
-                        }
-                    }
-                }
+                if (mtime(fn) > 0.0)
+                    fwers = xs_list_append(fwers, actor);
             }
         }
     }
 
-    return list;
+    return fwers;
 }
 
 
-xs_str *_muted_fn(snac *snac, const char *actor)
+/** pending followers **/
+
+int pending_add(snac *user, const char *actor, const xs_dict *msg)
+/* stores the follow message for later confirmation */
 {
+    xs *dir = xs_fmt("%s/pending", user->basedir);
     xs *md5 = xs_md5_hex(actor, strlen(actor));
-    return xs_fmt("%s/muted/%s", snac->basedir, md5);
+    xs *fn  = xs_fmt("%s/%s.json", dir, md5);
+    FILE *f;
+
+    mkdirx(dir);
+
+    if ((f = fopen(fn, "w")) == NULL)
+        return -1;
+
+    xs_json_dump(msg, 4, f);
+    fclose(f);
+
+    return 0;
 }
 
 
-void mute(snac *snac, const char *actor)
-/* mutes a moron */
+int pending_check(snac *user, const char *actor)
+/* checks if there is a pending follow confirmation for the actor */
 {
-    xs *fn = _muted_fn(snac, actor);
-    FILE *f;
-
-    if ((f = fopen(fn, "w")) != NULL) {
-        fprintf(f, "%s\n", actor);
-        fclose(f);
+    xs *md5 = xs_md5_hex(actor, strlen(actor));
+    xs *fn = xs_fmt("%s/pending/%s.json", user->basedir, md5);
 
-        snac_debug(snac, 2, xs_fmt("muted %s %s", actor, fn));
-    }
+    return mtime(fn) != 0;
 }
 
 
-void unmute(snac *snac, const char *actor)
-/* actor is no longer a moron */
+xs_dict *pending_get(snac *user, const char *actor)
+/* returns the pending follow confirmation for the actor */
 {
-    xs *fn = _muted_fn(snac, actor);
+    xs *md5 = xs_md5_hex(actor, strlen(actor));
+    xs *fn = xs_fmt("%s/pending/%s.json", user->basedir, md5);
+    xs_dict *msg = NULL;
+    FILE *f;
 
-    unlink(fn);
+    if ((f = fopen(fn, "r")) != NULL) {
+        msg = xs_json_load(f);
+        fclose(f);
+    }
 
-    snac_debug(snac, 2, xs_fmt("unmuted %s %s", actor, fn));
+    return msg;
 }
 
 
-int is_muted(snac *snac, const char *actor)
-/* check if someone is muted */
+void pending_del(snac *user, const char *actor)
+/* deletes a pending follow confirmation for the actor */
 {
-    xs *fn = _muted_fn(snac, actor);
+    xs *md5 = xs_md5_hex(actor, strlen(actor));
+    xs *fn = xs_fmt("%s/pending/%s.json", user->basedir, md5);
 
-    return !!(mtime(fn) != 0.0);
+    unlink(fn);
 }
 
 
-xs_list *muted_list(snac *user)
-/* returns the list (actor URLs) of the muted morons */
+xs_list *pending_list(snac *user)
+/* returns a list of pending follow confirmations */
 {
-    xs_list *l = xs_list_new();
-    xs *spec = xs_fmt("%s/muted/" "*", user->basedir);
-    xs *files = xs_glob(spec, 0, 0);
-    const char *fn;
+    xs *spec = xs_fmt("%s/pending/""*.json", user->basedir);
+    xs *l = xs_glob(spec, 0, 0);
+    xs_list *r = xs_list_new();
+    const char *v;
 
-    xs_list_foreach(files, fn) {
+    xs_list_foreach(l, v) {
         FILE *f;
+        xs *msg = NULL;
 
-        if ((f = fopen(fn, "r")) != NULL) {
-            xs *actor = xs_strip_i(xs_readline(f));
-            fclose(f);
-
-            l = xs_list_append(l, actor);
-        }
-    }
+        if ((f = fopen(v, "r")) == NULL)
+            continue;
 
-    return l;
-}
+        msg = xs_json_load(f);
+        fclose(f);
 
-/** emojis react **/
+        if (msg == NULL)
+            continue;
 
-xs_str *emoji_reacted(snac *user, const char *id)
-/* returns the emoji an user reacted to a message */
-{
-    xs *emojis = object_get_emoji_reacts(id);
-    int c = 0;
-    const char *v;
+        const char *actor = xs_dict_get(msg, "actor");
 
-    while (xs_list_next(emojis, &v, &c)) {
-        xs *msg = NULL;
-        if (object_get_by_md5(v, &msg)) {
-            const xs_val *act = xs_dict_get(msg, "actor");
-            if (act && strcmp(act, user->actor) == 0)
-                return xs_dup(xs_dict_get(msg, "content"));
-        }
+        if (xs_type(actor) == XSTYPE_STRING)
+            r = xs_list_append(r, actor);
     }
-    return NULL;
+
+    return r;
 }
 
-/** bookmarking **/
 
-int is_bookmarked(snac *user, const char *id)
-/* returns true if this note is bookmarked */
-{
-    return object_user_cache_in(user, id, "bookmark");
-}
-
-
-int bookmark(snac *user, const char *id)
-/* bookmarks a post */
+int pending_count(snac *user)
+/* returns the number of pending follow confirmations */
 {
-    if (is_bookmarked(user, id))
-        return -3;
+    xs *spec = xs_fmt("%s/pending/""*.json", user->basedir);
+    xs *l = xs_glob(spec, 0, 0);
 
-    return object_user_cache_add(user, id, "bookmark");
+    return xs_list_len(l);
 }
 
 
-int unbookmark(snac *user, const char *id)
-/* unbookmarks a post */
+int is_msg_mine(snac *user, const char *id)
+/* returns true if a post id is by the given user */
 {
-    return object_user_cache_del(user, id, "bookmark");
-}
+    int ret = 0;
 
+    if (xs_is_string(id)) {
+        xs *s1 = xs_fmt("%s/", user->actor);
+        ret = xs_startswith(id, s1);
+    }
 
-xs_list *bookmark_list(snac *user)
-/* return the lists of bookmarked posts */
-{
-    return object_user_cache_list(user, "bookmark", XS_ALL, 1);
+    return ret;
 }
 
 
-xs_str *bookmark_index_fn(snac *user)
+/** timeline **/
+
+double timeline_mtime(snac *snac)
 {
-    return object_user_cache_index_fn(user, "bookmark");
+    xs *fn = xs_fmt("%s/private.idx", snac->basedir);
+    return mtime(fn);
 }
 
 
-/** pinning **/
-
-int is_pinned(snac *user, const char *id)
-/* returns true if this note is pinned */
+int timeline_touch(snac *snac)
+/* changes the date of the timeline index */
 {
-    return object_user_cache_in(user, id, "pinned");
+    xs *fn = xs_fmt("%s/private.idx", snac->basedir);
+    return utimes(fn, NULL);
 }
 
 
-int is_pinned_by_md5(snac *user, const char *md5)
+xs_str *timeline_fn_by_md5(snac *snac, const char *md5)
+/* get the filename of an entry by md5 from any timeline */
 {
-    return object_user_cache_in_by_md5(user, md5, "pinned");
-}
+    xs_str *fn = NULL;
 
+    if (is_md5_hex(md5)) {
+        fn = xs_fmt("%s/private/%s.json", snac->basedir, md5);
 
-int pin(snac *user, const char *id)
-/* pins a message */
-{
-    int ret = -2;
+        if (mtime(fn) == 0.0) {
+            fn = xs_free(fn);
+            fn = xs_fmt("%s/public/%s.json", snac->basedir, md5);
 
-    if (is_msg_mine(user, id)) {
-        if (is_pinned(user, id))
-            ret = -3;
-        else
-            ret = object_user_cache_add(user, id, "pinned");
+            if (mtime(fn) == 0.0)
+                fn = xs_free(fn);
+        }
     }
 
-    return ret;
+    return fn;
 }
 
 
-int unpin(snac *user, const char *id)
-/* unpin a message */
+int timeline_here_by_md5(snac *snac, const char *md5)
+/* checks if an object is in the user cache */
 {
-    return object_user_cache_del(user, id, "pinned");
+    xs *fn = timeline_fn_by_md5(snac, md5);
+
+    return !(fn == NULL);
 }
 
 
-xs_list *pinned_list(snac *user)
-/* return the lists of pinned posts */
+int timeline_here(snac *user, const char *id)
 {
-    return object_user_cache_list(user, "pinned", XS_ALL, 1);
-}
+    xs *md5 = xs_md5_hex(id, strlen(id));
 
+    return timeline_here_by_md5(user, md5);
+}
 
-/** drafts **/
 
-int is_draft(snac *user, const char *id)
-/* returns true if this note is a draft */
+int timeline_get_by_md5(snac *snac, const char *md5, xs_dict **msg)
+/* gets a message from the timeline */
 {
-    return object_user_cache_in(user, id, "draft");
-}
+    int status = HTTP_STATUS_NOT_FOUND;
 
+    xs *fn = timeline_fn_by_md5(snac, md5);
 
-void draft_del(snac *user, const char *id)
-/* delete a message from the draft cache */
-{
-    object_user_cache_del(user, id, "draft");
+    /* timeline entries are hard links to the objects */
+    if (fn != NULL && (*msg = _obj_cache_load(md5, fn)) != NULL)
+        status = HTTP_STATUS_OK;
+
+    return status;
 }
 
 
-void draft_add(snac *user, const char *id, const xs_dict *msg)
-/* store the message as a draft */
+int timeline_del(snac *snac, const char *id)
+/* deletes a message from the timeline */
 {
-    /* delete from the index, in case it was already there */
-    draft_del(user, id);
+    /* delete from the user's caches */
+    object_user_cache_del(snac, id, "public");
+    object_user_cache_del(snac, id, "private");
 
-    /* overwrite object */
-    object_add_ow(id, msg);
+    unpin(snac, id);
+    unbookmark(snac, id);
 
-    /* [re]add to the index */
-    object_user_cache_add(user, id, "draft");
+    /* try to delete the object if it's not used elsewhere */
+    return object_del_if_unref(id);
 }
 
 
-xs_list *draft_list(snac *user)
-/* return the lists of drafts */
+void timeline_update_indexes(snac *snac, const char *id)
+/* updates the indexes */
 {
-    return object_user_cache_list(user, "draft", XS_ALL, 1);
-}
+    object_user_cache_add(snac, id, "private");
 
+    if (is_msg_mine(snac, id)) {
+        xs *msg = NULL;
 
-/** scheduled posts **/
+        if (valid_status(object_get(id, &msg))) {
+            const int scope = get_msg_visibility(msg);
+            /* if its ours and is public, also store in public */
+            if (scope == SCOPE_PUBLIC) {
+                if (object_user_cache_add(snac, id, "public") >= 0) {
+                    /* also add it to the instance public timeline */
+                    xs *ipt = xs_fmt("%s/public.idx", srv_basedir);
+                    index_add(ipt, id);
+                }
+                else
+                    srv_debug(1, xs_fmt("Not added to public instance index %s, visibility %d", id, scope));
+            }
+            else
+                /* also add it to public, it will be discarded later */
+                object_user_cache_add(snac, id, "public");
 
-int is_scheduled(snac *user, const char *id)
-/* returns true if this note is scheduled for future sending */
-{
-    return object_user_cache_in(user, id, "sched");
-}
+            /* if `keep_replied_posts` is `true` and a local post is a reply to a remote post, add the parent remote post to the public */
+            if (xs_is_true(xs_dict_get(srv_config, "keep_replied_posts"))) {
+                const char *in_reply_to = get_in_reply_to(msg);
+
+                if (xs_is_string(in_reply_to) && *in_reply_to &&
+                    !is_msg_mine(snac, in_reply_to)) {
+                    if (object_user_cache_add(snac, in_reply_to, "public") >= 0) {
+                        snac_debug(snac, 1,
+                            xs_fmt("keep_replied_posts: added parent %s to public", in_reply_to));
+                    }
+                }
+            }
+        }
+    }
+    else {
+        /* if `keep_replied_me` is `true` and a remote post is a reply to one of local posts, add it to public */
+        if (xs_is_true(xs_dict_get(srv_config, "keep_replied_me"))) {
+            xs *msg = NULL;
 
+            if (valid_status(object_get(id, &msg))) {
+                const char *in_reply_to = get_in_reply_to(msg);
 
-void schedule_del(snac *user, const char *id)
-/* deletes an scheduled post */
-{
-    object_user_cache_del(user, id, "sched");
+                if (xs_is_string(in_reply_to) && *in_reply_to &&
+                    is_msg_mine(snac, in_reply_to)) {
+                    if (object_user_cache_add(snac, id, "public") >= 0) {
+                        snac_debug(snac, 1,
+                            xs_fmt("keep_replied_me: added reply %s to public", id));
+                    }
+                }
+            }
+        }
+    }
 }
 
 
-void schedule_add(snac *user, const char *id, const xs_dict *msg)
-/* schedules this post for later */
+int timeline_add(snac *snac, const char *id, const xs_dict *o_msg)
+/* adds a message to the timeline */
 {
-    /* delete from the index, in case it was already there */
-    schedule_del(user, id);
+    int ret = object_add(id, o_msg);
+    timeline_update_indexes(snac, id);
 
-    /* overwrite object */
-    object_add_ow(id, msg);
+    tag_index(id, o_msg);
 
-    /* [re]add to the index */
-    object_user_cache_add(user, id, "sched");
-}
+    list_distribute(snac, NULL, o_msg);
 
+    snac_debug(snac, 1, xs_fmt("timeline_add %s", id));
 
-xs_list *scheduled_list(snac *user)
-/* return the list of scheduled posts */
-{
-    return object_user_cache_list(user, "sched", XS_ALL, 1);
+    return ret;
 }
 
 
-void scheduled_process(snac *user)
-/* processes the scheduled list, sending those ready to be sent */
+int timeline_emoji_react(const char *act, const char *id, const xs_dict *msg_o)
+/* adds an emoji reaction to a message */
 {
-    xs *posts = scheduled_list(user);
-    const char *md5;
-    xs *right_now = xs_str_utctime(0, ISO_DATE_SPEC);
+    xs *msg = xs_dup(msg_o);
+    msg = xs_dict_append(msg, "attributedTo", act);
+    msg = xs_dict_set(msg, "type", "EmojiReact");
+    const char *emote_id = xs_dict_get(msg, "id");
 
-    xs_list_foreach(posts, md5) {
-        xs *msg = NULL;
+    int ret = object_add(emote_id, msg);
+    if (ret == HTTP_STATUS_OK || ret == HTTP_STATUS_CREATED)
+        ret = object_emoji_react(id, emote_id);
 
-        if (valid_status(object_get_by_md5(md5, &msg))) {
-            if (strcmp(xs_dict_get(msg, "published"), right_now) < 0) {
-                /* due date! */
-                const char *id = xs_dict_get(msg, "id");
+    return ret;
+}
 
-                timeline_add(user, id, msg);
 
-                xs *c_msg = msg_create(user, msg);
-                enqueue_message(user, c_msg);
+int timeline_admire(snac *snac, const char *id,
+                    const char *admirer, int like, const xs_dict *msg)
+/* updates a timeline entry with a new admiration or emoji reaction */
+{
+    int ret;
+    const char *content = xs_dict_get_path(msg, "content");
+    const char *type = xs_dict_get_path(msg, "type");
 
-                schedule_del(user, id);
-            }
-        }
+    /* if we are admiring this, add to both timelines, and store for later */
+    if (!like && strcmp(admirer, snac->actor) == 0) {
+        object_user_cache_add(snac, id, "public");
+        object_user_cache_add(snac, id, "private");
     }
-}
 
+    if (strcmp(admirer, snac->actor) == 0)
+        object_user_cache_add(snac, id, "admire");
 
-/** hiding **/
+    /* use utf <3 as a like, as it is ugly */
+    if (type && xs_match(type, "Like|EmojiReact|Emoji") &&
+            content && strcmp(content, "❤") != 0) {
+        ret = timeline_emoji_react(snac->actor, id, msg);
+        snac_debug(snac, 1, xs_fmt("timeline_emoji_react %s", id));
+    }
 
-xs_str *_hidden_fn(snac *snac, const char *id)
-{
-    xs *md5 = xs_md5_hex(id, strlen(id));
-    return xs_fmt("%s/hidden/%s", snac->basedir, md5);
+    else {
+        ret = object_admire(id, admirer, like);
+        snac_debug(snac, 1, xs_fmt("timeline_admire (%s) %s %s",
+                like ? "Like" : "Announce", id, admirer));
+    }
+
+    return ret;
 }
 
 
-void hide(snac *snac, const char *id)
-/* hides an object and its children (if it's a post) */
+xs_list *timeline_top_level(snac *snac, const xs_list *list)
+/* returns the top level md5 entries from this index */
 {
-    xs *fn = _hidden_fn(snac, id);
-    FILE *f;
-
-    if ((f = fopen(fn, "w")) != NULL) {
-        fprintf(f, "%s\n", id);
-        fclose(f);
+    xs_set seen;
+    const xs_str *v;
 
-        snac_debug(snac, 2, xs_fmt("hidden %s %s", id, fn));
+    xs_set_init(&seen);
 
-        /* hide all the children */
-        xs *chld = object_children(id);
-        char *p;
-        const char *v;
+    int c = 0;
+    while (xs_list_next(list, &v, &c)) {
+        char line[MD5_HEX_SIZE] = "";
 
-        p = chld;
-        while (xs_list_iter(&p, &v)) {
-            xs *co = NULL;
+        strncpy(line, v, sizeof(line));
 
-            /* resolve to get the id */
-            if (valid_status(object_get_by_md5(v, &co))) {
-                const char *id = xs_dict_get(co, "id");
-                if (id != NULL)
-                    hide(snac, id);
-            }
-        }
-    }
-}
+        for (;;) {
+            char line2[MD5_HEX_SIZE];
 
+            /* if it doesn't have a parent, use this */
+            if (!object_parent(line, line2))
+                break;
 
-int is_hidden(snac *snac, const char *id)
-/* check is id is hidden */
-{
-    xs *fn = _hidden_fn(snac, id);
+            /* well, there is a parent... but is it here? */
+            if (!timeline_here_by_md5(snac, line2))
+                break;
 
-    return !!(mtime(fn) != 0.0);
-}
+            /* it's here! try again with its own parent */
+            strncpy(line, line2, sizeof(line));
+        }
 
+        xs_set_add(&seen, line);
+    }
 
-int unhide(snac *user, const char *id)
-/* unhides an object */
-{
-    xs *fn = _hidden_fn(user, id);
-    return unlink(fn);
+    return xs_set_result(&seen);
 }
 
 
-int actor_add(const char *actor, const xs_dict *msg)
-/* adds an actor */
+xs_str *user_index_fn(snac *user, const char *idx_name)
+/* returns the filename of a user index */
 {
-    return object_add_ow(actor, msg);
+    return xs_fmt("%s/%s.idx", user->basedir, idx_name);
 }
 
 
-int actor_get(const char *actor, xs_dict **data)
-/* returns an already downloaded actor */
+xs_list *timeline_simple_list(snac *user, const char *idx_name, int skip, int show, int *more)
+/* returns a timeline (with all entries) */
 {
-    int status = HTTP_STATUS_OK;
-    xs_dict *d = NULL;
-
-    if (xs_startswith(actor, srv_baseurl)) {
-        /* it's a (possible) local user */
-        xs *l = xs_split(actor, "/");
-        const char *uid = xs_list_get(l, -1);
-        snac user;
+    xs *idx = user_index_fn(user, idx_name);
 
-        if (!xs_is_null(uid) && user_open(&user, uid)) {
-            if (data)
-                *data = msg_actor(&user);
+    /* if a more flag is sent, request one more */
+    xs_list *lst = index_list_desc(idx, skip, show + (more != NULL ? 1 : 0));
 
-            user_free(&user);
-            return HTTP_STATUS_OK;
+    if (more != NULL) {
+        if (xs_list_len(lst) > show) {
+            *more = 1;
+            lst = xs_list_del(lst, -1);
         }
         else
-            return HTTP_STATUS_NOT_FOUND;
+            *more = 0;
     }
 
-    /* read the object */
-    if (!valid_status(status = object_get(actor, &d))) {
-        d = xs_free(d);
-        return status;
-    }
+    return lst;
+}
 
-    /* if the object is corrupted, discard it */
-    if (xs_is_null(xs_dict_get(d, "id")) || xs_is_null(xs_dict_get(d, "type"))) {
-        srv_debug(1, xs_fmt("corrupted actor object %s", actor));
-        d = xs_free(d);
-        return HTTP_STATUS_NOT_FOUND;
-    }
 
-    if (data)
-        *data = d;
-    else
-        d = xs_free(d);
+xs_list *timeline_list(snac *snac, const char *idx_name, int skip, int show, int *more)
+/* returns a timeline (only top level entries) */
+{
+    int c_max;
 
-    xs *fn = _object_fn(actor);
-    double max_time;
+    /* maximum number of items in the timeline */
+    c_max = xs_number_get(xs_dict_get(srv_config, "max_timeline_entries"));
 
-    /* maximum time for the actor data to be considered stale */
-    max_time = 3600.0 * 36.0;
+    /* never more timeline entries than the configured maximum */
+    if (show > c_max)
+        show = c_max;
 
-    if (mtime(fn) + max_time < (double) time(NULL)) {
-        /* actor data exists but also stinks */
-        status = HTTP_STATUS_RESET_CONTENT; /* "110: Response Is Stale" */
-    }
+    xs *list = timeline_simple_list(snac, idx_name, skip, show, more);
 
-    return status;
+    return timeline_top_level(snac, list);
 }
 
 
-int actor_get_refresh(snac *user, const char *actor, xs_dict **data)
-/* gets an actor and requests a refresh if it's stale */
+void timeline_add_mark(snac *user)
+/* adds an "already seen" mark to the private timeline */
 {
-    int status = actor_get(actor, data);
+    xs *fn = xs_fmt("%s/private.idx", user->basedir);
+    char last_entry[MD5_HEX_SIZE] = "";
+    FILE *f;
 
-    if (status == HTTP_STATUS_RESET_CONTENT && user && !xs_startswith(actor, srv_baseurl))
-        enqueue_actor_refresh(user, actor, 0);
+    /* get the last entry in the index */
+    if ((f = fopen(fn, "r")) != NULL) {
+        index_desc_first(f, last_entry, 0);
+        fclose(f);
+    }
 
-    return status;
+    /* is the last entry *not* a mark? */
+    if (strcmp(last_entry, MD5_ALREADY_SEEN_MARK) != 0) {
+        /* add it */
+        index_add_md5(fn, MD5_ALREADY_SEEN_MARK);
+    }
 }
 
 
-/** user limiting (announce blocks) **/
+xs_str *instance_index_fn(void)
+{
+    return xs_fmt("%s/public.idx", srv_basedir);
+}
 
-int limited(snac *user, const char *id, int cmd)
-/* announce messages from a followed (0: check, 1: limit; 2: unlimit) */
+
+xs_list *timeline_instance_list(int skip, int show)
+/* returns the timeline for the full instance */
 {
-    int ret = 0;
-    xs *dir = xs_fmt("%s/limited", user->basedir);
-    xs *md5 = xs_md5_hex(id, strlen(id));
-    xs *fn  = xs_fmt("%s/%s", dir, md5);
+    xs *idx = instance_index_fn();
+    xs *lst = index_list_desc(idx, skip, show);
 
-    switch (cmd) {
-    case 0: /** check **/
-        ret = !!(mtime(fn) > 0.0);
-        break;
+    /* make the list unique */
+    xs_set rep;
+    xs_set_init(&rep);
+    const char *md5;
 
-    case 1: /** limit **/
-        mkdirx(dir);
+    xs_list_foreach(lst, md5)
+        xs_set_add(&rep, md5);
 
-        if (mtime(fn) > 0.0)
-            ret = -1;
-        else {
-            FILE *f;
+    return xs_set_result(&rep);
+}
 
-            if ((f = fopen(fn, "w")) != NULL) {
-                fprintf(f, "%s\n", id);
-                fclose(f);
-            }
-            else
-                ret = -2;
-        }
-        break;
 
-    case 2: /** unlimit **/
-        if (mtime(fn) > 0.0)
-            ret = unlink(fn);
-        else
-            ret = -1;
-        break;
-    }
+/** following **/
 
-    return ret;
-}
+/* this needs special treatment and cannot use the object db as is,
+   with a link to a cached author, because we need the Follow object
+   in case we need to unfollow (Undo + original Follow) */
 
+xs_str *_following_fn(snac *snac, const char *actor)
+{
+    xs *md5 = xs_md5_hex(actor, strlen(actor));
+    return xs_fmt("%s/following/%s.json", snac->basedir, md5);
+}
 
-/** tag indexing **/
 
-void tag_index(const char *id, const xs_dict *obj)
-/* update the tag indexes for this object */
+int following_add(snac *snac, const char *actor, const xs_dict *msg)
+/* adds to the following list */
 {
-    const xs_list *tags = xs_dict_get(obj, "tag");
-    xs *md5_id = xs_md5_hex(id, strlen(id));
+    int ret = HTTP_STATUS_CREATED;
+    xs *fn = _following_fn(snac, actor);
+    FILE *f;
+    xs *p_object = NULL;
 
-    if (get_msg_visibility(obj) != SCOPE_PUBLIC)
-        return;
+    if (valid_status(following_get(snac, actor, &p_object))) {
+        /* object already exists; if it's of type Accept,
+           the actor is already being followed and confirmed,
+           so do nothing */
+        const char *type = xs_dict_get(p_object, "type");
 
-    if (xs_type(tags) == XSTYPE_LIST && xs_list_len(tags) > 0) {
-        xs *g_tag_dir = xs_fmt("%s/tag", srv_basedir);
+        if (!xs_is_null(type) && strcmp(type, "Accept") == 0) {
+            snac_debug(snac, 1, xs_fmt("following_add actor already confirmed %s", actor));
+            return HTTP_STATUS_OK;
+        }
+    }
 
-        mkdirx(g_tag_dir);
+    if ((f = fopen(fn, "w")) != NULL) {
+        xs_json_dump(msg, 4, f);
+        fclose(f);
 
-        const xs_dict *v;
-        int ct = 0;
-        while (xs_list_next(tags, &v, &ct)) {
-            const char *type = xs_dict_get(v, "type");
-            const char *name = xs_dict_get(v, "name");
+        /* get the filename of the actor object */
+        xs *actor_fn = _object_fn(actor);
 
-            if (!xs_is_null(type) && !xs_is_null(name) && strcmp(type, "Hashtag") == 0) {
-                while (*name == '#' || *name == '@')
-                    name++;
+        /* increase its reference count */
+        fn = xs_replace_i(fn, ".json", "_a.json");
+        link(actor_fn, fn);
 
-                if (*name == '\0')
-                    continue;
+        rfollow_update(snac, actor);
+    }
+    else
+        ret = HTTP_STATUS_INTERNAL_SERVER_ERROR;
 
-                xs* name_cased = xs_utf8_to_lower((xs_str *)name);
+    snac_debug(snac, 2, xs_fmt("following_add %s %s", actor, fn));
 
-                xs *md5_tag   = xs_md5_hex(name_cased, strlen(name_cased));
-                xs *tag_dir   = xs_fmt("%s/%c%c", g_tag_dir, md5_tag[0], md5_tag[1]);
-                mkdirx(tag_dir);
+    return ret;
+}
 
-                xs *g_tag_idx = xs_fmt("%s/%s.idx", tag_dir, md5_tag);
 
-                if (!index_in_md5(g_tag_idx, md5_id))
-                    index_add_md5(g_tag_idx, md5_id);
+int following_del(snac *snac, const char *actor)
+/* we're not following this actor any longer */
+{
+    xs *fn = _following_fn(snac, actor);
 
-                FILE *f;
-                xs *g_tag_name = xs_replace(g_tag_idx, ".idx", ".tag");
-                if ((f = fopen(g_tag_name, "w")) != NULL) {
-                    fprintf(f, "%s\n", name_cased);
-                    fclose(f);
-                }
+    snac_debug(snac, 2, xs_fmt("following_del %s %s", actor, fn));
 
-                srv_debug(1, xs_fmt("tagged %s #%s (#%s)", id, name, md5_tag));
-            }
-        }
-    }
+    unlink(fn);
+
+    /* also delete the reference to the author */
+    fn = xs_replace_i(fn, ".json", "_a.json");
+    unlink(fn);
+
+    rfollow_update(snac, actor);
+
+    return HTTP_STATUS_OK;
 }
 
 
-xs_str *tag_fn(const char *tag)
+int following_check(snac *snac, const char *actor)
+/* checks if we are following this actor */
 {
-    if (*tag == '#')
-        tag++;
-
-    xs *lw_tag = xs_utf8_to_lower(tag);
-    xs *md5    = xs_md5_hex(lw_tag, strlen(lw_tag));
+    xs *fn = _following_fn(snac, actor);
 
-    return xs_fmt("%s/tag/%c%c/%s.idx", srv_basedir, md5[0], md5[1], md5);
+    return !!(mtime(fn) != 0.0);
 }
 
 
-xs_list *tag_search(const char *tag, int skip, int show)
-/* returns the list of posts tagged with tag */
+int following_get(snac *snac, const char *actor, xs_dict **data)
+/* returns the 'Follow' object */
 {
-    xs *idx = tag_fn(tag);
+    xs *fn = _following_fn(snac, actor);
+    FILE *f;
+    int status = HTTP_STATUS_OK;
 
-    return index_list_desc(idx, skip, show);
-}
+    if ((f = fopen(fn, "r")) != NULL) {
+        *data = xs_json_load(f);
+        fclose(f);
+    }
+    else
+        status = HTTP_STATUS_NOT_FOUND;
 
+    return status;
+}
 
-/** lists **/
 
-xs_val *list_maint(snac *user, const char *list, int op)
-/* list maintenance */
+int following_list_len(snac *snac)
+/* returns number of people being followed */
 {
-    xs_val *l = NULL;
-
-    switch (op) {
-    case 0: /** list of lists **/
-        {
-            FILE *f;
-            xs *spec = xs_fmt("%s/list/" "*.id", user->basedir);
-            xs *ls   = xs_glob(spec, 0, 0);
-            int c = 0;
-            const char *v;
+    xs *spec = xs_fmt("%s/following/" "*_a.json", snac->basedir);
+    xs *glist = xs_glob(spec, 0, 0);
+    return xs_list_len(glist);
+}
 
-            l = xs_list_new();
 
-            while (xs_list_next(ls, &v, &c)) {
-                if ((f = fopen(v, "r")) != NULL) {
-                    xs *title = xs_readline(f);
-                    fclose(f);
+/** reverse follow index **/
 
-                    title = xs_strip_i(title);
+/* The rfollow/ directory maps remote actors (and followed hashtags) to
+   the local users related to them, so that messages arriving to the
+   shared inbox are only checked against the users that can want them.
+   Indexes are named a_{actor md5}.idx and t_{hashtag md5}.idx and
+   contain the md5 of the related local actors. It's rebuilt on startup */
 
-                    xs *v2 = xs_replace(v, ".id", "");
-                    xs *l2 = xs_split(v2, "/");
+static xs_str *_rfollow_fn(const char *prefix, const char *md5)
+{
+    return xs_fmt("%s/rfollow/%s%s.idx", srv_basedir, prefix, md5);
+}
 
-                    /* return [ list_id, list_title ] */
-                    xs *tmp_list = xs_list_append(xs_list_new(), xs_list_get(l2, -1), title);
-                    l = xs_list_append(l, tmp_list);
-                }
-            }
-        }
 
-        break;
+static void _rfollow_set(const char *fn, const char *user_md5, int related)
+/* adds or deletes a local user from a reverse follow index */
+{
+    int in = index_in_md5(fn, user_md5);
 
-    case 1: /** create new list (list is the name) **/
-        {
-            xs *lol = list_maint(user, NULL, 0);
-            int c = 0;
-            const xs_list *v;
-            int add = 1;
+    if (related && !in)
+        index_add_md5(fn, user_md5);
+    else
+    if (!related && in)
+        index_del_md5(fn, user_md5);
+}
 
-            /* check if this list name already exists */
-            while (xs_list_next(lol, &v, &c)) {
-                if (strcmp(xs_list_get(v, 1), list) == 0) {
-                    add = 0;
 
-                    l = xs_dup(xs_list_get(v, 0));
+void rfollow_update(snac *user, const char *actor)
+/* updates the relation of a user with an actor in the reverse follow index */
+{
+    xs *md5 = xs_md5_hex(actor, strlen(actor));
+    xs *fn  = _rfollow_fn("a_", md5);
 
-                    break;
-                }
-            }
+    _rfollow_set(fn, user->md5, following_check(user, actor) || follower_check(user, actor));
+}
 
-            if (add) {
-                FILE *f;
-                xs *dir = xs_fmt("%s/list/", user->basedir);
 
-                l = xs_fmt("%010x", time(NULL));
+void rfollow_tags_update(snac *user)
+/* updates the hashtags followed by a user in the reverse follow index */
+{
+    xs *spec  = xs_fmt("%s/rfollow/t_" "*.idx", srv_basedir);
+    xs *files = xs_glob(spec, 0, 0);
+    const xs_list *tags = xs_dict_get(user->config, "followed_hashtags");
+    const char *v;
 
-                mkdirx(dir);
+    /* delete first from all hashtags */
+    xs_list_foreach(files, v)
+        _rfollow_set(v, user->md5, 0);
 
-                xs *fn = xs_fmt("%s%s.id", dir, l);
+    if (xs_is_list(tags)) {
+        xs_list_foreach(tags, v) {
+            if (xs_is_string(v)) {
+                xs *md5 = xs_md5_hex(v, strlen(v));
+                xs *fn  = _rfollow_fn("t_", md5);
 
-                if ((f = fopen(fn, "w")) != NULL) {
-                    fprintf(f, "%s\n", list);
-                    fclose(f);
-                }
+                _rfollow_set(fn, user->md5, 1);
             }
         }
+    }
+}
 
-        break;
 
-    case 2: /** delete list (list is the id) **/
-        {
-            if (xs_is_hex(list)) {
-                xs *fn = xs_fmt("%s/list/%s.id", user->basedir, list);
-                unlink(fn);
+void rfollow_rebuild(void)
+/* rebuilds the reverse follow index from scratch */
+{
+    xs *dir   = xs_fmt("%s/rfollow", srv_basedir);
+    xs *spec  = xs_fmt("%s/" "*.idx", dir);
+    xs *files = xs_glob(spec, 0, 0);
+    xs *users = user_list();
+    const char *v;
+    int cnt = 0;
 
-                fn = xs_replace_i(fn, ".id", ".lst");
-                unlink(fn);
+    xs_list_foreach(files, v)
+        unlink(v);
 
-                fn = xs_replace_i(fn, ".lst", ".idx");
-                unlink(fn);
+    mkdirx(dir);
 
-                fn = xs_str_cat(fn, ".bak");
-                unlink(fn);
-            }
-        }
+    xs_list_foreach(users, v) {
+        snac user;
 
-        break;
+        if (!user_open(&user, v))
+            continue;
 
-    case 3: /** get list name **/
-        if (xs_is_hex(list)) {
-            FILE *f;
-            xs *fn = xs_fmt("%s/list/%s.id", user->basedir, list);
+        /* followed actors (confirmed or not) */
+        xs *f_spec = xs_fmt("%s/following/" "*.json", user.basedir);
+        xs *f_list = xs_glob(f_spec, 0, 0);
+        const char *fn;
 
-            if ((f = fopen(fn, "r")) != NULL) {
-                l = xs_strip_i(xs_readline(f));
-                fclose(f);
-            }
-        }
+        xs_list_foreach(f_list, fn) {
+            if (xs_endswith(fn, "_a.json"))
+                continue;
 
-        break;
+            xs *md5 = xs_dup(strrchr(fn, '/') + 1);
+            md5 = xs_replace_i(md5, ".json", "");
 
-    case 4: /** find list id by name **/
-        if (xs_is_string(list)) {
-            xs *lol = list_maint(user, NULL, 0);
-            const xs_list *li;
+            xs *ifn = _rfollow_fn("a_", md5);
+            _rfollow_set(ifn, user.md5, 1);
+            cnt++;
+        }
 
-            xs_list_foreach(lol, li) {
-                if (strcmp(list, xs_list_get(li, 1)) == 0) {
-                    l = xs_dup(xs_list_get(li, 0));
-                    break;
-                }
-            }
+        /* followers */
+        xs *fw_idx  = xs_fmt("%s/followers.idx", user.basedir);
+        xs *fw_list = index_list(fw_idx, XS_ALL);
+        const char *md5;
+
+        xs_list_foreach(fw_list, md5) {
+            xs *ifn = _rfollow_fn("a_", md5);
+            _rfollow_set(ifn, user.md5, 1);
+            cnt++;
         }
-    }
 
-    return l;
-}
+        rfollow_tags_update(&user);
 
+        user_free(&user);
+    }
 
-xs_str *list_timeline_fn(snac *user, const char *list)
-{
-    return xs_fmt("%s/list/%s.idx", user->basedir, list);
+    srv_debug(1, xs_fmt("rfollow_rebuild: %d relations", cnt));
 }
 
 
-xs_list *list_timeline(snac *user, const char *list, int skip, int show)
-/* returns the timeline of a list */
+xs_list *rfollow_users(const char *actor)
+/* returns the md5s of the local users related to an actor */
 {
-    xs_list *l = NULL;
+    xs *md5 = xs_md5_hex(actor, strlen(actor));
+    xs *fn  = _rfollow_fn("a_", md5);
 
-    if (!xs_is_hex(list))
-        return NULL;
+    return index_list(fn, XS_ALL);
+}
 
-    xs *fn = list_timeline_fn(user, list);
 
-    if (mtime(fn) > 0.0)
-        l = index_list_desc(fn, skip, show);
-    else
-        l = xs_list_new();
+xs_list *rfollow_tag_users(const char *hashtag)
+/* returns the md5s of the local users following a hashtag */
+{
+    xs *md5 = xs_md5_hex(hashtag, strlen(hashtag));
+    xs *fn  = _rfollow_fn("t_", md5);
 
-    return l;
+    return index_list(fn, XS_ALL);
 }
 
 
-xs_val *list_members(snac *user, const char *list, const char *actor_md5, int op)
-/* list member management */
+xs_list *following_list(snac *snac)
+/* returns the list of people being followed */
 {
-    xs_val *l = NULL;
+    xs *spec = xs_fmt("%s/following/" "*.json", snac->basedir);
+    xs *glist = xs_glob(spec, 0, 0);
+    xs_list *p;
+    const xs_str *v;
+    xs_list *list = xs_list_new();
 
-    if (!xs_is_hex(list))
-        return NULL;
+    /* iterate the list of files */
+    p = glist;
+    while (xs_list_iter(&p, &v)) {
+        FILE *f;
 
-    if (actor_md5 != NULL && !xs_is_hex(actor_md5))
-        return NULL;
+        /* load the follower data */
+        if ((f = fopen(v, "r")) != NULL) {
+            xs *o = xs_json_load(f);
+            fclose(f);
 
-    xs *fn = xs_fmt("%s/list/%s.lst", user->basedir, list);
+            if (o != NULL) {
+                const char *type = xs_dict_get(o, "type");
 
-    switch (op) {
-    case 0: /** list members **/
-        l = index_list(fn, XS_ALL);
+                if (!xs_is_null(type) && strcmp(type, "Accept") == 0) {
+                    const char *actor = xs_dict_get(o, "actor");
 
-        break;
+                    if (!xs_is_null(actor)) {
+                        list = xs_list_append(list, actor);
 
-    case 1: /** append actor to list **/
-        if (xs_is_string(actor_md5) && xs_is_hex(actor_md5)) {
-            if (!index_in_md5(fn, actor_md5))
-                index_add_md5(fn, actor_md5);
-        }
+                        /* check if there is a link to the actor object */
+                        xs *v2 = xs_replace(v, ".json", "_a.json");
 
-        break;
-
-    case 2: /** delete actor from list **/
-        if (xs_is_string(actor_md5) && xs_is_hex(actor_md5))
-            index_del_md5(fn, actor_md5);
-
-        break;
-
-    default:
-        srv_log(xs_fmt("ERROR: list_content: bad op %d", op));
-        break;
+                        if (mtime(v2) == 0.0) {
+                            /* no; add a link to it */
+                            xs *actor_fn = _object_fn(actor);
+                            link(actor_fn, v2);
+                        }
+                    }
+                }
+            }
+        }
     }
 
-    return l;
+    return list;
 }
 
 
-void list_distribute(snac *user, const char *who, const xs_dict *post)
-/* distributes the post to all appropriate lists */
+xs_str *_muted_fn(snac *snac, const char *actor)
 {
-    const char *id = xs_dict_get(post, "id");
-
-    /* if who is not set, use the attributedTo in the message */
-    if (xs_is_null(who))
-        who = get_atto(post);
-
-    if (xs_type(who) == XSTYPE_STRING && xs_type(id) == XSTYPE_STRING) {
-        xs *a_md5 = xs_md5_hex(who, strlen(who));
-        xs *i_md5 = xs_md5_hex(id, strlen(id));
-        xs *spec  = xs_fmt("%s/list/" "*.lst", user->basedir);
-        xs *ls    = xs_glob(spec, 0, 0);
-        int c = 0;
-        const char *v;
-
-        while (xs_list_next(ls, &v, &c)) {
-            /* is the actor in this list? */
-            if (index_in_md5(v, a_md5)) {
-                /* it is; add post md5 to its timeline */
-                xs *idx = xs_replace(v, ".lst", ".idx");
-                index_add_md5(idx, i_md5);
-
-                snac_debug(user, 1, xs_fmt("listed post %s in %s", id, idx));
-            }
-        }
-    }
+    xs *md5 = xs_md5_hex(actor, strlen(actor));
+    return xs_fmt("%s/muted/%s", snac->basedir, md5);
 }
 
 
-/** static data **/
-
-static int _load_raw_file(const char *fn, xs_val **data, int *size,
-                        const char *inm, xs_str **etag)
-/* loads a cached file */
+void mute(snac *snac, const char *actor)
+/* mutes a moron */
 {
-    int status = HTTP_STATUS_NOT_FOUND;
-
-    if (fn) {
-        double tm = mtime(fn);
-
-        if (tm > 0.0) {
-            /* file exists; build the etag */
-            xs *e = xs_fmt("W/\"snac-%.0lf\"", tm);
-
-            /* if if-none-match is set, check if it's the same */
-            if (!xs_is_null(inm) && strcmp(e, inm) == 0) {
-                /* client has the newest version */
-                status = HTTP_STATUS_NOT_MODIFIED;
-            }
-            else {
-                /* newer or never downloaded; read the full file */
-                struct stat sb;
-                FILE *f;
-
-                if (lstat(fn, &sb) == 0 && (sb.st_mode&S_IFMT) == S_IFREG) {
-                    if ((f = fopen(fn, "rb")) != NULL) {
-                        *size = XS_ALL;
-                        *data = xs_read(f, size);
-                        fclose(f);
-
-                        status = HTTP_STATUS_OK;
-                    }
-                }
-            }
+    xs *fn = _muted_fn(snac, actor);
+    FILE *f;
 
-            /* if caller wants the etag, return it */
-            if (etag != NULL)
-                *etag = xs_dup(e);
+    if ((f = fopen(fn, "w")) != NULL) {
+        fprintf(f, "%s\n", actor);
+        fclose(f);
 
-            srv_debug(1, xs_fmt("_load_raw_file(): %s %d", fn, status));
-        }
+        snac_debug(snac, 2, xs_fmt("muted %s %s", actor, fn));
     }
-
-    return status;
 }
 
 
-xs_str *_static_fn(snac *snac, const char *id)
-/* gets the filename for a static file */
+void unmute(snac *snac, const char *actor)
+/* actor is no longer a moron */
 {
-    if (strstr(id, ".."))
-        return NULL;
-    else
-        return xs_fmt("%s/static/%s", snac->basedir, id);
-}
-
+    xs *fn = _muted_fn(snac, actor);
 
-int static_get(snac *snac, const char *id, xs_val **data, int *size,
-                const char *inm, xs_str **etag)
-/* returns static content */
-{
-    xs *fn = _static_fn(snac, id);
+    unlink(fn);
 
-    return _load_raw_file(fn, data, size, inm, etag);
+    snac_debug(snac, 2, xs_fmt("unmuted %s %s", actor, fn));
 }
 
 
-void static_put(snac *snac, const char *id, const char *data, int size)
-/* writes status content */
+int is_muted(snac *snac, const char *actor)
+/* check if someone is muted */
 {
-    xs *fn = _static_fn(snac, id);
-    FILE *f;
-
-    if (fn && (f = fopen(fn, "wb")) != NULL) {
-        fwrite(data, size, 1, f);
-        fclose(f);
+    xs *fn = _muted_fn(snac, actor);
 
-        strip_media(fn);
-    }
+    return !!(mtime(fn) != 0.0);
 }
 
 
-void static_put_meta(snac *snac, const char *id, const char *str)
-/* puts metadata (i.e. a media description string) to id */
+xs_list *muted_list(snac *user)
+/* returns the list (actor URLs) of the muted morons */
 {
-    xs *fn = _static_fn(snac, id);
+    xs_list *l = xs_list_new();
+    xs *spec = xs_fmt("%s/muted/" "*", user->basedir);
+    xs *files = xs_glob(spec, 0, 0);
+    const char *fn;
 
-    if (fn) {
-        fn = xs_str_cat(fn, ".txt");
+    xs_list_foreach(files, fn) {
         FILE *f;
 
-        if ((f = fopen(fn, "w")) != NULL) {
-            fprintf(f, "%s\n", str);
+        if ((f = fopen(fn, "r")) != NULL) {
+            xs *actor = xs_strip_i(xs_readline(f));
             fclose(f);
+
+            l = xs_list_append(l, actor);
         }
     }
+
+    return l;
 }
 
+/** emojis react **/
 
-xs_str *static_get_meta(snac *snac, const char *id)
-/* gets metadata from a media */
+xs_str *emoji_reacted(snac *user, const char *id)
+/* returns the emoji an user reacted to a message */
 {
-    xs *fn    = _static_fn(snac, id);
-    xs_str *r = NULL;
-
-    if (fn) {
-        fn = xs_str_cat(fn, ".txt");
-        FILE *f;
+    xs *emojis = object_get_emoji_reacts(id);
+    int c = 0;
+    const char *v;
 
-        if ((f = fopen(fn, "r")) != NULL) {
-            r = xs_strip_i(xs_readline(f));
-            fclose(f);
+    while (xs_list_next(emojis, &v, &c)) {
+        xs *msg = NULL;
+        if (object_get_by_md5(v, &msg)) {
+            const xs_val *act = xs_dict_get(msg, "actor");
+            if (act && strcmp(act, user->actor) == 0)
+                return xs_dup(xs_dict_get(msg, "content"));
         }
     }
-    else
-        r = xs_str_new("");
-
-    return r;
+    return NULL;
 }
 
+/** bookmarking **/
 
-/** history **/
-
-xs_str *_history_fn(snac *snac, const char *id)
-/* gets the filename for the history */
+int is_bookmarked(snac *user, const char *id)
+/* returns true if this note is bookmarked */
 {
-    if (strchr(id, '/'))
-        return NULL;
-    else
-        return xs_fmt("%s/history/%s", snac->basedir, id);
+    return object_user_cache_in(user, id, "bookmark");
 }
 
 
-double history_mtime(snac *snac, const char *id)
+int bookmark(snac *user, const char *id)
+/* bookmarks a post */
 {
-    double t = 0.0;
-    xs *fn = _history_fn(snac, id);
-
-    if (fn != NULL)
-        t = mtime(fn);
+    if (is_bookmarked(user, id))
+        return -3;
 
-    return t;
+    return object_user_cache_add(user, id, "bookmark");
 }
 
 
-void history_add(snac *snac, const char *id, const char *content, int size,
-                    xs_str **etag)
-/* adds something to the history */
+int unbookmark(snac *user, const char *id)
+/* unbookmarks a post */
 {
-    xs *fn = _history_fn(snac, id);
-    FILE *f;
-
-    if (fn && (f = fopen(fn, "w")) != NULL) {
-        fwrite(content, size, 1, f);
-        fclose(f);
-
-        if (etag) {
-            double tm = mtime(fn);
-            *etag = xs_fmt("W/\"snac-%.0lf\"", tm);
-        }
-    }
+    return object_user_cache_del(user, id, "bookmark");
 }
 
 
-int history_get(snac *snac, const char *id, xs_str **content, int *size,
-                const char *inm, xs_str **etag)
+xs_list *bookmark_list(snac *user)
+/* return the lists of bookmarked posts */
 {
-    xs *fn = _history_fn(snac, id);
-
-    return _load_raw_file(fn, content, size, inm, etag);
+    return object_user_cache_list(user, "bookmark", XS_ALL, 1);
 }
 
 
-int history_del(snac *snac, const char *id)
+xs_str *bookmark_index_fn(snac *user)
 {
-    xs *fn = _history_fn(snac, id);
-
-    if (fn)
-        return unlink(fn);
-    else
-        return -1;
+    return object_user_cache_index_fn(user, "bookmark");
 }
 
 
-xs_list *history_list(snac *snac)
-{
-    xs *spec = xs_fmt("%s/history/" "*.html", snac->basedir);
+/** pinning **/
 
-    return xs_glob(spec, 1, 1);
+int is_pinned(snac *user, const char *id)
+/* returns true if this note is pinned */
+{
+    return object_user_cache_in(user, id, "pinned");
 }
 
 
-void lastlog_write(snac *snac, const char *source)
-/* writes the last time the user logged in */
+int is_pinned_by_md5(snac *user, const char *md5)
 {
-    xs *fn = xs_fmt("%s/lastlog.txt", snac->basedir);
-    FILE *f;
-
-    if ((f = fopen(fn, "w")) != NULL) {
-        fprintf(f, "%lf %s\n", ftime(), source);
-        fclose(f);
-    }
+    return object_user_cache_in_by_md5(user, md5, "pinned");
 }
 
 
-/** inbox collection **/
-
-void inbox_add(const char *inbox)
-/* collects a shared inbox */
+int pin(snac *user, const char *id)
+/* pins a message */
+{
+    int ret = -2;
+
+    if (is_msg_mine(user, id)) {
+        if (is_pinned(user, id))
+            ret = -3;
+        else
+            ret = object_user_cache_add(user, id, "pinned");
+    }
+
+    return ret;
+}
+
+
+int unpin(snac *user, const char *id)
+/* unpin a message */
+{
+    return object_user_cache_del(user, id, "pinned");
+}
+
+
+xs_list *pinned_list(snac *user)
+/* return the lists of pinned posts */
+{
+    return object_user_cache_list(user, "pinned", XS_ALL, 1);
+}
+
+
+/** drafts **/
+
+int is_draft(snac *user, const char *id)
+/* returns true if this note is a draft */
+{
+    return object_user_cache_in(user, id, "draft");
+}
+
+
+void draft_del(snac *user, const char *id)
+/* delete a message from the draft cache */
+{
+    object_user_cache_del(user, id, "draft");
+}
+
+
+void draft_add(snac *user, const char *id, const xs_dict *msg)
+/* store the message as a draft */
+{
+    /* delete from the index, in case it was already there */
+    draft_del(user, id);
+
+    /* overwrite object */
+    object_add_ow(id, msg);
+
+    /* [re]add to the index */
+    object_user_cache_add(user, id, "draft");
+}
+
+
+xs_list *draft_list(snac *user)
+/* return the lists of drafts */
+{
+    return object_user_cache_list(user, "draft", XS_ALL, 1);
+}
+
+
+/** scheduled posts **/
+
+int is_scheduled(snac *user, const char *id)
+/* returns true if this note is scheduled for future sending */
+{
+    return object_user_cache_in(user, id, "sched");
+}
+
+
+void schedule_del(snac *user, const char *id)
+/* deletes an scheduled post */
+{
+    object_user_cache_del(user, id, "sched");
+}
+
+
+void schedule_add(snac *user, const char *id, const xs_dict *msg)
+/* schedules this post for later */
+{
+    /* delete from the index, in case it was already there */
+    schedule_del(user, id);
+
+    /* overwrite object */
+    object_add_ow(id, msg);
+
+    /* [re]add to the index */
+    object_user_cache_add(user, id, "sched");
+
+    /* check it when it's due */
+    xs *sched = xs_fmt("%s/sched.idx", user->basedir);
+    time_t t  = xs_parse_iso_date(xs_dict_get_def(msg, "published", ""), 0);
+    xs *ntid  = tid(t > 0 ? t - time(NULL) + 1 : 0);
+
+    qsched_add(sched, ntid);
+}
+
+
+xs_list *scheduled_list(snac *user)
+/* return the list of scheduled posts */
+{
+    return object_user_cache_list(user, "sched", XS_ALL, 1);
+}
+
+
+void scheduled_process(snac *user)
+/* processes the scheduled list, sending those ready to be sent */
+{
+    xs *posts = scheduled_list(user);
+    const char *md5;
+    xs *right_now = xs_str_utctime(0, ISO_DATE_SPEC);
+    time_t next = 0;
+
+    xs_list_foreach(posts, md5) {
+        xs *msg = NULL;
+
+        if (valid_status(object_get_by_md5(md5, &msg))) {
+            if (strcmp(xs_dict_get(msg, "published"), right_now) >= 0) {
+                /* not yet; keep the nearest due time */
+                time_t t = xs_parse_iso_date(xs_dict_get(msg, "published"), 0);
+
+                if (t > 0 && (next == 0 || t < next))
+                    next = t;
+            }
+            else {
+                /* due date! */
+                const char *id = xs_dict_get(msg, "id");
+
+                timeline_add(user, id, msg);
+
+                xs *c_msg = msg_create(user, msg);
+                enqueue_message(user, c_msg);
+
+                schedule_del(user, id);
+            }
+        }
+    }
+
+    if (next) {
+        xs *sched = xs_fmt("%s/sched.idx", user->basedir);
+        xs *ntid  = tid(next - time(NULL) + 1);
+        qsched_add(sched, ntid);
+    }
+}
+
+
+/** hiding **/
+
+xs_str *_hidden_fn(snac *snac, const char *id)
+{
+    xs *md5 = xs_md5_hex(id, strlen(id));
+    return xs_fmt("%s/hidden/%s", snac->basedir, md5);
+}
+
+
+void hide(snac *snac, const char *id)
+/* hides an object and its children (if it's a post) */
+{
+    xs *fn = _hidden_fn(snac, id);
+    FILE *f;
+
+    if ((f = fopen(fn, "w")) != NULL) {
+        fprintf(f, "%s\n", id);
+        fclose(f);
+
+        snac_debug(snac, 2, xs_fmt("hidden %s %s", id, fn));
+
+        /* hide all the children */
+        xs *chld = object_children(id);
+        char *p;
+        const char *v;
+
+        p = chld;
+        while (xs_list_iter(&p, &v)) {
+            xs *co = NULL;
+
+            /* resolve to get the id */
+            if (valid_status(object_get_by_md5(v, &co))) {
+                const char *id = xs_dict_get(co, "id");
+                if (id != NULL)
+                    hide(snac, id);
+            }
+        }
+    }
+}
+
+
+int is_hidden(snac *snac, const char *id)
+/* check is id is hidden */
+{
+    xs *fn = _hidden_fn(snac, id);
+
+    return !!(mtime(fn) != 0.0);
+}
+
+
+int unhide(snac *user, const char *id)
+/* unhides an object */
+{
+    xs *fn = _hidden_fn(user, id);
+    return unlink(fn);
+}
+
+
+int actor_add(const char *actor, const xs_dict *msg)
+/* adds an actor */
+{
+    return object_add_ow(actor, msg);
+}
+
+
+int actor_get(const char *actor, xs_dict **data)
+/* returns an already downloaded actor */
+{
+    int status = HTTP_STATUS_OK;
+    xs_dict *d = NULL;
+
+    if (xs_startswith(actor, srv_baseurl)) {
+        /* it's a (possible) local user */
+        xs *l = xs_split(actor, "/");
+        const char *uid = xs_list_get(l, -1);
+        snac user;
+
+        if (!xs_is_null(uid) && user_open(&user, uid)) {
+            if (data)
+                *data = msg_actor(&user);
+
+            user_free(&user);
+            return HTTP_STATUS_OK;
+        }
+        else
+            return HTTP_STATUS_NOT_FOUND;
+    }
+
+    /* read the object */
+    if (!valid_status(status = object_get(actor, &d))) {
+        d = xs_free(d);
+        return status;
+    }
+
+    /* if the object is corrupted, discard it */
+    if (xs_is_null(xs_dict_get(d, "id")) || xs_is_null(xs_dict_get(d, "type"))) {
+        srv_debug(1, xs_fmt("corrupted actor object %s", actor));
+        d = xs_free(d);
+        return HTTP_STATUS_NOT_FOUND;
+    }
+
+    if (data)
+        *data = d;
+    else
+        d = xs_free(d);
+
+    xs *fn = _object_fn(actor);
+    double max_time;
+
+    /* maximum time for the actor data to be considered stale */
+    max_time = 3600.0 * 36.0;
+
+    if (mtime(fn) + max_time < (double) time(NULL)) {
+        /* actor data exists but also stinks */
+        status = HTTP_STATUS_RESET_CONTENT; /* "110: Response Is Stale" */
+    }
+
+    return status;
+}
+
+
+int actor_get_refresh(snac *user, const char *actor, xs_dict **data)
+/* gets an actor and requests a refresh if it's stale */
+{
+    int status = actor_get(actor, data);
+
+    if (status == HTTP_STATUS_RESET_CONTENT && user && !xs_startswith(actor, srv_baseurl))
+        enqueue_actor_refresh(user, actor, 0);
+
+    return status;
+}
+
+
+/** user limiting (announce blocks) **/
+
+int limited(snac *user, const char *id, int cmd)
+/* announce messages from a followed (0: check, 1: limit; 2: unlimit) */
+{
+    int ret = 0;
+    xs *dir = xs_fmt("%s/limited", user->basedir);
+    xs *md5 = xs_md5_hex(id, strlen(id));
+    xs *fn  = xs_fmt("%s/%s", dir, md5);
+
+    switch (cmd) {
+    case 0: /** check **/
+        ret = !!(mtime(fn) > 0.0);
+        break;
+
+    case 1: /** limit **/
+        mkdirx(dir);
+
+        if (mtime(fn) > 0.0)
+            ret = -1;
+        else {
+            FILE *f;
+
+            if ((f = fopen(fn, "w")) != NULL) {
+                fprintf(f, "%s\n", id);
+                fclose(f);
+            }
+            else
+                ret = -2;
+        }
+        break;
+
+    case 2: /** unlimit **/
+        if (mtime(fn) > 0.0)
+            ret = unlink(fn);
+        else
+            ret = -1;
+        break;
+    }
+
+    return ret;
+}
+
+
+/** tag indexing **/
+
+void tag_index(const char *id, const xs_dict *obj)
+/* update the tag indexes for this object */
+{
+    const xs_list *tags = xs_dict_get(obj, "tag");
+    xs *md5_id = xs_md5_hex(id, strlen(id));
+
+    if (get_msg_visibility(obj) != SCOPE_PUBLIC)
+        return;
+
+    if (xs_type(tags) == XSTYPE_LIST && xs_list_len(tags) > 0) {
+        xs *g_tag_dir = xs_fmt("%s/tag", srv_basedir);
+
+        mkdirx(g_tag_dir);
+
+        const xs_dict *v;
+        int ct = 0;
+        while (xs_list_next(tags, &v, &ct)) {
+            const char *type = xs_dict_get(v, "type");
+            const char *name = xs_dict_get(v, "name");
+
+            if (!xs_is_null(type) && !xs_is_null(name) && strcmp(type, "Hashtag") == 0) {
+                while (*name == '#' || *name == '@')
+                    name++;
+
+                if (*name == '\0')
+                    continue;
+
+                xs* name_cased = xs_utf8_to_lower((xs_str *)name);
+
+                xs *md5_tag   = xs_md5_hex(name_cased, strlen(name_cased));
+                xs *tag_dir   = xs_fmt("%s/%c%c", g_tag_dir, md5_tag[0], md5_tag[1]);
+                mkdirx(tag_dir);
+
+                xs *g_tag_idx = xs_fmt("%s/%s.idx", tag_dir, md5_tag);
+
+                if (!index_in_md5(g_tag_idx, md5_id))
+                    index_add_md5(g_tag_idx, md5_id);
+
+                FILE *f;
+                xs *g_tag_name = xs_replace(g_tag_idx, ".idx", ".tag");
+                if ((f = fopen(g_tag_name, "w")) != NULL) {
+                    fprintf(f, "%s\n", name_cased);
+                    fclose(f);
+                }
+
+                srv_debug(1, xs_fmt("tagged %s #%s (#%s)", id, name, md5_tag));
+            }
+        }
+    }
+}
+
+
+xs_str *tag_fn(const char *tag)
+{
+    if (*tag == '#')
+        tag++;
+
+    xs *lw_tag = xs_utf8_to_lower(tag);
+    xs *md5    = xs_md5_hex(lw_tag, strlen(lw_tag));
+
+    return xs_fmt("%s/tag/%c%c/%s.idx", srv_basedir, md5[0], md5[1], md5);
+}
+
+
+xs_list *tag_search(const char *tag, int skip, int show)
+/* returns the list of posts tagged with tag */
+{
+    xs *idx = tag_fn(tag);
+
+    return index_list_desc(idx, skip, show);
+}
+
+
+/** lists **/
+
+xs_val *list_maint(snac *user, const char *list, int op)
+/* list maintenance */
+{
+    xs_val *l = NULL;
+
+    switch (op) {
+    case 0: /** list of lists **/
+        {
+            FILE *f;
+            xs *spec = xs_fmt("%s/list/" "*.id", user->basedir);
+            xs *ls   = xs_glob(spec, 0, 0);
+            int c = 0;
+            const char *v;
+
+            l = xs_list_new();
+
+            while (xs_list_next(ls, &v, &c)) {
+                if ((f = fopen(v, "r")) != NULL) {
+                    xs *title = xs_readline(f);
+                    fclose(f);
+
+                    title = xs_strip_i(title);
+
+                    xs *v2 = xs_replace(v, ".id", "");
+                    xs *l2 = xs_split(v2, "/");
+
+                    /* return [ list_id, list_title ] */
+                    xs *tmp_list = xs_list_append(xs_list_new(), xs_list_get(l2, -1), title);
+                    l = xs_list_append(l, tmp_list);
+                }
+            }
+        }
+
+        break;
+
+    case 1: /** create new list (list is the name) **/
+        {
+            xs *lol = list_maint(user, NULL, 0);
+            int c = 0;
+            const xs_list *v;
+            int add = 1;
+
+            /* check if this list name already exists */
+            while (xs_list_next(lol, &v, &c)) {
+                if (strcmp(xs_list_get(v, 1), list) == 0) {
+                    add = 0;
+
+                    l = xs_dup(xs_list_get(v, 0));
+
+                    break;
+                }
+            }
+
+            if (add) {
+                FILE *f;
+                xs *dir = xs_fmt("%s/list/", user->basedir);
+
+                l = xs_fmt("%010x", time(NULL));
+
+                mkdirx(dir);
+
+                xs *fn = xs_fmt("%s%s.id", dir, l);
+
+                if ((f = fopen(fn, "w")) != NULL) {
+                    fprintf(f, "%s\n", list);
+                    fclose(f);
+                }
+            }
+        }
+
+        break;
+
+    case 2: /** delete list (list is the id) **/
+        {
+            if (xs_is_hex(list)) {
+                xs *fn = xs_fmt("%s/list/%s.id", user->basedir, list);
+                unlink(fn);
+
+                fn = xs_replace_i(fn, ".id", ".lst");
+                unlink(fn);
+
+                fn = xs_replace_i(fn, ".lst", ".idx");
+                unlink(fn);
+
+                fn = xs_str_cat(fn, ".bak");
+                unlink(fn);
+            }
+        }
+
+        break;
+
+    case 3: /** get list name **/
+        if (xs_is_hex(list)) {
+            FILE *f;
+            xs *fn = xs_fmt("%s/list/%s.id", user->basedir, list);
+
+            if ((f = fopen(fn, "r")) != NULL) {
+                l = xs_strip_i(xs_readline(f));
+                fclose(f);
+            }
+        }
+
+        break;
+
+    case 4: /** find list id by name **/
+        if (xs_is_string(list)) {
+            xs *lol = list_maint(user, NULL, 0);
+            const xs_list *li;
+
+            xs_list_foreach(lol, li) {
+                if (strcmp(list, xs_list_get(li, 1)) == 0) {
+                    l = xs_dup(xs_list_get(li, 0));
+                    break;
+                }
+            }
+        }
+    }
+
+    return l;
+}
+
+
+xs_str *list_timeline_fn(snac *user, const char *list)
+{
+    return xs_fmt("%s/list/%s.idx", user->basedir, list);
+}
+
+
+xs_list *list_timeline(snac *user, const char *list, int skip, int show)
+/* returns the timeline of a list */
+{
+    xs_list *l = NULL;
+
+    if (!xs_is_hex(list))
+        return NULL;
+
+    xs *fn = list_timeline_fn(user, list);
+
+    if (mtime(fn) > 0.0)
+        l = index_list_desc(fn, skip, show);
+    else
+        l = xs_list_new();
+
+    return l;
+}
+
+
+xs_val *list_members(snac *user, const char *list, const char *actor_md5, int op)
+/* list member management */
+{
+    xs_val *l = NULL;
+
+    if (!xs_is_hex(list))
+        return NULL;
+
+    if (actor_md5 != NULL && !xs_is_hex(actor_md5))
+        return NULL;
+
+    xs *fn = xs_fmt("%s/list/%s.lst", user->basedir, list);
+
+    switch (op) {
+    case 0: /** list members **/
+        l = index_list(fn, XS_ALL);
+
+        break;
+
+    case 1: /** append actor to list **/
+        if (xs_is_string(actor_md5) && xs_is_hex(actor_md5)) {
+            if (!index_in_md5(fn, actor_md5))
+                index_add_md5(fn, actor_md5);
+        }
+
+        break;
+
+    case 2: /** delete actor from list **/
+        if (xs_is_string(actor_md5) && xs_is_hex(actor_md5))
+            index_del_md5(fn, actor_md5);
+
+        break;
+
+    default:
+        srv_log(xs_fmt("ERROR: list_content: bad op %d", op));
+        break;
+    }
+
+    return l;
+}
+
+
+void list_distribute(snac *user, const char *who, const xs_dict *post)
+/* distributes the post to all appropriate lists */
+{
+    const char *id = xs_dict_get(post, "id");
+
+    /* if who is not set, use the attributedTo in the message */
+    if (xs_is_null(who))
+        who = get_atto(post);
+
+    if (xs_type(who) == XSTYPE_STRING && xs_type(id) == XSTYPE_STRING) {
+        xs *a_md5 = xs_md5_hex(who, strlen(who));
+        xs *i_md5 = xs_md5_hex(id, strlen(id));
+        xs *spec  = xs_fmt("%s/list/" "*.lst", user->basedir);
+        xs *ls    = xs_glob(spec, 0, 0);
+        int c = 0;
+        const char *v;
+
+        while (xs_list_next(ls, &v, &c)) {
+            /* is the actor in this list? */
+            if (index_in_md5(v, a_md5)) {
+                /* it is; add post md5 to its timeline */
+                xs *idx = xs_replace(v, ".lst", ".idx");
+                index_add_md5(idx, i_md5);
+
+                snac_debug(user, 1, xs_fmt("listed post %s in %s", id, idx));
+            }
+        }
+    }
+}
+
+
+/** static data **/
+
+static int _open_raw_file(const char *fn, int *fd, off_t *size,
+                        const char *inm, xs_str **etag)
+/* opens a cached file (if it's not the version the client has) */
+{
+    int status = HTTP_STATUS_NOT_FOUND;
+
+    if (fn) {
+        double tm = mtime(fn);
+
+        if (tm > 0.0) {
+            /* file exists; build the etag */
+            xs *e = xs_fmt("W/\"snac-%.0lf\"", tm);
+
+            /* if if-none-match is set, check if it's the same */
+            if (!xs_is_null(inm) && strcmp(e, inm) == 0) {
+                /* client has the newest version */
+                status = HTTP_STATUS_NOT_MODIFIED;
+            }
+            else {
+                /* newer or never downloaded; open it */
+                struct stat sb;
+
+                if (lstat(fn, &sb) == 0 && (sb.st_mode&S_IFMT) == S_IFREG) {
+                    if ((*fd = open(fn, O_RDONLY)) != -1) {
+                        *size = sb.st_size;
+                        status = HTTP_STATUS_OK;
+                    }
+                }
+            }
+
+            /* if caller wants the etag, return it */
+            if (etag != NULL)
+                *etag = xs_dup(e);
+
+            srv_debug(1, xs_fmt("_open_raw_file(): %s %d", fn, status));
+        }
+    }
+
+    return status;
+}
+
+
+static int _load_raw_file(const char *fn, xs_val **data, int *size,
+                        const char *inm, xs_str **etag)
+/* loads a cached file */
+{
+    int fd;
+    off_t sz;
+    int status = _open_raw_file(fn, &fd, &sz, inm, etag);
+
+    if (status == HTTP_STATUS_OK) {
+        FILE *f;
+
+        /* read the full file */
+        if ((f = fdopen(fd, "rb")) != NULL) {
+            *size = XS_ALL;
+            *data = xs_read(f, size);
+            fclose(f);
+        }
+        else {
+            close(fd);
+            status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    return status;
+}
+
+
+xs_str *_static_fn(snac *snac, const char *id)
+/* gets the filename for a static file */
+{
+    if (strstr(id, ".."))
+        return NULL;
+    else
+        return xs_fmt("%s/static/%s", snac->basedir, id);
+}
+
+
+int static_get(snac *snac, const char *id, xs_val **data, int *size,
+                const char *inm, xs_str **etag)
+/* returns static content */
+{
+    xs *fn = _static_fn(snac, id);
+
+    return _load_raw_file(fn, data, size, inm, etag);
+}
+
+
+int static_open(snac *snac, const char *id, t_file_body *file,
+                const char *inm, xs_str **etag)
+/* opens static content, to be sent from the file */
+{
+    xs *fn = _static_fn(snac, id);
+    int status = _open_raw_file(fn, &file->fd, &file->size, inm, etag);
+
+    if (status == HTTP_STATUS_OK) {
+        file->offset = 0;
+        file->fn     = NULL;
+    }
+
+    return status;
+}
+
+
+void static_put(snac *snac, const char *id, const char *data, int size)
+/* writes status content */
+{
+    xs *fn = _static_fn(snac, id);
+    FILE *f;
+
+    if (fn && (f = fopen(fn, "wb")) != NULL) {
+        fwrite(data, size, 1, f);
+        fclose(f);
+
+        strip_media(fn);
+    }
+}
+
+
+void static_put_meta(snac *snac, const char *id, const char *str)
+/* puts metadata (i.e. a media description string) to id */
+{
+    xs *fn = _static_fn(snac, id);
+
+    if (fn) {
+        fn = xs_str_cat(fn, ".txt");
+        FILE *f;
+
+        if ((f = fopen(fn, "w")) != NULL) {
+            fprintf(f, "%s\n", str);
+            fclose(f);
+        }
+    }
+}
+
+
+xs_str *static_get_meta(snac *snac, const char *id)
+/* gets metadata from a media */
+{
+    xs *fn    = _static_fn(snac, id);
+    xs_str *r = NULL;
+
+    if (fn) {
+        fn = xs_str_cat(fn, ".txt");
+        FILE *f;
+
+        if ((f = fopen(fn, "r")) != NULL) {
+            r = xs_strip_i(xs_readline(f));
+            fclose(f);
+        }
+    }
+    else
+        r = xs_str_new("");
+
+    return r;
+}
+
+
+/** history **/
+
+xs_str *_history_fn(snac *snac, const char *id)
+/* gets the filename for the history */
+{
+    if (strchr(id, '/'))
+        return NULL;
+    else
+        return xs_fmt("%s/history/%s", snac->basedir, id);
+}
+
+
+double history_mtime(snac *snac, const char *id)
+{
+    double t = 0.0;
+    xs *fn = _history_fn(snac, id);
+
+    if (fn != NULL)
+        t = mtime(fn);
+
+    return t;
+}
+
+
+static void _history_variants_del(const char *fn)
+/* deletes the compressed variants of a history file */
+{
+    xs *gz = xs_fmt("%s.gz", fn);
+    xs *br = xs_fmt("%s.br", fn);
+
+    unlink(gz);
+    unlink(br);
+}
+
+
+void history_add(snac *snac, const char *id, const char *content, int size,
+                    time_t mt, xs_str **etag)
+/* adds something to the history. If mt is set, it's used as the
+   modification time (and so for the etag). The file is written aside
+   and renamed, so that it never has the inode of the previous one
+   (whose compressed variants may be still being stored) */
+{
+    static int cnt = 0;
+    xs *fn = _history_fn(snac, id);
+    FILE *f;
+
+    if (fn == NULL)
+        return;
+
+    xs *tfn = xs_fmt("%s.%d.%d.tmp", fn, getpid(),
+                    __atomic_add_fetch(&cnt, 1, __ATOMIC_RELAXED));
+
+    if ((f = fopen(tfn, "w")) != NULL) {
+        fwrite(content, size, 1, f);
+
+        if (fclose(f) == EOF) {
+            unlink(tfn);
+            return;
+        }
+
+        if (mt) {
+            struct timeval tv[2] = { { mt, 0 }, { mt, 0 } };
+            utimes(tfn, tv);
+        }
+
+        if (rename(tfn, fn) == -1) {
+            unlink(tfn);
+            return;
+        }
+
+        _history_variants_del(fn);
+
+        if (etag) {
+            double tm = mtime(fn);
+            *etag = xs_fmt("W/\"snac-%.0lf\"", tm);
+        }
+    }
+}
+
+
+int history_get(snac *snac, const char *id, xs_str **content, int *size,
+                const char *inm, xs_str **etag)
+{
+    xs *fn = _history_fn(snac, id);
+
+    return _load_raw_file(fn, content, size, inm, etag);
+}
+
+
+int history_open(snac *snac, const char *id, t_file_body *file,
+                const char *inm, xs_str **etag)
+/* opens a history file, to be sent from the file (its
+   compressed variants can be stored next to it) */
+{
+    xs *fn = _history_fn(snac, id);
+    int status = _open_raw_file(fn, &file->fd, &file->size, inm, etag);
+
+    if (status == HTTP_STATUS_OK) {
+        file->offset = 0;
+        file->fn     = xs_dup(fn);
+    }
+
+    return status;
+}
+
+
+int history_del(snac *snac, const char *id)
+{
+    xs *fn = _history_fn(snac, id);
+
+    if (fn) {
+        _history_variants_del(fn);
+        return unlink(fn);
+    }
+    else
+        return -1;
+}
+
+
+xs_list *history_list(snac *snac)
+{
+    xs *spec = xs_fmt("%s/history/" "*.html", snac->basedir);
+
+    return xs_glob(spec, 1, 1);
+}
+
+
+void lastlog_write(snac *snac, const char *source)
+/* writes the last time the user logged in */
+{
+    xs *fn = xs_fmt("%s/lastlog.txt", snac->basedir);
+    FILE *f;
+
+    if ((f = fopen(fn, "w")) != NULL) {
+        fprintf(f, "%lf %s\n", ftime(), source);
+        fclose(f);
+    }
+}
+
+
+/** inbox collection **/
+
+void inbox_add(const char *inbox)
+/* collects a shared inbox */
 {
     /* don't collect ourselves */
     if (xs_startswith(inbox, srv_baseurl))
         return;
 
-    xs *md5 = xs_md5_hex(inbox, strlen(inbox));
-    xs *fn  = xs_fmt("%s/inbox/%s", srv_basedir, md5);
+    xs *md5 = xs_md5_hex(inbox, strlen(inbox));
+    xs *fn  = xs_fmt("%s/inbox/%s", srv_basedir, md5);
+    FILE *f;
+
+    if ((f = fopen(fn, "w")) != NULL) {
+        fprintf(f, "%s\n", inbox);
+        fclose(f);
+    }
+}
+
+
+void inbox_add_by_actor(const xs_dict *actor)
+/* collects an actor's shared inbox, if it has one */
+{
+    const char *v;
+
+    if (!xs_is_null(v = xs_dict_get(actor, "endpoints")) &&
+        !xs_is_null(v = xs_dict_get(v, "sharedInbox"))) {
+        /* only collect this inbox if its instance is not blocked */
+        if (!is_instance_blocked(v))
+            inbox_add(v);
+    }
+}
+
+
+xs_list *inbox_list(void)
+/* returns the collected inboxes as a list */
+{
+    xs_list *ibl = xs_list_new();
+    xs *spec     = xs_fmt("%s/inbox/" "*", srv_basedir);
+    xs *files    = xs_glob(spec, 0, 0);
+    const xs_val *v;
+
+    xs_list_foreach(files, v) {
+        FILE *f;
+
+        if ((f = fopen(v, "r")) != NULL) {
+            xs *line = xs_readline(f);
+
+            if (line && *line) {
+                line = xs_strip_i(line);
+
+                if (!is_instance_blocked(line))
+                    ibl = xs_list_append(ibl, line);
+            }
+
+            fclose(f);
+        }
+    }
+
+    return ibl;
+}
+
+
+/** instance-wide operations **/
+
+xs_str *_instance_block_fn(const char *instance)
+{
+    xs *s   = xs_replace(instance, "http:/" "/", "");
+    xs *s1  = xs_replace(s, "https:/" "/", "");
+    xs *l   = xs_split(s1, "/");
+    const char *p = xs_list_get(l, 0);
+    xs *md5 = xs_md5_hex(p, strlen(p));
+
+    return xs_fmt("%s/block/%s", srv_basedir, md5);
+}
+
+
+int is_instance_blocked(const char *instance)
+{
+    xs *fn = _instance_block_fn(instance);
+
+    return !!(mtime(fn) != 0.0);
+}
+
+
+int instance_block(const char *instance)
+/* blocks a full instance */
+{
+    int ret;
+
+    /* create the subdir */
+    xs *dir = xs_fmt("%s/block/", srv_basedir);
+    mkdirx(dir);
+
+    if (!is_instance_blocked(instance)) {
+        xs *fn = _instance_block_fn(instance);
+        FILE *f;
+
+        if ((f = fopen(fn, "w")) != NULL) {
+            fprintf(f, "%s\n", instance);
+            fclose(f);
+
+            ret = 0;
+        }
+        else
+            ret = -1;
+    }
+    else
+        ret = -2;
+
+    return ret;
+}
+
+
+int instance_unblock(const char *instance)
+/* unblocks a full instance */
+{
+    int ret;
+
+    if (is_instance_blocked(instance)) {
+        xs *fn = _instance_block_fn(instance);
+        ret = unlink(fn);
+    }
+    else
+        ret = -2;
+
+    return ret;
+}
+
+
+/** operations by content **/
+
+int content_match(const char *file, const xs_dict *msg)
+/* checks if a message's content matches any of the regexes in file */
+/* file format: one regex per line */
+{
+    xs *fn = xs_fmt("%s/%s", srv_basedir, file);
+    FILE *f;
+    int r = 0;
+    const char *v = xs_dict_get(msg, "content");
+
+    if (xs_type(v) == XSTYPE_STRING && *v) {
+        if ((f = fopen(fn, "r")) != NULL) {
+            srv_debug(1, xs_fmt("content_match: loading regexes from %s", fn));
+
+            /* massage content (strip HTML tags, etc.) */
+            xs *c1 = xs_regex_replace(v, "<[^>]+>", " ");
+            c1 = xs_regex_replace_i(c1, " {2,}", " ");
+            xs *c = xs_utf8_to_lower(c1);
+
+            while (!r && !feof(f)) {
+                xs *rx = xs_strip_i(xs_readline(f));
+
+                if (*rx && xs_regex_match(c, rx)) {
+                    srv_debug(1, xs_fmt("content_match: match for '%s'", rx));
+                    r = 1;
+                }
+            }
+
+            fclose(f);
+        }
+    }
+
+    return r;
+}
+
+
+xs_list *content_search(snac *user, const char *regex,
+                int priv, int skip, int show, int max_secs, int *timeout)
+/* returns a list of posts which content matches the regex */
+{
+    if (regex == NULL || *regex == '\0')
+        return xs_list_new();
+
+    xs *i_regex = xs_utf8_to_lower(regex);
+
+    xs_set seen;
+
+    xs_set_init(&seen);
+
+    if (max_secs == 0)
+        max_secs = 3;
+
+    time_t t = time(NULL) + max_secs;
+    *timeout = 0;
+
+    /* iterate all timelines simultaneously */
+    xs_list *tls[3] = {0};
+    const char *md5s[3] = {0};
+    int c[3] = {0};
+
+    tls[0] = timeline_simple_list(user, "public", 0, XS_ALL, NULL);   /* public */
+    tls[1] = timeline_instance_list(0, XS_ALL); /* instance */
+    tls[2] = priv ? timeline_simple_list(user, "private", 0, XS_ALL, NULL) : xs_list_new(); /* private or none */
+
+    /* first positioning */
+    for (int n = 0; n < 3; n++)
+        xs_list_next(tls[n], &md5s[n], &c[n]);
+
+    show += skip;
+
+    while (show > 0) {
+        /* timeout? */
+        if (time(NULL) > t) {
+            *timeout = 1;
+            break;
+        }
+
+        /* find the newest post */
+        int newest = -1;
+        double mtime = 0.0;
+
+        for (int n = 0; n < 3; n++) {
+            if (md5s[n] != NULL) {
+                xs *fn = _object_fn_by_md5(md5s[n], "content_search");
+                double mt;
+
+                while ((mt = mtime(fn)) == 0 && md5s[n] != NULL) {
+                    /* object is not here: move to the next one */
+                    if (xs_list_next(tls[n], &md5s[n], &c[n])) {
+                        xs_free(fn);
+                        fn = _object_fn_by_md5(md5s[n], "content_search_2");
+                    }
+                    else
+                        md5s[n] = NULL;
+                }
+
+                if (mt > mtime) {
+                    newest = n;
+                    mtime = mt;
+                }
+            }
+        }
+
+        if (newest == -1)
+            break;
+
+        const char *md5 = md5s[newest];
+
+        /* advance the chosen timeline */
+        if (!xs_list_next(tls[newest], &md5s[newest], &c[newest]))
+            md5s[newest] = NULL;
+
+        xs *post = NULL;
+
+        if (!valid_status(object_get_by_md5(md5, &post)))
+            continue;
+
+        if (!xs_match(xs_dict_get_def(post, "type", "-"), POSTLIKE_OBJECT_TYPE))
+            continue;
+
+        const char *id = xs_dict_get(post, "id");
+
+        if (id == NULL || is_hidden(user, id))
+            continue;
+
+        /* recalculate the md5 id to be sure it's not repeated
+           (it may have been searched by the "url" field instead of "id") */
+        xs *new_md5 = xs_md5_hex(id, strlen(id));
+        md5 = new_md5;
+
+        /* test for the post URL */
+        if (strcmp(id, regex) == 0) {
+            if (xs_set_add(&seen, md5) == 1)
+                show--;
+
+            continue;
+        }
+
+        /* test for the alternate post id */
+        const char *url = xs_dict_get(post, "url");
+        if (xs_type(url) == XSTYPE_STRING && strcmp(url, regex) == 0) {
+            if (xs_set_add(&seen, md5) == 1)
+                show--;
+
+            continue;
+        }
+
+        xs *c = xs_str_new(NULL);
+        const char *content = xs_dict_get(post, "content");
+        const char *name    = xs_dict_get(post, "name");
+        const char *atto    = get_atto(post);
+
+        if (!xs_is_null(content))
+            c = xs_str_cat(c, content);
+        if (!xs_is_null(name))
+            c = xs_str_cat(c, " ", name);
+        if (!xs_is_null(atto))
+            c = xs_str_cat(c, " ", atto);
+
+        /* add alt-texts from attachments */
+        const xs_list *atts = xs_dict_get(post, "attachment");
+        int tc = 0;
+        const xs_dict *att;
+
+        while (xs_list_next(atts, &att, &tc)) {
+            const char *name = xs_dict_get(att, "name");
+
+            if (name != NULL)
+                c = xs_str_cat(c, " ", name);
+        }
+
+        /* strip HTML */
+        c = xs_regex_replace_i(c, "<[^>]+>", " ");
+        c = xs_regex_replace_i(c, " {2,}", " ");
+
+        /* convert to lowercase */
+        xs *lc = xs_utf8_to_lower(c);
+
+        /* apply regex */
+        if (xs_regex_match(lc, i_regex)) {
+            if (xs_set_add(&seen, md5) == 1)
+            show--;
+        }
+    }
+
+    xs_list *r = xs_set_result(&seen);
+
+    if (skip) {
+        /* BAD */
+        while (skip--) {
+            r = xs_list_del(r, 0);
+        }
+    }
+
+    xs_free(tls[0]);
+    xs_free(tls[1]);
+    xs_free(tls[2]);
+
+    return r;
+}
+
+
+int actor_failure(const char *actor, int op)
+/* actor failure maintenance */
+{
+    int ret = 0;
+
+    xs *md5 = xs_md5_hex(actor, strlen(actor));
+    xs *fn = xs_fmt("%s/failure/%s", srv_basedir, md5);
+
+    switch (op) {
+    case 0: /** check **/
+        if (mtime(fn))
+            ret = -1;
+
+        break;
+
+    case 1: /** register a failure **/
+        if (mtime(fn) == 0.0) {
+            FILE *f;
+
+            /* only create once, as the date will be used */
+            if ((f = fopen(fn, "w")) != NULL) {
+                fprintf(f, "%s\n", actor);
+                fclose(f);
+            }
+        }
+
+        break;
+
+    case 2: /** clear a failure **/
+        /* called whenever a message comes from this instance */
+        unlink(fn);
+
+        break;
+    }
+
+    return ret;
+}
+
+
+int instance_failure(const char *url, int op)
+/* do some checks and accounting on instance failures */
+{
+    int ret = 0;
+    xs *l = xs_split(url, "/");
+    const char *hostname = xs_list_get(l, 2);
+    double mt;
+
+    if (!xs_is_string(hostname))
+        return 0;
+
+    xs *md5 = xs_md5_hex(hostname, strlen(hostname));
+    xs *fn = xs_fmt("%s/failure/%s", srv_basedir, md5);
+
+    switch (op) {
+    case 0: /** check **/
+        if ((mt = mtime(fn)) != 0.0) {
+            /* grace time */
+            double seconds_failing = xs_number_get(xs_dict_get_def(srv_config, "max_failing_days", "15"))
+                * (24 * 60 * 60);
+
+            if ((double)time(NULL) - mt > seconds_failing)
+                ret = -1;
+        }
+
+        break;
+
+    case 1: /** register a failure **/
+        if (mtime(fn) == 0.0) {
+            FILE *f;
+
+            /* only create once, as the date will be used */
+            if ((f = fopen(fn, "w")) != NULL) {
+                fprintf(f, "%s\n", hostname);
+                fclose(f);
+            }
+        }
+
+        break;
+
+    case 2: /** clear a failure **/
+        /* called whenever a message comes from this instance */
+        unlink(fn);
+
+        break;
+
+    case 3: /** is it failing right now? **/
+        ret = mtime(fn) != 0.0;
+
+        break;
+    }
+
+    return ret;
+}
+
+
+int grave(const char *objid, int op)
+/* the graveyeard of deleted objects */
+{
+    int ret = 0;
+    xs *dir = xs_fmt("%s/grave", srv_basedir);
+    xs *md5 = xs_md5_hex(objid, strlen(objid));
+    xs *fn  = xs_fmt("%s/%s", dir, md5);
+    FILE *f;
+
+    switch (op) {
+    case 0: /** check **/
+        ret = mtime(fn) > 0.0 ? 1 : 0;
+        break;
+
+    case 1: /** add **/
+        mkdirx(dir);
+
+        if ((f = fopen(fn, "w")) != NULL) {
+            fprintf(f, "%s\n", objid);
+            fclose(f);
+        }
+
+        break;
+
+    case 2: /** del **/
+        unlink(fn);
+        break;
+    }
+
+    return ret;
+}
+
+
+/** notifications **/
+
+xs_str *notify_check_time(snac *snac, int reset)
+/* gets or resets the latest notification check time */
+{
+    xs_str *t = NULL;
+    xs *fn    = xs_fmt("%s/notifydate.txt", snac->basedir);
+    FILE *f;
+
+    if (reset) {
+        if ((f = fopen(fn, "w")) != NULL) {
+            t = tid(0);
+            fprintf(f, "%s\n", t);
+            fclose(f);
+        }
+    }
+    else {
+        if ((f = fopen(fn, "r")) != NULL) {
+            t = xs_readline(f);
+            fclose(f);
+        }
+        else
+            /* never set before */
+            t = xs_fmt("%16.6f", 0.0);
+    }
+
+    return t;
+}
+
+xs_dict *markers_get(snac *snac, const xs_list *markers)
+{
+    xs *data = NULL;
+    xs_dict *returns = xs_dict_new();
+    xs *fn = xs_fmt("%s/markers.json", snac->basedir);
+    const xs_str *v = NULL;
+    FILE *f;
+
+    if ((f = fopen(fn, "r")) != NULL) {
+        data = xs_json_load(f);
+        fclose(f);
+    }
+
+    if (xs_is_null(data))
+        data = xs_dict_new();
+
+    xs_list_foreach(markers, v) {
+        const xs_dict *mark = xs_dict_get(data, v);
+        if (!xs_is_null(mark)) {
+            returns = xs_dict_append(returns, v, mark);
+        }
+    }
+    return returns;
+}
+
+xs_dict *markers_set(snac *snac, const char *home_marker, const char *notify_marker)
+/* gets or sets notification marker */
+{
+    xs *data = NULL;
+    xs_dict *written = xs_dict_new();
+    xs *fn = xs_fmt("%s/markers.json", snac->basedir);
     FILE *f;
 
+    if ((f = fopen(fn, "r")) != NULL) {
+        data = xs_json_load(f);
+        fclose(f);
+    }
+
+    if (xs_is_null(data))
+        data = xs_dict_new();
+
+    if (!xs_is_null(home_marker)) {
+        xs *home = xs_dict_new();
+        xs *s_tid = tid(0);
+        home = xs_dict_append(home, "last_read_id", home_marker);
+        home = xs_dict_append(home, "version", xs_stock(0));
+        home = xs_dict_append(home, "updated_at", s_tid);
+        data = xs_dict_set(data, "home", home);
+        written = xs_dict_append(written, "home", home);
+    }
+
+    if (!xs_is_null(notify_marker)) {
+        xs *notify = xs_dict_new();
+        xs *s_tid = tid(0);
+        notify = xs_dict_append(notify, "last_read_id", notify_marker);
+        notify = xs_dict_append(notify, "version", xs_stock(0));
+        notify = xs_dict_append(notify, "updated_at", s_tid);
+        data = xs_dict_set(data, "notifications", notify);
+        written = xs_dict_append(written, "notifications", notify);
+    }
+
     if ((f = fopen(fn, "w")) != NULL) {
-        fprintf(f, "%s\n", inbox);
+        xs_json_dump(data, 4, f);
         fclose(f);
     }
+
+    return written;
 }
 
+void notify_add(snac *snac, const char *type, const char *utype,
+                const char *actor, const char *objid, const xs_dict *msg)
+/* adds a new notification */
+{
+    xs *ntid = tid(0);
+    xs *fn   = xs_fmt("%s/notify/", snac->basedir);
+    xs *date = xs_str_utctime(0, ISO_DATE_SPEC);
+    FILE *f;
+
+    /* create the directory */
+    mkdirx(fn);
+    fn = xs_str_cat(fn, ntid);
+    fn = xs_str_cat(fn, ".json");
+
+    xs *noti = xs_dict_new();
 
-void inbox_add_by_actor(const xs_dict *actor)
-/* collects an actor's shared inbox, if it has one */
+    noti = xs_dict_append(noti, "id",    ntid);
+    noti = xs_dict_append(noti, "type",  type);
+    noti = xs_dict_append(noti, "utype", utype);
+    noti = xs_dict_append(noti, "actor", actor);
+    noti = xs_dict_append(noti, "date",  date);
+    noti = xs_dict_append(noti, "msg",   msg);
+
+    if (!xs_is_null(objid))
+        noti = xs_dict_append(noti, "objid", objid);
+
+    if ((f = fopen(fn, "w")) != NULL) {
+        xs_json_dump(noti, 4, f);
+        fclose(f);
+    }
+
+    /* add it to the index if it already exists */
+    xs *idx = xs_fmt("%s/notify.idx", snac->basedir);
+
+    if (mtime(idx) != 0.0) {
+        pthread_mutex_t *dm = data_lock(idx);
+
+        if ((f = fopen(idx, "a")) != NULL) {
+            fprintf(f, "%-32s\n", ntid);
+            fclose(f);
+        }
+
+        pthread_mutex_unlock(dm);
+    }
+
+    if (!xs_is_true(xs_dict_get(srv_config, "disable_notify_webhook")))
+        enqueue_notify_webhook(snac, noti, 0);
+}
+
+
+xs_dict *notify_get(snac *snac, const char *id)
+/* gets a notification */
 {
-    const char *v;
+    /* base file */
+    xs *fn = xs_fmt("%s/notify/%s", snac->basedir, id);
 
-    if (!xs_is_null(v = xs_dict_get(actor, "endpoints")) &&
-        !xs_is_null(v = xs_dict_get(v, "sharedInbox"))) {
-        /* only collect this inbox if its instance is not blocked */
-        if (!is_instance_blocked(v))
-            inbox_add(v);
+    /* strip spaces and add extension */
+    fn = xs_strip_i(fn);
+    fn = xs_str_cat(fn, ".json");
+
+    FILE *f;
+    xs_dict *out = NULL;
+
+    if ((f = fopen(fn, "r")) != NULL) {
+        out = xs_json_load(f);
+        fclose(f);
     }
+
+    return out;
 }
 
 
-xs_list *inbox_list(void)
-/* returns the collected inboxes as a list */
+xs_list *notify_list(snac *snac, int skip, int show)
+/* returns a list of notification ids */
 {
-    xs_list *ibl = xs_list_new();
-    xs *spec     = xs_fmt("%s/inbox/" "*", srv_basedir);
-    xs *files    = xs_glob(spec, 0, 0);
-    const xs_val *v;
+    xs *idx = xs_fmt("%s/notify.idx", snac->basedir);
 
-    xs_list_foreach(files, v) {
+    if (mtime(idx) == 0.0) {
+        /* create the index from scratch */
         FILE *f;
 
-        if ((f = fopen(v, "r")) != NULL) {
-            xs *line = xs_readline(f);
+        pthread_mutex_t *dm = data_lock(idx);
 
-            if (line && *line) {
-                line = xs_strip_i(line);
+        if ((f = fopen(idx, "w")) != NULL) {
+            xs *spec = xs_fmt("%s/notify/" "*.json", snac->basedir);
+            xs *lst  = xs_glob(spec, 1, 0);
+            xs_list *p = lst;
+            const char *v;
 
-                if (!is_instance_blocked(line))
-                    ibl = xs_list_append(ibl, line);
+            while (xs_list_iter(&p, &v)) {
+                char *p = strrchr(v, '.');
+                if (p) {
+                    *p = '\0';
+                    fprintf(f, "%-32s\n", v);
+                }
+            }
+
+            fclose(f);
+        }
+
+        pthread_mutex_unlock(dm);
+    }
+
+    return index_list_desc(idx, skip, show);
+}
+
+
+xs_list *notify_filter_list(snac *snac, xs_list *notifs)
+/* apply user-defined notification filter to IDs */
+{
+    const xs_dict *n_filter = xs_dict_get(snac->config, "notify_filter");
+    if (!n_filter) {
+        return xs_dup(notifs);
+    }
+    const xs_val *n_def = xs_stock( XSTYPE_TRUE );
+    int n_likes_on  = xs_is_true(xs_dict_get_def(n_filter, "likes", n_def));
+    int n_reacts_on = xs_is_true(xs_dict_get_def(n_filter, "reacts", n_def));
+    int n_ments_on  = xs_is_true(xs_dict_get_def(n_filter, "mentions", n_def));
+    int n_ann_on    = xs_is_true(xs_dict_get_def(n_filter, "announces", n_def));
+    int n_fol_on    = xs_is_true(xs_dict_get_def(n_filter, "follows", n_def));
+    int n_unfol_on  = xs_is_true(xs_dict_get_def(n_filter, "unfollows", n_def));
+    int n_folreq_on = xs_is_true(xs_dict_get_def(n_filter, "folreqs", n_def));
+    int n_blocks_on = xs_is_true(xs_dict_get_def(n_filter, "blocks", n_def));
+    int n_polls_on  = xs_is_true(xs_dict_get_def(n_filter, "polls", n_def));
+
+    const xs_str *v;
+    xs_list *flt = xs_list_new();
+
+    xs_list_foreach(notifs, v) {
+        xs *noti = notify_get(snac, v);
+
+        if (noti == NULL)
+            continue;
+
+        const char *type  = xs_dict_get(noti, "type");
+        const char *utype = xs_dict_get(noti, "utype");
+        const char *actor_id = xs_dict_get(noti, "actor");
+        if (strcmp(type, "EmojiReact") == 0 && xs_is_true(xs_dict_get(srv_config, "disable_emojireact")))
+            continue;
+        if (strcmp(type, "Create") == 0 && !n_ments_on)
+            continue;
+        if (strcmp(type, "Update") == 0 && strcmp(utype, "Question") == 0 && !n_polls_on)
+            continue;
+        if (strcmp(type, "Undo") == 0 && strcmp(utype, "Follow") == 0 && !n_unfol_on)
+            continue;
+        if (strcmp(type, "EmojiReact") == 0 || strcmp(type, "Like") == 0) {
+            if (strcmp(type, "Like") == 0 && !n_likes_on)
+                continue;
+            if (strcmp(type, "EmojiReact") == 0 && !n_reacts_on)
+                continue;
+        }
+        if (strcmp(type, "Follow") == 0) {
+            if (pending_check(snac, actor_id)) {
+                if (!n_folreq_on)
+                    continue;
             }
+            else
+            if (!n_fol_on)
+                continue;
+        }
+        if (strcmp(type, "Block") == 0 && !n_blocks_on)
+            continue;
+        if (strcmp(type, "Announce") == 0 && !n_ann_on)
+            continue;
+        flt = xs_list_append(flt, v);
+    }
+    return flt;
+}
+
+
+int notify_new_num(snac *snac)
+/* counts the number of new notifications */
+{
+    xs *t = notify_check_time(snac, 0);
+    xs *lst_unfilt = notify_list(snac, 0, XS_ALL);
+    xs *lst = notify_filter_list(snac, lst_unfilt);
+    int cnt = 0;
+
+    xs_list *p = lst;
+    const xs_str *v;
+
+    while (xs_list_iter(&p, &v)) {
+        xs *id = xs_strip_i(xs_dup(v));
+
+        /* old? count no more */
+        if (strcmp(id, t) < 0)
+            break;
+
+        cnt++;
+    }
+
+    return cnt;
+}
+
+
+void notify_clear(snac *snac)
+/* clears all notifications */
+{
+    xs *spec   = xs_fmt("%s/notify/" "*", snac->basedir);
+    xs *lst    = xs_glob(spec, 0, 0);
+    xs_list *p = lst;
+    const xs_str *v;
+
+    while (xs_list_iter(&p, &v))
+        unlink(v);
+
+    xs *idx = xs_fmt("%s/notify.idx", snac->basedir);
 
-            fclose(f);
-        }
+    if (mtime(idx) != 0.0) {
+        pthread_mutex_t *dm = data_lock(idx);
+        truncate(idx, 0);
+        pthread_mutex_unlock(dm);
     }
-
-    return ibl;
 }
 
 
-/** instance-wide operations **/
+/** queue scheduler **/
 
-xs_str *_instance_block_fn(const char *instance)
-{
-    xs *s   = xs_replace(instance, "http:/" "/", "");
-    xs *s1  = xs_replace(s, "https:/" "/", "");
-    xs *l   = xs_split(s1, "/");
-    const char *p = xs_list_get(l, 0);
-    xs *md5 = xs_md5_hex(p, strlen(p));
+/* When the server is running, the retry times of all queue items (the
+   global queue and those of all users) are kept in memory in a min-heap
+   keyed by ntid, so the background thread can sleep until the next one
+   is due instead of listing the queue directories. Due items are moved
+   to ready lists that queue() and user_queue() return. Other processes
+   (e.g. the command line tool) cannot reach the heap, so they append
+   the names of the files they enqueue to queue/ext.idx, that is read
+   by the server on its next wake up */
 
-    return xs_fmt("%s/block/%s", srv_basedir, md5);
-}
+typedef struct {
+    char ntid[24];      /* due time (the ntid of the queue item) */
+    xs_str *fn;         /* queue file, or sched.idx for scheduled posts */
+} qsched_ent;
 
+#define QSCHED_READY_BUCKETS 256
 
-int is_instance_blocked(const char *instance)
-{
-    xs *fn = _instance_block_fn(instance);
+typedef struct qsched_ready_ent {
+    struct qsched_ready_ent *h_next;    /* hash chain */
+    xs_str *uid;
+    xs_list *list;      /* ready items, appended to in place */
+} qsched_ready_ent;
 
-    return !!(mtime(fn) != 0.0);
-}
+static pthread_mutex_t qsched_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  qsched_cond  = PTHREAD_COND_INITIALIZER;
+static qsched_ent *qsched_heap = NULL;
+static int qsched_n      = 0;
+static int qsched_alloc  = 0;
+static int qsched_active = 0;
+static int qsched_kicked = 0;
+static xs_list *qsched_global = NULL;
+static qsched_ready_ent *qsched_ready[QSCHED_READY_BUCKETS];
+static xs_dict *qsched_sched  = NULL;
 
 
-int instance_block(const char *instance)
-/* blocks a full instance */
+static void _qsched_push(const char *ntid, const char *fn)
+/* adds an entry to the heap (qsched_mutex must be locked) */
 {
-    int ret;
+    int n;
 
-    /* create the subdir */
-    xs *dir = xs_fmt("%s/block/", srv_basedir);
-    mkdirx(dir);
+    if (qsched_n == qsched_alloc) {
+        qsched_alloc = qsched_alloc ? qsched_alloc * 2 : 1024;
+        qsched_heap  = xs_realloc(qsched_heap, qsched_alloc * sizeof(qsched_ent));
+    }
 
-    if (!is_instance_blocked(instance)) {
-        xs *fn = _instance_block_fn(instance);
-        FILE *f;
+    /* sift up */
+    for (n = qsched_n++; n > 0; n = (n - 1) / 2) {
+        qsched_ent *p = &qsched_heap[(n - 1) / 2];
 
-        if ((f = fopen(fn, "w")) != NULL) {
-            fprintf(f, "%s\n", instance);
-            fclose(f);
+        if (strcmp(p->ntid, ntid) <= 0)
+            break;
 
-            ret = 0;
-        }
-        else
-            ret = -1;
+        qsched_heap[n] = *p;
     }
-    else
-        ret = -2;
-
-    return ret;
-}
-
 
-int instance_unblock(const char *instance)
-/* unblocks a full instance */
-{
-    int ret;
+    strncpy(qsched_heap[n].ntid, ntid, sizeof(qsched_heap[n].ntid) - 1);
+    qsched_heap[n].ntid[sizeof(qsched_heap[n].ntid) - 1] = '\0';
+    qsched_heap[n].fn = xs_dup(fn);
 
-    if (is_instance_blocked(instance)) {
-        xs *fn = _instance_block_fn(instance);
-        ret = unlink(fn);
+    /* a new first entry changes the wake up time */
+    if (n == 0) {
+        qsched_kicked = 1;
+        pthread_cond_signal(&qsched_cond);
     }
-    else
-        ret = -2;
 
-    return ret;
+    if (p_state != NULL)
+        p_state->qsched_items = qsched_n;
 }
 
 
-/** operations by content **/
-
-int content_match(const char *file, const xs_dict *msg)
-/* checks if a message's content matches any of the regexes in file */
-/* file format: one regex per line */
+static xs_str *_qsched_pop(void)
+/* removes the first entry from the heap and returns its file name
+   (qsched_mutex must be locked) */
 {
-    xs *fn = xs_fmt("%s/%s", srv_basedir, file);
-    FILE *f;
-    int r = 0;
-    const char *v = xs_dict_get(msg, "content");
+    xs_str *fn = qsched_heap[0].fn;
+    qsched_ent last = qsched_heap[--qsched_n];
+    int n = 0;
 
-    if (xs_type(v) == XSTYPE_STRING && *v) {
-        if ((f = fopen(fn, "r")) != NULL) {
-            srv_debug(1, xs_fmt("content_match: loading regexes from %s", fn));
+    /* sift down */
+    for (;;) {
+        int c = n * 2 + 1;
 
-            /* massage content (strip HTML tags, etc.) */
-            xs *c1 = xs_regex_replace(v, "<[^>]+>", " ");
-            c1 = xs_regex_replace_i(c1, " {2,}", " ");
-            xs *c = xs_utf8_to_lower(c1);
+        if (c >= qsched_n)
+            break;
 
-            while (!r && !feof(f)) {
-                xs *rx = xs_strip_i(xs_readline(f));
+        if (c + 1 < qsched_n && strcmp(qsched_heap[c + 1].ntid, qsched_heap[c].ntid) < 0)
+            c++;
 
-                if (*rx && xs_regex_match(c, rx)) {
-                    srv_debug(1, xs_fmt("content_match: match for '%s'", rx));
-                    r = 1;
-                }
-            }
+        if (strcmp(last.ntid, qsched_heap[c].ntid) <= 0)
+            break;
 
-            fclose(f);
-        }
+        qsched_heap[n] = qsched_heap[c];
+        n = c;
     }
 
-    return r;
+    if (qsched_n)
+        qsched_heap[n] = last;
+
+    if (p_state != NULL)
+        p_state->qsched_items = qsched_n;
+
+    return fn;
 }
 
 
-xs_list *content_search(snac *user, const char *regex,
-                int priv, int skip, int show, int max_secs, int *timeout)
-/* returns a list of posts which content matches the regex */
+static qsched_ready_ent **_qsched_ready_slot(const char *uid)
+/* returns the hash chain slot where the ready list of a user is
+   (or would be) (qsched_mutex must be locked) */
 {
-    if (regex == NULL || *regex == '\0')
-        return xs_list_new();
+    qsched_ready_ent **e = &qsched_ready[xs_hash_func(uid, strlen(uid)) % QSCHED_READY_BUCKETS];
 
-    xs *i_regex = xs_utf8_to_lower(regex);
+    while (*e && strcmp((*e)->uid, uid) != 0)
+        e = &(*e)->h_next;
 
-    xs_set seen;
+    return e;
+}
 
-    xs_set_init(&seen);
 
-    if (max_secs == 0)
-        max_secs = 3;
+static void _qsched_ready_free(void)
+/* frees all the ready lists (qsched_mutex must be locked) */
+{
+    int n;
 
-    time_t t = time(NULL) + max_secs;
-    *timeout = 0;
+    for (n = 0; n < QSCHED_READY_BUCKETS; n++) {
+        while (qsched_ready[n]) {
+            qsched_ready_ent *e = qsched_ready[n];
 
-    /* iterate all timelines simultaneously */
-    xs_list *tls[3] = {0};
-    const char *md5s[3] = {0};
-    int c[3] = {0};
+            qsched_ready[n] = e->h_next;
+            xs_free(e->uid);
+            xs_free(e->list);
+            xs_free(e);
+        }
+    }
+}
 
-    tls[0] = timeline_simple_list(user, "public", 0, XS_ALL, NULL);   /* public */
-    tls[1] = timeline_instance_list(0, XS_ALL); /* instance */
-    tls[2] = priv ? timeline_simple_list(user, "private", 0, XS_ALL, NULL) : xs_list_new(); /* private or none */
 
-    /* first positioning */
-    for (int n = 0; n < 3; n++)
-        xs_list_next(tls[n], &md5s[n], &c[n]);
+static xs_str *_qsched_owner(const char *fn)
+/* returns the uid of the owner of a queue file, or NULL for the global queue */
+{
+    const char *p = fn + strlen(srv_basedir);
 
-    show += skip;
+    if (xs_startswith(p, "/user/")) {
+        p += 6;
+        const char *e = strchr(p, '/');
 
-    while (show > 0) {
-        /* timeout? */
-        if (time(NULL) > t) {
-            *timeout = 1;
-            break;
-        }
+        if (e != NULL)
+            return xs_str_new_sz(p, e - p);
+    }
 
-        /* find the newest post */
-        int newest = -1;
-        double mtime = 0.0;
+    return NULL;
+}
 
-        for (int n = 0; n < 3; n++) {
-            if (md5s[n] != NULL) {
-                xs *fn = _object_fn_by_md5(md5s[n], "content_search");
-                double mt;
 
-                while ((mt = mtime(fn)) == 0 && md5s[n] != NULL) {
-                    /* object is not here: move to the next one */
-                    if (xs_list_next(tls[n], &md5s[n], &c[n])) {
-                        xs_free(fn);
-                        fn = _object_fn_by_md5(md5s[n], "content_search_2");
-                    }
-                    else
-                        md5s[n] = NULL;
-                }
+static void _qsched_add(const char *fn, const char *ntid)
+/* schedules a queue item (ntid == NULL: its time is in the file name)
+   (qsched_mutex must be locked) */
+{
+    xs *bn = NULL;
 
-                if (mt > mtime) {
-                    newest = n;
-                    mtime = mt;
-                }
-            }
-        }
+    if (ntid == NULL) {
+        const char *p = strrchr(fn, '/');
+        bn   = xs_str_new(p ? p + 1 : fn);
+        bn   = xs_replace_i(bn, ".json", "");
+        ntid = bn;
+    }
+    else
+    if (xs_endswith(fn, "/sched.idx")) {
+        /* don't repeat scheduled posts checks */
+        if (qsched_sched == NULL)
+            qsched_sched = xs_dict_new();
 
-        if (newest == -1)
-            break;
+        const char *prev = xs_dict_get(qsched_sched, fn);
 
-        const char *md5 = md5s[newest];
+        if (prev != NULL && strcmp(prev, ntid) <= 0)
+            return;
 
-        /* advance the chosen timeline */
-        if (!xs_list_next(tls[newest], &md5s[newest], &c[newest]))
-            md5s[newest] = NULL;
+        qsched_sched = xs_dict_set(qsched_sched, fn, ntid);
+    }
 
-        xs *post = NULL;
+    _qsched_push(ntid, fn);
+}
 
-        if (!valid_status(object_get_by_md5(md5, &post)))
-            continue;
 
-        if (!xs_match(xs_dict_get_def(post, "type", "-"), POSTLIKE_OBJECT_TYPE))
-            continue;
+void qsched_add(const char *fn, const char *ntid)
+/* schedules a queue item (ntid == NULL: its time is in the file name),
+   a queue log record or a scheduled posts check */
+{
+    pthread_mutex_lock(&qsched_mutex);
 
-        const char *id = xs_dict_get(post, "id");
+    int active = qsched_active;
 
-        if (id == NULL || is_hidden(user, id))
-            continue;
+    if (active)
+        _qsched_add(fn, ntid);
 
-        /* recalculate the md5 id to be sure it's not repeated
-           (it may have been searched by the "url" field instead of "id") */
-        xs *new_md5 = xs_md5_hex(id, strlen(id));
-        md5 = new_md5;
+    pthread_mutex_unlock(&qsched_mutex);
 
-        /* test for the post URL */
-        if (strcmp(id, regex) == 0) {
-            if (xs_set_add(&seen, md5) == 1)
-                show--;
+    if (!active) {
+        /* not the server: tell it through the external index */
+        xs *ext = xs_fmt("%s/queue/ext.idx", srv_basedir);
+        FILE *f;
 
-            continue;
+        if ((f = fopen(ext, "a")) != NULL) {
+            fprintf(f, "%s %s\n", ntid ? ntid : "-", fn);
+            fclose(f);
         }
+    }
+}
 
-        /* test for the alternate post id */
-        const char *url = xs_dict_get(post, "url");
-        if (xs_type(url) == XSTYPE_STRING && strcmp(url, regex) == 0) {
-            if (xs_set_add(&seen, md5) == 1)
-                show--;
 
-            continue;
-        }
+static void _qsched_external(void)
+/* reads the items enqueued from other processes (qsched_mutex must be locked) */
+{
+    xs *ext = xs_fmt("%s/queue/ext.idx", srv_basedir);
+    xs *tmp = xs_fmt("%s.tmp", ext);
+    FILE *f;
 
-        xs *c = xs_str_new(NULL);
-        const char *content = xs_dict_get(post, "content");
-        const char *name    = xs_dict_get(post, "name");
-        const char *atto    = get_atto(post);
+    if (rename(ext, tmp) == -1)
+        return;
 
-        if (!xs_is_null(content))
-            c = xs_str_cat(c, content);
-        if (!xs_is_null(name))
-            c = xs_str_cat(c, " ", name);
-        if (!xs_is_null(atto))
-            c = xs_str_cat(c, " ", atto);
+    if ((f = fopen(tmp, "r")) != NULL) {
+        while (!feof(f)) {
+            xs *l = xs_strip_i(xs_readline(f));
+            char *fn;
 
-        /* add alt-texts from attachments */
-        const xs_list *atts = xs_dict_get(post, "attachment");
-        int tc = 0;
-        const xs_dict *att;
+            if (*l == '\0' || (fn = strchr(l, ' ')) == NULL)
+                continue;
 
-        while (xs_list_next(atts, &att, &tc)) {
-            const char *name = xs_dict_get(att, "name");
+            *fn++ = '\0';
 
-            if (name != NULL)
-                c = xs_str_cat(c, " ", name);
+            _qsched_add(fn, strcmp(l, "-") == 0 ? NULL : l);
         }
 
-        /* strip HTML */
-        c = xs_regex_replace_i(c, "<[^>]+>", " ");
-        c = xs_regex_replace_i(c, " {2,}", " ");
+        fclose(f);
+    }
 
-        /* convert to lowercase */
-        xs *lc = xs_utf8_to_lower(c);
+    unlink(tmp);
+}
 
-        /* apply regex */
-        if (xs_regex_match(lc, i_regex)) {
-            if (xs_set_add(&seen, md5) == 1)
-            show--;
-        }
-    }
 
-    xs_list *r = xs_set_result(&seen);
+void qsched_rebuild(void)
+/* loads all the queue items into the heap and activates the scheduler */
+{
+    int cnt = 0;
 
-    if (skip) {
-        /* BAD */
-        while (skip--) {
-            r = xs_list_del(r, 0);
-        }
+    pthread_mutex_lock(&qsched_mutex);
+
+    while (qsched_n) {
+        xs *fn = _qsched_pop();
     }
 
-    xs_free(tls[0]);
-    xs_free(tls[1]);
-    xs_free(tls[2]);
+    qsched_global = xs_free(qsched_global);
+    _qsched_ready_free();
+    qsched_sched  = xs_free(qsched_sched);
+    qsched_global = xs_list_new();
 
-    return r;
-}
+    /* the external index is obsolete, as everything is read here */
+    xs *ext = xs_fmt("%s/queue/ext.idx", srv_basedir);
+    unlink(ext);
 
+    xs *spec = xs_fmt("%s/queue/" "*.json", srv_basedir);
+    xs *fns  = xs_glob(spec, 0, 0);
+    const char *fn;
 
-int actor_failure(const char *actor, int op)
-/* actor failure maintenance */
-{
-    int ret = 0;
+    xs_list_foreach(fns, fn) {
+        _qsched_add(fn, NULL);
+        cnt++;
+    }
 
-    xs *md5 = xs_md5_hex(actor, strlen(actor));
-    xs *fn = xs_fmt("%s/failure/%s", srv_basedir, md5);
+    xs *live = queue_log_live();
+    const char *ntid;
 
-    switch (op) {
-    case 0: /** check **/
-        if (mtime(fn))
-            ret = -1;
+    xs_dict_foreach(live, fn, ntid) {
+        _qsched_add(fn, ntid);
+        cnt++;
+    }
 
-        break;
+    xs *users = user_list();
+    const char *uid;
 
-    case 1: /** register a failure **/
-        if (mtime(fn) == 0.0) {
-            FILE *f;
+    xs_list_foreach(users, uid) {
+        xs *u_spec = xs_fmt("%s/user/%s/queue/" "*.json", srv_basedir, uid);
+        xs *u_fns  = xs_glob(u_spec, 0, 0);
 
-            /* only create once, as the date will be used */
-            if ((f = fopen(fn, "w")) != NULL) {
-                fprintf(f, "%s\n", actor);
-                fclose(f);
-            }
+        xs_list_foreach(u_fns, fn) {
+            _qsched_add(fn, NULL);
+            cnt++;
         }
 
-        break;
-
-    case 2: /** clear a failure **/
-        /* called whenever a message comes from this instance */
-        unlink(fn);
+        /* users with scheduled posts are checked on start */
+        xs *sched = xs_fmt("%s/user/%s/sched.idx", srv_basedir, uid);
 
-        break;
+        if (index_len(sched) > 0) {
+            xs *ntid = tid(0);
+            _qsched_add(sched, ntid);
+        }
     }
 
-    return ret;
+    qsched_active = 1;
+
+    pthread_mutex_unlock(&qsched_mutex);
+
+    srv_debug(1, xs_fmt("qsched_rebuild %d items", cnt));
 }
 
 
-int instance_failure(const char *url, int op)
-/* do some checks and accounting on instance failures */
+time_t qsched_collect(void)
+/* moves the due items to the ready lists; returns the time of the next one (or 0) */
 {
-    int ret = 0;
-    xs *l = xs_split(url, "/");
-    const char *hostname = xs_list_get(l, 2);
-    double mt;
+    time_t t = time(NULL);
+    time_t next = 0;
 
-    if (!xs_is_string(hostname))
-        return 0;
+    pthread_mutex_lock(&qsched_mutex);
 
-    xs *md5 = xs_md5_hex(hostname, strlen(hostname));
-    xs *fn = xs_fmt("%s/failure/%s", srv_basedir, md5);
+    _qsched_external();
 
-    switch (op) {
-    case 0: /** check **/
-        if ((mt = mtime(fn)) != 0.0) {
-            /* grace time */
-            double seconds_failing = xs_number_get(xs_dict_get_def(srv_config, "max_failing_days", "15"))
-                * (24 * 60 * 60);
+    while (qsched_n) {
+        time_t t2 = atol(qsched_heap[0].ntid);
 
-            if ((double)time(NULL) - mt > seconds_failing)
-                ret = -1;
+        if (t2 > t) {
+            next = t2;
+            break;
         }
 
-        break;
+        xs *fn  = _qsched_pop();
+        xs *uid = _qsched_owner(fn);
 
-    case 1: /** register a failure **/
-        if (mtime(fn) == 0.0) {
-            FILE *f;
+        if (qsched_sched != NULL && xs_dict_get(qsched_sched, fn) != NULL)
+            qsched_sched = xs_dict_del(qsched_sched, fn);
 
-            /* only create once, as the date will be used */
-            if ((f = fopen(fn, "w")) != NULL) {
-                fprintf(f, "%s\n", hostname);
-                fclose(f);
+        if (uid == NULL)
+            qsched_global = xs_list_append(qsched_global, fn);
+        else {
+            qsched_ready_ent **e = _qsched_ready_slot(uid);
+
+            if (*e == NULL) {
+                *e = xs_realloc(NULL, sizeof(qsched_ready_ent));
+                (*e)->h_next = NULL;
+                (*e)->uid    = xs_dup(uid);
+                (*e)->list   = xs_list_new();
             }
-        }
 
-        break;
+            (*e)->list = xs_list_append((*e)->list, fn);
+        }
+    }
 
-    case 2: /** clear a failure **/
-        /* called whenever a message comes from this instance */
-        unlink(fn);
+    if (p_state != NULL)
+        p_state->qsched_next = next;
 
-        break;
-    }
+    pthread_mutex_unlock(&qsched_mutex);
 
-    return ret;
+    return next;
 }
 
 
-int grave(const char *objid, int op)
-/* the graveyeard of deleted objects */
+xs_list *qsched_ready_users(void)
+/* returns the list of users with ready items */
 {
-    int ret = 0;
-    xs *dir = xs_fmt("%s/grave", srv_basedir);
-    xs *md5 = xs_md5_hex(objid, strlen(objid));
-    xs *fn  = xs_fmt("%s/%s", dir, md5);
-    FILE *f;
-
-    switch (op) {
-    case 0: /** check **/
-        ret = mtime(fn) > 0.0 ? 1 : 0;
-        break;
-
-    case 1: /** add **/
-        mkdirx(dir);
-
-        if ((f = fopen(fn, "w")) != NULL) {
-            fprintf(f, "%s\n", objid);
-            fclose(f);
-        }
+    xs_list *list = xs_list_new();
+    qsched_ready_ent *e;
+    int n;
 
-        break;
+    pthread_mutex_lock(&qsched_mutex);
 
-    case 2: /** del **/
-        unlink(fn);
-        break;
+    for (n = 0; n < QSCHED_READY_BUCKETS; n++) {
+        for (e = qsched_ready[n]; e != NULL; e = e->h_next)
+            list = xs_list_append(list, e->uid);
     }
 
-    return ret;
-}
+    pthread_mutex_unlock(&qsched_mutex);
 
+    return list;
+}
 
-/** notifications **/
 
-xs_str *notify_check_time(snac *snac, int reset)
-/* gets or resets the latest notification check time */
+xs_list *qsched_take(const char *uid)
+/* takes the list of ready items of a user (NULL if the scheduler is not active) */
 {
-    xs_str *t = NULL;
-    xs *fn    = xs_fmt("%s/notifydate.txt", snac->basedir);
-    FILE *f;
+    xs_list *list = NULL;
 
-    if (reset) {
-        if ((f = fopen(fn, "w")) != NULL) {
-            t = tid(0);
-            fprintf(f, "%s\n", t);
-            fclose(f);
-        }
-    }
-    else {
-        if ((f = fopen(fn, "r")) != NULL) {
-            t = xs_readline(f);
-            fclose(f);
+    pthread_mutex_lock(&qsched_mutex);
+
+    if (qsched_active) {
+        qsched_ready_ent **slot = _qsched_ready_slot(uid);
+        qsched_ready_ent *e = *slot;
+
+        if (e != NULL) {
+            *slot = e->h_next;
+            list  = e->list;
+            xs_free(e->uid);
+            xs_free(e);
         }
         else
-            /* never set before */
-            t = xs_fmt("%16.6f", 0.0);
+            list = xs_list_new();
     }
 
-    return t;
+    pthread_mutex_unlock(&qsched_mutex);
+
+    return list;
 }
 
-xs_dict *markers_get(snac *snac, const xs_list *markers)
+
+void qsched_wait(time_t until)
+/* sleeps until the next item is due, something is scheduled before it,
+   qsched_kick() is called or the until time is reached */
 {
-    xs *data = NULL;
-    xs_dict *returns = xs_dict_new();
-    xs *fn = xs_fmt("%s/markers.json", snac->basedir);
-    const xs_str *v = NULL;
-    FILE *f;
+    pthread_mutex_lock(&qsched_mutex);
 
-    if ((f = fopen(fn, "r")) != NULL) {
-        data = xs_json_load(f);
-        fclose(f);
-    }
+    if (!qsched_kicked) {
+        if (qsched_n) {
+            time_t t2 = atol(qsched_heap[0].ntid);
 
-    if (xs_is_null(data))
-        data = xs_dict_new();
+            if (t2 < until)
+                until = t2;
+        }
 
-    xs_list_foreach(markers, v) {
-        const xs_dict *mark = xs_dict_get(data, v);
-        if (!xs_is_null(mark)) {
-            returns = xs_dict_append(returns, v, mark);
+        if (until > time(NULL)) {
+            struct timespec ts = { .tv_sec = until, .tv_nsec = 0 };
+            pthread_cond_timedwait(&qsched_cond, &qsched_mutex, &ts);
         }
     }
-    return returns;
+
+    qsched_kicked = 0;
+
+    pthread_mutex_unlock(&qsched_mutex);
 }
 
-xs_dict *markers_set(snac *snac, const char *home_marker, const char *notify_marker)
-/* gets or sets notification marker */
+
+void qsched_kick(void)
+/* wakes up the thread waiting in qsched_wait() */
 {
-    xs *data = NULL;
-    xs_dict *written = xs_dict_new();
-    xs *fn = xs_fmt("%s/markers.json", snac->basedir);
-    FILE *f;
+    pthread_mutex_lock(&qsched_mutex);
 
-    if ((f = fopen(fn, "r")) != NULL) {
-        data = xs_json_load(f);
-        fclose(f);
-    }
+    qsched_kicked = 1;
+    pthread_cond_signal(&qsched_cond);
 
-    if (xs_is_null(data))
-        data = xs_dict_new();
+    pthread_mutex_unlock(&qsched_mutex);
+}
 
-    if (!xs_is_null(home_marker)) {
-        xs *home = xs_dict_new();
-        xs *s_tid = tid(0);
-        home = xs_dict_append(home, "last_read_id", home_marker);
-        home = xs_dict_append(home, "version", xs_stock(0));
-        home = xs_dict_append(home, "updated_at", s_tid);
-        data = xs_dict_set(data, "home", home);
-        written = xs_dict_append(written, "home", home);
-    }
 
-    if (!xs_is_null(notify_marker)) {
-        xs *notify = xs_dict_new();
-        xs *s_tid = tid(0);
-        notify = xs_dict_append(notify, "last_read_id", notify_marker);
-        notify = xs_dict_append(notify, "version", xs_stock(0));
-        notify = xs_dict_append(notify, "updated_at", s_tid);
-        data = xs_dict_set(data, "notifications", notify);
-        written = xs_dict_append(written, "notifications", notify);
-    }
+/** queue log **/
 
-    if ((f = fopen(fn, "w")) != NULL) {
-        xs_json_dump(data, 4, f);
-        fclose(f);
-    }
+/* Deferred deliveries of shared payloads are appended as compact
+   records to segment files in queue/log/ instead of being written one
+   per file. A record is referenced as {segment}:{offset}; dequeuing it
+   marks it as done by overwriting its first byte with a '-' (as it's
+   done with index entries). queue_log_compact() deletes the segments
+   with no live records left and moves the few live records of old
+   ones to the current segment. The 'disable_queue_log' option
+   keeps using one file per item */
 
-    return written;
+#define QLOG_SEGMENT_SIZE (1024 * 1024)
+
+static pthread_mutex_t qlog_mutex = PTHREAD_MUTEX_INITIALIZER;
+static xs_str *qlog_current = NULL;
+
+
+int queue_log_enabled(void)
+/* returns true if deferred deliveries go to the queue log */
+{
+    return xs_type(xs_dict_get(srv_config, "disable_queue_log")) != XSTYPE_TRUE;
 }
 
-void notify_add(snac *snac, const char *type, const char *utype,
-                const char *actor, const char *objid, const xs_dict *msg)
-/* adds a new notification */
+
+static int _qlog_ref(const char *ref, xs_str **seg, long *off)
+/* splits a queue log reference */
 {
-    xs *ntid = tid(0);
-    xs *fn   = xs_fmt("%s/notify/", snac->basedir);
-    xs *date = xs_str_utctime(0, ISO_DATE_SPEC);
-    FILE *f;
+    const char *p = strrchr(ref, ':');
 
-    /* create the directory */
-    mkdirx(fn);
-    fn = xs_str_cat(fn, ntid);
-    fn = xs_str_cat(fn, ".json");
+    if (p == NULL || p - ref < 4 || strncmp(p - 4, ".seg", 4) != 0)
+        return 0;
 
-    xs *noti = xs_dict_new();
+    *seg = xs_str_new_sz(ref, p - ref);
+    *off = atol(p + 1);
 
-    noti = xs_dict_append(noti, "id",    ntid);
-    noti = xs_dict_append(noti, "type",  type);
-    noti = xs_dict_append(noti, "utype", utype);
-    noti = xs_dict_append(noti, "actor", actor);
-    noti = xs_dict_append(noti, "date",  date);
-    noti = xs_dict_append(noti, "msg",   msg);
+    return 1;
+}
 
-    if (!xs_is_null(objid))
-        noti = xs_dict_append(noti, "objid", objid);
 
-    if ((f = fopen(fn, "w")) != NULL) {
-        xs_json_dump(noti, 4, f);
-        fclose(f);
+static xs_str *_qlog_append(const char *rec)
+/* appends a record line to the current segment and returns its reference
+   (qlog_mutex must be locked) */
+{
+    xs_str *ref = NULL;
+    FILE *f;
+
+    if (qlog_current == NULL) {
+        /* continue with the last segment, if there is room */
+        xs *spec = xs_fmt("%s/queue/log/" "*.seg", srv_basedir);
+        xs *segs = xs_glob(spec, 0, 1);
+        const char *last = xs_list_get(segs, 0);
+        struct stat st;
+
+        if (xs_is_string(last) && stat(last, &st) != -1 && st.st_size < QLOG_SEGMENT_SIZE)
+            qlog_current = xs_dup(last);
+        else {
+            xs *ntid = tid(0);
+            qlog_current = xs_fmt("%s/queue/log/%s.seg", srv_basedir, ntid);
+        }
     }
 
-    /* add it to the index if it already exists */
-    xs *idx = xs_fmt("%s/notify.idx", snac->basedir);
+    if ((f = fopen(qlog_current, "a")) != NULL) {
+        fprintf(f, "%s\n", rec);
+        fflush(f);
 
-    if (mtime(idx) != 0.0) {
-        pthread_mutex_lock(&data_mutex);
+        long end = ftell(f);
+        fclose(f);
 
-        if ((f = fopen(idx, "a")) != NULL) {
-            fprintf(f, "%-32s\n", ntid);
-            fclose(f);
+        if (end > 0) {
+            ref = xs_fmt("%s:%ld", qlog_current, end - (long)strlen(rec) - 1);
+
+            if (p_state != NULL)
+                p_state->qlog_appends++;
         }
 
-        pthread_mutex_unlock(&data_mutex);
+        /* segment full? start a new one next time */
+        if (end >= QLOG_SEGMENT_SIZE)
+            qlog_current = xs_free(qlog_current);
     }
 
-    if (!xs_is_true(xs_dict_get(srv_config, "disable_notify_webhook")))
-        enqueue_notify_webhook(snac, noti, 0);
+    return ref;
 }
 
 
-xs_dict *notify_get(snac *snac, const char *id)
-/* gets a notification */
+xs_str *queue_log_add(const xs_dict *qmsg)
+/* appends a queue item to the log; returns its reference */
 {
-    /* base file */
-    xs *fn = xs_fmt("%s/notify/%s", snac->basedir, id);
+    xs *rec = xs_json_dumps(qmsg, 0);
 
-    /* strip spaces and add extension */
-    fn = xs_strip_i(fn);
-    fn = xs_str_cat(fn, ".json");
+    pthread_mutex_lock(&qlog_mutex);
 
-    FILE *f;
-    xs_dict *out = NULL;
+    xs_str *ref = _qlog_append(rec);
 
-    if ((f = fopen(fn, "r")) != NULL) {
-        out = xs_json_load(f);
-        fclose(f);
-    }
+    pthread_mutex_unlock(&qlog_mutex);
 
-    return out;
+    if (ref != NULL)
+        qsched_add(ref, xs_dict_get(qmsg, "ntid"));
+
+    return ref;
 }
 
 
-xs_list *notify_list(snac *snac, int skip, int show)
-/* returns a list of notification ids */
+static xs_dict *_qlog_get(const char *ref, int ack)
+/* reads a live record from the log, optionally marking it as done
+   (qlog_mutex must be locked) */
 {
-    xs *idx = xs_fmt("%s/notify.idx", snac->basedir);
+    xs *seg = NULL;
+    long off;
+    xs_dict *qmsg = NULL;
+    FILE *f;
 
-    if (mtime(idx) == 0.0) {
-        /* create the index from scratch */
-        FILE *f;
+    if (!_qlog_ref(ref, &seg, &off))
+        return NULL;
 
-        pthread_mutex_lock(&data_mutex);
+    if ((f = fopen(seg, ack ? "r+" : "r")) != NULL) {
+        if (fseek(f, off, SEEK_SET) == 0) {
+            xs *l = xs_readline(f);
 
-        if ((f = fopen(idx, "w")) != NULL) {
-            xs *spec = xs_fmt("%s/notify/" "*.json", snac->basedir);
-            xs *lst  = xs_glob(spec, 1, 0);
-            xs_list *p = lst;
-            const char *v;
+            if (*l == '{') {
+                qmsg = xs_json_loads(l);
 
-            while (xs_list_iter(&p, &v)) {
-                char *p = strrchr(v, '.');
-                if (p) {
-                    *p = '\0';
-                    fprintf(f, "%-32s\n", v);
+                if (qmsg != NULL && ack) {
+                    fseek(f, off, SEEK_SET);
+                    fwrite("-", 1, 1, f);
                 }
             }
-
-            fclose(f);
         }
 
-        pthread_mutex_unlock(&data_mutex);
+        fclose(f);
     }
 
-    return index_list_desc(idx, skip, show);
+    return qmsg;
 }
 
 
-xs_list *notify_filter_list(snac *snac, xs_list *notifs)
-/* apply user-defined notification filter to IDs */
+xs_dict *queue_log_live(void)
+/* returns the live records of all segments, as a dict of reference: ntid */
 {
-    const xs_dict *n_filter = xs_dict_get(snac->config, "notify_filter");
-    if (!n_filter) {
-        return xs_dup(notifs);
-    }
-    const xs_val *n_def = xs_stock( XSTYPE_TRUE );
-    int n_likes_on  = xs_is_true(xs_dict_get_def(n_filter, "likes", n_def));
-    int n_reacts_on = xs_is_true(xs_dict_get_def(n_filter, "reacts", n_def));
-    int n_ments_on  = xs_is_true(xs_dict_get_def(n_filter, "mentions", n_def));
-    int n_ann_on    = xs_is_true(xs_dict_get_def(n_filter, "announces", n_def));
-    int n_fol_on    = xs_is_true(xs_dict_get_def(n_filter, "follows", n_def));
-    int n_unfol_on  = xs_is_true(xs_dict_get_def(n_filter, "unfollows", n_def));
-    int n_folreq_on = xs_is_true(xs_dict_get_def(n_filter, "folreqs", n_def));
-    int n_blocks_on = xs_is_true(xs_dict_get_def(n_filter, "blocks", n_def));
-    int n_polls_on  = xs_is_true(xs_dict_get_def(n_filter, "polls", n_def));
+    xs *spec = xs_fmt("%s/queue/log/" "*.seg", srv_basedir);
+    xs *segs = xs_glob(spec, 0, 0);
+    xs_dict *live = xs_dict_new();
+    const char *seg;
 
-    const xs_str *v;
-    xs_list *flt = xs_list_new();
+    pthread_mutex_lock(&qlog_mutex);
 
-    xs_list_foreach(notifs, v) {
-        xs *noti = notify_get(snac, v);
+    xs_list_foreach(segs, seg) {
+        FILE *f;
 
-        if (noti == NULL)
+        if ((f = fopen(seg, "r")) == NULL)
             continue;
 
-        const char *type  = xs_dict_get(noti, "type");
-        const char *utype = xs_dict_get(noti, "utype");
-        const char *actor_id = xs_dict_get(noti, "actor");
-        if (strcmp(type, "EmojiReact") == 0 && xs_is_true(xs_dict_get(srv_config, "disable_emojireact")))
-            continue;
-        if (strcmp(type, "Create") == 0 && !n_ments_on)
-            continue;
-        if (strcmp(type, "Update") == 0 && strcmp(utype, "Question") == 0 && !n_polls_on)
-            continue;
-        if (strcmp(type, "Undo") == 0 && strcmp(utype, "Follow") == 0 && !n_unfol_on)
-            continue;
-        if (strcmp(type, "EmojiReact") == 0 || strcmp(type, "Like") == 0) {
-            if (strcmp(type, "Like") == 0 && !n_likes_on)
-                continue;
-            if (strcmp(type, "EmojiReact") == 0 && !n_reacts_on)
+        for (;;) {
+            long off = ftell(f);
+            xs *l = xs_readline(f);
+
+            if (*l == '\0')
+                break;
+
+            if (*l != '{')
                 continue;
-        }
-        if (strcmp(type, "Follow") == 0) {
-            if (pending_check(snac, actor_id)) {
-                if (!n_folreq_on)
-                    continue;
+
+            xs *qmsg = xs_json_loads(l);
+            const char *ntid = xs_dict_get(qmsg, "ntid");
+
+            if (xs_is_string(ntid)) {
+                xs *ref = xs_fmt("%s:%ld", seg, off);
+                live = xs_dict_set(live, ref, ntid);
             }
-            else
-            if (!n_fol_on)
-                continue;
         }
-        if (strcmp(type, "Block") == 0 && !n_blocks_on)
-            continue;
-        if (strcmp(type, "Announce") == 0 && !n_ann_on)
-            continue;
-        flt = xs_list_append(flt, v);
+
+        fclose(f);
     }
-    return flt;
+
+    pthread_mutex_unlock(&qlog_mutex);
+
+    return live;
 }
 
 
-int notify_new_num(snac *snac)
-/* counts the number of new notifications */
+void queue_log_compact(void)
+/* deletes the segments with no live records and rewrites the old
+   ones that are mostly done */
 {
-    xs *t = notify_check_time(snac, 0);
-    xs *lst_unfilt = notify_list(snac, 0, XS_ALL);
-    xs *lst = notify_filter_list(snac, lst_unfilt);
+    xs *spec = xs_fmt("%s/queue/log/" "*.seg", srv_basedir);
+    xs *segs = xs_glob(spec, 0, 0);
+    time_t old = time(NULL) - 60 * 60;
+    const char *seg;
     int cnt = 0;
 
-    xs_list *p = lst;
-    const xs_str *v;
+    xs_list_foreach(segs, seg) {
+        pthread_mutex_lock(&qlog_mutex);
 
-    while (xs_list_iter(&p, &v)) {
-        xs *id = xs_strip_i(xs_dup(v));
+        /* the current segment is left alone */
+        if (qlog_current == NULL || strcmp(seg, qlog_current) != 0) {
+            xs *recs = xs_list_new();
+            int total = 0;
+            FILE *f;
 
-        /* old? count no more */
-        if (strcmp(id, t) < 0)
-            break;
+            if ((f = fopen(seg, "r")) != NULL) {
+                for (;;) {
+                    xs *l = xs_readline(f);
 
-        cnt++;
-    }
+                    if (*l == '\0')
+                        break;
 
-    return cnt;
-}
+                    total++;
 
+                    if (*l == '{')
+                        recs = xs_list_append(recs, xs_strip_i(l));
+                }
 
-void notify_clear(snac *snac)
-/* clears all notifications */
-{
-    xs *spec   = xs_fmt("%s/notify/" "*", snac->basedir);
-    xs *lst    = xs_glob(spec, 0, 0);
-    xs_list *p = lst;
-    const xs_str *v;
+                fclose(f);
+            }
 
-    while (xs_list_iter(&p, &v))
-        unlink(v);
+            int live = xs_list_len(recs);
 
-    xs *idx = xs_fmt("%s/notify.idx", snac->basedir);
+            if (live == 0 || (live * 4 < total && mtime(seg) < old)) {
+                const char *rec;
 
-    if (mtime(idx) != 0.0) {
-        pthread_mutex_lock(&data_mutex);
-        truncate(idx, 0);
-        pthread_mutex_unlock(&data_mutex);
+                /* no current segment yet (e.g. after a restart)? start a
+                   new one, as _qlog_append() would otherwise continue
+                   with the last one, that may be this one */
+                if (live && qlog_current == NULL) {
+                    xs *ntid = tid(0);
+                    qlog_current = xs_fmt("%s/queue/log/%s.seg", srv_basedir, ntid);
+                }
+
+                /* move the live records to the current segment */
+                xs_list_foreach(recs, rec) {
+                    xs *qmsg = xs_json_loads(rec);
+                    xs *ref  = _qlog_append(rec);
+
+                    if (ref != NULL && qmsg != NULL)
+                        qsched_add(ref, xs_dict_get(qmsg, "ntid"));
+                }
+
+                unlink(seg);
+                cnt++;
+
+                srv_debug(1, xs_fmt("queue_log_compact %s (%d/%d live)", seg, live, total));
+            }
+        }
+
+        pthread_mutex_unlock(&qlog_mutex);
     }
+
+    if (p_state != NULL)
+        p_state->qlog_compacted += cnt;
 }
 
 
@@ -3679,10 +5544,12 @@ static xs_dict *_enqueue_put(const char *fn, xs_dict *msg)
     FILE *f;
 
     if ((f = fopen(tfn, "w")) != NULL) {
-        xs_json_dump(msg, 4, f);
+        xs_json_dump(msg, storage_json_indent(), f);
         fclose(f);
 
         rename(tfn, fn);
+
+        qsched_add(fn, NULL);
     }
 
     return msg;
@@ -3756,6 +5623,12 @@ void enqueue_output_raw(const char *keyid, const char *seckey,
     /* if it's to be sent right now, bypass the disk queue and post the job */
     if (retries == 0 && p_state != NULL)
         job_post(qmsg, 0);
+    else
+    if (queue_log_enabled()) {
+        /* store the message as a payload and log just the delivery */
+        xs *pl_id = payload_add_raw(keyid, seckey, msg);
+        enqueue_output_payload(pl_id, inbox, retries, p_status);
+    }
     else {
         qmsg = _enqueue_put(fn, qmsg);
         srv_debug(1, xs_fmt("enqueue_output %s %s %d", inbox, fn, retries));
@@ -3763,6 +5636,146 @@ void enqueue_output_raw(const char *keyid, const char *seckey,
 }
 
 
+/** shared payloads for fan-out deliveries **/
+
+#define PAYLOAD_CACHE_SIZE 16
+
+static struct {
+    xs_str *id;
+    xs_dict *pl;
+    unsigned long used;
+} payload_cache[PAYLOAD_CACHE_SIZE];
+static unsigned long payload_cache_tick = 0;
+static pthread_mutex_t payload_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static xs_dict *_payload_cache(const char *id, const xs_dict *pl)
+/* gets a payload from the cache or, if pl is set, stores it */
+{
+    xs_dict *r = NULL;
+    int n, lru = 0;
+
+    pthread_mutex_lock(&payload_cache_mutex);
+
+    for (n = 0; n < PAYLOAD_CACHE_SIZE; n++) {
+        if (payload_cache[n].id && strcmp(payload_cache[n].id, id) == 0)
+            break;
+
+        if (payload_cache[n].used < payload_cache[lru].used)
+            lru = n;
+    }
+
+    if (n < PAYLOAD_CACHE_SIZE) {
+        payload_cache[n].used = ++payload_cache_tick;
+        r = xs_dup(payload_cache[n].pl);
+    }
+    else
+    if (pl != NULL) {
+        xs_free(payload_cache[lru].id);
+        xs_free(payload_cache[lru].pl);
+
+        payload_cache[lru].id   = xs_dup(id);
+        payload_cache[lru].pl   = xs_dup(pl);
+        payload_cache[lru].used = ++payload_cache_tick;
+    }
+
+    pthread_mutex_unlock(&payload_cache_mutex);
+
+    return r;
+}
+
+
+xs_str *payload_add_raw(const char *keyid, const char *seckey, const xs_dict *msg)
+/* stores a message to be delivered to many inboxes; returns its id */
+{
+    xs *body = xs_json_dumps(msg, 4);
+    xs *s    = xs_fmt("%s %s", keyid, body);
+    xs_str *id = xs_md5_hex(s, strlen(s));
+    xs *fn   = xs_fmt("%s/payload/%s.json", srv_basedir, id);
+
+    xs *pl = xs_dict_new();
+    pl = xs_dict_append(pl, "keyid",  keyid);
+    pl = xs_dict_append(pl, "seckey", seckey);
+    pl = xs_dict_append(pl, "body",   body);
+
+    /* payloads are immutable, so an existing one is fine, but it's
+       touched so the purge (that goes by age) keeps it for the new
+       deliveries that reference it */
+    if (utimes(fn, NULL) == -1) {
+        xs *tfn = xs_fmt("%s.tmp", fn);
+        FILE *f;
+
+        if ((f = fopen(tfn, "w")) != NULL) {
+            xs_json_dump(pl, storage_json_indent(), f);
+            fclose(f);
+
+            rename(tfn, fn);
+        }
+    }
+
+    xs_free(_payload_cache(id, pl));
+
+    return id;
+}
+
+
+xs_str *payload_add(snac *snac, const xs_dict *msg)
+/* stores a message from a user to be delivered to many inboxes */
+{
+    return payload_add_raw(snac->actor, xs_dict_get(snac->key, "secret"), msg);
+}
+
+
+xs_dict *payload_get(const char *id)
+/* gets a shared payload */
+{
+    xs_dict *pl = _payload_cache(id, NULL);
+
+    if (pl == NULL) {
+        xs *fn = xs_fmt("%s/payload/%s.json", srv_basedir, id);
+        FILE *f;
+
+        if ((f = fopen(fn, "r")) != NULL) {
+            pl = xs_json_load(f);
+            fclose(f);
+
+            if (pl != NULL)
+                xs_free(_payload_cache(id, pl));
+        }
+    }
+
+    return pl;
+}
+
+
+void enqueue_output_payload(const char *pl_id, const xs_str *inbox,
+                            int retries, int p_status)
+/* enqueues the delivery of a shared payload to an inbox */
+{
+    xs *qmsg   = _new_qmsg("output", NULL, retries);
+    const char *ntid = xs_dict_get(qmsg, "ntid");
+    xs *fn     = xs_fmt("%s/queue/%s.json", srv_basedir, ntid);
+
+    xs *ns = xs_number_new(p_status);
+    qmsg = xs_dict_append(qmsg, "p_status", ns);
+
+    qmsg = xs_dict_append(qmsg, "inbox",   inbox);
+    qmsg = xs_dict_append(qmsg, "payload", pl_id);
+
+    if (retries == 0 && p_state != NULL)
+        job_post(qmsg, 0);
+    else
+    if (queue_log_enabled()) {
+        xs *ref = queue_log_add(qmsg);
+        srv_debug(1, xs_fmt("enqueue_output_payload %s %s %d", inbox, ref, retries));
+    }
+    else {
+        qmsg = _enqueue_put(fn, qmsg);
+        srv_debug(1, xs_fmt("enqueue_output_payload %s %s %d", inbox, fn, retries));
+    }
+}
+
+
 void enqueue_output(snac *snac, const xs_dict *msg,
                     const xs_str *inbox, int retries, int p_status)
 /* enqueues an output message to an inbox */
@@ -4036,6 +6049,21 @@ int was_question_voted(snac *user, const char *id)
 xs_list *user_queue(snac *snac)
 /* returns a list with filenames that can be dequeued */
 {
+    xs *ready = qsched_take(snac->uid);
+
+    if (ready != NULL) {
+        xs_list *list = xs_list_new();
+        const char *fn;
+
+        xs_list_foreach(ready, fn) {
+            /* scheduled posts are always checked */
+            if (!xs_endswith(fn, "/sched.idx"))
+                list = xs_list_append(list, fn);
+        }
+
+        return list;
+    }
+
     xs *spec      = xs_fmt("%s/queue/" "*.json", snac->basedir);
     xs_list *list = xs_list_new();
     time_t t      = time(NULL);
@@ -4062,9 +6090,78 @@ xs_list *user_queue(snac *snac)
 }
 
 
-xs_list *queue(void)
-/* returns a list with filenames that can be dequeued */
+int user_queue_pending(const char *uid)
+/* returns the number of items ready in a user's queue (without opening it),
+   plus one if there are scheduled posts to be checked */
+{
+    pthread_mutex_lock(&qsched_mutex);
+
+    if (qsched_active) {
+        qsched_ready_ent *e = *_qsched_ready_slot(uid);
+        int n = e ? xs_list_len(e->list) : 0;
+
+        pthread_mutex_unlock(&qsched_mutex);
+
+        return n;
+    }
+
+    pthread_mutex_unlock(&qsched_mutex);
+
+    xs *spec = xs_fmt("%s/user/%s/queue/" "*.json", srv_basedir, uid);
+    xs *fns  = xs_glob(spec, 0, 0);
+    time_t t = time(NULL);
+    const char *v;
+    int cnt  = 0;
+
+    xs_list_foreach(fns, v) {
+        const char *bn = strrchr(v, '/');
+
+        if (atol(bn + 1) <= t)
+            cnt++;
+    }
+
+    xs *sched = xs_fmt("%s/user/%s/sched.idx", srv_basedir, uid);
+
+    if (index_len(sched) > 0)
+        cnt++;
+
+    return cnt;
+}
+
+
+xs_list *queue(int max)
+/* returns a list with (up to max) filenames that can be dequeued */
 {
+    pthread_mutex_lock(&qsched_mutex);
+
+    if (qsched_active) {
+        /* take the ready list from the scheduler */
+        xs_list *list = qsched_global;
+        qsched_global = xs_list_new();
+
+        if (xs_list_len(list) > max) {
+            /* leave the rest there */
+            xs *all = list;
+            const char *fn;
+            int n = 0;
+
+            list = xs_list_new();
+
+            xs_list_foreach(all, fn) {
+                if (n++ < max)
+                    list = xs_list_append(list, fn);
+                else
+                    qsched_global = xs_list_append(qsched_global, fn);
+            }
+        }
+
+        pthread_mutex_unlock(&qsched_mutex);
+
+        return list;
+    }
+
+    pthread_mutex_unlock(&qsched_mutex);
+
     xs *spec      = xs_fmt("%s/queue/" "*.json", srv_basedir);
     xs_list *list = xs_list_new();
     time_t t      = time(NULL);
@@ -4087,6 +6184,15 @@ xs_list *queue(void)
         }
     }
 
+    /* add the due records from the queue log */
+    xs *live = queue_log_live();
+    const xs_str *ref;
+
+    xs_dict_foreach(live, ref, v) {
+        if (atol(v) <= t)
+            list = xs_list_append(list, ref);
+    }
+
     return list;
 }
 
@@ -4097,6 +6203,15 @@ xs_dict *queue_get(const char *fn)
     FILE *f;
     xs_dict *obj = NULL;
 
+    if (!xs_endswith(fn, ".json")) {
+        /* a queue log reference */
+        pthread_mutex_lock(&qlog_mutex);
+        obj = _qlog_get(fn, 0);
+        pthread_mutex_unlock(&qlog_mutex);
+
+        return obj;
+    }
+
     if ((f = fopen(fn, "r")) != NULL) {
         obj = xs_json_load(f);
         fclose(f);
@@ -4109,6 +6224,15 @@ xs_dict *queue_get(const char *fn)
 xs_dict *dequeue(const char *fn)
 /* dequeues a message */
 {
+    if (!xs_endswith(fn, ".json")) {
+        /* a queue log reference: just mark it as done */
+        pthread_mutex_lock(&qlog_mutex);
+        xs_dict *obj = _qlog_get(fn, 1);
+        pthread_mutex_unlock(&qlog_mutex);
+
+        return obj;
+    }
+
     xs_dict *obj = queue_get(fn);
 
     unlink(fn);
@@ -4117,6 +6241,24 @@ xs_dict *dequeue(const char *fn)
 }
 
 
+void queue_put_back(const xs_dict *q_item)
+/* writes an item that was dequeued but not processed back to the queue,
+   to be processed as soon as possible (used on shutdown) */
+{
+    xs *qmsg = xs_dup(q_item);
+    xs *ntid = tid(0);
+
+    qmsg = xs_dict_set(qmsg, "ntid", ntid);
+
+    if (queue_log_enabled() && xs_is_string(xs_dict_get(qmsg, "payload")))
+        xs_free(queue_log_add(qmsg));
+    else {
+        xs *fn = xs_fmt("%s/queue/%s.json", srv_basedir, ntid);
+        qmsg = _enqueue_put(fn, qmsg);
+    }
+}
+
+
 /** the purge **/
 
 static int _purge_file(const char *fn, time_t mt)
@@ -4151,17 +6293,84 @@ static void _purge_dir(const char *dir, int days)
         while (xs_list_iter(&p, &v))
             cnt += _purge_file(v, mt);
 
-        srv_debug(1, xs_fmt("purge: %s %d", dir, cnt));
+        srv_debug(1, xs_fmt("purge: %s %d", dir, cnt));
+    }
+}
+
+
+static void _purge_user_subdir(snac *snac, const char *subdir, int days)
+/* purges all files in a user subdir older than days */
+{
+    xs *u_subdir = xs_fmt("%s/%s", snac->basedir, subdir);
+
+    _purge_dir(u_subdir, days);
+}
+
+
+static int _purge_object_file(const char *fn, time_t mt)
+/* purges an entry of an object directory if it's older than mt:
+   objects with no hard links (returns 1), stray indexes of objects
+   that are not here (returns 2) and index backups */
+{
+    int ret = 0;
+
+    if (xs_endswith(fn, ".json")) {
+        int n_link;
+
+        /* old and with no hard links? */
+        if (mtime_nl(fn, &n_link) < mt && n_link < 2) {
+            xs *s1    = xs_replace(fn, ".json", "");
+            xs *l     = xs_split(s1, "/");
+            const char *md5 = xs_list_get(l, -1);
+
+            object_del_by_md5(md5);
+            ret = 1;
+        }
+    }
+    else
+    if (xs_endswith(fn, ".idx") && strlen(fn) > 6 && fn[strlen(fn) - 6] == '_') {
+        /* old enough to consider? */
+        if (mtime(fn) < mt) {
+            /* check if the indexed object is here */
+            xs *o = xs_dup(fn);
+            char *ext = strrchr(o, '_');
+
+            *ext = '\0';
+            o = xs_str_cat(o, ".json");
+
+            if (mtime(o) == 0.0) {
+                /* delete */
+                unlink(fn);
+                srv_debug(1, xs_fmt("purged %s", fn));
+                ret = 2;
+            }
+        }
+    }
+    else
+    if (xs_endswith(fn, ".bak")) {
+        /* delete index backups */
+        unlink(fn);
+        srv_debug(1, xs_fmt("purged %s", fn));
     }
+
+    return ret;
 }
 
 
-static void _purge_user_subdir(snac *snac, const char *subdir, int days)
-/* purges all files in a user subdir older than days */
+static void _purge_tag_index_cleanup(const char *fn)
+/* deletes the backup of a garbage-collected tag index, and the index
+   itself if it's now empty */
 {
-    xs *u_subdir = xs_fmt("%s/%s", snac->basedir, subdir);
+    xs *bak = xs_fmt("%s.bak", fn);
+    unlink(bak);
 
-    _purge_dir(u_subdir, days);
+    if (index_len(fn) == 0) {
+        /* there are no longer any entry with this tag;
+           purge it completely */
+        unlink(fn);
+        xs *dottag = xs_replace(fn, ".idx", ".tag");
+        unlink(dottag);
+    }
 }
 
 
@@ -4179,65 +6388,18 @@ void purge_server(void)
 
     p = dirs;
     while (xs_list_iter(&p, &v)) {
-        xs_list *p2;
+        xs *spec2 = xs_fmt("%s/" "*", v);
+        xs *files = xs_glob(spec2, 0, 0);
         const xs_str *v2;
 
-        {
-            xs *spec2 = xs_fmt("%s/" "*.json", v);
-            xs *files = xs_glob(spec2, 0, 0);
-
-            p2 = files;
-            while (xs_list_iter(&p2, &v2)) {
-                int n_link;
-
-                /* old and with no hard links? */
-                if (mtime_nl(v2, &n_link) < mt && n_link < 2) {
-                    xs *s1    = xs_replace(v2, ".json", "");
-                    xs *l     = xs_split(s1, "/");
-                    const char *md5 = xs_list_get(l, -1);
-
-                    object_del_by_md5(md5);
-                    cnt++;
-                }
-            }
-        }
-
-        {
-            /* look for stray indexes */
-            xs *speci = xs_fmt("%s/" "*_?.idx", v);
-            xs *idxfs = xs_glob(speci, 0, 0);
-
-            p2 = idxfs;
-            while (xs_list_iter(&p2, &v2)) {
-                /* old enough to consider? */
-                if (mtime(v2) < mt) {
-                    /* check if the indexed object is here */
-                    xs *o = xs_dup(v2);
-                    char *ext = strchr(o, '_');
-
-                    if (ext) {
-                        *ext = '\0';
-                        o = xs_str_cat(o, ".json");
-
-                        if (mtime(o) == 0.0) {
-                            /* delete */
-                            unlink(v2);
-                            srv_debug(1, xs_fmt("purged %s", v2));
-                            icnt++;
-                        }
-                    }
-                }
-            }
-
-            /* delete index backups */
-            xs *specb = xs_fmt("%s/" "*.bak", v);
-            xs *bakfs = xs_glob(specb, 0, 0);
+        xs_list_foreach(files, v2) {
+            int r = _purge_object_file(v2, mt);
 
-            p2 = bakfs;
-            while (xs_list_iter(&p2, &v2)) {
-                unlink(v2);
-                srv_debug(1, xs_fmt("purged %s", v2));
-            }
+            if (r == 1)
+                cnt++;
+            else
+            if (r == 2)
+                icnt++;
         }
     }
 
@@ -4245,6 +6407,16 @@ void purge_server(void)
     xs *ib_dir = xs_fmt("%s/inbox", srv_basedir);
     _purge_dir(ib_dir, 7);
 
+    {
+        /* purge shared payloads that no queued delivery can still need */
+        int qrt = xs_number_get(xs_dict_get(srv_config, "queue_retry_minutes"));
+        int qrm = xs_number_get(xs_dict_get(srv_config, "queue_retry_max"));
+        int days = 1 + (qrt * 60 * (qrm * (qrm + 1) / 2)) / (24 * 3600);
+
+        xs *pl_dir = xs_fmt("%s/payload", srv_basedir);
+        _purge_dir(pl_dir, days);
+    }
+
     /* purge the instance timeline */
     xs *itl_fn = xs_fmt("%s/public.idx", srv_basedir);
     int itl_gc = index_gc(itl_fn);
@@ -4264,16 +6436,7 @@ void purge_server(void)
         p2 = files;
         while (xs_list_iter(&p2, &v2)) {
             tag_gc += index_gc(v2);
-            xs *bak = xs_fmt("%s.bak", v2);
-            unlink(bak);
-
-            if (index_len(v2) == 0) {
-                /* there are no longer any entry with this tag;
-                   purge it completely */
-                unlink(v2);
-                xs *dottag = xs_replace(v2, ".idx", ".tag");
-                unlink(dottag);
-            }
+            _purge_tag_index_cleanup(v2);
         }
     }
 
@@ -4437,15 +6600,14 @@ void purge_static(snac *user)
 }
 
 
-void purge_user(snac *snac)
-/* do the purge for this user */
+static void _purge_user_days(snac *snac, int *priv_days, int *pub_days)
+/* gets the purge days of a user's private and public data */
 {
-    int priv_days, pub_days, user_days = 0;
+    int user_days = 0;
     const char *v;
-    int n;
 
-    priv_days = xs_number_get(xs_dict_get(srv_config, "timeline_purge_days"));
-    pub_days  = xs_number_get(xs_dict_get(srv_config, "local_purge_days"));
+    *priv_days = xs_number_get(xs_dict_get(srv_config, "timeline_purge_days"));
+    *pub_days  = xs_number_get(xs_dict_get(srv_config, "local_purge_days"));
 
     if ((v = xs_dict_get(snac->config_o, "purge_days")) != NULL ||
         (v = xs_dict_get(snac->config, "purge_days")) != NULL)
@@ -4453,12 +6615,26 @@ void purge_user(snac *snac)
 
     if (user_days) {
         /* override admin settings only if they are lesser */
-        if (priv_days == 0 || user_days < priv_days)
-            priv_days = user_days;
+        if (*priv_days == 0 || user_days < *priv_days)
+            *priv_days = user_days;
 
-        if (pub_days == 0 || user_days < pub_days)
-            pub_days = user_days;
+        if (*pub_days == 0 || user_days < *pub_days)
+            *pub_days = user_days;
     }
+}
+
+
+/* the indexes of a user that are garbage-collected */
+static const char *purge_user_idxs[] = { "followers.idx", "private.idx", "public.idx",
+    "pinned.idx", "bookmark.idx", "draft.idx", "sched.idx", "admire.idx", NULL };
+
+void purge_user(snac *snac)
+/* do the purge for this user */
+{
+    int priv_days, pub_days;
+    int n;
+
+    _purge_user_days(snac, &priv_days, &pub_days);
 
     if (xs_is_true(xs_dict_get(srv_config, "propagate_local_purge")))
         delete_purged_posts(snac, pub_days);
@@ -4470,11 +6646,8 @@ void purge_user(snac *snac)
     _purge_user_subdir(snac, "public",  pub_days);
     _purge_user_subdir(snac, "admire",  pub_days);
 
-    const char *idxs[] = { "followers.idx", "private.idx", "public.idx", "pinned.idx",
-                           "bookmark.idx", "draft.idx", "sched.idx", "admire.idx", NULL };
-
-    for (n = 0; idxs[n]; n++) {
-        xs *idx = xs_fmt("%s/%s", snac->basedir, idxs[n]);
+    for (n = 0; purge_user_idxs[n]; n++) {
+        xs *idx = xs_fmt("%s/%s", snac->basedir, purge_user_idxs[n]);
         int gc = index_gc(idx);
         srv_debug(1, xs_fmt("purge: %s %d", idx, gc));
     }
@@ -4525,6 +6698,504 @@ void purge_all(void)
 }
 
 
+/** incremental purge **/
+
+/* When the server is running, the purge is not done in one go once a
+   day, but in slices of purge_slice_ms milliseconds every
+   purge_slice_seconds. A purge cycle is a list of tasks (directories
+   whose files are checked, indexes to be garbage-collected and some
+   per-user chores) built when it starts; the list, the current task
+   and the position inside it are saved in purge.json after every
+   slice, so the work is resumed from there after a restart. A new
+   cycle starts 24 hours after the previous one did, or as soon as it
+   ends if it took longer than that. Indexes are collected by marking
+   their entries as deleted in place, a chunk at a time, and are only
+   rewritten (without checking the objects again) at the end */
+
+#define PURGE_IDX_CHUNK 256
+
+static pthread_mutex_t purge_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+    int loaded;
+    xs_list *tasks;         /* the tasks of the cycle */
+    time_t start;           /* cycle start time */
+    time_t end;             /* cycle end time (0: not yet) */
+    int task;               /* current task */
+    int pos;                /* position inside the task */
+    xs_str *last;           /* last file done in the task (to resume) */
+    long off;               /* offset inside the current index */
+    int marked;             /* entries marked in the current index */
+    int checked;            /* entries checked in the cycle */
+    int deleted;            /* entries deleted in the cycle */
+    double busy;            /* time spent in the cycle */
+    int slices;             /* slices run in the cycle */
+} purge_cur = {0};
+
+/* the globbed files of the current task */
+static xs_list *purge_files = NULL;
+static int purge_files_task = -1;
+
+
+static xs_list *_purge_tasks(void)
+/* builds the task list of a new purge cycle */
+{
+    xs_list *tasks = xs_list_new();
+    xs *users = user_list();
+    const char *uid;
+    const char *v;
+    int n;
+
+    xs_list_foreach(users, uid) {
+        snac user;
+        int priv_days, pub_days;
+
+        if (!user_open(&user, uid))
+            continue;
+
+        _purge_user_days(&user, &priv_days, &pub_days);
+
+        xs *nd = xs_number_new(0);
+        xs *np = xs_number_new(priv_days);
+        xs *nu = xs_number_new(pub_days);
+
+        if (pub_days && xs_is_true(xs_dict_get(srv_config, "propagate_local_purge"))) {
+            xs *t = xs_list_append(xs_list_new(), "user", uid, "pre");
+            tasks = xs_list_append(tasks, t);
+        }
+
+        if (priv_days) {
+            const char *dirs[] = { "hidden", "private", "pending", NULL };
+
+            for (n = 0; dirs[n]; n++) {
+                xs *spec = xs_fmt("%s/%s/" "*", user.basedir, dirs[n]);
+                xs *t = xs_list_append(xs_list_new(), "files", spec, np);
+                tasks = xs_list_append(tasks, t);
+            }
+        }
+
+        if (pub_days) {
+            const char *dirs[] = { "public", "admire", NULL };
+
+            for (n = 0; dirs[n]; n++) {
+                xs *spec = xs_fmt("%s/%s/" "*", user.basedir, dirs[n]);
+                xs *t = xs_list_append(xs_list_new(), "files", spec, nu);
+                tasks = xs_list_append(tasks, t);
+            }
+        }
+
+        for (n = 0; purge_user_idxs[n]; n++) {
+            xs *spec = xs_fmt("%s/%s", user.basedir, purge_user_idxs[n]);
+            xs *t = xs_list_append(xs_list_new(), "index", spec, nd);
+            tasks = xs_list_append(tasks, t);
+        }
+
+        {
+            xs *spec = xs_fmt("%s/list/" "*.idx", user.basedir);
+            xs *t = xs_list_append(xs_list_new(), "index", spec, nd);
+            tasks = xs_list_append(tasks, t);
+        }
+
+        xs *t = xs_list_append(xs_list_new(), "user", uid, "post");
+        tasks = xs_list_append(tasks, t);
+
+        user_free(&user);
+    }
+
+    {
+        xs *spec = xs_fmt("%s/object/??", srv_basedir);
+        xs *dirs = xs_glob(spec, 0, 0);
+
+        xs_list_foreach(dirs, v) {
+            xs *spec2 = xs_fmt("%s/" "*", v);
+            xs *t = xs_list_append(xs_list_new(), "objects", spec2);
+            tasks = xs_list_append(tasks, t);
+        }
+    }
+
+    {
+        xs *spec = xs_fmt("%s/inbox/" "*", srv_basedir);
+        xs *nd = xs_number_new(7);
+        xs *t = xs_list_append(xs_list_new(), "files", spec, nd);
+        tasks = xs_list_append(tasks, t);
+    }
+
+    {
+        /* shared payloads that no queued delivery can still need */
+        int qrt = xs_number_get(xs_dict_get(srv_config, "queue_retry_minutes"));
+        int qrm = xs_number_get(xs_dict_get(srv_config, "queue_retry_max"));
+        int days = 1 + (qrt * 60 * (qrm * (qrm + 1) / 2)) / (24 * 3600);
+
+        xs *spec = xs_fmt("%s/payload/" "*", srv_basedir);
+        xs *nd = xs_number_new(days);
+        xs *t = xs_list_append(xs_list_new(), "files", spec, nd);
+        tasks = xs_list_append(tasks, t);
+    }
+
+    {
+        xs *spec = xs_fmt("%s/public.idx", srv_basedir);
+        xs *nd = xs_number_new(0);
+        xs *t = xs_list_append(xs_list_new(), "index", spec, nd);
+        tasks = xs_list_append(tasks, t);
+    }
+
+    {
+        xs *spec = xs_fmt("%s/tag/??", srv_basedir);
+        xs *dirs = xs_glob(spec, 0, 0);
+        xs *nt = xs_number_new(1);
+
+        xs_list_foreach(dirs, v) {
+            xs *spec2 = xs_fmt("%s/" "*.idx", v);
+            xs *t = xs_list_append(xs_list_new(), "index", spec2, nt);
+            tasks = xs_list_append(tasks, t);
+        }
+    }
+
+    {
+        xs *t = xs_list_append(xs_list_new(), "mastoapi");
+        tasks = xs_list_append(tasks, t);
+    }
+
+    return tasks;
+}
+
+
+static void _purge_cur_load(void)
+/* loads the purge cursor */
+{
+    xs *fn = xs_fmt("%s/purge.json", srv_basedir);
+    xs *j = NULL;
+    FILE *f;
+
+    purge_cur.loaded = 1;
+
+    if ((f = fopen(fn, "r")) == NULL)
+        return;
+
+    j = xs_json_load(f);
+    fclose(f);
+
+    if (!xs_is_dict(j))
+        return;
+
+    const xs_list *tasks = xs_dict_get(j, "tasks");
+
+    if (!xs_is_list(tasks))
+        return;
+
+    purge_cur.tasks   = xs_free(purge_cur.tasks);
+    purge_cur.tasks   = xs_dup(tasks);
+    purge_cur.start   = xs_number_get(xs_dict_get(j, "start"));
+    purge_cur.end     = xs_number_get(xs_dict_get(j, "end"));
+    purge_cur.task    = xs_number_get(xs_dict_get(j, "task"));
+    purge_cur.pos     = xs_number_get(xs_dict_get(j, "pos"));
+    purge_cur.last    = xs_free(purge_cur.last);
+    purge_cur.last    = xs_dup(xs_dict_get_def(j, "last", ""));
+    purge_cur.off     = xs_number_get(xs_dict_get(j, "off"));
+    purge_cur.marked  = xs_number_get(xs_dict_get(j, "marked"));
+    purge_cur.checked = xs_number_get(xs_dict_get(j, "checked"));
+    purge_cur.deleted = xs_number_get(xs_dict_get(j, "deleted"));
+    purge_cur.busy    = xs_number_get(xs_dict_get(j, "busy"));
+    purge_cur.slices  = xs_number_get(xs_dict_get(j, "slices"));
+}
+
+
+static void _purge_cur_save(void)
+/* saves the purge cursor */
+{
+    xs *fn  = xs_fmt("%s/purge.json", srv_basedir);
+    xs *nfn = xs_fmt("%s/purge.json.new", srv_basedir);
+    xs *j   = xs_dict_new();
+    FILE *f;
+
+    xs *start   = xs_number_new(purge_cur.start);
+    xs *end     = xs_number_new(purge_cur.end);
+    xs *task    = xs_number_new(purge_cur.task);
+    xs *pos     = xs_number_new(purge_cur.pos);
+    xs *off     = xs_number_new(purge_cur.off);
+    xs *marked  = xs_number_new(purge_cur.marked);
+    xs *checked = xs_number_new(purge_cur.checked);
+    xs *deleted = xs_number_new(purge_cur.deleted);
+    xs *busy    = xs_number_new(purge_cur.busy);
+    xs *slices  = xs_number_new(purge_cur.slices);
+
+    j = xs_dict_append(j, "start",   start);
+    j = xs_dict_append(j, "end",     end);
+    j = xs_dict_append(j, "task",    task);
+    j = xs_dict_append(j, "pos",     pos);
+
+    if (purge_files_task == purge_cur.task && purge_cur.pos > 0)
+        j = xs_dict_append(j, "last", xs_list_get(purge_files, purge_cur.pos - 1));
+
+    j = xs_dict_append(j, "off",     off);
+    j = xs_dict_append(j, "marked",  marked);
+    j = xs_dict_append(j, "checked", checked);
+    j = xs_dict_append(j, "deleted", deleted);
+    j = xs_dict_append(j, "busy",    busy);
+    j = xs_dict_append(j, "slices",  slices);
+    j = xs_dict_append(j, "tasks",   purge_cur.tasks);
+
+    if ((f = fopen(nfn, "w")) != NULL) {
+        xs_json_dump(j, 0, f);
+        fclose(f);
+
+        rename(nfn, fn);
+    }
+}
+
+
+static int _purge_index_step(const char *fn, double deadline)
+/* marks as deleted the entries of an index whose objects are not here,
+   from the cursor offset on; returns 1 when the end is reached */
+{
+    char buf[PURGE_IDX_CHUNK * MD5_HEX_SIZE];
+    int fd;
+
+    if ((fd = open(fn, O_RDWR)) == -1)
+        return 1;
+
+    int binary = _index_is_binary_fd(fd);
+    int rsz    = binary ? BIDX_REC_SIZE : MD5_HEX_SIZE;
+
+    if (binary && purge_cur.off < BIDX_HDR_SIZE)
+        purge_cur.off = BIDX_HDR_SIZE;
+
+    for (;;) {
+        if (ftime() >= deadline) {
+            close(fd);
+            return 0;
+        }
+
+        ssize_t r = pread(fd, buf, PURGE_IDX_CHUNK * rsz, purge_cur.off);
+        int n;
+
+        if (r < rsz)
+            break;
+
+        for (n = 0; n < r / rsz; n++) {
+            const char *rec = buf + n * rsz;
+            char md5[MD5_HEX_SIZE];
+
+            if (binary)
+                _raw_to_md5((const unsigned char *)rec, md5);
+            else {
+                memcpy(md5, rec, MD5_HEX_SIZE - 1);
+                md5[MD5_HEX_SIZE - 1] = '\0';
+            }
+
+            purge_cur.checked++;
+
+            if (md5[0] != '-' && !object_here_by_md5(md5)) {
+                off_t pos = purge_cur.off + n * rsz;
+                char chk[MD5_HEX_SIZE];
+
+                pthread_mutex_t *dm = data_lock(fn);
+
+                /* overwrite it only if it's still there */
+                if (pread(fd, chk, rsz, pos) == rsz && memcmp(chk, rec, rsz) == 0) {
+                    if (binary)
+                        pwrite(fd, bidx_deleted, BIDX_REC_SIZE, pos);
+                    else
+                        pwrite(fd, "-", 1, pos);
+
+                    purge_cur.marked++;
+                    purge_cur.deleted++;
+                }
+
+                pthread_mutex_unlock(dm);
+            }
+        }
+
+        purge_cur.off += (r / rsz) * rsz;
+    }
+
+    close(fd);
+
+    return 1;
+}
+
+
+static int _purge_task_step(const xs_list *task, double deadline)
+/* runs a task of the purge cycle until the deadline; returns 1 if it's done */
+{
+    const char *kind = xs_list_get(task, 0);
+    const char *arg  = xs_list_get(task, 1);
+    int done = 1;
+
+    if (strcmp(kind, "user") == 0) {
+        snac user;
+
+        if (user_open(&user, arg)) {
+            if (strcmp(xs_list_get(task, 2), "pre") == 0) {
+                int priv_days, pub_days;
+
+                _purge_user_days(&user, &priv_days, &pub_days);
+                delete_purged_posts(&user, pub_days);
+            }
+            else {
+                if (xs_is_true(xs_dict_get(srv_config, "purge_static")))
+                    purge_static(&user);
+
+                verify_links(&user);
+            }
+
+            user_free(&user);
+        }
+    }
+    else
+    if (strcmp(kind, "mastoapi") == 0) {
+#ifndef NO_MASTODON_API
+        mastoapi_purge();
+#endif
+    }
+    else {
+        /* tasks over a list of files */
+        if (purge_files_task != purge_cur.task) {
+            purge_files = xs_free(purge_files);
+            purge_files = xs_glob(arg, 0, 0);
+            purge_files_task = purge_cur.task;
+
+            if (purge_cur.pos > 0 && !xs_is_null(purge_cur.last)) {
+                /* resuming after a restart: as files may have been
+                   deleted, continue after the last one done */
+                const char *v;
+
+                purge_cur.pos = 0;
+
+                xs_list_foreach(purge_files, v) {
+                    if (strcmp(v, purge_cur.last) > 0)
+                        break;
+
+                    purge_cur.pos++;
+                }
+            }
+        }
+
+        int len = xs_list_len(purge_files);
+        int num = xs_number_get(xs_list_get(task, 2));
+        time_t mt = time(NULL) - (strcmp(kind, "objects") == 0 ? 7 : num) * 24 * 3600;
+
+        while (purge_cur.pos < len) {
+            const char *fn = xs_list_get(purge_files, purge_cur.pos);
+
+            if (strcmp(kind, "files") == 0) {
+                purge_cur.checked++;
+                purge_cur.deleted += _purge_file(fn, mt);
+            }
+            else
+            if (strcmp(kind, "objects") == 0) {
+                purge_cur.checked++;
+                purge_cur.deleted += _purge_object_file(fn, mt) != 0;
+            }
+            else
+            if (strcmp(kind, "index") == 0) {
+                if (!_purge_index_step(fn, deadline))
+                    break;
+
+                /* drop the marked entries */
+                if (purge_cur.marked)
+                    _index_rewrite(fn, -1, 0);
+
+                srv_debug(1, xs_fmt("purge: %s %d", fn, purge_cur.marked));
+
+                /* tag index? */
+                if (num)
+                    _purge_tag_index_cleanup(fn);
+
+                purge_cur.off    = 0;
+                purge_cur.marked = 0;
+            }
+
+            purge_cur.pos++;
+
+            if (ftime() >= deadline)
+                break;
+        }
+
+        done = purge_cur.pos >= len;
+    }
+
+    return done;
+}
+
+
+int purge_step(void)
+/* runs a slice of the incremental purge; returns 1 if a cycle was finished */
+{
+    int ret = 0;
+
+    /* another slice still running? */
+    if (pthread_mutex_trylock(&purge_mutex) != 0)
+        return 0;
+
+    int slice_ms = xs_number_get(xs_dict_get_def(srv_config, "purge_slice_ms", "500"));
+    double t = ftime();
+    double deadline = t + (slice_ms > 0 ? slice_ms : 500) / 1000.0;
+    time_t now = time(NULL);
+
+    if (!purge_cur.loaded)
+        _purge_cur_load();
+
+    if (purge_cur.tasks == NULL ||
+        (purge_cur.end && now > purge_cur.start + 24 * 60 * 60)) {
+        /* start a new cycle */
+        purge_cur.tasks = xs_free(purge_cur.tasks);
+        purge_cur.tasks = _purge_tasks();
+        purge_cur.start = now;
+        purge_cur.end   = 0;
+        purge_cur.task  = purge_cur.pos = purge_cur.off = purge_cur.marked = 0;
+        purge_cur.checked = purge_cur.deleted = purge_cur.slices = 0;
+        purge_cur.busy  = 0.0;
+
+        purge_files_task = -1;
+
+        srv_log(xs_fmt("purge: cycle start (%d tasks)", xs_list_len(purge_cur.tasks)));
+    }
+
+    int n_tasks = xs_list_len(purge_cur.tasks);
+
+    if (purge_cur.end == 0) {
+        while (purge_cur.task < n_tasks && ftime() < deadline) {
+            if (_purge_task_step(xs_list_get(purge_cur.tasks, purge_cur.task), deadline)) {
+                purge_cur.task++;
+                purge_cur.pos = purge_cur.off = purge_cur.marked = 0;
+            }
+        }
+
+        purge_cur.busy += ftime() - t;
+        purge_cur.slices++;
+
+        if (purge_cur.task >= n_tasks) {
+            purge_cur.end = time(NULL);
+            purge_files = xs_free(purge_files);
+            purge_files_task = -1;
+
+            srv_log(xs_fmt("purge: cycle end (%d checked, %d deleted, %.1f s in %d slices)",
+                purge_cur.checked, purge_cur.deleted, purge_cur.busy, purge_cur.slices));
+
+            ret = 1;
+        }
+
+        _purge_cur_save();
+    }
+
+    if (p_state != NULL) {
+        p_state->purge_start   = purge_cur.start;
+        p_state->purge_end     = purge_cur.end;
+        p_state->purge_tasks   = n_tasks;
+        p_state->purge_task    = purge_cur.task;
+        p_state->purge_checked = purge_cur.checked;
+        p_state->purge_deleted = purge_cur.deleted;
+        p_state->purge_busy_ms = (int)(purge_cur.busy * 1000);
+        p_state->purge_slices  = purge_cur.slices;
+    }
+
+    pthread_mutex_unlock(&purge_mutex);
+
+    return ret;
+}
+
+
 /** archive **/
 
 void srv_archive(const char *direction, const char *url, xs_dict *req,
@@ -4786,7 +7457,7 @@ int _badlogin_read(const char *fn, int *failures)
     int ok = 0;
     FILE *f;
 
-    pthread_mutex_lock(&data_mutex);
+    pthread_mutex_t *dm = data_lock(fn);
 
     if ((f = fopen(fn, "r")) != NULL) {
         xs *l = xs_readline(f);
@@ -4796,7 +7467,7 @@ int _badlogin_read(const char *fn, int *failures)
             ok = 1;
     }
 
-    pthread_mutex_unlock(&data_mutex);
+    pthread_mutex_unlock(dm);
 
     return ok;
 }
@@ -4856,7 +7527,7 @@ void badlogin_inc(const char *user, const char *addr)
 
         _badlogin_read(fn, &failures);
 
-        pthread_mutex_lock(&data_mutex);
+        pthread_mutex_t *dm = data_lock(fn);
 
         if ((f = fopen(fn, "w")) != NULL) {
             failures++;
@@ -4867,7 +7538,7 @@ void badlogin_inc(const char *user, const char *addr)
             srv_log(xs_fmt("Registered %d login failure(s) from %s for %s", failures, addr, user));
         }
 
-        pthread_mutex_unlock(&data_mutex);
+        pthread_mutex_unlock(dm);
     }
 }
 
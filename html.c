@@ -17,9 +17,12 @@
 #include "xs_random.h"
 #include "xs_http.h"
 #include "xs_list_tools.h"
+#include "xs_httpd.h"
 
 #include "snac.h"
 
+#include <pthread.h>
+
 int login(snac *user, const xs_dict *headers)
 /* tries a login */
 {
@@ -768,9 +771,13 @@ xs_html *html_note(snac *user, const char *summary,
 
     /* fields for the currently existing attachments */
     if (xs_is_list(att_files) && xs_is_list(att_alt_texts)) {
-        while (att_n < max_attachments) {
-            const char *att_file = xs_list_get(att_files, att_n);
-            const char *att_alt_text = xs_list_get(att_alt_texts, att_n);
+        const char *att_file;
+        const char *att_alt_text;
+        int c1 = 0, c2 = 0;
+
+        while (att_n < max_attachments &&
+               xs_list_next(att_files, &att_file, &c1) &&
+               xs_list_next(att_alt_texts, &att_alt_text, &c2)) {
 
             if (!xs_is_string(att_file) || !xs_is_string(att_alt_text))
                 break;
@@ -2307,1014 +2314,1234 @@ static const xs_str* words_in_content(const xs_list *words, const xs_val *conten
 }
 
 
-xs_html *html_entry(snac *user, xs_dict *msg, int read_only,
-                   int level, const char *md5, int hide_children)
+static xs_list *html_entry_fragments(snac *user, const xs_dict *msg, const char *proxy)
+/* renders the parts of an entry that only depend on the object: the
+   content string, the attachments, and the audience, location, time
+   and hashtags. Returns a list of three HTML strings */
 {
-    const char *id    = xs_dict_get(msg, "id");
-    const char *type  = xs_dict_get(msg, "type");
-    const char *actor;
-    const char *v;
-    int has_title = 0;
-    int collapse_threads = 0;
-    const char *proxy = NULL;
-
-    if (user && !read_only && xs_is_true(xs_dict_get(srv_config, "proxy_media")))
-        proxy = user->actor;
+    const char *type = xs_dict_get(msg, "type");
+    xs_list *frags = xs_list_new();
 
-    /* do not show non-public messages in the public timeline */
-    if ((read_only || !user) && !is_msg_public(msg))
-        return NULL;
+    {
+        /** the content string **/
+        const char *content = xs_dict_get(msg, "content");
 
-    if (id && is_instance_blocked(id))
-        return NULL;
+        if (xs_type(content) != XSTYPE_STRING) {
+            if (!xs_is_null(content))
+                srv_archive_error("unexpected_content_xstype",
+                    "content field type", xs_stock(XSTYPE_DICT), msg);
 
-    if (user && level == 0 && xs_is_true(xs_dict_get(user->config, "collapse_threads")))
-        collapse_threads = 1;
+            content = "";
+        }
 
-    /* hidden? do nothing more for this conversation */
-    if (user && is_hidden(user, id)) {
-        xs *s1 = xs_fmt("%s_entry", md5);
+        /* skip ugly line breaks at the beginning */
+        while (xs_startswith(content, "<br>"))
+            content += 4;
 
-        /* return just an dummy anchor, to keep position after hitting 'Hide' */
-        return xs_html_tag("div",
-            xs_html_tag("a",
-                xs_html_attr("name", s1)));
-    }
+        xs *c = sanitize(content);
 
-    /* avoid too deep nesting, as it may be a loop */
-    if (level >= MAX_CONVERSATION_LEVELS)
-        return xs_html_tag("mark",
-            xs_html_text(L("Truncated (too deep)")));
+        /* do some tweaks to the content */
+        c = xs_replace_i(c, "\r", "");
 
-    const char *lang = NULL;
-    const xs_dict *cmap = xs_dict_get(msg, "contentMap");
-    if (xs_is_dict(cmap)) {
-        const char *dummy;
-        int c = 0;
+        while (xs_endswith(c, "<br><br>"))
+            c = xs_crop_i(c, 0, -4);
 
-        xs_dict_next(cmap, &lang, &dummy, &c);
+        c = xs_replace_i(c, "<br><br>", "<p>");
 
-        if (user && xs_is_string(lang)) {
-            /* discard posts in excluded languages */
-            const char *excluded_langs = xs_dict_get(user->config, "excluded_langs");
+        /* replace the :shortnames: */
+        c = replace_shortnames(c, xs_dict_get(msg, "tag"), 2, proxy);
 
-            if (xs_is_string(excluded_langs) &&
-                xs_str_in(excluded_langs, lang) != -1) {
-                snac_debug(user, 1, xs_fmt("excluded post in language '%s'", lang));
-                return NULL;
-            }
+        /* Peertube videos content is in markdown */
+        const char *mtype = xs_dict_get(msg, "mediaType");
+        if (xs_type(mtype) == XSTYPE_STRING && strcmp(mtype, "text/markdown") == 0) {
+            /* a full conversion could be better */
+            c = xs_replace_i(c, "\r", "");
+            c = xs_replace_i(c, "\n", "<br>");
         }
-    }
 
-    if (strcmp(type, "Follow") == 0) {
-        return xs_html_tag("div",
-            xs_html_attr("class", "snac-post"),
-            xs_html_tag("div",
-                xs_html_attr("class", "snac-post-header"),
-                xs_html_tag("div",
-                    xs_html_attr("class", "snac-origin"),
-                    xs_html_text(L("follows you"))),
-                html_msg_icon(read_only ? NULL : user, xs_dict_get(msg, "actor"), msg, proxy, NULL, lang)));
-    }
-    else
-    if (!xs_match(type, POSTLIKE_OBJECT_TYPE)) {
-        /* skip oddities */
-        snac_debug(user, 1, xs_fmt("html_entry: ignoring object type '%s' %s", type, id));
-        return NULL;
+        /* c contains sanitized HTML */
+        frags = xs_list_append(frags, c);
     }
 
-    /* ignore notes with "name", as they are votes to Questions */
-    if (strcmp(type, "Note") == 0 && !xs_is_null(xs_dict_get(msg, "name")))
-        return NULL;
+    /** attachments **/
+    xs *attach = get_attachments(msg);
 
-    /* get the attributedTo */
-    if ((actor = get_atto(msg)) == NULL)
-        return NULL;
+    {
+        /* make custom css for attachments easier */
+        xs_html *content_attachments = xs_html_tag("div",
+            xs_html_attr("class", "snac-content-attachments"));
 
-    /* ignore muted morons immediately */
-    if (user && is_muted(user, actor)) {
-        xs *s1 = xs_fmt("%s_entry", md5);
+        const char *content = xs_dict_get(msg, "content");
 
-        /* return just an dummy anchor, to keep position after hitting 'MUTE' */
-        return xs_html_tag("div",
-            xs_html_tag("a",
-                xs_html_attr("name", s1)));
-    }
+        int c = 0;
+        const xs_dict *a;
+        while (xs_list_next(attach, &a, &c)) {
+            const char *type = xs_dict_get(a, "type");
+            const char *o_href = xs_dict_get(a, "href");
+            const char *name = xs_dict_get(a, "name");
 
-    /* don't show followers-only notes from not followed users */
-    if (user && get_msg_visibility(msg) == SCOPE_FOLLOWERS &&
-        strcmp(user->actor, actor) != 0 && following_check(user, actor) == 0) {
-        return NULL;
-    }
+            if (!xs_is_string(type) || !xs_is_string(o_href))
+                continue;
 
-    if ((user == NULL || strcmp(actor, user->actor) != 0)
-        && !valid_status(actor_get(actor, NULL))) {
+            /* if this URL is already in the post content, skip */
+            if (content && xs_str_in(content, o_href) != -1)
+                continue;
 
-        if (user)
-            enqueue_actor_refresh(user, actor, 0);
+            if (strcmp(type, "image/svg+xml") == 0 && !xs_is_true(xs_dict_get(srv_config, "enable_svg")))
+                continue;
 
-        return NULL;
-    }
+            /* do this attachment include an icon? */
+            const xs_dict *icon = xs_dict_get(a, "icon");
+            if (xs_type(icon) == XSTYPE_DICT) {
+                const char *icon_mtype = xs_dict_get(icon, "mediaType");
+                const char *icon_url   = xs_dict_get(icon, "url");
 
-    /** html_entry top tag **/
-    xs_html *entry_top = xs_html_tag("div", NULL);
+                if (icon_mtype && icon_url && xs_startswith(icon_mtype, "image/")) {
+                    xs_html_add(content_attachments,
+                        xs_html_tag("a",
+                            xs_html_attr("href", icon_url),
+                            xs_html_attr("target", "_blank"),
+                            xs_html_sctag("img",
+                                xs_html_attr("loading", "lazy"),
+                                xs_html_attr("src", icon_url))));
+                }
+            }
 
-    {
-        xs *s1 = xs_fmt("%s_entry", md5);
-        xs_html_add(entry_top,
-            xs_html_tag("a",
-                xs_html_attr("name", s1)));
-    }
+            xs *href = make_url(o_href, proxy, 0);
 
-    xs_html *entry = xs_html_tag("div",
-        xs_html_attr("class", level == 0 ? "snac-post" : "snac-child"));
+            if (xs_startswith(type, "image/") || strcmp(type, "Image") == 0) {
+                xs_html_add(content_attachments,
+                    xs_html_tag("a",
+                        xs_html_attr("href", href),
+                        xs_html_attr("target", "_blank"),
+                        xs_html_sctag("img",
+                            xs_html_attr("loading", "lazy"),
+                            xs_html_attr("src", href),
+                            xs_html_attr("alt", name),
+                            xs_html_attr("title", name))));
+            }
+            else
+            if (xs_startswith(type, "video/") || strcmp(type, "Video") == 0) {
+                xs_html_add(content_attachments,
+                    xs_html_tag("video",
+                        xs_html_attr("preload", "none"),
+                        xs_html_attr("style", "width: 100%"),
+                        xs_html_attr("class", "snac-embedded-video"),
+                        xs_html_attr("controls", NULL),
+                        xs_html_attr("src", href),
+                        xs_html_text(L("Video")),
+                        xs_html_text(": "),
+                        xs_html_tag("a",
+                            xs_html_attr("href", href),
+                            xs_html_text(name))));
+            }
+            else
+            if (xs_startswith(type, "audio/")) {
+                xs_html_add(content_attachments,
+                    xs_html_tag("audio",
+                        xs_html_attr("preload", "none"),
+                        xs_html_attr("style", "width: 100%"),
+                        xs_html_attr("class", "snac-embedded-audio"),
+                        xs_html_attr("controls", NULL),
+                        xs_html_attr("src", href),
+                        xs_html_text(L("Audio")),
+                        xs_html_text(": "),
+                        xs_html_tag("a",
+                            xs_html_attr("href", href),
+                            xs_html_text(name))));
+            }
+            else
+            if (strcmp(type, "Link") == 0) {
+                xs_html_add(content_attachments,
+                    xs_html_tag("p",
+                        xs_html_tag("a",
+                            xs_html_attr("href", o_href),
+                            xs_html_text(href))));
 
-    xs_html_add(entry_top,
-        entry);
+                /* do not generate an Alt... */
+                name = NULL;
+            }
+            else {
+                xs *d_href = xs_dup(o_href);
+                if (strlen(d_href) > 64) {
+                    d_href[64] = '\0';
+                    d_href = xs_str_cat(d_href, "...");
+                }
 
-    /** post header **/
+                xs_html_add(content_attachments,
+                    xs_html_tag("p",
+                        xs_html_tag("a",
+                            xs_html_attr("href", o_href),
+                            xs_html_text(L("Attachment")),
+                            xs_html_text(": "),
+                            xs_html_text(d_href))));
 
-    xs_html *score;
-    xs_html *post_header = xs_html_tag("div",
-        xs_html_attr("class", "snac-post-header"),
-        score = xs_html_tag("div",
-            xs_html_attr("class", "snac-score")));
+                /* do not generate an Alt... */
+                name = NULL;
+            }
 
-    xs_html_add(entry,
-        post_header);
+            if (name != NULL && *name) {
+                xs_html_add(content_attachments,
+                    xs_html_tag("p",
+                        xs_html_attr("class", "snac-alt-text"),
+                        xs_html_tag("details",
+                            xs_html_tag("summary",
+                                xs_html_text(L("Alt..."))),
+                            xs_html_text(name))));
+            }
+        }
 
-    if (user && is_pinned(user, id)) {
-        /* add a pin emoji */
-        xs_html_add(score,
-            xs_html_tag("span",
-                xs_html_attr("title", L("Pinned")),
-                xs_html_raw(" &#128204; ")));
+        xs *s = xs_html_render(content_attachments);
+        frags = xs_list_append(frags, s);
     }
 
-    if (user && !read_only && is_bookmarked(user, id)) {
-        /* add a bookmark emoji */
-        xs_html_add(score,
-            xs_html_tag("span",
-                xs_html_attr("title", L("Bookmarked")),
-                xs_html_raw(" &#128278; ")));
+    xs_html *extras = xs_html_container(NULL);
+
+    /* has this message an audience (i.e., comes from a channel or community)? */
+    const char *audience = xs_dict_get(msg, "audience");
+    if (strcmp(type, "Page") == 0 && !xs_is_null(audience)) {
+        xs_html *au_tag = xs_html_tag("p",
+            xs_html_text("("),
+            xs_html_tag("a",
+                xs_html_attr("href", audience),
+                xs_html_attr("title", L("Source channel or community")),
+                xs_html_text(audience)),
+            xs_html_text(")"));
+
+        xs_html_add(extras,
+            au_tag);
     }
 
-    if (strcmp(type, "Question") == 0) {
-        /* add the ballot box emoji */
-        xs_html_add(score,
-            xs_html_tag("span",
-                xs_html_attr("title", L("Poll")),
-                xs_html_raw(" &#128499; ")));
+    /* does it have a location? */
+    const xs_dict *location = xs_dict_get(msg, "location");
+    if (xs_type(location) == XSTYPE_DICT) {
+        const xs_number *latitude = xs_dict_get(location, "latitude");
+        const xs_number *longitude = xs_dict_get(location, "longitude");
+        const char *name = xs_dict_get(location, "name");
+        const char *address = xs_dict_get(location, "address");
+        xs *label_list = xs_list_new();
 
-        if (user && was_question_voted(user, id)) {
-            /* add a check to show this poll was voted */
-            xs_html_add(score,
-                xs_html_tag("span",
-                    xs_html_attr("title", L("Voted")),
-                    xs_html_raw(" &#10003; ")));
+        if (xs_type(name) == XSTYPE_STRING)
+            label_list = xs_list_append(label_list, name);
+        if (xs_type(address) == XSTYPE_STRING)
+            label_list = xs_list_append(label_list, address);
+
+        if (xs_list_len(label_list)) {
+            const char *url = xs_dict_get(location, "url");
+            xs *label = xs_join(label_list, ", ");
+
+            if (xs_type(url) == XSTYPE_STRING) {
+                xs_html_add(extras,
+                    xs_html_tag("p",
+                        xs_html_text(L("Location: ")),
+                        xs_html_tag("a",
+                            xs_html_attr("href", url),
+                            xs_html_attr("target", "_blank"),
+                            xs_html_text(label))));
+            }
+            else
+            if (!xs_is_null(latitude) && !xs_is_null(longitude)) {
+                xs *url = xs_fmt("https://openstreetmap.org/search/?query=%s,%s",
+                    xs_or(xs_number_str(latitude), latitude), xs_or(xs_number_str(longitude), longitude));
+
+                xs_html_add(extras,
+                    xs_html_tag("p",
+                        xs_html_text(L("Location: ")),
+                        xs_html_tag("a",
+                            xs_html_attr("href", url),
+                            xs_html_attr("target", "_blank"),
+                            xs_html_text(label))));
+            }
+            else
+                xs_html_add(extras,
+                    xs_html_tag("p",
+                        xs_html_text(L("Location: ")),
+                        xs_html_text(label)));
         }
     }
 
-    if (strcmp(type, "Event") == 0) {
-        /* add the calendar emoji */
-        xs_html_add(score,
-            xs_html_tag("span",
-                xs_html_attr("title", L("Event")),
-                xs_html_raw(" &#128197; ")));
-    }
+    if (strcmp(type, "Event") == 0) { /** Event start and end times **/
+        const char *s_time = xs_dict_get(msg, "startTime");
 
-    /* if it's a user from this same instance, add the score */
-    if (xs_startswith(id, srv_baseurl)) {
-        int n_likes  = object_likes_len(id);
-        int n_boosts = object_announces_len(id);
+        if (xs_is_string(s_time) && strlen(s_time) > 20) {
+            const char *e_time = xs_dict_get(msg, "endTime");
+            const char *tz     = xs_dict_get(msg, "timezone");
 
-        /* alternate emojis: %d &#128077; %d &#128257; */
-        xs *s1 = xs_fmt("%d &#9733; %d &#8634;\n", n_likes, n_boosts);
+            xs *s = xs_replace_i(xs_dup(s_time), "T", " ");
+            xs *e = NULL;
 
-        xs_html_add(score,
-            xs_html_raw(s1));
-    }
+            if (xs_is_string(e_time) && strlen(e_time) > 20)
+                e = xs_replace_i(xs_dup(e_time), "T", " ");
 
-    xs *boosts = object_announces(id);
+            /* if the event has a timezone, crop the offsets */
+            if (xs_is_string(tz)) {
+                s = xs_crop_i(s, 0, 19);
 
-    if (xs_list_len(boosts)) {
-        /* if somebody boosted this, show as origin */
-        const char *p = xs_list_get(boosts, -1);
-        xs *actor_r = NULL;
+                if (e)
+                    e = xs_crop_i(e, 0, 19);
+            }
+            else
+                tz = "";
 
-        if (user && xs_list_in(boosts, user->md5) != -1) {
-            /* we boosted this */
-            xs_html_add(post_header,
-                xs_html_tag("div",
-                    xs_html_attr("class", "snac-origin"),
-                    xs_html_tag("a",
-                        xs_html_attr("href", user->actor),
-                        xs_html_text(xs_dict_get(user->config, "name"))),
-                        xs_html_text(" "),
-                        xs_html_text(L("boosted"))));
-        }
-        else
-        if (valid_status(object_get_by_md5(p, &actor_r))) {
-            xs *name = actor_name(actor_r, proxy);
+            /* if start and end share the same day, crop it from the end */
+            if (e && memcmp(s, e, 11) == 0)
+                e = xs_crop_i(e, 11, 0);
 
-            if (!xs_is_null(name)) {
-                xs *href = NULL;
-                const char *id = xs_dict_get(actor_r, "id");
-                int fwers = 0;
-                int fwing = 0;
+            if (e)
+                s = xs_str_cat(s, " / ", e);
 
-                if (user != NULL) {
-                    fwers = follower_check(user, id);
-                    fwing = following_check(user, id);
-                }
+            if (*tz)
+                s = xs_str_cat(s, " (", tz, ")");
 
-                if (!read_only && (fwers || fwing))
-                    href = xs_fmt("%s/people/%s", user->actor, p);
-                else
-                    href = xs_dup(id);
+            /* replace ugly decimals */
+            s = xs_replace_i(s, ".000", "");
 
-                xs_html_add(post_header,
-                    xs_html_tag("div",
-                        xs_html_attr("class", "snac-origin"),
-                        xs_html_tag("a",
-                            xs_html_attr("href", href),
-                            xs_html_raw(name)), /* already sanitized */
-                            xs_html_text(" "),
-                            xs_html_text(L("boosted"))));
-            }
+            xs_html_add(extras,
+                xs_html_tag("p",
+                    xs_html_text(L("Time: ")),
+                    xs_html_text(s)));
         }
     }
 
-    if (user && strcmp(type, "Note") == 0) {
-        /* is the parent not here? */
-        const char *parent = get_in_reply_to(msg);
+    /* show all hashtags that has not been shown previously in the content */
+    const xs_list *tags = xs_dict_get(msg, "tag");
+    const char *o_content = xs_dict_get_def(msg, "content", "");
 
-        if (!xs_is_null(parent) && *parent) {
-            if (!timeline_here(user, parent)) {
-                xs_html_add(post_header,
-                    xs_html_tag("div",
-                        xs_html_attr("class", "snac-origin"),
-                        xs_html_text(L("in reply to")),
-                        xs_html_text(" "),
-                        xs_html_tag("a",
-                            xs_html_attr("href", parent),
-                            xs_html_text("»"))));
+    if (xs_is_string(o_content) && xs_is_list(tags) && xs_list_len(tags)) {
+        xs *content = xs_utf8_to_lower(o_content);
+        const xs_dict *tag;
+
+        xs_html *add_hashtags = xs_html_tag("ul",
+            xs_html_attr("class", "snac-more-hashtags"));
+
+        xs_list_foreach(tags, tag) {
+            const char *type = xs_dict_get(tag, "type");
+
+            if (xs_is_string(type) && strcmp(type, "Hashtag") == 0) {
+                const char *o_href = xs_dict_get(tag, "href");
+                const char *name   = xs_dict_get(tag, "name");
+
+                if (xs_is_string(o_href) && xs_is_string(name)) {
+                    xs *href = xs_utf8_to_lower(o_href);
+
+                    if (xs_str_in(content, href) == -1 && xs_str_in(content, name) == -1) {
+                        /* not in the content: add here */
+                        xs_html_add(add_hashtags,
+                            xs_html_tag("li",
+                                xs_html_tag("a",
+                                    xs_html_attr("href", href),
+                                    xs_html_text(name),
+                                    xs_html_text(" "))));
+                    }
+                }
             }
         }
+
+        xs_html_add(extras,
+            add_hashtags);
     }
 
-    xs_html_add(post_header,
-        html_msg_icon(read_only ? NULL : user, actor, msg, proxy, md5, lang));
+    xs *s = xs_html_render(extras);
+    frags = xs_list_append(frags, s);
 
-    /** post content **/
+    return frags;
+}
 
-    xs_html *snac_content_wrap = xs_html_tag("div",
-        xs_html_attr("class", "e-content snac-content"));
 
-    if (xs_is_string(lang))
-        xs_html_add(snac_content_wrap,
-            xs_html_attr("lang", lang));
+/** entry fragment cache **/
 
-    xs_html_add(entry,
-        snac_content_wrap);
+/* A bounded LRU of the object-dependent parts of rendered entries
+   (see html_entry_fragments()), keyed by the object md5, the language
+   and the media proxy, and validated against a hash of the object
+   data, so that edited posts are rendered again. The budget is set
+   in megabytes with "entry_cache_mb" (0 disables it) */
 
-    if (!has_title && !xs_is_null(v = xs_dict_get(msg, "name"))) {
-        xs_html_add(snac_content_wrap,
-            xs_html_tag("h3",
-                xs_html_attr("class", "snac-entry-title"),
-                xs_html_text(v)));
+#define FRAG_CACHE_BUCKETS 4096
 
-        has_title = 1;
-    }
+typedef struct frag_cache_ent {
+    struct frag_cache_ent *prev;    /* LRU list (most recent first) */
+    struct frag_cache_ent *next;
+    struct frag_cache_ent *h_next;  /* hash chain */
+    xs_str *key;
+    uint64_t hash;
+    xs_list *frags;
+    int f_size;
+} frag_cache_ent;
 
-    xs_html *snac_content = NULL;
+static frag_cache_ent *frag_cache_buckets[FRAG_CACHE_BUCKETS];
+static frag_cache_ent *frag_cache_first = NULL;
+static frag_cache_ent *frag_cache_last  = NULL;
+static long frag_cache_bytes = 0;
+static long frag_cache_budget = -1;
+static pthread_mutex_t frag_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-    v = xs_dict_get(msg, "summary");
 
-    /* if it has summary or marked as sensitive - add CW */
-    /* come clients don't set "sensitive" flag properly */
-    if ((!xs_is_null(v) && *v) || xs_type(xs_dict_get(msg, "sensitive")) == XSTYPE_TRUE) {
-        if (xs_is_null(v) || *v == '\0')
-            v = "...";
+static frag_cache_ent **_frag_cache_slot(const char *key)
+/* returns the hash chain slot where a key is (or would be) */
+{
+    frag_cache_ent **e = &frag_cache_buckets[xs_hash_func(key, strlen(key)) % FRAG_CACHE_BUCKETS];
 
-        const char *cw = "";
+    while (*e && strcmp((*e)->key, key) != 0)
+        e = &(*e)->h_next;
 
-        if (user) {
-            /* only show it when not in the public timeline and the config setting is "open" */
-            cw = xs_dict_get(user->config, "cw");
-            if (xs_is_null(cw) || read_only)
-                cw = "";
-        }
+    return e;
+}
 
-        /* summary can't contain HTML */
-        xs *s1 = xs_regex_replace(v, "<[^>]+>", "");
 
-        /* crop stupidly long summaries */
-        if (xs_utf8_len(s1) > 1024) {
-            s1 = xs_utf8_crop_i(s1, 0, 1024);
-            s1 = xs_str_cat(s1, "...");
-        }
+static void _frag_cache_unlink(frag_cache_ent *e)
+/* removes an entry from the LRU list */
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        frag_cache_first = e->next;
 
-        snac_content = xs_html_tag("details",
-            xs_html_attr(cw, NULL),
-            xs_html_tag("summary",
-                xs_html_text(s1),
-                xs_html_text(L(" [SENSITIVE CONTENT]"))));
-    }
+    if (e->next)
+        e->next->prev = e->prev;
     else
-    if (user &&
-        /* muted_words is all lowercase and sorted for performance */
-        (v = words_in_content(xs_dict_get(user->config, "muted_words"),
-                              xs_dict_get(msg, "content"))) != NULL) {
-        snac_debug(user, 1, xs_fmt("word %s muted by user preferences: %s", v, id));
-        snac_content = xs_html_tag("details",
-            xs_html_tag("summary",
-                xs_html_text(L("Muted: ")),
-                xs_html_text(v)));
-    }
-    else {
-        snac_content = xs_html_tag("div", NULL);
-    }
+        frag_cache_last = e->prev;
+}
 
-    xs_html_add(snac_content_wrap,
-        snac_content);
 
-    /* add all emoji reacts */
-    int is_emoji = 0;
-    if (!xs_is_true(xs_dict_get(srv_config, "disable_emojireact"))) {
-        int c = 0;
-        const xs_dict *k;
-        xs *ls = xs_list_new();
-        xs *sfrl = xs_dict_new();
-        xs *rl = object_get_emoji_reacts(id);
+static void _frag_cache_drop(frag_cache_ent **slot)
+/* deletes the entry in a hash chain slot */
+{
+    frag_cache_ent *e = *slot;
 
-        while (xs_list_next(rl, &v, &c)) {
-            xs *m = NULL;
-            if (valid_status(object_get_by_md5(v, &m))) {
-                const char *content = xs_dict_get(m, "content");
-                const char *actor = xs_dict_get(m, "actor");
-                const xs_list *contentl = xs_dict_get(sfrl, content);
+    *slot = e->h_next;
+    _frag_cache_unlink(e);
 
-                if ((user && is_muted(user, actor)) || is_instance_blocked(actor))
-                    continue;
+    frag_cache_bytes -= e->f_size;
 
-                xs *actors = xs_list_new();
-                actors = xs_list_append(actors, actor);
-                char me = actor && user && strcmp(actor, user->actor) == 0;
-                int count = 1;
+    xs_free(e->key);
+    xs_free(e->frags);
+    xs_free(e);
+}
 
-                if (contentl) {
-                    count = atoi(xs_list_get(contentl, 0)) + 1;
-                    const xs_list *actorsc = xs_list_get(contentl, 1);
-                    if (strncmp(xs_list_get(contentl, 2), "1", 1) == 0)
-                        me = 1;
 
-                    if (xs_list_in(actorsc, actor) != -1) {
-                        xs_free(actors);
-                        actors = xs_dup(actorsc);
-                    }
-                    else
-                        actors = xs_list_cat(actors, actorsc);
-                }
+static xs_list *_frag_cache_get(const char *key, uint64_t hash)
+/* returns a copy of cached fragments, if they are still valid */
+{
+    xs_list *frags = NULL;
 
-                xs *fl = xs_list_new();
-                xs *c1 = xs_fmt("%d", count);
-                xs *c2 = xs_fmt("%d", me);
-                fl = xs_list_append(fl, c1, actors, c2);
-                sfrl = xs_dict_append(sfrl, content, fl);
-            }
-        }
+    pthread_mutex_lock(&frag_cache_mutex);
 
-        c = 0;
+    frag_cache_ent **slot = _frag_cache_slot(key);
+    frag_cache_ent *e = *slot;
 
-        while (xs_list_next(rl, &k, &c)) {
-            xs *m = NULL;
-            if (valid_status(object_get_by_md5(k, &m))) {
-                const xs_dict *tag = xs_dict_get(m, "tag");
-                const xs_dict *ide = xs_dict_get(m, "id");
+    if (e != NULL) {
+        if (e->hash == hash) {
+            frags = xs_dup(e->frags);
 
-                const char *content = xs_dict_get(m, "content");
-                const char *shortname;
-                shortname = xs_dict_get(m, "content");
+            /* move to the front */
+            _frag_cache_unlink(e);
 
-                const xs_list *items = xs_dict_get(sfrl, content);
+            e->prev = NULL;
+            e->next = frag_cache_first;
 
-                if (!xs_is_null(items)) {
-                    const char *nb = xs_list_get(items, 0);
-                    const xs_list *actors = xs_list_get(items, 1);
-                    const char me = *xs_list_get(items, 2) == '1';
+            if (frag_cache_first)
+                frag_cache_first->prev = e;
+            else
+                frag_cache_last = e;
 
-                    is_emoji = 1;
+            frag_cache_first = e;
+        }
+        else
+            _frag_cache_drop(slot);
+    }
 
-                    xs *al = xs_join(actors, ",\n\t");
-                    xs *act = atoi(nb) > 1 ?
-                        xs_fmt("%d different actors \n\t%s", atoi(nb), al) :
-                        xs_dup(xs_dict_get(m, "actor"));
+    /* (the server state is not available in command line tools) */
+    if (p_state != NULL) {
+        if (frags)
+            p_state->entry_cache_hits++;
+        else
+            p_state->entry_cache_misses++;
+    }
 
-                    xs *class = xs_list_new();
-                    class = xs_list_append(class, "snac-reaction");
+    pthread_mutex_unlock(&frag_cache_mutex);
 
-                    xs_html *ret = NULL;
-                    if (tag && shortname) {
-                        xs *cl = xs_list_new();
-                        cl = xs_list_append(cl, "snac-reaction-image");
-                        xs *emoji = _replace_shortnames(xs_dup(shortname), tag, 2, proxy, cl, act);
+    return frags;
+}
 
-                        emoji = xs_strip_chars_i(emoji, ":");
 
-                        if (me)
-                            class = xs_list_append(class, "snac-reacted");
+static void _frag_cache_put(const char *key, uint64_t hash, const xs_list *frags)
+/* stores a copy of the fragments in the cache */
+{
+    pthread_mutex_lock(&frag_cache_mutex);
 
-                        xs *l1 = xs_join(class, " ");
-                        ret = xs_html_tag("button",
-                                xs_html_attr("type", "submit"),
-                                xs_html_attr("name", "action"),
-                                xs_html_attr("value", me ? L("EmojiReact") : L("EmojiUnreact")),
-                                xs_html_raw(emoji),
-                                xs_html_tag("span",
-                                    xs_html_raw(nb),
-                                    xs_html_attr("style", "padding-left: 5px;")),
-                                xs_html_attr("title", act),
-                                xs_html_attr("class", l1));
+    if (frag_cache_budget == -1)
+        frag_cache_budget = 1024 * 1024 *
+            xs_number_get(xs_dict_get_def(srv_config, "entry_cache_mb", "8"));
 
-                        if (!(ide && xs_startswith(ide, srv_baseurl)))
-                            xs_html_add(ret, xs_html_attr("disabled", "true"));
-                    }
-                    else if (shortname) {
-                        xs *sn = xs_dup(shortname);
-                        const char *sna = sn;
-                        unsigned int utf = xs_utf8_dec((const char **)&sna);
+    int f_size = xs_size(frags) + strlen(key);
 
-                        if (xs_is_emoji(utf)) {
-                            const char *style = "font-size: large;";
-                            if (me)
-                                class = xs_list_append(class, "snac-reacted");
-                            xs *l1 = xs_join(class, " ");
-                            xs *s1 = xs_fmt("&#%d", utf);
-                            ret = xs_html_tag("button",
-                                    xs_html_attr("type", "submit"),
-                                    xs_html_attr("name", "action"),
-                                    xs_html_attr("value", me ? L("EmojiUnreact") : L("EmojiReact")),
-                                    xs_html_raw(s1),
-                                    xs_html_tag("span",
-                                        xs_html_raw(nb),
-                                        xs_html_attr("style", "font-size: initial; padding-left: 5px;")),
-                                    xs_html_attr("title", act),
-                                    xs_html_attr("class", l1),
-                                    xs_html_attr("style", style));
-                        }
-                    }
-                    if (ret) {
-                        xs *s1;
-                        if (user) {
-                            xs *action = xs_fmt("%s/admin/action", user->actor);
-                            xs *form_id = xs_fmt("%s_reply_form", md5);
+    if (f_size < frag_cache_budget) {
+        frag_cache_ent **slot = _frag_cache_slot(key);
 
-                            xs_html *form =
-                                xs_html_tag("form",
-                                xs_html_attr("autocomplete", "off"),
-                                xs_html_attr("method",       "post"),
-                                xs_html_attr("action",       action),
-                                xs_html_attr("enctype",      "multipart/form-data"),
-                                xs_html_attr("style",      "display: inline-flex;"
-                                    "vertical-align: middle;"),
-                                xs_html_attr("id",           form_id),
-                                xs_html_sctag("input",
-                                    xs_html_attr("type",  "hidden"),
-                                    xs_html_attr("name",  "id"),
-                                    xs_html_attr("value", id)),
-                                xs_html_sctag("input",
-                                    xs_html_attr("type",  "hidden"),
-                                    xs_html_attr("name",  "eid"),
-                                    xs_html_attr("value", shortname)),
-                                ret);
-                            s1 = xs_html_render(form);
-                        }
-                        else
-                            s1 = xs_html_render(ret);
+        if (*slot)
+            _frag_cache_drop(slot);
 
-                        ls = xs_list_append(ls, s1);
-                        sfrl = xs_dict_del(sfrl, content);
-                    }
-                }
-            }
-        }
+        frag_cache_ent *e = xs_realloc(NULL, sizeof(frag_cache_ent));
 
-        c = 0;
+        *e = (frag_cache_ent){ NULL, frag_cache_first, NULL,
+            xs_dup(key), hash, xs_dup(frags), f_size };
 
-        xs_html *emoji_div;
-        if (xs_list_len(ls) > 0) {
-                emoji_div = xs_html_tag("div", xs_html_text(L("Emoji reactions: ")),
-                        xs_html_attr("class", "snac-reaction-div"));
+        if (frag_cache_first)
+            frag_cache_first->prev = e;
+        else
+            frag_cache_last = e;
 
-            while (ls != NULL && xs_list_next(ls, &k, &c))
-                xs_html_add(emoji_div, xs_html_raw(k));
+        frag_cache_first = e;
+        *slot = e;
 
-            xs_html_add(snac_content_wrap, emoji_div);
-        }
+        frag_cache_bytes += f_size;
 
-    }
+        /* evict the least recently used ones */
+        while (frag_cache_bytes > frag_cache_budget) {
+            _frag_cache_drop(_frag_cache_slot(frag_cache_last->key));
 
-    {
-        /** build the content string **/
-        const char *content = xs_dict_get(msg, "content");
+            if (p_state != NULL)
+                p_state->entry_cache_evictions++;
+        }
+    }
 
-        if (xs_type(content) != XSTYPE_STRING) {
-            if (!xs_is_null(content))
-                srv_archive_error("unexpected_content_xstype",
-                    "content field type", xs_stock(XSTYPE_DICT), msg);
+    pthread_mutex_unlock(&frag_cache_mutex);
+}
 
-            content = "";
-        }
 
-        /* skip ugly line breaks at the beginning */
-        while (xs_startswith(content, "<br>"))
-            content += 4;
+static xs_list *html_entry_cached_fragments(snac *user, const xs_dict *msg,
+                                            const char *md5, const char *proxy)
+/* returns the object-dependent fragments of an entry, from the cache if possible */
+{
+    if (md5 == NULL)
+        return html_entry_fragments(user, msg, proxy);
 
-        xs *c = sanitize(content);
+    /* the fragments are shared by all users with the same language and proxy */
+    const char *lang = "-";
+    if (user && xs_is_dict(user->lang))
+        lang = xs_dict_get(user->config, "lang");
 
-        /* do some tweaks to the content */
-        c = xs_replace_i(c, "\r", "");
+    xs *key = xs_fmt("%s %s %s", md5, lang, proxy ? proxy : "-");
+    uint64_t hash = xs_hash64_func(msg, xs_size(msg));
+    xs_list *frags;
 
-        while (xs_endswith(c, "<br><br>"))
-            c = xs_crop_i(c, 0, -4);
+    if ((frags = _frag_cache_get(key, hash)) == NULL) {
+        frags = html_entry_fragments(user, msg, proxy);
+        _frag_cache_put(key, hash, frags);
+    }
 
-        c = xs_replace_i(c, "<br><br>", "<p>");
+    return frags;
+}
 
-        if (is_emoji == 0)
-            c = xs_str_cat(c, "<p>");
 
-        /* replace the :shortnames: */
-        c = replace_shortnames(c, xs_dict_get(msg, "tag"), 2, proxy);
+xs_html *html_entry(snac *user, xs_dict *msg, int read_only,
+                   int level, const char *md5, int hide_children)
+{
+    const char *id    = xs_dict_get(msg, "id");
+    const char *type  = xs_dict_get(msg, "type");
+    const char *actor;
+    const char *v;
+    int has_title = 0;
+    int collapse_threads = 0;
+    const char *proxy = NULL;
 
-        /* Peertube videos content is in markdown */
-        const char *mtype = xs_dict_get(msg, "mediaType");
-        if (xs_type(mtype) == XSTYPE_STRING && strcmp(mtype, "text/markdown") == 0) {
-            /* a full conversion could be better */
-            c = xs_replace_i(c, "\r", "");
-            c = xs_replace_i(c, "\n", "<br>");
-        }
+    if (user && !read_only && xs_is_true(xs_dict_get(srv_config, "proxy_media")))
+        proxy = user->actor;
 
-        /* c contains sanitized HTML */
-        xs_html_add(snac_content,
-            xs_html_raw(c));
+    /* do not show non-public messages in the public timeline */
+    if ((read_only || !user) && !is_msg_public(msg))
+        return NULL;
 
-        /* quoted post */
-        const char *quoted_id = xs_or(xs_dict_get(msg, "quoteUri"), xs_dict_get(msg, "quoteUrl"));
+    if (id && is_instance_blocked(id))
+        return NULL;
 
-        if (level < 3 && xs_is_string(quoted_id) && xs_match(quoted_id, "https://*|http://*")) { /** **/
-            xs *quoted_post = NULL;
+    if (user && level == 0 && xs_is_true(xs_dict_get(user->config, "collapse_threads")))
+        collapse_threads = 1;
 
-            if (valid_status(object_get(quoted_id, &quoted_post))) {
-                xs *md5 = xs_md5_hex(quoted_id, strlen(quoted_id));
+    /* hidden? do nothing more for this conversation */
+    if (user && is_hidden(user, id)) {
+        xs *s1 = xs_fmt("%s_entry", md5);
 
-                xs_html_add(snac_content,
-                    xs_html_tag("blockquote",
-                        xs_html_attr("class", "snac-quoted-post"),
-                        html_entry(user, quoted_post, 1, level + 1, md5, 1)));
-            }
-            else
-            if (user)
-                enqueue_object_request(user, quoted_id, 0);
-        }
+        /* return just an dummy anchor, to keep position after hitting 'Hide' */
+        return xs_html_tag("div",
+            xs_html_tag("a",
+                xs_html_attr("name", s1)));
     }
 
-    if (strcmp(type, "Question") == 0) { /** question content **/
-        const xs_list *oo = xs_dict_get(msg, "oneOf");
-        const xs_list *ao = xs_dict_get(msg, "anyOf");
-        const xs_list *p;
-        const xs_dict *v;
-        int closed = 0;
-        const char *f_closed = NULL;
-
-        xs_html *poll = xs_html_tag("div", NULL);
+    /* avoid too deep nesting, as it may be a loop */
+    if (level >= MAX_CONVERSATION_LEVELS)
+        return xs_html_tag("mark",
+            xs_html_text(L("Truncated (too deep)")));
 
-        if (read_only)
-            closed = 1; /* non-identified page; show as closed */
-        else
-        if (user && is_msg_mine(user, id))
-            closed = 1; /* we questioned; closed for us */
-        else
-        if (user && was_question_voted(user, id))
-            closed = 1; /* we already voted; closed for us */
+    const char *lang = NULL;
+    const xs_dict *cmap = xs_dict_get(msg, "contentMap");
+    if (xs_is_dict(cmap)) {
+        const char *dummy;
+        int c = 0;
 
-        if ((f_closed = xs_dict_get(msg, "closed")) != NULL) {
-            /* it has a closed date... but is it in the past? */
-            time_t t0 = time(NULL);
-            time_t t1 = xs_parse_iso_date(f_closed, 0);
+        xs_dict_next(cmap, &lang, &dummy, &c);
 
-            if (t1 < t0)
-                closed = 2;
+        if (user && xs_is_string(lang)) {
+            /* discard posts in excluded languages */
+            const char *excluded_langs = xs_dict_get(user->config, "excluded_langs");
+
+            if (xs_is_string(excluded_langs) &&
+                xs_str_in(excluded_langs, lang) != -1) {
+                snac_debug(user, 1, xs_fmt("excluded post in language '%s'", lang));
+                return NULL;
+            }
         }
+    }
 
-        /* get the appropriate list of options */
-        p = oo != NULL ? oo : ao;
+    if (strcmp(type, "Follow") == 0) {
+        return xs_html_tag("div",
+            xs_html_attr("class", "snac-post"),
+            xs_html_tag("div",
+                xs_html_attr("class", "snac-post-header"),
+                xs_html_tag("div",
+                    xs_html_attr("class", "snac-origin"),
+                    xs_html_text(L("follows you"))),
+                html_msg_icon(read_only ? NULL : user, xs_dict_get(msg, "actor"), msg, proxy, NULL, lang)));
+    }
+    else
+    if (!xs_match(type, POSTLIKE_OBJECT_TYPE)) {
+        /* skip oddities */
+        snac_debug(user, 1, xs_fmt("html_entry: ignoring object type '%s' %s", type, id));
+        return NULL;
+    }
 
-        if (closed || user == NULL) {
-            /* closed poll */
-            xs_html *poll_result = xs_html_tag("table",
-                xs_html_attr("class", "snac-poll-result"));
-            int c = 0;
+    /* ignore notes with "name", as they are votes to Questions */
+    if (strcmp(type, "Note") == 0 && !xs_is_null(xs_dict_get(msg, "name")))
+        return NULL;
 
-            while (xs_list_next(p, &v, &c)) {
-                const char *name       = xs_dict_get(v, "name");
-                const xs_dict *replies = xs_dict_get(v, "replies");
+    /* get the attributedTo */
+    if ((actor = get_atto(msg)) == NULL)
+        return NULL;
 
-                if (xs_is_string(name) && xs_is_dict(replies)) {
-                    const char *ti = xs_number_str(xs_dict_get(replies, "totalItems"));
+    /* ignore muted morons immediately */
+    if (user && is_muted(user, actor)) {
+        xs *s1 = xs_fmt("%s_entry", md5);
 
-                    if (xs_is_string(ti))
-                        xs_html_add(poll_result,
-                            xs_html_tag("tr",
-                                xs_html_tag("td",
-                                    xs_html_text(name),
-                                    xs_html_text(":")),
-                                xs_html_tag("td",
-                                    xs_html_text(ti))));
-                }
-            }
+        /* return just an dummy anchor, to keep position after hitting 'MUTE' */
+        return xs_html_tag("div",
+            xs_html_tag("a",
+                xs_html_attr("name", s1)));
+    }
 
-            xs_html_add(poll,
-                poll_result);
-        }
-        else {
-            /* poll still active */
-            xs *vote_action = xs_fmt("%s/admin/vote", user->actor);
-            xs_html *form;
-            xs_html *poll_form = xs_html_tag("div",
-                xs_html_attr("class", "snac-poll-form"),
-                form = xs_html_tag("form",
-                    xs_html_attr("autocomplete", "off"),
-                    xs_html_attr("method", "post"),
-                    xs_html_attr("action", vote_action),
-                    xs_html_sctag("input",
-                        xs_html_attr("type", "hidden"),
-                        xs_html_attr("name", "actor"),
-                        xs_html_attr("value", actor)),
-                    xs_html_sctag("input",
-                        xs_html_attr("type", "hidden"),
-                        xs_html_attr("name", "irt"),
-                        xs_html_attr("value", id))));
+    /* don't show followers-only notes from not followed users */
+    if (user && get_msg_visibility(msg) == SCOPE_FOLLOWERS &&
+        strcmp(user->actor, actor) != 0 && following_check(user, actor) == 0) {
+        return NULL;
+    }
 
-            int c = 0;
-            while (xs_list_next(p, &v, &c)) {
-                const char *name = xs_dict_get(v, "name");
-                const xs_dict *replies = xs_dict_get(v, "replies");
+    if ((user == NULL || strcmp(actor, user->actor) != 0)
+        && !valid_status(actor_get(actor, NULL))) {
 
-                if (name) {
-                    char *ti = (char *)xs_number_str(xs_dict_get(replies, "totalItems"));
+        if (user)
+            enqueue_actor_refresh(user, actor, 0);
 
-                    xs_html *btn = xs_html_sctag("input",
-                            xs_html_attr("id", name),
-                            xs_html_attr("value", name),
-                            xs_html_attr("name", "question"));
+        return NULL;
+    }
 
-                    if (!xs_is_null(oo)) {
-                        xs_html_add(btn,
-                            xs_html_attr("type", "radio"),
-                            xs_html_attr("required", "required"));
-                    }
-                    else
-                        xs_html_add(btn,
-                            xs_html_attr("type", "checkbox"));
+    /** html_entry top tag **/
+    xs_html *entry_top = xs_html_tag("div", NULL);
 
-                    xs_html_add(form,
-                        btn,
-                        xs_html_text(" "),
-                        xs_html_tag("span",
-                            xs_html_attr("title", ti),
-                            xs_html_text(name)),
-                        xs_html_sctag("br", NULL));
-                }
-            }
+    {
+        xs *s1 = xs_fmt("%s_entry", md5);
+        xs_html_add(entry_top,
+            xs_html_tag("a",
+                xs_html_attr("name", s1)));
+    }
 
-            xs_html_add(form,
-                xs_html_tag("p", NULL),
-                xs_html_sctag("input",
-                    xs_html_attr("type", "submit"),
-                    xs_html_attr("class", "button"),
-                    xs_html_attr("value", L("Vote"))));
+    xs_html *entry = xs_html_tag("div",
+        xs_html_attr("class", level == 0 ? "snac-post" : "snac-child"));
 
-            xs_html_add(poll,
-                poll_form);
-        }
+    xs_html_add(entry_top,
+        entry);
 
-        /* if it's *really* closed, say it */
-        if (closed == 2) {
-            xs_html_add(poll,
-                xs_html_tag("p",
-                    xs_html_text(L("Closed"))));
-        }
-        else {
-            /* show when the poll closes */
-            const char *end_time = xs_dict_get(msg, "endTime");
+    /** post header **/
 
-            /* Pleroma does not have an endTime field;
-               it has a closed time in the future */
-            if (xs_is_null(end_time))
-                end_time = xs_dict_get(msg, "closed");
+    xs_html *score;
+    xs_html *post_header = xs_html_tag("div",
+        xs_html_attr("class", "snac-post-header"),
+        score = xs_html_tag("div",
+            xs_html_attr("class", "snac-score")));
 
-            if (!xs_is_null(end_time)) {
-                time_t t0 = time(NULL);
-                time_t t1 = xs_parse_iso_date(end_time, 0);
+    xs_html_add(entry,
+        post_header);
 
-                if (t1 > 0 && t1 > t0) {
-                    time_t diff_time = t1 - t0;
-                    xs *tf = xs_str_time_diff(diff_time);
-                    char *p = tf;
+    if (user && is_pinned(user, id)) {
+        /* add a pin emoji */
+        xs_html_add(score,
+            xs_html_tag("span",
+                xs_html_attr("title", L("Pinned")),
+                xs_html_raw(" &#128204; ")));
+    }
 
-                    /* skip leading zeros */
-                    for (; *p == '0' || *p == ':'; p++);
+    if (user && !read_only && is_bookmarked(user, id)) {
+        /* add a bookmark emoji */
+        xs_html_add(score,
+            xs_html_tag("span",
+                xs_html_attr("title", L("Bookmarked")),
+                xs_html_raw(" &#128278; ")));
+    }
 
-                    xs_html_add(poll,
-                        xs_html_tag("p",
-                            xs_html_text(L("Closes in")),
-                            xs_html_text(" "),
-                            xs_html_text(p)));
-                }
-            }
+    if (strcmp(type, "Question") == 0) {
+        /* add the ballot box emoji */
+        xs_html_add(score,
+            xs_html_tag("span",
+                xs_html_attr("title", L("Poll")),
+                xs_html_raw(" &#128499; ")));
+
+        if (user && was_question_voted(user, id)) {
+            /* add a check to show this poll was voted */
+            xs_html_add(score,
+                xs_html_tag("span",
+                    xs_html_attr("title", L("Voted")),
+                    xs_html_raw(" &#10003; ")));
         }
+    }
 
-        xs_html_add(snac_content,
-            poll);
+    if (strcmp(type, "Event") == 0) {
+        /* add the calendar emoji */
+        xs_html_add(score,
+            xs_html_tag("span",
+                xs_html_attr("title", L("Event")),
+                xs_html_raw(" &#128197; ")));
     }
 
-    /** attachments **/
-    xs *attach = get_attachments(msg);
+    /* if it's a user from this same instance, add the score */
+    if (xs_startswith(id, srv_baseurl)) {
+        int n_likes  = object_likes_len(id);
+        int n_boosts = object_announces_len(id);
 
-    {
-        /* make custom css for attachments easier */
-        xs_html *content_attachments = xs_html_tag("div",
-            xs_html_attr("class", "snac-content-attachments"));
+        /* alternate emojis: %d &#128077; %d &#128257; */
+        xs *s1 = xs_fmt("%d &#9733; %d &#8634;\n", n_likes, n_boosts);
 
-        xs_html_add(snac_content,
-            content_attachments);
+        xs_html_add(score,
+            xs_html_raw(s1));
+    }
 
-        const char *content = xs_dict_get(msg, "content");
-
-        int c = 0;
-        const xs_dict *a;
-        while (xs_list_next(attach, &a, &c)) {
-            const char *type = xs_dict_get(a, "type");
-            const char *o_href = xs_dict_get(a, "href");
-            const char *name = xs_dict_get(a, "name");
-
-            if (!xs_is_string(type) || !xs_is_string(o_href))
-                continue;
+    xs *boosts = object_announces(id);
 
-            /* if this URL is already in the post content, skip */
-            if (content && xs_str_in(content, o_href) != -1)
-                continue;
+    if (xs_list_len(boosts)) {
+        /* if somebody boosted this, show as origin */
+        const char *p = xs_list_get(boosts, -1);
+        xs *actor_r = NULL;
 
-            if (strcmp(type, "image/svg+xml") == 0 && !xs_is_true(xs_dict_get(srv_config, "enable_svg")))
-                continue;
+        if (user && xs_list_in(boosts, user->md5) != -1) {
+            /* we boosted this */
+            xs_html_add(post_header,
+                xs_html_tag("div",
+                    xs_html_attr("class", "snac-origin"),
+                    xs_html_tag("a",
+                        xs_html_attr("href", user->actor),
+                        xs_html_text(xs_dict_get(user->config, "name"))),
+                        xs_html_text(" "),
+                        xs_html_text(L("boosted"))));
+        }
+        else
+        if (valid_status(object_get_by_md5(p, &actor_r))) {
+            xs *name = actor_name(actor_r, proxy);
 
-            /* do this attachment include an icon? */
-            const xs_dict *icon = xs_dict_get(a, "icon");
-            if (xs_type(icon) == XSTYPE_DICT) {
-                const char *icon_mtype = xs_dict_get(icon, "mediaType");
-                const char *icon_url   = xs_dict_get(icon, "url");
+            if (!xs_is_null(name)) {
+                xs *href = NULL;
+                const char *id = xs_dict_get(actor_r, "id");
+                int fwers = 0;
+                int fwing = 0;
 
-                if (icon_mtype && icon_url && xs_startswith(icon_mtype, "image/")) {
-                    xs_html_add(content_attachments,
-                        xs_html_tag("a",
-                            xs_html_attr("href", icon_url),
-                            xs_html_attr("target", "_blank"),
-                            xs_html_sctag("img",
-                                xs_html_attr("loading", "lazy"),
-                                xs_html_attr("src", icon_url))));
+                if (user != NULL) {
+                    fwers = follower_check(user, id);
+                    fwing = following_check(user, id);
                 }
-            }
 
-            xs *href = make_url(o_href, proxy, 0);
+                if (!read_only && (fwers || fwing))
+                    href = xs_fmt("%s/people/%s", user->actor, p);
+                else
+                    href = xs_dup(id);
 
-            if (xs_startswith(type, "image/") || strcmp(type, "Image") == 0) {
-                xs_html_add(content_attachments,
-                    xs_html_tag("a",
-                        xs_html_attr("href", href),
-                        xs_html_attr("target", "_blank"),
-                        xs_html_sctag("img",
-                            xs_html_attr("loading", "lazy"),
-                            xs_html_attr("src", href),
-                            xs_html_attr("alt", name),
-                            xs_html_attr("title", name))));
-            }
-            else
-            if (xs_startswith(type, "video/") || strcmp(type, "Video") == 0) {
-                xs_html_add(content_attachments,
-                    xs_html_tag("video",
-                        xs_html_attr("preload", "none"),
-                        xs_html_attr("style", "width: 100%"),
-                        xs_html_attr("class", "snac-embedded-video"),
-                        xs_html_attr("controls", NULL),
-                        xs_html_attr("src", href),
-                        xs_html_text(L("Video")),
-                        xs_html_text(": "),
-                        xs_html_tag("a",
-                            xs_html_attr("href", href),
-                            xs_html_text(name))));
-            }
-            else
-            if (xs_startswith(type, "audio/")) {
-                xs_html_add(content_attachments,
-                    xs_html_tag("audio",
-                        xs_html_attr("preload", "none"),
-                        xs_html_attr("style", "width: 100%"),
-                        xs_html_attr("class", "snac-embedded-audio"),
-                        xs_html_attr("controls", NULL),
-                        xs_html_attr("src", href),
-                        xs_html_text(L("Audio")),
-                        xs_html_text(": "),
+                xs_html_add(post_header,
+                    xs_html_tag("div",
+                        xs_html_attr("class", "snac-origin"),
                         xs_html_tag("a",
                             xs_html_attr("href", href),
-                            xs_html_text(name))));
+                            xs_html_raw(name)), /* already sanitized */
+                            xs_html_text(" "),
+                            xs_html_text(L("boosted"))));
             }
-            else
-            if (strcmp(type, "Link") == 0) {
-                xs_html_add(content_attachments,
-                    xs_html_tag("p",
-                        xs_html_tag("a",
-                            xs_html_attr("href", o_href),
-                            xs_html_text(href))));
+        }
+    }
 
-                /* do not generate an Alt... */
-                name = NULL;
-            }
-            else {
-                xs *d_href = xs_dup(o_href);
-                if (strlen(d_href) > 64) {
-                    d_href[64] = '\0';
-                    d_href = xs_str_cat(d_href, "...");
-                }
+    if (user && strcmp(type, "Note") == 0) {
+        /* is the parent not here? */
+        const char *parent = get_in_reply_to(msg);
 
-                xs_html_add(content_attachments,
-                    xs_html_tag("p",
+        if (!xs_is_null(parent) && *parent) {
+            if (!timeline_here(user, parent)) {
+                xs_html_add(post_header,
+                    xs_html_tag("div",
+                        xs_html_attr("class", "snac-origin"),
+                        xs_html_text(L("in reply to")),
+                        xs_html_text(" "),
                         xs_html_tag("a",
-                            xs_html_attr("href", o_href),
-                            xs_html_text(L("Attachment")),
-                            xs_html_text(": "),
-                            xs_html_text(d_href))));
-
-                /* do not generate an Alt... */
-                name = NULL;
-            }
-
-            if (name != NULL && *name) {
-                xs_html_add(content_attachments,
-                    xs_html_tag("p",
-                        xs_html_attr("class", "snac-alt-text"),
-                        xs_html_tag("details",
-                            xs_html_tag("summary",
-                                xs_html_text(L("Alt..."))),
-                            xs_html_text(name))));
+                            xs_html_attr("href", parent),
+                            xs_html_text("»"))));
             }
         }
     }
 
-    /* has this message an audience (i.e., comes from a channel or community)? */
-    const char *audience = xs_dict_get(msg, "audience");
-    if (strcmp(type, "Page") == 0 && !xs_is_null(audience)) {
-        xs_html *au_tag = xs_html_tag("p",
-            xs_html_text("("),
-            xs_html_tag("a",
-                xs_html_attr("href", audience),
-                xs_html_attr("title", L("Source channel or community")),
-                xs_html_text(audience)),
-            xs_html_text(")"));
+    xs_html_add(post_header,
+        html_msg_icon(read_only ? NULL : user, actor, msg, proxy, md5, lang));
 
-        xs_html_add(snac_content_wrap,
-            au_tag);
-    }
+    /** post content **/
 
-    /* does it have a location? */
-    const xs_dict *location = xs_dict_get(msg, "location");
-    if (xs_type(location) == XSTYPE_DICT) {
-        const xs_number *latitude = xs_dict_get(location, "latitude");
-        const xs_number *longitude = xs_dict_get(location, "longitude");
-        const char *name = xs_dict_get(location, "name");
-        const char *address = xs_dict_get(location, "address");
-        xs *label_list = xs_list_new();
+    xs *frags = html_entry_cached_fragments(user, msg, md5, proxy);
 
-        if (xs_type(name) == XSTYPE_STRING)
-            label_list = xs_list_append(label_list, name);
-        if (xs_type(address) == XSTYPE_STRING)
-            label_list = xs_list_append(label_list, address);
+    xs_html *snac_content_wrap = xs_html_tag("div",
+        xs_html_attr("class", "e-content snac-content"));
 
-        if (xs_list_len(label_list)) {
-            const char *url = xs_dict_get(location, "url");
-            xs *label = xs_join(label_list, ", ");
+    if (xs_is_string(lang))
+        xs_html_add(snac_content_wrap,
+            xs_html_attr("lang", lang));
 
-            if (xs_type(url) == XSTYPE_STRING) {
-                xs_html_add(snac_content_wrap,
-                    xs_html_tag("p",
-                        xs_html_text(L("Location: ")),
-                        xs_html_tag("a",
-                            xs_html_attr("href", url),
-                            xs_html_attr("target", "_blank"),
-                            xs_html_text(label))));
-            }
-            else
-            if (!xs_is_null(latitude) && !xs_is_null(longitude)) {
-                xs *url = xs_fmt("https://openstreetmap.org/search/?query=%s,%s",
-                    xs_or(xs_number_str(latitude), latitude), xs_or(xs_number_str(longitude), longitude));
+    xs_html_add(entry,
+        snac_content_wrap);
 
-                xs_html_add(snac_content_wrap,
-                    xs_html_tag("p",
-                        xs_html_text(L("Location: ")),
-                        xs_html_tag("a",
-                            xs_html_attr("href", url),
-                            xs_html_attr("target", "_blank"),
-                            xs_html_text(label))));
-            }
-            else
-                xs_html_add(snac_content_wrap,
-                    xs_html_tag("p",
-                        xs_html_text(L("Location: ")),
-                        xs_html_text(label)));
-        }
+    if (!has_title && !xs_is_null(v = xs_dict_get(msg, "name"))) {
+        xs_html_add(snac_content_wrap,
+            xs_html_tag("h3",
+                xs_html_attr("class", "snac-entry-title"),
+                xs_html_text(v)));
+
+        has_title = 1;
     }
 
-    if (strcmp(type, "Event") == 0) { /** Event start and end times **/
-        const char *s_time = xs_dict_get(msg, "startTime");
+    xs_html *snac_content = NULL;
 
-        if (xs_is_string(s_time) && strlen(s_time) > 20) {
-            const char *e_time = xs_dict_get(msg, "endTime");
-            const char *tz     = xs_dict_get(msg, "timezone");
+    v = xs_dict_get(msg, "summary");
 
-            xs *s = xs_replace_i(xs_dup(s_time), "T", " ");
-            xs *e = NULL;
+    /* if it has summary or marked as sensitive - add CW */
+    /* come clients don't set "sensitive" flag properly */
+    if ((!xs_is_null(v) && *v) || xs_type(xs_dict_get(msg, "sensitive")) == XSTYPE_TRUE) {
+        if (xs_is_null(v) || *v == '\0')
+            v = "...";
 
-            if (xs_is_string(e_time) && strlen(e_time) > 20)
-                e = xs_replace_i(xs_dup(e_time), "T", " ");
+        const char *cw = "";
 
-            /* if the event has a timezone, crop the offsets */
-            if (xs_is_string(tz)) {
-                s = xs_crop_i(s, 0, 19);
+        if (user) {
+            /* only show it when not in the public timeline and the config setting is "open" */
+            cw = xs_dict_get(user->config, "cw");
+            if (xs_is_null(cw) || read_only)
+                cw = "";
+        }
 
-                if (e)
-                    e = xs_crop_i(e, 0, 19);
+        /* summary can't contain HTML */
+        xs *s1 = xs_regex_replace(v, "<[^>]+>", "");
+
+        /* crop stupidly long summaries */
+        if (xs_utf8_len(s1) > 1024) {
+            s1 = xs_utf8_crop_i(s1, 0, 1024);
+            s1 = xs_str_cat(s1, "...");
+        }
+
+        snac_content = xs_html_tag("details",
+            xs_html_attr(cw, NULL),
+            xs_html_tag("summary",
+                xs_html_text(s1),
+                xs_html_text(L(" [SENSITIVE CONTENT]"))));
+    }
+    else
+    if (user &&
+        /* muted_words is all lowercase and sorted for performance */
+        (v = words_in_content(xs_dict_get(user->config, "muted_words"),
+                              xs_dict_get(msg, "content"))) != NULL) {
+        snac_debug(user, 1, xs_fmt("word %s muted by user preferences: %s", v, id));
+        snac_content = xs_html_tag("details",
+            xs_html_tag("summary",
+                xs_html_text(L("Muted: ")),
+                xs_html_text(v)));
+    }
+    else {
+        snac_content = xs_html_tag("div", NULL);
+    }
+
+    xs_html_add(snac_content_wrap,
+        snac_content);
+
+    /* add all emoji reacts */
+    int is_emoji = 0;
+    if (!xs_is_true(xs_dict_get(srv_config, "disable_emojireact"))) {
+        int c = 0;
+        const xs_dict *k;
+        xs *ls = xs_list_new();
+        xs *sfrl = xs_dict_new();
+        xs *rl = object_get_emoji_reacts(id);
+
+        while (xs_list_next(rl, &v, &c)) {
+            xs *m = NULL;
+            if (valid_status(object_get_by_md5(v, &m))) {
+                const char *content = xs_dict_get(m, "content");
+                const char *actor = xs_dict_get(m, "actor");
+                const xs_list *contentl = xs_dict_get(sfrl, content);
+
+                if ((user && is_muted(user, actor)) || is_instance_blocked(actor))
+                    continue;
+
+                xs *actors = xs_list_new();
+                actors = xs_list_append(actors, actor);
+                char me = actor && user && strcmp(actor, user->actor) == 0;
+                int count = 1;
+
+                if (contentl) {
+                    count = atoi(xs_list_get(contentl, 0)) + 1;
+                    const xs_list *actorsc = xs_list_get(contentl, 1);
+                    if (strncmp(xs_list_get(contentl, 2), "1", 1) == 0)
+                        me = 1;
+
+                    if (xs_list_in(actorsc, actor) != -1) {
+                        xs_free(actors);
+                        actors = xs_dup(actorsc);
+                    }
+                    else
+                        actors = xs_list_cat(actors, actorsc);
+                }
+
+                xs *fl = xs_list_new();
+                xs *c1 = xs_fmt("%d", count);
+                xs *c2 = xs_fmt("%d", me);
+                fl = xs_list_append(fl, c1, actors, c2);
+                sfrl = xs_dict_append(sfrl, content, fl);
+            }
+        }
+
+        c = 0;
+
+        while (xs_list_next(rl, &k, &c)) {
+            xs *m = NULL;
+            if (valid_status(object_get_by_md5(k, &m))) {
+                const xs_dict *tag = xs_dict_get(m, "tag");
+                const xs_dict *ide = xs_dict_get(m, "id");
+
+                const char *content = xs_dict_get(m, "content");
+                const char *shortname;
+                shortname = xs_dict_get(m, "content");
+
+                const xs_list *items = xs_dict_get(sfrl, content);
+
+                if (!xs_is_null(items)) {
+                    const char *nb = xs_list_get(items, 0);
+                    const xs_list *actors = xs_list_get(items, 1);
+                    const char me = *xs_list_get(items, 2) == '1';
+
+                    is_emoji = 1;
+
+                    xs *al = xs_join(actors, ",\n\t");
+                    xs *act = atoi(nb) > 1 ?
+                        xs_fmt("%d different actors \n\t%s", atoi(nb), al) :
+                        xs_dup(xs_dict_get(m, "actor"));
+
+                    xs *class = xs_list_new();
+                    class = xs_list_append(class, "snac-reaction");
+
+                    xs_html *ret = NULL;
+                    if (tag && shortname) {
+                        xs *cl = xs_list_new();
+                        cl = xs_list_append(cl, "snac-reaction-image");
+                        xs *emoji = _replace_shortnames(xs_dup(shortname), tag, 2, proxy, cl, act);
+
+                        emoji = xs_strip_chars_i(emoji, ":");
+
+                        if (me)
+                            class = xs_list_append(class, "snac-reacted");
+
+                        xs *l1 = xs_join(class, " ");
+                        ret = xs_html_tag("button",
+                                xs_html_attr("type", "submit"),
+                                xs_html_attr("name", "action"),
+                                xs_html_attr("value", me ? L("EmojiReact") : L("EmojiUnreact")),
+                                xs_html_raw(emoji),
+                                xs_html_tag("span",
+                                    xs_html_raw(nb),
+                                    xs_html_attr("style", "padding-left: 5px;")),
+                                xs_html_attr("title", act),
+                                xs_html_attr("class", l1));
+
+                        if (!(ide && xs_startswith(ide, srv_baseurl)))
+                            xs_html_add(ret, xs_html_attr("disabled", "true"));
+                    }
+                    else if (shortname) {
+                        xs *sn = xs_dup(shortname);
+                        const char *sna = sn;
+                        unsigned int utf = xs_utf8_dec((const char **)&sna);
+
+                        if (xs_is_emoji(utf)) {
+                            const char *style = "font-size: large;";
+                            if (me)
+                                class = xs_list_append(class, "snac-reacted");
+                            xs *l1 = xs_join(class, " ");
+                            xs *s1 = xs_fmt("&#%d", utf);
+                            ret = xs_html_tag("button",
+                                    xs_html_attr("type", "submit"),
+                                    xs_html_attr("name", "action"),
+                                    xs_html_attr("value", me ? L("EmojiUnreact") : L("EmojiReact")),
+                                    xs_html_raw(s1),
+                                    xs_html_tag("span",
+                                        xs_html_raw(nb),
+                                        xs_html_attr("style", "font-size: initial; padding-left: 5px;")),
+                                    xs_html_attr("title", act),
+                                    xs_html_attr("class", l1),
+                                    xs_html_attr("style", style));
+                        }
+                    }
+                    if (ret) {
+                        xs *s1;
+                        if (user) {
+                            xs *action = xs_fmt("%s/admin/action", user->actor);
+                            xs *form_id = xs_fmt("%s_reply_form", md5);
+
+                            xs_html *form =
+                                xs_html_tag("form",
+                                xs_html_attr("autocomplete", "off"),
+                                xs_html_attr("method",       "post"),
+                                xs_html_attr("action",       action),
+                                xs_html_attr("enctype",      "multipart/form-data"),
+                                xs_html_attr("style",      "display: inline-flex;"
+                                    "vertical-align: middle;"),
+                                xs_html_attr("id",           form_id),
+                                xs_html_sctag("input",
+                                    xs_html_attr("type",  "hidden"),
+                                    xs_html_attr("name",  "id"),
+                                    xs_html_attr("value", id)),
+                                xs_html_sctag("input",
+                                    xs_html_attr("type",  "hidden"),
+                                    xs_html_attr("name",  "eid"),
+                                    xs_html_attr("value", shortname)),
+                                ret);
+                            s1 = xs_html_render(form);
+                        }
+                        else
+                            s1 = xs_html_render(ret);
+
+                        ls = xs_list_append(ls, s1);
+                        sfrl = xs_dict_del(sfrl, content);
+                    }
+                }
+            }
+        }
+
+        c = 0;
+
+        xs_html *emoji_div;
+        if (xs_list_len(ls) > 0) {
+                emoji_div = xs_html_tag("div", xs_html_text(L("Emoji reactions: ")),
+                        xs_html_attr("class", "snac-reaction-div"));
+
+            while (ls != NULL && xs_list_next(ls, &k, &c))
+                xs_html_add(emoji_div, xs_html_raw(k));
+
+            xs_html_add(snac_content_wrap, emoji_div);
+        }
+
+    }
+
+    {
+        /** the content string (already sanitized HTML) **/
+        xs *c = xs_dup(xs_list_get(frags, 0));
+
+        if (is_emoji == 0)
+            c = xs_str_cat(c, "<p>");
+
+        xs_html_add(snac_content,
+            xs_html_raw(c));
+
+        /* quoted post */
+        const char *quoted_id = xs_or(xs_dict_get(msg, "quoteUri"), xs_dict_get(msg, "quoteUrl"));
+
+        if (level < 3 && xs_is_string(quoted_id) && xs_match(quoted_id, "https://*|http://*")) { /** **/
+            xs *quoted_post = NULL;
+
+            if (valid_status(object_get(quoted_id, &quoted_post))) {
+                xs *md5 = xs_md5_hex(quoted_id, strlen(quoted_id));
+
+                xs_html_add(snac_content,
+                    xs_html_tag("blockquote",
+                        xs_html_attr("class", "snac-quoted-post"),
+                        html_entry(user, quoted_post, 1, level + 1, md5, 1)));
+            }
+            else
+            if (user)
+                enqueue_object_request(user, quoted_id, 0);
+        }
+    }
+
+    if (strcmp(type, "Question") == 0) { /** question content **/
+        const xs_list *oo = xs_dict_get(msg, "oneOf");
+        const xs_list *ao = xs_dict_get(msg, "anyOf");
+        const xs_list *p;
+        const xs_dict *v;
+        int closed = 0;
+        const char *f_closed = NULL;
+
+        xs_html *poll = xs_html_tag("div", NULL);
+
+        if (read_only)
+            closed = 1; /* non-identified page; show as closed */
+        else
+        if (user && is_msg_mine(user, id))
+            closed = 1; /* we questioned; closed for us */
+        else
+        if (user && was_question_voted(user, id))
+            closed = 1; /* we already voted; closed for us */
+
+        if ((f_closed = xs_dict_get(msg, "closed")) != NULL) {
+            /* it has a closed date... but is it in the past? */
+            time_t t0 = time(NULL);
+            time_t t1 = xs_parse_iso_date(f_closed, 0);
+
+            if (t1 < t0)
+                closed = 2;
+        }
+
+        /* get the appropriate list of options */
+        p = oo != NULL ? oo : ao;
+
+        if (closed || user == NULL) {
+            /* closed poll */
+            xs_html *poll_result = xs_html_tag("table",
+                xs_html_attr("class", "snac-poll-result"));
+            int c = 0;
+
+            while (xs_list_next(p, &v, &c)) {
+                const char *name       = xs_dict_get(v, "name");
+                const xs_dict *replies = xs_dict_get(v, "replies");
+
+                if (xs_is_string(name) && xs_is_dict(replies)) {
+                    const char *ti = xs_number_str(xs_dict_get(replies, "totalItems"));
+
+                    if (xs_is_string(ti))
+                        xs_html_add(poll_result,
+                            xs_html_tag("tr",
+                                xs_html_tag("td",
+                                    xs_html_text(name),
+                                    xs_html_text(":")),
+                                xs_html_tag("td",
+                                    xs_html_text(ti))));
+                }
+            }
+
+            xs_html_add(poll,
+                poll_result);
+        }
+        else {
+            /* poll still active */
+            xs *vote_action = xs_fmt("%s/admin/vote", user->actor);
+            xs_html *form;
+            xs_html *poll_form = xs_html_tag("div",
+                xs_html_attr("class", "snac-poll-form"),
+                form = xs_html_tag("form",
+                    xs_html_attr("autocomplete", "off"),
+                    xs_html_attr("method", "post"),
+                    xs_html_attr("action", vote_action),
+                    xs_html_sctag("input",
+                        xs_html_attr("type", "hidden"),
+                        xs_html_attr("name", "actor"),
+                        xs_html_attr("value", actor)),
+                    xs_html_sctag("input",
+                        xs_html_attr("type", "hidden"),
+                        xs_html_attr("name", "irt"),
+                        xs_html_attr("value", id))));
+
+            int c = 0;
+            while (xs_list_next(p, &v, &c)) {
+                const char *name = xs_dict_get(v, "name");
+                const xs_dict *replies = xs_dict_get(v, "replies");
+
+                if (name) {
+                    char *ti = (char *)xs_number_str(xs_dict_get(replies, "totalItems"));
+
+                    xs_html *btn = xs_html_sctag("input",
+                            xs_html_attr("id", name),
+                            xs_html_attr("value", name),
+                            xs_html_attr("name", "question"));
+
+                    if (!xs_is_null(oo)) {
+                        xs_html_add(btn,
+                            xs_html_attr("type", "radio"),
+                            xs_html_attr("required", "required"));
+                    }
+                    else
+                        xs_html_add(btn,
+                            xs_html_attr("type", "checkbox"));
+
+                    xs_html_add(form,
+                        btn,
+                        xs_html_text(" "),
+                        xs_html_tag("span",
+                            xs_html_attr("title", ti),
+                            xs_html_text(name)),
+                        xs_html_sctag("br", NULL));
+                }
             }
-            else
-                tz = "";
-
-            /* if start and end share the same day, crop it from the end */
-            if (e && memcmp(s, e, 11) == 0)
-                e = xs_crop_i(e, 11, 0);
-
-            if (e)
-                s = xs_str_cat(s, " / ", e);
 
-            if (*tz)
-                s = xs_str_cat(s, " (", tz, ")");
+            xs_html_add(form,
+                xs_html_tag("p", NULL),
+                xs_html_sctag("input",
+                    xs_html_attr("type", "submit"),
+                    xs_html_attr("class", "button"),
+                    xs_html_attr("value", L("Vote"))));
 
-            /* replace ugly decimals */
-            s = xs_replace_i(s, ".000", "");
+            xs_html_add(poll,
+                poll_form);
+        }
 
-            xs_html_add(snac_content_wrap,
+        /* if it's *really* closed, say it */
+        if (closed == 2) {
+            xs_html_add(poll,
                 xs_html_tag("p",
-                    xs_html_text(L("Time: ")),
-                    xs_html_text(s)));
+                    xs_html_text(L("Closed"))));
         }
-    }
-
-    /* show all hashtags that has not been shown previously in the content */
-    const xs_list *tags = xs_dict_get(msg, "tag");
-    const char *o_content = xs_dict_get_def(msg, "content", "");
-
-    if (xs_is_string(o_content) && xs_is_list(tags) && xs_list_len(tags)) {
-        xs *content = xs_utf8_to_lower(o_content);
-        const xs_dict *tag;
+        else {
+            /* show when the poll closes */
+            const char *end_time = xs_dict_get(msg, "endTime");
 
-        xs_html *add_hashtags = xs_html_tag("ul",
-            xs_html_attr("class", "snac-more-hashtags"));
+            /* Pleroma does not have an endTime field;
+               it has a closed time in the future */
+            if (xs_is_null(end_time))
+                end_time = xs_dict_get(msg, "closed");
 
-        xs_list_foreach(tags, tag) {
-            const char *type = xs_dict_get(tag, "type");
+            if (!xs_is_null(end_time)) {
+                time_t t0 = time(NULL);
+                time_t t1 = xs_parse_iso_date(end_time, 0);
 
-            if (xs_is_string(type) && strcmp(type, "Hashtag") == 0) {
-                const char *o_href = xs_dict_get(tag, "href");
-                const char *name   = xs_dict_get(tag, "name");
+                if (t1 > 0 && t1 > t0) {
+                    time_t diff_time = t1 - t0;
+                    xs *tf = xs_str_time_diff(diff_time);
+                    char *p = tf;
 
-                if (xs_is_string(o_href) && xs_is_string(name)) {
-                    xs *href = xs_utf8_to_lower(o_href);
+                    /* skip leading zeros */
+                    for (; *p == '0' || *p == ':'; p++);
 
-                    if (xs_str_in(content, href) == -1 && xs_str_in(content, name) == -1) {
-                        /* not in the content: add here */
-                        xs_html_add(add_hashtags,
-                            xs_html_tag("li",
-                                xs_html_tag("a",
-                                    xs_html_attr("href", href),
-                                    xs_html_text(name),
-                                    xs_html_text(" "))));
-                    }
+                    xs_html_add(poll,
+                        xs_html_tag("p",
+                            xs_html_text(L("Closes in")),
+                            xs_html_text(" "),
+                            xs_html_text(p)));
                 }
             }
         }
 
-        xs_html_add(snac_content_wrap,
-            add_hashtags);
+        xs_html_add(snac_content,
+            poll);
     }
 
+    /** attachments **/
+    xs_html_add(snac_content,
+        xs_html_raw(xs_list_get(frags, 1)));
+
+    /* audience, location, time and hashtags */
+    xs_html_add(snac_content_wrap,
+        xs_html_raw(xs_list_get(frags, 2)));
+
     /** controls **/
 
     if (!read_only && user) {
@@ -3466,11 +3693,17 @@ xs_html *html_footer(const snac *user)
 }
 
 
-xs_str *html_timeline(snac *user, const xs_list *list, int read_only,
+/* places in the page skeleton where the entries and the rendering time go */
+#define HTML_ENTRIES_MARK "<!-- snac-entries -->"
+#define HTML_TIME_MARK    "<!-- snac-time -->"
+
+xs_str *html_timeline_stream(t_body_stream *s, snac *user, const xs_list *list, int read_only,
                       int skip, int show, int show_more,
                       const char *title, const char *page,
                       int utl, const char *error, int terse)
-/* returns the HTML for the timeline */
+/* writes the HTML for the timeline into the stream: the page skeleton
+   is sent first and then each entry as soon as it's rendered. Returns
+   the HTML (or its copy, if it was streamed and a tee was asked for) */
 {
     const char *v;
     double t = ftime();
@@ -3657,8 +3890,90 @@ xs_str *html_timeline(snac *user, const xs_list *list, int read_only,
                 xs_html_text(title)));
     }
 
+    xs_html_add(posts,
+        xs_html_raw(HTML_ENTRIES_MARK));
+
     xs_html_add(body, posts);
 
+    if (list && user && read_only) {
+        /** history **/
+        if (xs_type(xs_dict_get(srv_config, "disable_history")) != XSTYPE_TRUE && !terse) {
+            xs_html *ul = xs_html_tag("ul", NULL);
+
+            xs_html *history = xs_html_tag("div",
+                xs_html_attr("class", "snac-history"),
+                xs_html_tag("p",
+                    xs_html_attr("class", "snac-history-title"),
+                    xs_html_text(L("History"))),
+                    ul);
+
+            xs *list = history_list(user);
+            xs_list *p = list;
+            const char *v;
+
+            while (xs_list_iter(&p, &v)) {
+                xs *fn  = xs_replace(v, ".html", "");
+                xs *url = xs_fmt("%s/h/%s", user->actor, v);
+
+                xs_html_add(ul,
+                    xs_html_tag("li",
+                        xs_html_tag("a",
+                            xs_html_attr("href", url),
+                            xs_html_text(fn))));
+            }
+
+            xs_html_add(body,
+                history);
+        }
+    }
+
+    xs_html_add(body,
+        xs_html_raw(HTML_TIME_MARK));
+
+    if (show_more) {
+        xs *m  = NULL;
+        xs *ss = xs_fmt("skip=%d&show=%d", skip + show, show);
+
+        xs *url = xs_dup(user == NULL ? srv_baseurl : user->actor);
+
+        if (page != NULL)
+            url = xs_str_cat(url, page);
+
+        if (xs_str_in(url, "?") != -1)
+            m = xs_fmt("%s&%s", url, ss);
+        else
+            m = xs_fmt("%s?%s", url, ss);
+
+        xs_html *more_links = xs_html_tag("p",
+            xs_html_tag("a",
+                xs_html_attr("href", url),
+                xs_html_attr("name", "snac-more"),
+                xs_html_text(L("Back to top"))),
+            xs_html_text(" - "),
+            xs_html_tag("a",
+                xs_html_attr("href", m),
+                xs_html_attr("name", "snac-more"),
+                xs_html_text(L("More..."))));
+
+        xs_html_add(body,
+            more_links);
+    }
+
+    xs_html_add(body,
+        html_footer(user));
+
+    /* render the skeleton and split it where the entries go */
+    xs *skel = xs_html_render_s(html, "<!DOCTYPE html>\n");
+    char *tail = strstr(skel, HTML_ENTRIES_MARK);
+
+    *tail = '\0';
+    tail += strlen(HTML_ENTRIES_MARK);
+
+    body_stream_open(s);
+
+    fputs(skel, s->f);
+    body_stream_flush(s);
+
     int mark_shown = 0;
 
     int show_unlisted = user ? xs_is_true(xs_dict_get(user->config, "show_unlisted")) : 0;
@@ -3670,16 +3985,16 @@ xs_str *html_timeline(snac *user, const xs_list *list, int read_only,
         /* "already seen" mark? */
         if (strcmp(v, MD5_ALREADY_SEEN_MARK) == 0) {
             if (skip == 0 && !mark_shown) {
-                xs *s = xs_fmt("%s/admin", user->actor);
+                xs *url = xs_fmt("%s/admin", user->actor);
 
-                xs_html_add(posts,
+                xs_html_render_f(
                     xs_html_tag("div",
                         xs_html_attr("class", "snac-no-more-unseen-posts"),
                         xs_html_text(L("No more unseen posts")),
                         xs_html_text(" - "),
                         xs_html_tag("a",
-                            xs_html_attr("href", s),
-                            xs_html_text(L("Back to top")))));
+                            xs_html_attr("href", url),
+                            xs_html_text(L("Back to top")))), s->f);
             }
 
             mark_shown = 1;
@@ -3731,82 +4046,31 @@ xs_str *html_timeline(snac *user, const xs_list *list, int read_only,
 
         xs_html *entry = html_entry(user, msg, read_only, 0, v, (user && !hide_children) ? 0 : 1);
 
-        if (entry != NULL)
-            xs_html_add(posts,
-                entry);
-    }
-
-    if (list && user && read_only) {
-        /** history **/
-        if (xs_type(xs_dict_get(srv_config, "disable_history")) != XSTYPE_TRUE && !terse) {
-            xs_html *ul = xs_html_tag("ul", NULL);
-
-            xs_html *history = xs_html_tag("div",
-                xs_html_attr("class", "snac-history"),
-                xs_html_tag("p",
-                    xs_html_attr("class", "snac-history-title"),
-                    xs_html_text(L("History"))),
-                    ul);
-
-            xs *list = history_list(user);
-            xs_list *p = list;
-            const char *v;
-
-            while (xs_list_iter(&p, &v)) {
-                xs *fn  = xs_replace(v, ".html", "");
-                xs *url = xs_fmt("%s/h/%s", user->actor, v);
-
-                xs_html_add(ul,
-                    xs_html_tag("li",
-                        xs_html_tag("a",
-                            xs_html_attr("href", url),
-                            xs_html_text(fn))));
-            }
-
-            xs_html_add(body,
-                history);
+        if (entry != NULL) {
+            xs_html_render_f(entry, s->f);
+            body_stream_flush(s);
         }
     }
 
-    {
-        xs *s1 = xs_fmt("\n<!-- %lf seconds -->\n", ftime() - t);
-        xs_html_add(body,
-            xs_html_raw(s1));
-    }
-
-    if (show_more) {
-        xs *m  = NULL;
-        xs *ss = xs_fmt("skip=%d&show=%d", skip + show, show);
-
-        xs *url = xs_dup(user == NULL ? srv_baseurl : user->actor);
-
-        if (page != NULL)
-            url = xs_str_cat(url, page);
+    xs *s1 = xs_fmt("\n<!-- %lf seconds -->\n", ftime() - t);
+    xs *s2 = xs_replace(tail, HTML_TIME_MARK, s1);
 
-        if (xs_str_in(url, "?") != -1)
-            m = xs_fmt("%s&%s", url, ss);
-        else
-            m = xs_fmt("%s?%s", url, ss);
+    fputs(s2, s->f);
 
-        xs_html *more_links = xs_html_tag("p",
-            xs_html_tag("a",
-                xs_html_attr("href", url),
-                xs_html_attr("name", "snac-more"),
-                xs_html_text(L("Back to top"))),
-            xs_html_text(" - "),
-            xs_html_tag("a",
-                xs_html_attr("href", m),
-                xs_html_attr("name", "snac-more"),
-                xs_html_text(L("More..."))));
+    return body_stream_close(s);
+}
 
-        xs_html_add(body,
-            more_links);
-    }
 
-    xs_html_add(body,
-        html_footer(user));
+xs_str *html_timeline(snac *user, const xs_list *list, int read_only,
+                      int skip, int show, int show_more,
+                      const char *title, const char *page,
+                      int utl, const char *error, int terse)
+/* returns the HTML for the timeline */
+{
+    t_body_stream s = {0};
 
-    return xs_html_render_s(html, "<!DOCTYPE html>\n");
+    return html_timeline_stream(&s, user, list, read_only, skip, show, show_more,
+                                title, page, utl, error, terse);
 }
 
 
@@ -4644,7 +4908,9 @@ void set_user_lang(snac *user)
 
 int html_get_handler(const xs_dict *req, const char *q_path,
                      char **body, int *b_size, char **ctype,
-                     xs_str **etag, xs_str **last_modified)
+                     xs_str **etag, xs_str **last_modified,
+                     xs_str **content_range, t_file_body *file,
+                     t_body_stream *stream)
 {
     const char *accept = xs_dict_get(req, "accept");
     int status = HTTP_STATUS_NOT_FOUND;
@@ -4776,7 +5042,7 @@ int html_get_handler(const xs_dict *req, const char *q_path,
 
         if (xs_type(xs_dict_get(snac.config, "private")) == XSTYPE_TRUE) {
             /** empty public timeline for private users **/
-            *body = html_timeline(&snac, NULL, 1, 0, 0, 0, NULL, "", 1, error, terse);
+            *body = html_timeline_stream(stream, &snac, NULL, 1, 0, 0, 0, NULL, "", 1, error, terse);
             *b_size = strlen(*body);
             status  = HTTP_STATUS_OK;
         }
@@ -4784,7 +5050,7 @@ int html_get_handler(const xs_dict *req, const char *q_path,
         if (cache && history_mtime(&snac, h) > timeline_mtime(&snac)) {
             snac_debug(&snac, 1, xs_fmt("serving cached local timeline"));
 
-            status = history_get(&snac, h, body, b_size,
+            status = history_open(&snac, h, file,
                         xs_dict_get(req, "if-none-match"), etag);
         }
         else {
@@ -4799,13 +5065,21 @@ int html_get_handler(const xs_dict *req, const char *q_path,
             xs *pins = pinned_list(&snac);
             pins = xs_list_cat(pins, list);
 
-            *body = html_timeline(&snac, pins, 1, skip, show, more, NULL, "", 1, error, terse);
+            /* keep a copy of the page if it's to be cached; as it may
+               be sent before being saved, its etag is set beforehand */
+            time_t mt = time(NULL);
+            stream->tee = save;
+
+            if (save)
+                stream->etag = xs_fmt("W/\"snac-%ld\"", (long)mt);
+
+            *body = html_timeline_stream(stream, &snac, pins, 1, skip, show, more, NULL, "", 1, error, terse);
 
             *b_size = strlen(*body);
             status  = HTTP_STATUS_OK;
 
             if (save)
-                history_add(&snac, h, *body, *b_size, etag);
+                history_add(&snac, h, *body, *b_size, mt, etag);
         }
     }
     else
@@ -4927,7 +5201,7 @@ int html_get_handler(const xs_dict *req, const char *q_path,
                     xs *title = xs_fmt(xs_list_len(tl) ?
                         L("Search results for tag %s") : L("Nothing found for tag %s"), q);
 
-                    *body = html_timeline(&snac, tl, 0, skip, show, more, title, page, 0, error, terse);
+                    *body = html_timeline_stream(stream, &snac, tl, 0, skip, show, more, title, page, 0, error, terse);
                     *b_size = strlen(*body);
                     status  = HTTP_STATUS_OK;
                 }
@@ -4951,8 +5225,8 @@ int html_get_handler(const xs_dict *req, const char *q_path,
                     else
                         title = xs_fmt(L("Nothing found for '%s'"), q);
 
-                    *body   = html_timeline(&snac, tl, 0, skip, tl_len, to || tl_len == show,
-                                            title, page, 0, error, terse);
+                    *body   = html_timeline_stream(stream, &snac, tl, 0, skip, tl_len,
+                                            to || tl_len == show, title, page, 0, error, terse);
                     *b_size = strlen(*body);
                     status  = HTTP_STATUS_OK;
                 }
@@ -4968,7 +5242,7 @@ int html_get_handler(const xs_dict *req, const char *q_path,
                 if (cache && t > timeline_mtime(&snac) && t > p_state->srv_start_time) {
                     snac_debug(&snac, 1, xs_fmt("serving cached timeline"));
 
-                    status = history_get(&snac, "timeline.html_", body, b_size,
+                    status = history_open(&snac, "timeline.html_", file,
                                 xs_dict_get(req, "if-none-match"), etag);
                 }
                 else {
@@ -4978,14 +5252,20 @@ int html_get_handler(const xs_dict *req, const char *q_path,
 
                     xs *list = timeline_list(&snac, "private", skip, show, &more);
 
-                    *body = html_timeline(&snac, list, 0, skip, show,
+                    time_t mt = time(NULL);
+                    stream->tee = save;
+
+                    if (save)
+                        stream->etag = xs_fmt("W/\"snac-%ld\"", (long)mt);
+
+                    *body = html_timeline_stream(stream, &snac, list, 0, skip, show,
                             more, NULL, "/admin", 1, error, terse);
 
                     *b_size = strlen(*body);
                     status  = HTTP_STATUS_OK;
 
                     if (save)
-                        history_add(&snac, "timeline.html_", *body, *b_size, etag);
+                        history_add(&snac, "timeline.html_", *body, *b_size, mt, etag);
 
                     timeline_add_mark(&snac);
                 }
@@ -5006,7 +5286,7 @@ int html_get_handler(const xs_dict *req, const char *q_path,
                 xs *list0 = xs_list_append(xs_list_new(), md5);
                 xs *list  = timeline_top_level(&snac, list0);
 
-                *body   = html_timeline(&snac, list, 0, 0, 0, 0, NULL, "/admin", 1, error, terse);
+                *body   = html_timeline_stream(stream, &snac, list, 0, 0, 0, 0, NULL, "/admin", 1, error, terse);
                 *b_size = strlen(*body);
                 status  = HTTP_STATUS_OK;
             }
@@ -5077,7 +5357,7 @@ int html_get_handler(const xs_dict *req, const char *q_path,
             xs *list = timeline_instance_list(skip, show);
             xs *next = timeline_instance_list(skip + show, 1);
 
-            *body = html_timeline(&snac, list, 0, skip, show,
+            *body = html_timeline_stream(stream, &snac, list, 0, skip, show,
                 xs_list_len(next), L("Showing instance timeline"), "/instance", 0, error, terse);
             *b_size = strlen(*body);
             status  = HTTP_STATUS_OK;
@@ -5092,7 +5372,7 @@ int html_get_handler(const xs_dict *req, const char *q_path,
         else {
             xs *list = pinned_list(&snac);
 
-            *body = html_timeline(&snac, list, 0, skip, show,
+            *body = html_timeline_stream(stream, &snac, list, 0, skip, show,
                 0, L("Pinned posts"), "", 0, error, terse);
             *b_size = strlen(*body);
             status  = HTTP_STATUS_OK;
@@ -5108,7 +5388,7 @@ int html_get_handler(const xs_dict *req, const char *q_path,
             int more = 0;
             xs *list = timeline_list(&snac, "admire", skip, show, &more);
 
-            *body = html_timeline(&snac, list, 0, skip, show,
+            *body = html_timeline_stream(stream, &snac, list, 0, skip, show,
                 more, L("Liked, boosted or reacted posts"), "/admirations", 0, error, terse);
             *b_size = strlen(*body);
             status  = HTTP_STATUS_OK;
@@ -5123,7 +5403,7 @@ int html_get_handler(const xs_dict *req, const char *q_path,
         else {
             xs *list = bookmark_list(&snac);
 
-            *body = html_timeline(&snac, list, 0, skip, show,
+            *body = html_timeline_stream(stream, &snac, list, 0, skip, show,
                 0, L("Bookmarked posts"), "", 0, error, terse);
             *b_size = strlen(*body);
             status  = HTTP_STATUS_OK;
@@ -5138,7 +5418,7 @@ int html_get_handler(const xs_dict *req, const char *q_path,
         else {
             xs *list = draft_list(&snac);
 
-            *body = html_timeline(&snac, list, 0, skip, show,
+            *body = html_timeline_stream(stream, &snac, list, 0, skip, show,
                 0, L("Post drafts"), "", 0, error, terse);
             *b_size = strlen(*body);
             status  = HTTP_STATUS_OK;
@@ -5153,7 +5433,7 @@ int html_get_handler(const xs_dict *req, const char *q_path,
         else {
             xs *list = scheduled_list(&snac);
 
-            *body = html_timeline(&snac, list, 0, skip, show,
+            *body = html_timeline_stream(stream, &snac, list, 0, skip, show,
                 0, L("Scheduled posts"), "", 0, error, terse);
             *b_size = strlen(*body);
             status  = HTTP_STATUS_OK;
@@ -5179,7 +5459,7 @@ int html_get_handler(const xs_dict *req, const char *q_path,
                 xs *name = list_maint(&snac, lid, 3);
                 xs *title = xs_fmt(L("Showing timeline for list '%s'"), name);
 
-                *body = html_timeline(&snac, ttl, 0, skip, show,
+                *body = html_timeline_stream(stream, &snac, ttl, 0, skip, show,
                     xs_list_len(next), title, base, 1, error, terse);
                 *b_size = strlen(*body);
                 status  = HTTP_STATUS_OK;
@@ -5200,7 +5480,7 @@ int html_get_handler(const xs_dict *req, const char *q_path,
 
             list = xs_list_append(list, md5);
 
-            *body   = html_timeline(&snac, list, 1, 0, 0, 0, NULL, "", 1, error, terse);
+            *body   = html_timeline_stream(stream, &snac, list, 1, 0, 0, 0, NULL, "", 1, error, terse);
             *b_size = strlen(*body);
             status  = HTTP_STATUS_OK;
         }
@@ -5209,16 +5489,14 @@ int html_get_handler(const xs_dict *req, const char *q_path,
     if (xs_startswith(p_path, "s/")) { /** a static file **/
         xs *l    = xs_split_n(p_path, "/", 1);
         const char *id = xs_list_get(l, 1);
-        int sz;
 
         if (id && *id) {
-            status = static_get(&snac, id, body, &sz,
+            /* sent straight from the file */
+            status = static_open(&snac, id, file,
                         xs_dict_get(req, "if-none-match"), etag);
 
-            if (valid_status(status)) {
-                *b_size = sz;
-                *ctype  = (char *)xs_mime_by_ext(id);
-            }
+            if (valid_status(status))
+                *ctype = (char *)xs_mime_by_ext(id);
         }
     }
     else
@@ -5233,13 +5511,14 @@ int html_get_handler(const xs_dict *req, const char *q_path,
         const char *id = xs_list_get(l, 1);
 
         if (id && *id) {
-            if (xs_endswith(id, "timeline.html_")) {
-                /* Don't let them in */
+            if (!xs_endswith(id, ".html")) {
+                /* Don't let them in the timeline cache
+                   nor in the compressed variants */
                 *b_size = 0;
                 status = HTTP_STATUS_NOT_FOUND;
             }
             else
-                status = history_get(&snac, id, body, b_size,
+                status = history_open(&snac, id, file,
                             xs_dict_get(req, "if-none-match"), etag);
         }
     }
@@ -5311,6 +5590,18 @@ int html_get_handler(const xs_dict *req, const char *q_path,
             if (ims) hdrs = xs_dict_append(hdrs, "if-modified-since", ims);
             if (inm) hdrs = xs_dict_append(hdrs, "if-none-match", inm);
 
+            /* forward ranges, so that seeking in media
+               doesn't download it all every time */
+            const char *range = xs_dict_get(req, "range");
+            const char *if_range = xs_dict_get(req, "if-range");
+
+            if (xs_is_string(range)) {
+                hdrs = xs_dict_append(hdrs, "range", range);
+
+                if (xs_is_string(if_range))
+                    hdrs = xs_dict_append(hdrs, "if-range", if_range);
+            }
+
             xs *rsp = xs_http_request("GET", url, hdrs,
                         NULL, 0, &status, body, b_size, 0);
 
@@ -5318,10 +5609,28 @@ int html_get_handler(const xs_dict *req, const char *q_path,
                 const char *ct = xs_or(xs_dict_get(rsp, "content-type"), "");
                 const char *lm = xs_dict_get(rsp, "last-modified");
                 const char *et = xs_dict_get(rsp, "etag");
+                const char *cr = xs_dict_get(rsp, "content-range");
 
                 if (lm) *last_modified = xs_dup(lm);
                 if (et) *etag = xs_dup(et);
 
+                if (status == HTTP_STATUS_PARTIAL_CONTENT && cr)
+                    *content_range = xs_dup(cr);
+                else
+                if (status == HTTP_STATUS_OK && xs_is_string(range) && !xs_is_string(if_range)) {
+                    /* the origin ignored the range: cut it from the full body */
+                    off_t start, len;
+
+                    if (xs_httpd_range(range, *b_size, &start, &len) == 1) {
+                        *content_range = xs_fmt("bytes %lld-%lld/%d", (long long)start,
+                                        (long long)(start + len - 1), *b_size);
+
+                        memmove(*body, *body + start, len);
+                        *b_size = len;
+                        status  = HTTP_STATUS_PARTIAL_CONTENT;
+                    }
+                }
+
                 /* find the content-type in the static mime types,
                    and return that value instead of ct, which will
                    be destroyed when out of scope */
@@ -5335,6 +5644,12 @@ int html_get_handler(const xs_dict *req, const char *q_path,
 
             snac_debug(&snac, 1, xs_fmt("Proxy for %s %d", url, status));
 
+            if (status == HTTP_STATUS_RANGE_NOT_SATISFIABLE) {
+                const char *cr = xs_dict_get(rsp, "content-range");
+
+                if (cr) *content_range = xs_dup(cr);
+            }
+            else
             if (status >= 400 && status <= 499)
                 status = HTTP_STATUS_NOT_FOUND;
         }
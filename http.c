@@ -11,6 +11,102 @@
 
 #include "snac.h"
 
+#include <pthread.h>
+
+/** parsed key cache **/
+
+#define KEY_CACHE_SIZE 256
+
+typedef struct {
+    unsigned int hash;
+    int secret;
+    xs_str *keyid;
+    xs_str *pem;
+    void *pkey;
+    unsigned long used;
+} key_cache_ent;
+
+static key_cache_ent key_cache[KEY_CACHE_SIZE];
+static unsigned long key_cache_tick = 0;
+static pthread_mutex_t key_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static key_cache_ent *_key_cache_slot(const char *keyid, unsigned int hash, int secret)
+/* returns the entry for a keyid, or the least recently used one */
+{
+    key_cache_ent *lru = &key_cache[0];
+    int n;
+
+    for (n = 0; n < KEY_CACHE_SIZE; n++) {
+        key_cache_ent *e = &key_cache[n];
+
+        if (e->keyid && e->hash == hash && e->secret == secret && strcmp(e->keyid, keyid) == 0)
+            return e;
+
+        if (e->used < lru->used)
+            lru = e;
+    }
+
+    return lru;
+}
+
+
+static void *key_cache_get(const char *keyid, const char *pem, int secret)
+/* returns a reference to the parsed PEM key of keyid (to be freed) */
+{
+    unsigned int hash = xs_hash_func(keyid, strlen(keyid));
+    key_cache_ent *e;
+    void *pkey = NULL;
+
+    pthread_mutex_lock(&key_cache_mutex);
+
+    e = _key_cache_slot(keyid, hash, secret);
+
+    /* the PEM is compared to detect key rotations */
+    if (e->keyid && e->secret == secret && strcmp(e->keyid, keyid) == 0 &&
+        strcmp(e->pem, pem) == 0) {
+        e->used = ++key_cache_tick;
+        pkey = xs_evp_key_ref(e->pkey);
+    }
+
+    if (p_state != NULL) {
+        if (pkey)
+            p_state->key_cache_hits++;
+        else
+            p_state->key_cache_misses++;
+    }
+
+    pthread_mutex_unlock(&key_cache_mutex);
+
+    if (pkey != NULL)
+        return pkey;
+
+    /* parse it out of the lock */
+    if ((pkey = xs_evp_key_load(pem, secret)) == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&key_cache_mutex);
+
+    e = _key_cache_slot(keyid, hash, secret);
+
+    /* users of the previous key hold their own references */
+    xs_evp_key_free(e->pkey);
+    xs_free(e->keyid);
+    xs_free(e->pem);
+
+    e->hash   = hash;
+    e->secret = secret;
+    e->keyid  = xs_dup(keyid);
+    e->pem    = xs_dup(pem);
+    e->pkey   = xs_evp_key_ref(pkey);
+    e->used   = ++key_cache_tick;
+
+    pthread_mutex_unlock(&key_cache_mutex);
+
+    return pkey;
+}
+
+
 xs_dict *http_signed_request_raw(const char *keyid, const char *seckey,
                             const char *method, const char *url,
                             const xs_dict *headers,
@@ -67,7 +163,11 @@ xs_dict *http_signed_request_raw(const char *keyid, const char *seckey,
                     strcmp(method, "POST") == 0 ? "post" : "get",
                     target, host, digest, date);
 
-        s64 = xs_evp_sign(seckey, s, strlen(s));
+        void *pkey = key_cache_get(keyid, seckey, 1);
+
+        s64 = xs_evp_sign_key(pkey, s, strlen(s));
+
+        xs_evp_key_free(pkey);
     }
 
     /* build now the signature header */
@@ -265,7 +365,12 @@ int check_signature(const xs_dict *req, xs_str **err, xs_str **key_id)
         }
     }
 
-    if (xs_evp_verify(pubkey, sig_str, strlen(sig_str), signature) != 1) {
+    void *pkey = key_cache_get(keyId, pubkey, 0);
+    int r = xs_evp_verify_key(pkey, sig_str, strlen(sig_str), signature);
+
+    xs_evp_key_free(pkey);
+
+    if (r != 1) {
         *err = xs_fmt("RSA verify error %s", keyId);
         return 0;
     }
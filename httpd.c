@@ -14,6 +14,7 @@
 #include "xs_fcgi.h"
 #include "xs_html.h"
 #include "xs_webmention.h"
+#include "xs_curl.h"
 
 #include "snac.h"
 
@@ -26,9 +27,15 @@
 #include <sys/resource.h> // for getrlimit()
 
 #include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 
-#ifdef USE_POLL_FOR_SLEEP
 #include <poll.h>
+#include <limits.h>
+#include <zlib.h>
+
+#ifdef WITH_BROTLI
+#include <brotli/encode.h>
 #endif
 
 /** server state **/
@@ -37,19 +44,29 @@ srv_state *p_state = NULL;
 
 /** job control **/
 
-/* mutex to access the lists of jobs */
-static pthread_mutex_t job_mutex;
-
-/* semaphore to trigger job processing */
-static sem_t *job_sem;
+/* Jobs are processed by two pools of threads, each one with its own
+   FIFO: one serves HTTP requests and the other processes queue items,
+   so slow deliveries can never take the threads needed to serve */
 
 typedef struct job_fifo_item {
     struct job_fifo_item *next;
     xs_val *job;
 } job_fifo_item;
 
-static job_fifo_item *job_fifo_first = NULL;
-static job_fifo_item *job_fifo_last  = NULL;
+typedef struct {
+    pthread_mutex_t mutex;      /* mutex to access the list of jobs */
+    sem_t *sem;                 /* semaphore to trigger job processing */
+    sem_t anon_sem;
+    xs_str *sem_name;
+    job_fifo_item *first;
+    job_fifo_item *last;
+} job_pool;
+
+static job_pool job_pools[N_POOLS];
+
+/* set when the background thread holds queue items back
+   (accessed atomically, as job threads release it) */
+static int queue_held = 0;
 
 
 /** other global data **/
@@ -457,8 +474,447 @@ int server_post_handler(const xs_dict *req, const char *q_path,
 }
 
 
-void httpd_connection(FILE *f)
-/* the connection processor */
+static pthread_mutex_t state_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void state_count(int *counter)
+/* increments a server state counter */
+{
+    pthread_mutex_lock(&state_mutex);
+    (*counter)++;
+    pthread_mutex_unlock(&state_mutex);
+}
+
+
+static int httpd_keepalive(const xs_dict *req, int n_req)
+/* checks if the connection can be kept open after this request */
+{
+    int max_req = xs_number_get(xs_dict_get_def(srv_config, "keepalive_max_requests", "100"));
+    const char *proto = xs_dict_get(req, "proto");
+    xs *conn = xs_tolower_i(xs_dup(xs_dict_get_def(req, "connection", "")));
+
+    if (p_state->use_fcgi || !p_state->srv_running)
+        return 0;
+
+    if (xs_number_get(xs_dict_get(srv_config, "keepalive_timeout")) <= 0.0)
+        return 0;
+
+    if (max_req > 0 && n_req >= max_req)
+        return 0;
+
+    /* HTTP/1.1 connections are persistent by default; 1.0 ones must ask */
+    if (xs_str_in(conn, "close") != -1)
+        return 0;
+
+    if (xs_type(proto) == XSTYPE_STRING && strcmp(proto, "HTTP/1.1") == 0)
+        return 1;
+
+    return xs_str_in(conn, "keep-alive") != -1;
+}
+
+
+/** response compression **/
+
+static int comp_accepts(const char *accept, const char *enc)
+/* checks if an encoding is in the accept-encoding header (and not q=0) */
+{
+    xs *l = xs_split(accept, ",");
+    const char *v;
+
+    xs_list_foreach(l, v) {
+        xs *s = xs_strip_i(xs_dup(v));
+        xs *p = xs_split_n(s, ";", 1);
+        xs *n = xs_strip_i(xs_dup(xs_list_get(p, 0)));
+
+        if (strcmp(n, enc) == 0 || strcmp(n, "*") == 0) {
+            const char *q = xs_list_get(p, 1);
+
+            if (q && (q = strstr(q, "q=")) != NULL && atof(q + 2) <= 0.0)
+                return 0;
+
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static int comp_type(const char *ctype)
+/* checks if a content type is worth compressing */
+{
+    return ctype && (xs_startswith(ctype, "text/") ||
+        xs_str_in(ctype, "json") != -1 || xs_str_in(ctype, "xml") != -1 ||
+        xs_str_in(ctype, "javascript") != -1);
+}
+
+
+static const char *comp_encoding(const xs_dict *req, const char *ctype, off_t size)
+/* returns the encoding to be used for a response (NULL: none).
+   A size of -1 means the body is streamed */
+{
+    const char *accept = xs_dict_get(req, "accept-encoding");
+
+    if (!xs_is_string(accept) || !comp_type(ctype))
+        return NULL;
+
+    if (xs_is_true(xs_dict_get(srv_config, "disable_compression")))
+        return NULL;
+
+    if (size >= 0 && size < xs_number_get(xs_dict_get_def(srv_config, "compression_min_size", "1024")))
+        return NULL;
+
+#ifdef WITH_BROTLI
+    /* streamed bodies are always compressed with gzip */
+    if (size >= 0 && comp_accepts(accept, "br"))
+        return "br";
+#endif
+
+    if (comp_accepts(accept, "gzip"))
+        return "gzip";
+
+    return NULL;
+}
+
+
+static xs_str *comp_compress(const char *enc, const char *data, int size, int *c_size)
+/* compresses data; returns NULL on error or if it doesn't get smaller */
+{
+    xs_str *c = NULL;
+
+#ifdef WITH_BROTLI
+    if (strcmp(enc, "br") == 0) {
+        size_t sz = BrotliEncoderMaxCompressedSize(size);
+
+        c = xs_realloc(NULL, sz + 1);
+
+        if (!BrotliEncoderCompress(5, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                size, (const uint8_t *)data, &sz, (uint8_t *)c) || (int)sz >= size)
+            return xs_free(c);
+
+        *c_size = sz;
+        return c;
+    }
+#else
+    (void)enc; /* always gzip */
+#endif
+
+    z_stream zs = {0};
+
+    /* 15 + 16: maximum window, with the gzip header */
+    if (deflateInit2(&zs, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+
+    uLong sz = deflateBound(&zs, size);
+
+    c = xs_realloc(NULL, sz + 1);
+
+    zs.next_in   = (Bytef *)data;
+    zs.avail_in  = size;
+    zs.next_out  = (Bytef *)c;
+    zs.avail_out = sz;
+
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END || (int)zs.total_out >= size)
+        c = xs_free(c);
+    else
+        *c_size = zs.total_out;
+
+    deflateEnd(&zs);
+
+    return c;
+}
+
+
+static int comp_newer(const struct timespec *a, const struct timespec *b)
+/* returns true if a is not older than b (with sub-second resolution) */
+{
+    return a->tv_sec > b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec >= b->tv_nsec);
+}
+
+
+static void comp_variant_store(const char *fn, const char *vfn,
+                               const struct stat *sb, const char *data, int size)
+/* stores a compressed variant next to its file, if it didn't change meanwhile
+   (same inode, size and modification time, to the nanosecond) */
+{
+    static int cnt = 0;
+    xs *tmp = xs_fmt("%s.%d.%d.tmp", vfn, getpid(),
+                    __atomic_add_fetch(&cnt, 1, __ATOMIC_RELAXED));
+    struct stat sb2;
+    FILE *f;
+
+    if ((f = fopen(tmp, "w")) == NULL)
+        return;
+
+    fwrite(data, size, 1, f);
+
+    if (fclose(f) == EOF || stat(fn, &sb2) == -1 ||
+        sb2.st_ino != sb->st_ino || sb2.st_size != sb->st_size ||
+        sb2.st_mtim.tv_sec != sb->st_mtim.tv_sec || sb2.st_mtim.tv_nsec != sb->st_mtim.tv_nsec ||
+        rename(tmp, vfn) == -1)
+        unlink(tmp);
+}
+
+
+static int comp_file(t_file_body *file, const char *enc, xs_str **body, int *b_size)
+/* compresses a file body, sending instead its cached variant if it's
+   up to date, or storing it for the next time if it's not. Returns
+   non-zero if the body is now compressed */
+{
+    xs *vfn = xs_fmt("%s.%s", file->fn, strcmp(enc, "br") == 0 ? "br" : "gz");
+    struct stat sb, vsb;
+    int vfd;
+
+    if (fstat(file->fd, &sb) == -1)
+        return 0;
+
+    /* the variant is written after reading its file, so it must be newer */
+    if (stat(vfn, &vsb) == 0 && comp_newer(&vsb.st_mtim, &sb.st_mtim) && vsb.st_size > 0 &&
+        (vfd = open(vfn, O_RDONLY)) != -1) {
+        /* the cached variant is good */
+        close(file->fd);
+
+        file->fd     = vfd;
+        file->offset = 0;
+        file->size   = vsb.st_size;
+
+        state_count(&p_state->n_comp_cached);
+        return 1;
+    }
+
+    /* compress it and store it for the next time */
+    xs *data = xs_realloc(NULL, file->size + 1);
+    int c_size;
+
+    if (pread(file->fd, data, file->size, file->offset) != file->size)
+        return 0;
+
+    if ((*body = comp_compress(enc, data, file->size, &c_size)) == NULL)
+        return 0;
+
+    comp_variant_store(file->fn, vfn, &sb, *body, c_size);
+
+    close(file->fd);
+
+    file->fd   = -1;
+    file->size = 0;
+    *b_size    = c_size;
+
+    return 1;
+}
+
+
+/** streamed responses **/
+
+typedef struct {
+    FILE *o;            /* connection */
+    int fcgi_id;        /* FastCGI request id */
+    int keep_alive;     /* persistent connection */
+    const char *enc;    /* content encoding (NULL: none) */
+    z_stream zs;        /* gzip compressor */
+    xs_dict *headers;   /* sent headers */
+    int error;          /* the body could not be sent */
+} httpd_stream;
+
+
+void body_stream_open(t_body_stream *s)
+/* opens a body stream, to be written into s->f */
+{
+    s->buf  = NULL;
+    s->size = 0;
+    s->f    = open_memstream(&s->buf, &s->size);
+}
+
+
+int body_stream_flush(t_body_stream *s)
+/* sends what was written into a streamed body up to now
+   (if it's not streamed, it's just kept). Returns -1 on error */
+{
+    int ret = 0;
+
+    if (s->send == NULL)
+        return 0;
+
+    fclose(s->f);
+
+    if (s->size) {
+        if (s->tee)
+            s->copy = xs_append_m(s->copy ? s->copy : xs_str_new(NULL), s->buf, s->size);
+
+        ret = s->send(s, s->buf, s->size);
+        s->sent += s->size;
+    }
+
+    free(s->buf);
+    body_stream_open(s);
+
+    return ret;
+}
+
+
+xs_str *body_stream_close(t_body_stream *s)
+/* closes a body stream. Returns the body, or its copy if it was streamed
+   (an empty string if no copy was asked for) */
+{
+    if (s->send == NULL) {
+        fclose(s->f);
+        s->f = NULL;
+
+        return s->buf;
+    }
+
+    body_stream_flush(s);
+
+    fclose(s->f);
+    free(s->buf);
+    s->f = NULL;
+
+    xs_str *copy = s->copy ? s->copy : xs_str_new(NULL);
+    s->copy = NULL;
+
+    return copy;
+}
+
+
+static xs_dict *httpd_headers(xs_dict *headers, int status, const char *ctype,
+                              const xs_dict *more, const char *enc, int keep_alive)
+/* adds the headers that go in all responses */
+{
+    const char *k, *v;
+
+    headers = xs_dict_append(headers, "content-type", ctype);
+    headers = xs_dict_append(headers, "x-creator",    USER_AGENT);
+
+    /* the ones specific to this response */
+    if (xs_is_dict(more)) {
+        xs_dict_foreach(more, k, v)
+            headers = xs_dict_append(headers, k, v);
+    }
+
+    /* if there are any additional headers, add them */
+    const xs_dict *more_headers = xs_dict_get(srv_config, "http_headers");
+    if (xs_type(more_headers) == XSTYPE_DICT) {
+        int c = 0;
+        while (xs_dict_next(more_headers, &k, &v, &c))
+            headers = xs_dict_set(headers, k, v);
+    }
+
+    if (enc != NULL)
+        headers = xs_dict_append(headers, "content-encoding", enc);
+
+    if (status == HTTP_STATUS_OK && comp_type(ctype) &&
+        !xs_is_true(xs_dict_get(srv_config, "disable_compression")))
+        headers = xs_dict_append(headers, "vary", "accept-encoding");
+
+    headers = xs_dict_append(headers, "access-control-allow-origin", "*");
+    headers = xs_dict_append(headers, "access-control-allow-headers", "*");
+    headers = xs_dict_append(headers, "access-control-expose-headers", "Link");
+
+    /* disable any form of fucking JavaScript */
+    headers = xs_dict_append(headers, "Content-Security-Policy", "script-src ;");
+
+    if (!p_state->use_fcgi)
+        headers = xs_dict_append(headers, "connection", keep_alive ? "keep-alive" : "close");
+
+    return headers;
+}
+
+
+static int httpd_stream_chunk(httpd_stream *hs, const char *data, int size)
+/* sends a chunk of a streamed body (a size of 0 ends it) */
+{
+    if (p_state->use_fcgi)
+        return xs_fcgi_response_chunk(hs->o, data, size, hs->fcgi_id);
+    else
+        return xs_httpd_response_chunk(hs->o, data, size);
+}
+
+
+static int httpd_stream_send(t_body_stream *s, const char *data, int size)
+/* sends data of a streamed body, preceded by the headers the first
+   time, and compressed if the client accepts it. A size of 0 ends it.
+   Returns -1 on error */
+{
+    httpd_stream *hs = s->ctx;
+    const char *ctype = "text/html; charset=utf-8";
+
+    if (hs->error)
+        return -1;
+
+    if (s->sent == 0) {
+        /* first data: send the headers */
+        int r;
+
+        if (hs->enc != NULL && deflateInit2(&hs->zs, 6, Z_DEFLATED,
+                    15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            hs->enc = NULL;
+
+        xs *more = NULL;
+
+        /* the page is also being cached: send the etag it will have */
+        if (s->etag != NULL) {
+            more = xs_dict_new();
+            more = xs_dict_append(more, "etag", s->etag);
+        }
+
+        hs->headers = httpd_headers(xs_dict_new(), HTTP_STATUS_OK, ctype,
+                            more, hs->enc, hs->keep_alive);
+
+        if (p_state->use_fcgi)
+            r = xs_fcgi_response_start(hs->o, HTTP_STATUS_OK, hs->headers, hs->fcgi_id);
+        else
+            r = xs_httpd_response_start(hs->o, HTTP_STATUS_OK,
+                        xs_http_status_text(HTTP_STATUS_OK), hs->headers);
+
+        if (r == -1) {
+            hs->error = 1;
+            return -1;
+        }
+    }
+
+    if (hs->enc != NULL) {
+        /* compress it, flushing the compressor so that the
+           client can show what it has received up to now */
+        char out[16384];
+
+        hs->zs.next_in  = (Bytef *)data;
+        hs->zs.avail_in = size;
+
+        do {
+            hs->zs.next_out  = (Bytef *)out;
+            hs->zs.avail_out = sizeof(out);
+
+            deflate(&hs->zs, size ? Z_SYNC_FLUSH : Z_FINISH);
+
+            int n = sizeof(out) - hs->zs.avail_out;
+
+            if (n && httpd_stream_chunk(hs, out, n) == -1)
+                hs->error = 1;
+
+        } while (hs->zs.avail_out == 0 && !hs->error);
+
+        if (size == 0) {
+            pthread_mutex_lock(&state_mutex);
+            p_state->n_comp_responses++;
+            p_state->comp_bytes_saved += hs->zs.total_in - hs->zs.total_out;
+            pthread_mutex_unlock(&state_mutex);
+
+            deflateEnd(&hs->zs);
+        }
+    }
+    else
+    if (size && httpd_stream_chunk(hs, data, size) == -1)
+        hs->error = 1;
+
+    if (size == 0 && !hs->error && httpd_stream_chunk(hs, NULL, 0) == -1)
+        hs->error = 1;
+
+    return hs->error ? -1 : 0;
+}
+
+
+static int httpd_request(FILE *f, FILE *o, int n_req)
+/* processes a request. Returns non-zero if the connection is
+   to be kept open for more requests */
 {
     xs *req;
     const char *method;
@@ -472,6 +928,12 @@ void httpd_connection(FILE *f)
     xs *etag     = NULL;
     xs *last_modified = NULL;
     xs *link     = NULL;
+    xs *content_range = NULL;
+    t_file_body file = { -1, 0, 0, NULL };
+    xs *c_body   = NULL;
+    int c_size   = 0;
+    t_body_stream stream = {0};
+    httpd_stream hs = {0};
     int p_size   = 0;
     const char *p;
     int fcgi_id;
@@ -483,16 +945,21 @@ void httpd_connection(FILE *f)
 
     if (req == NULL) {
         /* probably because a timeout */
-        fclose(f);
-        return;
+        return 0;
     }
 
     if (!(method = xs_dict_get(req, "method")) || !(p = xs_dict_get(req, "path"))) {
         /* missing needed headers; discard */
-        fclose(f);
-        return;
+        return 0;
     }
 
+    state_count(&p_state->n_requests);
+
+    if (n_req > 1)
+        state_count(&p_state->n_reused_requests);
+
+    int keep_alive = httpd_keepalive(req, n_req);
+
     q_path = xs_dup(p);
 
     /* crop the q_path from leading / and the prefix */
@@ -510,6 +977,22 @@ void httpd_connection(FILE *f)
         status = HTTP_STATUS_FOUND;
     }
 
+    /* bodies built incrementally (timelines) can be sent while
+       they are being built, if the client can receive them chunked */
+    const char *proto = xs_dict_get(req, "proto");
+
+    if (strcmp(method, "GET") == 0 &&
+        !xs_is_true(xs_dict_get(srv_config, "disable_streaming")) &&
+        (p_state->use_fcgi || (xs_is_string(proto) && strcmp(proto, "HTTP/1.1") == 0))) {
+        hs.o          = o;
+        hs.fcgi_id    = fcgi_id;
+        hs.keep_alive = keep_alive;
+        hs.enc        = comp_encoding(req, "text/html", -1);
+
+        stream.send = httpd_stream_send;
+        stream.ctx  = &hs;
+    }
+
     if (strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0) {
         /* cascade through */
         if (status == 0)
@@ -530,7 +1013,8 @@ void httpd_connection(FILE *f)
 #endif /* NO_MASTODON_API */
 
         if (status == 0)
-            status = html_get_handler(req, q_path, &body, &b_size, &ctype, &etag, &last_modified);
+            status = html_get_handler(req, q_path, &body, &b_size, &ctype,
+                        &etag, &last_modified, &content_range, &file, &stream);
     }
     else
     if (strcmp(method, "POST") == 0) {
@@ -600,6 +1084,59 @@ void httpd_connection(FILE *f)
         status = HTTP_STATUS_NOT_FOUND;
     }
 
+    stream.etag = xs_free(stream.etag);
+
+    if (stream.sent) {
+        /* the body was sent while it was being built; end it */
+        if (stream.send(&stream, NULL, 0) == -1 || fflush(o) == EOF)
+            keep_alive = 0;
+
+        if (b_size == 0 && body != NULL)
+            b_size = strlen(body);
+
+        srv_archive("RECV", NULL, req, payload, p_size, status, hs.headers, body, b_size);
+
+        xs_free(hs.headers);
+        xs_free(file.fn);
+        xs_free(body);
+
+        return keep_alive;
+    }
+
+    /* files can be requested partially */
+    if (file.fd != -1 && status == HTTP_STATUS_OK) {
+        const char *range    = xs_dict_get(req, "range");
+        const char *if_range = xs_dict_get(req, "if-range");
+
+        headers = xs_dict_append(headers, "accept-ranges", "bytes");
+
+        /* if-range is just compared with the etag; if it doesn't
+           match, the client has an old version and gets it all */
+        if (xs_is_string(range) &&
+            (!xs_is_string(if_range) || (etag && strcmp(if_range, etag) == 0))) {
+            off_t start, len;
+            int r = xs_httpd_range(range, file.size, &start, &len);
+
+            if (r == 1) {
+                content_range = xs_fmt("bytes %lld-%lld/%lld", (long long)start,
+                                (long long)(start + len - 1), (long long)file.size);
+
+                file.offset += start;
+                file.size    = len;
+                status       = HTTP_STATUS_PARTIAL_CONTENT;
+            }
+            else
+            if (r == -1) {
+                content_range = xs_fmt("bytes */%lld", (long long)file.size);
+
+                close(file.fd);
+                file.fd   = -1;
+                file.size = 0;
+                status = HTTP_STATUS_RANGE_NOT_SATISFIABLE;
+            }
+        }
+    }
+
     if (body == NULL) {
         if (status == HTTP_STATUS_FORBIDDEN)
             body = xs_str_new("<h1>403 Forbidden (" USER_AGENT ")</h1>");
@@ -631,184 +1168,1354 @@ void httpd_connection(FILE *f)
     if (ctype == NULL)
         ctype = "text/html; charset=utf-8";
 
-    headers = xs_dict_append(headers, "content-type", ctype);
-    headers = xs_dict_append(headers, "x-creator",    USER_AGENT);
+    /* the headers specific to this response */
+    xs *more = xs_dict_new();
 
     if (!xs_is_null(etag))
-        headers = xs_dict_append(headers, "etag", etag);
+        more = xs_dict_append(more, "etag", etag);
     if (!xs_is_null(last_modified))
-        headers = xs_dict_append(headers, "last-modified", last_modified);
+        more = xs_dict_append(more, "last-modified", last_modified);
     if (!xs_is_null(link))
-        headers = xs_dict_append(headers, "Link", link);
-
-    /* if there are any additional headers, add them */
-    const xs_dict *more_headers = xs_dict_get(srv_config, "http_headers");
-    if (xs_type(more_headers) == XSTYPE_DICT) {
-        const char *k, *v;
-        int c = 0;
-        while (xs_dict_next(more_headers, &k, &v, &c))
-            headers = xs_dict_set(headers, k, v);
-    }
+        more = xs_dict_append(more, "Link", link);
+    if (!xs_is_null(content_range))
+        more = xs_dict_append(more, "content-range", content_range);
 
     if (b_size == 0 && body != NULL)
         b_size = strlen(body);
 
-    /* if it was a HEAD, no body will be sent */
-    if (strcmp(method, "HEAD") == 0)
-        body = xs_free(body);
+    /* compress the body, if the client accepts it */
+    const char *c_enc = NULL;
 
-    headers = xs_dict_append(headers, "access-control-allow-origin", "*");
-    headers = xs_dict_append(headers, "access-control-allow-headers", "*");
-    headers = xs_dict_append(headers, "access-control-expose-headers", "Link");
+    if (status == HTTP_STATUS_OK && strcmp(method, "HEAD") != 0 && content_range == NULL) {
+        off_t o_size = file.fd != -1 ? file.size : b_size;
+        const char *enc = comp_encoding(req, ctype, o_size);
 
-    /* disable any form of fucking JavaScript */
-    headers = xs_dict_append(headers, "Content-Security-Policy", "script-src ;");
+        if (enc != NULL) {
+            int done;
 
-    if (p_state->use_fcgi)
-        xs_fcgi_response(f, status, headers, body, b_size, fcgi_id);
-    else
-        xs_httpd_response(f, status, xs_http_status_text(status), headers, body, b_size);
+            if (file.fd != -1)
+                done = file.fn != NULL && comp_file(&file, enc, &c_body, &c_size);
+            else
+                done = (c_body = comp_compress(enc, body, b_size, &c_size)) != NULL;
 
-    fclose(f);
+            if (done) {
+                c_enc = enc;
 
-    srv_archive("RECV", NULL, req, payload, p_size, status, headers, body, b_size);
+                pthread_mutex_lock(&state_mutex);
+                p_state->n_comp_responses++;
+                p_state->comp_bytes_saved += o_size - (c_body ? c_size : file.size);
+                pthread_mutex_unlock(&state_mutex);
+            }
+        }
+    }
 
-    /* JSON validation check */
-    if (!xs_is_null(body) && strcmp(ctype, "application/json") == 0) {
-        xs *j = xs_json_loads(body);
+    headers = httpd_headers(headers, status, ctype, more, c_enc, keep_alive);
 
-        if (j == NULL) {
-            srv_log(xs_fmt("bad JSON"));
-            srv_archive_error("bad_json", "bad JSON", req, body);
+    /* if it was a HEAD, no body will be sent */
+    if (strcmp(method, "HEAD") == 0) {
+        body = xs_free(body);
+
+        if (file.fd != -1) {
+            close(file.fd);
+            file.fd = -1;
         }
     }
 
-    xs_free(body);
-}
+    if (file.size != 0) {
+        /* the body is sent from a file */
+        int r;
 
+        if (p_state->use_fcgi)
+            r = xs_fcgi_response_file(o, status, headers, file.fd,
+                        file.offset, file.size, fcgi_id);
+        else
+            r = xs_httpd_response_file(o, status, xs_http_status_text(status), headers,
+                        file.fd, file.offset, file.size);
+
+        if (r == -1)
+            keep_alive = 0;
+    }
+    else
+    if (c_body != NULL) {
+        /* the body is sent compressed */
+        if (p_state->use_fcgi)
+            xs_fcgi_response(o, status, headers, c_body, c_size, fcgi_id);
+        else
+            xs_httpd_response(o, status, xs_http_status_text(status), headers, c_body, c_size);
+    }
+    else
+    if (p_state->use_fcgi)
+        xs_fcgi_response(o, status, headers, body, b_size, fcgi_id);
+    else
+        xs_httpd_response(o, status, xs_http_status_text(status), headers, body, b_size);
+
+    if (file.fd != -1)
+        close(file.fd);
+
+    xs_free(file.fn);
+
+    if (fflush(o) == EOF)
+        keep_alive = 0;
+
+    srv_archive("RECV", NULL, req, payload, p_size, status, headers, body, b_size);
+
+    /* JSON validation check */
+    if (!xs_is_null(body) && strcmp(ctype, "application/json") == 0) {
+        xs *j = xs_json_loads(body);
+
+        if (j == NULL) {
+            srv_log(xs_fmt("bad JSON"));
+            srv_archive_error("bad_json", "bad JSON", req, body);
+        }
+    }
+
+    xs_free(body);
+
+    return keep_alive;
+}
+
+
+void httpd_connection(FILE *f)
+/* the connection processor (FastCGI) */
+{
+    state_count(&p_state->n_connections);
+
+    httpd_request(f, f, 1);
+
+    fclose(f);
+}
+
+
+static void _job_post(int pool, const xs_val *job, int urgent)
+/* adds a job to the FIFO of a pool */
+{
+    if (job != NULL) {
+        job_pool *jp = &job_pools[pool];
+
+        /* allocate before locking, to keep the mutex held for as
+           short as possible */
+        job_fifo_item *i = xs_realloc(NULL, sizeof(job_fifo_item));
+        *i = (job_fifo_item){ NULL, xs_dup(job) };
+
+        /* lock the mutex */
+        pthread_mutex_lock(&jp->mutex);
+
+        if (jp->first == NULL)
+            jp->first = jp->last = i;
+        else
+        if (urgent) {
+            /* prepend */
+            i->next = jp->first;
+            jp->first = i;
+        }
+        else {
+            /* append */
+            jp->last->next = i;
+            jp->last = i;
+        }
+
+        p_state->job_fifo_size++;
+
+        if (p_state->job_fifo_size > p_state->peak_job_fifo_size)
+            p_state->peak_job_fifo_size = p_state->job_fifo_size;
+
+        p_state->pool[pool].fifo_size++;
+
+        if (p_state->pool[pool].fifo_size > p_state->pool[pool].peak_fifo_size)
+            p_state->pool[pool].peak_fifo_size = p_state->pool[pool].fifo_size;
+
+        /* unlock the mutex */
+        pthread_mutex_unlock(&jp->mutex);
+
+        /* ask for someone to attend it */
+        sem_post(jp->sem);
+    }
+}
+
+
+static void job_wait(int pool, xs_val **job)
+/* waits for an available job in a pool */
+{
+    job_pool *jp = &job_pools[pool];
+    job_fifo_item *i = NULL;
+
+    *job = NULL;
+
+    if (sem_wait(jp->sem) == 0) {
+        /* lock the mutex */
+        pthread_mutex_lock(&jp->mutex);
+
+        /* dequeue */
+        i = jp->first;
+
+        if (i != NULL) {
+            jp->first = i->next;
+
+            if (jp->first == NULL)
+                jp->last = NULL;
+
+            p_state->job_fifo_size--;
+            p_state->pool[pool].fifo_size--;
+        }
+
+        /* unlock the mutex */
+        pthread_mutex_unlock(&jp->mutex);
+    }
+
+    /* free outside the lock */
+    if (i != NULL) {
+        *job = i->job;
+        xs_free(i);
+    }
+}
+
+
+static int job_pool_init(int pool)
+/* initializes a job pool */
+{
+    job_pool *jp = &job_pools[pool];
+
+    pthread_mutex_init(&jp->mutex, NULL);
+    jp->sem_name = xs_fmt("/job_%d_%d", getpid(), pool);
+    jp->sem      = sem_open(jp->sem_name, O_CREAT, 0644, 0);
+
+    if (jp->sem == NULL) {
+        /* error opening a named semaphore; try with an anonymous one */
+        if (sem_init(&jp->anon_sem, 0, 0) != -1)
+            jp->sem = &jp->anon_sem;
+    }
+
+    return jp->sem != NULL;
+}
+
+
+static int queue_room(void)
+/* returns how many queue items can be posted before hitting the
+   high water mark of the queue pool (4 jobs per thread) */
+{
+    return p_state->pool[POOL_QUEUE].n_threads * 4 -
+        __atomic_load_n(&p_state->pool[POOL_QUEUE].fifo_size, __ATOMIC_RELAXED);
+}
+
+
+/** delivery lanes **/
+
+/* Output items reach the job FIFO through a lane for their destination
+   host. Each lane limits the deliveries in flight to that host; the
+   limit adapts AIMD-style (it grows by one for each window of
+   successful deliveries and halves on each failure) up to
+   'max_deliveries_per_host'. Items over the limit wait in the lane.
+   After several consecutive failures the lane's circuit breaker opens
+   and its items are requeued without even trying, until a cooldown
+   (that doubles each time) passes; then deliveries resume one at a
+   time. Lanes of hosts registered as failing by instance_failure()
+   also start one at a time. As the waiting items are already out of
+   the queue, lane_flush() writes them back to it on shutdown. Lanes
+   that stay idle (empty, with nothing in flight and the breaker closed)
+   for a while are dropped */
+
+#define LANE_BREAKER_FAILURES 5
+#define LANE_BUCKETS 1024
+#define LANE_IDLE_SECS 600
+
+typedef struct lane {
+    struct lane *h_next;    /* hash chain */
+    xs_str *host;
+    time_t last_used;
+    int in_flight;          /* deliveries being processed */
+    double cwnd;            /* adaptive concurrency limit */
+    int fails;              /* consecutive failures */
+    int opens;              /* consecutive circuit breaker openings */
+    time_t open_until;      /* circuit breaker open until this time */
+    job_fifo_item *first;   /* items waiting for a slot */
+    job_fifo_item *last;
+    int depth;
+    int n_ok;
+    int n_err;
+    int avg_ms;
+} lane;
+
+static pthread_mutex_t lane_mutex = PTHREAD_MUTEX_INITIALIZER;
+static lane *lanes[LANE_BUCKETS];
+static int lane_tick = 0;
+static time_t lane_gc_time = 0;
+
+
+static xs_str *_lane_host(const char *inbox)
+/* returns the host (and port) of an inbox */
+{
+    const char *p = strstr(inbox, "://");
+    const char *e;
+
+    p = p ? p + 3 : inbox;
+
+    if ((e = strchr(p, '/')) == NULL)
+        e = p + strlen(p);
+
+    return xs_str_new_sz(p, e - p);
+}
+
+
+static lane **_lane_slot(const char *host)
+/* returns the hash chain slot where the lane of a host is (or would be)
+   (lane_mutex must be locked) */
+{
+    lane **l = &lanes[xs_hash_func(host, strlen(host)) % LANE_BUCKETS];
+
+    while (*l && strcmp((*l)->host, host) != 0)
+        l = &(*l)->h_next;
+
+    return l;
+}
+
+
+static lane *_lane_lock(const char *inbox)
+/* locks lane_mutex and returns the lane of an inbox, creating it if needed.
+   Checking if its host is already failing needs file I/O, so it's done
+   with the mutex unlocked */
+{
+    xs *host = _lane_host(inbox);
+    lane **l;
+
+    pthread_mutex_lock(&lane_mutex);
+
+    if (*(l = _lane_slot(host)) == NULL) {
+        pthread_mutex_unlock(&lane_mutex);
+
+        int failing = instance_failure(inbox, 3);
+
+        pthread_mutex_lock(&lane_mutex);
+
+        /* it may have been created meanwhile */
+        if (*(l = _lane_slot(host)) == NULL) {
+            *l = xs_realloc(NULL, sizeof(lane));
+            **l = (lane){ .host = xs_dup(host), .cwnd = 2.0 };
+
+            /* already failing? start slowly */
+            if (failing)
+                (*l)->fails = 1;
+        }
+    }
+
+    (*l)->last_used = time(NULL);
+
+    return *l;
+}
+
+
+static void _lane_gc(void)
+/* drops the lanes that have been idle for a while (lane_mutex must be locked) */
+{
+    time_t t = time(NULL);
+    int n;
+
+    if (t - lane_gc_time < 60)
+        return;
+
+    lane_gc_time = t;
+
+    for (n = 0; n < LANE_BUCKETS; n++) {
+        lane **l = &lanes[n];
+
+        while (*l) {
+            lane *d = *l;
+
+            if (d->first == NULL && d->in_flight == 0 && d->open_until <= t &&
+                t - d->last_used > LANE_IDLE_SECS) {
+                *l = d->h_next;
+                xs_free(d->host);
+                xs_free(d);
+            }
+            else
+                l = &d->h_next;
+        }
+    }
+}
+
+
+static int _lane_limit(const lane *l)
+/* returns the current in flight limit of a lane */
+{
+    int max = xs_number_get(xs_dict_get_def(srv_config, "max_deliveries_per_host", "4"));
+    int lim = (int)l->cwnd;
+
+    if (max < 1)
+        max = 1;
+
+    if (l->fails || lim < 1)
+        lim = 1;
+
+    return lim > max ? max : lim;
+}
+
+
+static void _lane_stats(const lane *l)
+/* updates the statistics of a lane (lane_mutex must be locked) */
+{
+    int n, lru = 0;
+
+    if (p_state == NULL)
+        return;
+
+    for (n = 0; n < MAX_LANE_STATS; n++) {
+        if (strcmp(p_state->lane[n].host, l->host) == 0)
+            break;
+
+        if (p_state->lane[n].tick < p_state->lane[lru].tick)
+            lru = n;
+    }
+
+    if (n == MAX_LANE_STATS) {
+        n = lru;
+        memset(&p_state->lane[n], '\0', sizeof(p_state->lane[n]));
+        strncpy(p_state->lane[n].host, l->host, sizeof(p_state->lane[n].host) - 1);
+    }
+
+    p_state->lane[n].tick      = ++lane_tick;
+    p_state->lane[n].depth     = l->depth;
+    p_state->lane[n].in_flight = l->in_flight;
+    p_state->lane[n].limit     = _lane_limit(l);
+    p_state->lane[n].n_ok      = l->n_ok;
+    p_state->lane[n].n_err     = l->n_err;
+    p_state->lane[n].avg_ms    = l->avg_ms;
+    p_state->lane[n].open      = l->open_until > time(NULL);
+}
+
+
+static int lane_admit(const xs_dict *q_item)
+/* admits an output item to be processed now, or keeps it in its lane */
+{
+    const char *inbox = xs_dict_get(q_item, "inbox");
+    int ret = 1;
+
+    if (!xs_is_string(inbox))
+        return ret;
+
+    lane *l = _lane_lock(inbox);
+
+    if (l->in_flight < _lane_limit(l))
+        l->in_flight++;
+    else {
+        job_fifo_item *i = xs_realloc(NULL, sizeof(job_fifo_item));
+        *i = (job_fifo_item){ NULL, xs_dup(q_item) };
+
+        if (l->first == NULL)
+            l->first = l->last = i;
+        else {
+            l->last->next = i;
+            l->last = i;
+        }
+
+        l->depth++;
+        ret = 0;
+    }
+
+    _lane_stats(l);
+
+    pthread_mutex_unlock(&lane_mutex);
+
+    return ret;
+}
+
+
+void lane_result(const char *inbox, int status, int ms)
+/* registers the result of a delivery */
+{
+    lane *l = _lane_lock(inbox);
+
+    /* exponential moving average */
+    l->avg_ms = l->avg_ms ? (l->avg_ms * 7 + ms) / 8 : ms;
+
+    /* only network errors, timeouts and server errors are the host's fault */
+    if (valid_status(status) || (status >= 400 && status < 500 &&
+        status != HTTP_STATUS_REQUEST_TIMEOUT &&
+        status != HTTP_STATUS_TOO_MANY_REQUESTS &&
+        status != HTTP_STATUS_CLIENT_CLOSED_REQUEST)) {
+        l->n_ok++;
+        l->fails = 0;
+        l->opens = 0;
+
+        /* additive increase */
+        l->cwnd += 1.0 / l->cwnd;
+
+        double max = xs_number_get(xs_dict_get_def(srv_config, "max_deliveries_per_host", "4"));
+
+        if (l->cwnd > max)
+            l->cwnd = max;
+    }
+    else {
+        l->n_err++;
+        l->fails++;
+
+        /* multiplicative decrease */
+        l->cwnd /= 2.0;
+
+        if (l->cwnd < 1.0)
+            l->cwnd = 1.0;
+
+        if (l->fails >= LANE_BREAKER_FAILURES) {
+            int secs = 30 << (l->opens < 5 ? l->opens : 5);
+
+            l->open_until = time(NULL) + secs;
+            l->opens++;
+            l->fails = 1;
+
+            srv_log(xs_fmt("circuit breaker open for %s (%d seconds)", l->host, secs));
+        }
+    }
+
+    _lane_stats(l);
+
+    pthread_mutex_unlock(&lane_mutex);
+}
+
+
+int lane_blocked(const char *inbox)
+/* returns true if the circuit breaker of this inbox's host is open */
+{
+    int ret;
+
+    lane *l = _lane_lock(inbox);
+    ret = l->open_until > time(NULL);
+
+    pthread_mutex_unlock(&lane_mutex);
+
+    return ret;
+}
+
+
+static void lane_done(const xs_dict *q_item)
+/* frees the slot of a processed output item and admits the next ones */
+{
+    const char *inbox = xs_dict_get(q_item, "inbox");
+    job_fifo_item *ready = NULL;
+    job_fifo_item *tail  = NULL;
+
+    if (!xs_is_string(inbox))
+        return;
+
+    lane *l = _lane_lock(inbox);
+
+    l->in_flight--;
+
+    /* on shutdown, they stay in the lane to be written back */
+    while (p_state->srv_running && l->first != NULL && l->in_flight < _lane_limit(l)) {
+        job_fifo_item *i = l->first;
+
+        if ((l->first = i->next) == NULL)
+            l->last = NULL;
+
+        /* keep them in order */
+        i->next = NULL;
+
+        if (ready == NULL)
+            ready = tail = i;
+        else {
+            tail->next = i;
+            tail = i;
+        }
+
+        l->depth--;
+        l->in_flight++;
+    }
+
+    _lane_stats(l);
+
+    _lane_gc();
+
+    pthread_mutex_unlock(&lane_mutex);
+
+    while (ready != NULL) {
+        job_fifo_item *i = ready;
+        ready = i->next;
+
+        _job_post(POOL_QUEUE, i->job, 0);
+
+        xs_free(i->job);
+        xs_free(i);
+    }
+}
+
+
+static int lane_flush(void)
+/* writes the items waiting in the lanes back to the queue;
+   returns the number of items */
+{
+    job_fifo_item *waiting = NULL;
+    int cnt = 0;
+    int n;
+
+    /* take them all under the lock; write them after it */
+    pthread_mutex_lock(&lane_mutex);
+
+    for (n = 0; n < LANE_BUCKETS; n++) {
+        lane *l;
+
+        for (l = lanes[n]; l != NULL; l = l->h_next) {
+            if (l->last != NULL) {
+                l->last->next = waiting;
+                waiting = l->first;
+            }
+
+            l->first = l->last = NULL;
+            l->depth = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&lane_mutex);
+
+    while (waiting != NULL) {
+        job_fifo_item *i = waiting;
+        waiting = i->next;
+
+        queue_put_back(i->job);
+        cnt++;
+
+        xs_free(i->job);
+        xs_free(i);
+    }
+
+    return cnt;
+}
+
+
+void job_post(const xs_val *job, int urgent)
+/* posts a job for the threads to process it */
+{
+    /* connections and requests go to the HTTP pool */
+    if (xs_type(job) != XSTYPE_DICT) {
+        _job_post(POOL_HTTP, job, urgent);
+        return;
+    }
+
+    /* output items go through the lane of their destination */
+    if (strcmp(xs_dict_get_def(job, "type", ""), "output") == 0 && !lane_admit(job))
+        return;
+
+    _job_post(POOL_QUEUE, job, urgent);
+}
+
+
+/** connection front end **/
+
+/* Plain HTTP connections are read by the main thread, that polls all
+   of them and only posts complete requests to the job FIFO, so slow
+   or idle clients don't keep job threads busy. Once served, kept-alive
+   connections return here through a pipe. FastCGI connections are
+   still read from the job threads */
+
+#define HTTP_MAX_HEADER_SIZE    (64 * 1024)
+
+typedef struct {
+    int fd;                 /* client socket (-1: free slot) */
+    int busy;               /* a job thread is serving a request */
+    int n_req;              /* number of requests dispatched */
+    int hdr_size;           /* size of the headers, once complete */
+    int req_size;           /* size of the request, once known */
+    int scan_pos;           /* where the header or chunk scan resumes */
+    int in_trailer;         /* the chunk scan reached the trailer */
+    int chunked;            /* the body is chunked */
+    char *buf;              /* input buffer */
+    int b_size;
+    int b_alloc;
+    time_t deadline;        /* time to get a complete request */
+} http_conn;
+
+/* jobs for the HTTP pool: whole connections (FastCGI) or
+   requests already read by the front end */
+enum { HTTP_JOB_CONN, HTTP_JOB_REQUEST };
+
+typedef struct {
+    int type;               /* HTTP_JOB_* */
+    FILE *f;                /* the connection (HTTP_JOB_CONN) */
+    int slot;
+    int fd;
+    int n_req;
+    int size;
+    char *buf;              /* the request (owned by the job) */
+} http_job;
+
+typedef struct {
+    int slot;
+    int keep_alive;
+} http_done;
+
+static http_conn *http_conns = NULL;
+static int http_max_conns = 0;
+static long long http_max_body = 0;
+static int http_done_pipe[2] = { -1, -1 };
+
+
+static int http_request_size(http_conn *c)
+/* returns the size of the complete request at the start of the
+   connection buffer, 0 if more data is needed, -1 if it's invalid
+   or -2 if its body is too large. Scanning resumes where the
+   previous call stopped */
+{
+    const char *buf = c->buf;
+    int size = c->b_size;
+    int n;
+
+    if (c->hdr_size == 0) {
+        /* find the empty line after the headers */
+        for (n = c->scan_pos; n < size - 1; n++) {
+            if (buf[n] == '\n') {
+                if (buf[n + 1] == '\n') {
+                    c->hdr_size = n + 2;
+                    break;
+                }
+
+                if (buf[n + 1] == '\r' && n + 2 < size && buf[n + 2] == '\n') {
+                    c->hdr_size = n + 3;
+                    break;
+                }
+            }
+        }
+
+        if (c->hdr_size == 0) {
+            /* the last two bytes may be the start of the empty line */
+            c->scan_pos = size > 2 ? size - 2 : 0;
+            return size > HTTP_MAX_HEADER_SIZE ? -1 : 0;
+        }
+
+        c->scan_pos = 0;
+    }
+
+    if (c->req_size)
+        return c->req_size <= size ? c->req_size : 0;
+
+    /* search for the payload headers */
+    xs *hdrs = xs_str_new_sz(buf, c->hdr_size);
+    hdrs = xs_tolower_i(hdrs);
+
+    const char *cl = strstr(hdrs, "\ncontent-length:");
+    const char *te = strstr(hdrs, "\ntransfer-encoding:");
+
+    /* a chunked transfer encoding overrides the content length */
+    c->chunked = te != NULL && xs_startswith(te + 19 + strspn(te + 19, " \t"), "chunked");
+
+    if (cl != NULL && !c->chunked) {
+        long long l = atoll(cl + 16);
+
+        if (l < 0 || l > INT_MAX - c->hdr_size)
+            return -1;
+
+        if (l > http_max_body)
+            return -2;
+
+        c->req_size = c->hdr_size + (int)l;
+
+        return c->req_size <= size ? c->req_size : 0;
+    }
+
+    if (c->chunked) {
+        /* resume from the first chunk (or trailer line) not yet complete */
+        int pos = c->scan_pos ? c->scan_pos : c->hdr_size;
+
+        /* walk the chunks */
+        while (!c->in_trailer) {
+            const char *nl = memchr(buf + pos, '\n', size - pos);
+
+            if (nl == NULL) {
+                c->scan_pos = pos;
+                return 0;
+            }
+
+            long chunk_size = strtol(buf + pos, NULL, 16);
+            int end = nl - buf + 1;
+
+            if (chunk_size <= 0) {
+                pos = end;
+                c->in_trailer = 1;
+                break;
+            }
+
+            if (chunk_size > INT_MAX - end - 2)
+                return -1;
+
+            if (end + chunk_size - c->hdr_size > http_max_body)
+                return -2;
+
+            /* skip the chunk and its trailing line */
+            end += chunk_size;
+
+            if (end >= size || (nl = memchr(buf + end, '\n', size - end)) == NULL) {
+                c->scan_pos = pos;
+                return 0;
+            }
+
+            pos = nl - buf + 1;
+        }
+
+        /* skip the (probably empty) trailer */
+        for (;;) {
+            const char *nl = memchr(buf + pos, '\n', size - pos);
+
+            if (nl == NULL) {
+                c->scan_pos = pos;
+                return 0;
+            }
+
+            int empty = (nl - buf == pos || (nl - buf == pos + 1 && buf[pos] == '\r'));
+
+            pos = nl - buf + 1;
+
+            if (empty)
+                break;
+        }
+
+        return pos;
+    }
+
+    return c->req_size = c->hdr_size;
+}
 
-void job_post(const xs_val *job, int urgent)
-/* posts a job for the threads to process it */
+
+static void http_conn_close(http_conn *c)
+/* closes a front end connection */
 {
-    if (job != NULL) {
-        /* lock the mutex */
-        pthread_mutex_lock(&job_mutex);
+    close(c->fd);
+    xs_free(c->buf);
 
-        job_fifo_item *i = xs_realloc(NULL, sizeof(job_fifo_item));
-        *i = (job_fifo_item){ NULL, xs_dup(job) };
+    *c = (http_conn){ .fd = -1 };
 
-        if (job_fifo_first == NULL)
-            job_fifo_first = job_fifo_last = i;
-        else
-        if (urgent) {
-            /* prepend */
-            i->next = job_fifo_first;
-            job_fifo_first = i;
+    pthread_mutex_lock(&state_mutex);
+    p_state->conns_open--;
+    pthread_mutex_unlock(&state_mutex);
+}
+
+
+static int http_chunks_copy(const char *buf, int pos, int size, char *out)
+/* walks the (already validated) chunks of a body starting at pos,
+   copying their data to out, if set; returns the size of the data */
+{
+    int len = 0;
+
+    for (;;) {
+        const char *nl = memchr(buf + pos, '\n', size - pos);
+        long chunk_size;
+
+        if (nl == NULL || (chunk_size = strtol(buf + pos, NULL, 16)) <= 0)
+            break;
+
+        pos = nl - buf + 1;
+
+        if (out != NULL)
+            memcpy(out + len, buf + pos, chunk_size);
+
+        len += chunk_size;
+        pos += chunk_size;
+
+        /* skip the line after the chunk */
+        if ((nl = memchr(buf + pos, '\n', size - pos)) == NULL)
+            break;
+
+        pos = nl - buf + 1;
+    }
+
+    return len;
+}
+
+
+static char *http_dechunk(const char *buf, int hdr_size, int size, int *n_size)
+/* rewrites a request with a chunked body as one with a content length,
+   so that the request parser never has to deal with chunks; returns
+   the new request and its size in n_size */
+{
+    int b_size = http_chunks_copy(buf, hdr_size, size, NULL);
+    xs *cl = xs_fmt("content-length: %d\r\n\r\n", b_size);
+    char *out = xs_realloc(NULL, hdr_size + strlen(cl) + b_size);
+    int pos = 0;
+    int o = 0;
+
+    /* lowercased copy, to find the headers to be dropped */
+    xs *hdrs = xs_tolower_i(xs_str_new_sz(buf, hdr_size));
+
+    /* copy the header lines, but the empty one and the framing ones */
+    while (pos < hdr_size) {
+        const char *nl = memchr(buf + pos, '\n', hdr_size - pos);
+        int end = nl ? nl - buf + 1 : hdr_size;
+
+        if (pos && (buf[pos] == '\n' || buf[pos] == '\r'))
+            break;
+
+        if (!xs_startswith(hdrs + pos, "transfer-encoding:") &&
+            !xs_startswith(hdrs + pos, "content-length:")) {
+            memcpy(out + o, buf + pos, end - pos);
+            o += end - pos;
         }
-        else {
-            /* append */
-            job_fifo_last->next = i;
-            job_fifo_last = i;
+
+        pos = end;
+    }
+
+    memcpy(out + o, cl, strlen(cl));
+    o += strlen(cl);
+
+    http_chunks_copy(buf, hdr_size, size, out + o);
+
+    *n_size = o + b_size;
+
+    return out;
+}
+
+
+static int http_conn_dispatch(int slot)
+/* posts the complete request in the connection buffer, if any.
+   Returns -1 if the connection is to be closed */
+{
+    http_conn *c = &http_conns[slot];
+    int size;
+
+    if (c->busy || c->b_size == 0)
+        return 0;
+
+    if ((size = http_request_size(c)) == -2) {
+        /* body too large: tell the client before closing */
+        const char *r = "HTTP/1.1 413 Payload Too Large\r\n"
+            "content-length: 0\r\nconnection: close\r\n\r\n";
+
+        if (send(c->fd, r, strlen(r), MSG_DONTWAIT) == -1)
+            srv_debug(1, xs_fmt("front end: cannot send 413 (%s)", strerror(errno)));
+
+        return -1;
+    }
+
+    if (size <= 0)
+        return size;
+
+    http_job j = { HTTP_JOB_REQUEST, NULL, slot, c->fd, ++c->n_req, size, c->buf };
+
+    /* keep what's left (pipelined requests) for later */
+    c->b_alloc = c->b_size - size;
+    c->b_size  = c->b_size - size;
+    c->buf     = NULL;
+
+    if (c->b_size) {
+        c->buf = xs_realloc(NULL, c->b_alloc);
+        memcpy(c->buf, j.buf + size, c->b_size);
+    }
+
+    if (c->chunked) {
+        char *buf = http_dechunk(j.buf, c->hdr_size, size, &j.size);
+
+        xs_free(j.buf);
+        j.buf = buf;
+    }
+
+    c->hdr_size   = 0;
+    c->req_size   = 0;
+    c->scan_pos   = 0;
+    c->in_trailer = 0;
+    c->chunked    = 0;
+    c->busy       = 1;
+
+    xs *job = xs_data_new(&j, sizeof(j));
+    job_post(job, 1);
+
+    return 0;
+}
+
+
+static void http_conn_serve(const http_job *j)
+/* serves a request read by the front end (called from job threads) */
+{
+    http_done d = { j->slot, 0 };
+    FILE *f = fmemopen(j->buf, j->size, "r");
+    int fd = dup(j->fd);
+    FILE *o = fd != -1 ? fdopen(fd, "w") : NULL;
+
+    if (f != NULL && o != NULL)
+        d.keep_alive = httpd_request(f, o, j->n_req);
+
+    if (f != NULL)
+        fclose(f);
+
+    if (o != NULL)
+        fclose(o);
+    else
+    if (fd != -1)
+        close(fd);
+
+    xs_free(j->buf);
+
+    /* give the connection back */
+    write(http_done_pipe[1], &d, sizeof(d));
+}
+
+
+static void http_conn_loop(int rs)
+/* the front end loop: accepts connections and reads requests */
+{
+    int n_fds = http_max_conns + 2;
+    struct pollfd *fds = xs_realloc(NULL, n_fds * sizeof(struct pollfd));
+    int *slots = xs_realloc(NULL, n_fds * sizeof(int));
+    double read_timeout = xs_number_get(xs_dict_get_def(srv_config, "read_timeout", "10"));
+    int n;
+
+    for (;;) {
+        time_t t = time(NULL);
+        int keepalive_timeout = xs_number_get(xs_dict_get(srv_config, "keepalive_timeout"));
+        int nf = 0;
+
+        fds[nf++] = (struct pollfd){ http_done_pipe[0], POLLIN, 0 };
+
+        /* don't accept more connections if the limit is reached */
+        if (p_state->conns_open < http_max_conns)
+            fds[nf++] = (struct pollfd){ rs, POLLIN, 0 };
+
+        for (n = 0; n < http_max_conns; n++) {
+            http_conn *c = &http_conns[n];
+
+            if (c->fd == -1 || c->busy)
+                continue;
+
+            if (c->deadline < t) {
+                /* idle kept-alive connections just time out */
+                if (c->b_size || c->n_req == 0)
+                    state_count(&p_state->n_read_timeouts);
+
+                http_conn_close(c);
+                continue;
+            }
+
+            slots[nf] = n;
+            fds[nf++] = (struct pollfd){ c->fd, POLLIN, 0 };
         }
 
-        p_state->job_fifo_size++;
+        if (poll(fds, nf, 1000) <= 0)
+            continue;
 
-        if (p_state->job_fifo_size > p_state->peak_job_fifo_size)
-            p_state->peak_job_fifo_size = p_state->job_fifo_size;
+        t = time(NULL);
 
-        /* unlock the mutex */
-        pthread_mutex_unlock(&job_mutex);
+        for (n = 0; n < nf; n++) {
+            if (fds[n].revents == 0)
+                continue;
 
-        /* ask for someone to attend it */
-        sem_post(job_sem);
+            if (fds[n].fd == http_done_pipe[0]) {
+                http_done d;
+
+                while (read(http_done_pipe[0], &d, sizeof(d)) == sizeof(d)) {
+                    http_conn *c = &http_conns[d.slot];
+
+                    c->busy = 0;
+
+                    if (!d.keep_alive)
+                        http_conn_close(c);
+                    else {
+                        c->deadline = c->b_size ? t + read_timeout : t + keepalive_timeout;
+
+                        /* there may be a pipelined request already */
+                        if (http_conn_dispatch(d.slot) == -1)
+                            http_conn_close(c);
+                    }
+                }
+            }
+            else
+            if (fds[n].fd == rs) {
+                int cs = xs_socket_accept(rs);
+
+                if (cs == -1) {
+                    srv_log(xs_fmt("error: xs_socket_accept failed: %s", strerror(errno)));
+                    continue;
+                }
+
+                int s;
+                for (s = 0; http_conns[s].fd != -1; s++);
+
+                http_conns[s] = (http_conn){ .fd = cs, .deadline = t + read_timeout };
+
+                state_count(&p_state->n_connections);
+
+                pthread_mutex_lock(&state_mutex);
+
+                if (++p_state->conns_open > p_state->peak_conns_open)
+                    p_state->peak_conns_open = p_state->conns_open;
+
+                pthread_mutex_unlock(&state_mutex);
+            }
+            else {
+                http_conn *c = &http_conns[slots[n]];
+
+                /* closed or reused in this same round? */
+                if (c->fd != fds[n].fd || c->busy)
+                    continue;
+
+                if (c->b_alloc - c->b_size < 16384) {
+                    /* grow geometrically, but not much beyond the request size, if known */
+                    long long a = c->b_size < 16384 ? 32768 : (long long)c->b_size * 2;
+
+                    if (c->req_size && a > (long long)c->req_size + 16384)
+                        a = (long long)c->req_size + 16384;
+
+                    if (a < (long long)c->b_size + 16384)
+                        a = (long long)c->b_size + 16384;
+
+                    if (a > INT_MAX)
+                        a = INT_MAX;
+
+                    c->b_alloc = (int)a;
+                    c->buf = xs_realloc(c->buf, c->b_alloc);
+                }
+
+                ssize_t r = recv(c->fd, c->buf + c->b_size, c->b_alloc - c->b_size, MSG_DONTWAIT);
+
+                if (r == 0 || (r == -1 && errno != EAGAIN && errno != EINTR)) {
+                    /* closed by the peer */
+                    http_conn_close(c);
+                    continue;
+                }
+
+                if (r > 0) {
+                    /* start counting from the first byte of a new request */
+                    if (c->b_size == 0)
+                        c->deadline = t + read_timeout;
+
+                    c->b_size += r;
+
+                    /* while reading the body, only fail on inactivity */
+                    if (c->hdr_size)
+                        c->deadline = t + read_timeout;
+
+                    if (http_conn_dispatch(slots[n]) == -1)
+                        http_conn_close(c);
+                }
+            }
+        }
     }
 }
 
 
-void job_wait(xs_val **job)
-/* waits for an available job */
+static int http_conn_init(void)
+/* initializes the front end */
 {
-    *job = NULL;
+    int n;
 
-    if (sem_wait(job_sem) == 0) {
-        /* lock the mutex */
-        pthread_mutex_lock(&job_mutex);
+    http_max_conns = xs_number_get(xs_dict_get_def(srv_config, "max_connections", "256"));
+    http_max_body  = 1024 * 1024 *
+        (long long)xs_number_get(xs_dict_get_def(srv_config, "max_request_size_mb", "64"));
 
-        /* dequeue */
-        job_fifo_item *i = job_fifo_first;
+    /* don't go beyond the available file descriptors */
+    struct rlimit r;
+    if (getrlimit(RLIMIT_NOFILE, &r) != -1 && r.rlim_cur != RLIM_INFINITY &&
+        http_max_conns > (int)r.rlim_cur - 64)
+        http_max_conns = (int)r.rlim_cur - 64;
 
-        if (i != NULL) {
-            job_fifo_first = i->next;
+    if (http_max_conns < 1)
+        http_max_conns = 1;
 
-            if (job_fifo_first == NULL)
-                job_fifo_last = NULL;
+    if (pipe(http_done_pipe) == -1)
+        return 0;
 
-            *job = i->job;
-            xs_free(i);
+    fcntl(http_done_pipe[0], F_SETFL, O_NONBLOCK);
 
-            p_state->job_fifo_size--;
+    http_conns = xs_realloc(NULL, http_max_conns * sizeof(http_conn));
+
+    for (n = 0; n < http_max_conns; n++)
+        http_conns[n] = (http_conn){ .fd = -1 };
+
+    srv_debug(1, xs_fmt("front end: up to %d connections", http_max_conns));
+
+    return 1;
+}
+
+
+/** per-user queues **/
+
+/* The background thread doesn't process user queues itself; it posts
+   a job for each user with pending work to the job threads. A user
+   is never dispatched again until its current job ends, so its queue
+   is still processed in order */
+
+static pthread_mutex_t uq_mutex = PTHREAD_MUTEX_INITIALIZER;
+static xs_dict *uq_busy = NULL;
+
+
+static int _uq_stats_slot(const char *uid)
+/* returns the statistics slot for a user, or -1 if there is no room */
+{
+    int n;
+
+    for (n = 0; n < MAX_USER_QUEUE_STATS; n++) {
+        if (p_state->user_q[n].uid[0] == '\0') {
+            strncpy(p_state->user_q[n].uid, uid, sizeof(p_state->user_q[n].uid) - 1);
+            return n;
         }
 
-        /* unlock the mutex */
-        pthread_mutex_unlock(&job_mutex);
+        if (strcmp(p_state->user_q[n].uid, uid) == 0)
+            return n;
+    }
+
+    return -1;
+}
+
+
+static int user_queue_dispatch(const char *uid, int max_jobs)
+/* posts a job to process a user queue, if it has work and it's not busy */
+{
+    int depth;
+
+    pthread_mutex_lock(&uq_mutex);
+
+    if (uq_busy == NULL)
+        uq_busy = xs_dict_new();
+
+    int busy = xs_dict_get(uq_busy, uid) != NULL || p_state->user_queue_jobs >= max_jobs;
+
+    pthread_mutex_unlock(&uq_mutex);
+
+    if (busy)
+        return 0;
+
+    if ((depth = user_queue_pending(uid)) == 0)
+        return 0;
+
+    xs *posted = xs_number_new(ftime());
+
+    pthread_mutex_lock(&uq_mutex);
+
+    uq_busy = xs_dict_set(uq_busy, uid, posted);
+    p_state->user_queue_jobs++;
+
+    int n = _uq_stats_slot(uid);
+
+    if (n != -1) {
+        p_state->user_q[n].depth = depth;
+        p_state->user_q[n].busy  = 1;
+    }
+
+    pthread_mutex_unlock(&uq_mutex);
+
+    xs *q_item = xs_dict_new();
+    q_item = xs_dict_append(q_item, "type",   "user_queue");
+    q_item = xs_dict_append(q_item, "uid",    uid);
+    q_item = xs_dict_append(q_item, "posted", posted);
+    job_post(q_item, 0);
+
+    return 1;
+}
+
+
+static void user_queue_job(const xs_dict *q_item)
+/* processes a user queue from a job thread */
+{
+    const char *uid = xs_dict_get(q_item, "uid");
+    double posted   = xs_number_get(xs_dict_get(q_item, "posted"));
+    snac user;
+    int cnt = 0;
+
+    if (user_open(&user, uid)) {
+        cnt = process_user_queue(&user);
+        user_free(&user);
+    }
+    else {
+        /* the user is gone: forget its items */
+        xs *l = qsched_take(uid);
+    }
+
+    int ms = (int)((ftime() - posted) * 1000);
+
+    pthread_mutex_lock(&uq_mutex);
+
+    uq_busy = xs_dict_del(uq_busy, uid);
+    p_state->user_queue_jobs--;
+
+    int n = _uq_stats_slot(uid);
+
+    if (n != -1) {
+        p_state->user_q[n].busy     = 0;
+        p_state->user_q[n].n_items += cnt;
+        p_state->user_q[n].last_ms  = ms;
+
+        if (ms > p_state->user_q[n].peak_ms)
+            p_state->user_q[n].peak_ms = ms;
     }
+
+    pthread_mutex_unlock(&uq_mutex);
+
+    /* wake up the background thread, as more items
+       for this user may have become due meanwhile */
+    qsched_kick();
 }
 
 
 static void *job_thread(void *arg)
 /* job thread */
 {
-    int pid = (int)(uintptr_t)arg;
+    int pid  = (int)(uintptr_t)arg;
+    int pool = pid > p_state->pool[POOL_HTTP].n_threads ? POOL_QUEUE : POOL_HTTP;
 
-    srv_debug(1, xs_fmt("job thread %d started", pid));
+    srv_debug(1, xs_fmt("job thread %d started (%s)", pid, pool == POOL_HTTP ? "http" : "queue"));
 
     for (;;) {
         xs *job = NULL;
 
         p_state->th_state[pid] = THST_WAIT;
 
-        job_wait(&job);
+        job_wait(pool, &job);
 
         if (job == NULL) /* corrupted message? */
             continue;
 
         if (xs_type(job) == XSTYPE_FALSE) /* special message: exit */
             break;
-        else
+
+        __atomic_add_fetch(&p_state->pool[pool].busy, 1, __ATOMIC_RELAXED);
+
         if (xs_type(job) == XSTYPE_DATA) {
-            /* it's a socket */
-            FILE *f = NULL;
+            http_job j;
 
             p_state->th_state[pid] = THST_IN;
 
-            xs_data_get(&f, job);
+            xs_data_get(&j, job);
 
-            if (f != NULL)
-                httpd_connection(f);
+            if (j.type == HTTP_JOB_REQUEST) {
+                /* it's a request read by the front end */
+                http_conn_serve(&j);
+            }
+            else
+            if (j.f != NULL) {
+                /* it's a socket */
+                httpd_connection(j.f);
+            }
         }
         else {
             /* it's a q_item */
             p_state->th_state[pid] = THST_QUEUE;
 
-            process_queue_item(job);
+            const char *type = xs_dict_get_def(job, "type", "");
+
+            if (strcmp(type, "user_queue") == 0)
+                user_queue_job(job);
+            else {
+                process_queue_item(job);
+
+                if (strcmp(type, "output") == 0)
+                    lane_done(job);
+            }
+
+            /* below the low water mark? release the queue */
+            if (__atomic_load_n(&queue_held, __ATOMIC_ACQUIRE) &&
+                queue_room() > p_state->pool[POOL_QUEUE].n_threads * 2 &&
+                __atomic_exchange_n(&queue_held, 0, __ATOMIC_ACQ_REL))
+                qsched_kick();
         }
+
+        __atomic_sub_fetch(&p_state->pool[pool].busy, 1, __ATOMIC_RELAXED);
     }
 
     p_state->th_state[pid] = THST_STOP;
 
+    xs_curl_thread_cleanup();
+
     srv_debug(1, xs_fmt("job thread %d stopped", pid));
 
     return NULL;
 }
 
-/* background thread sleep control */
-static pthread_mutex_t sleep_mutex;
-static pthread_cond_t  sleep_cond;
-
 static void *background_thread(void *arg)
 /* background thread (queue management and other things) */
 {
-    time_t t, purge_time, rss_time;
+    time_t t, purge_time, rss_time, compact_time;
 
     (void)arg;
 
@@ -820,6 +2527,9 @@ static void *background_thread(void *arg)
     /* first RSS polling time */
     rss_time = t + 15 * 60;
 
+    /* first queue log compaction time */
+    compact_time = t + 5 * 60;
+
     srv_log(xs_fmt("background thread started"));
 
     enqueue_fsck();
@@ -829,33 +2539,69 @@ static void *background_thread(void *arg)
 
         p_state->th_state[0] = THST_QUEUE;
 
-        {
-            xs *list = user_list();
-            const char *uid;
+        /* move the due queue items to the ready lists */
+        qsched_collect();
 
-            /* process queues for all users */
-            xs_list_foreach(list, uid) {
-                snac user;
+        int room = queue_room();
 
-                if (user_open(&user, uid)) {
-                    cnt += process_user_queue(&user);
-                    user_free(&user);
-                }
-            }
+        if (room <= 0) {
+            /* the queue pool is overwhelmed: keep everything waiting
+               until a job thread releases it */
+            __atomic_store_n(&queue_held, 1, __ATOMIC_RELEASE);
         }
+        else {
+            xs *list = qsched_ready_users();
+            const char *uid;
+
+            /* leave at least half of the queue threads for the global queue */
+            int max_jobs = p_state->pool[POOL_QUEUE].n_threads / 2;
+
+            if (max_jobs < 1)
+                max_jobs = 1;
+
+            /* dispatch the queues of the users with ready items */
+            xs_list_foreach(list, uid)
+                cnt += user_queue_dispatch(uid, max_jobs);
 
-        /* global queue */
-        cnt += process_queue();
+            /* global queue */
+            cnt += process_queue(room);
+
+            /* more left? */
+            if (queue_room() <= 0)
+                __atomic_store_n(&queue_held, 1, __ATOMIC_RELEASE);
+        }
 
         t = time(NULL);
 
         /* time to purge? */
         if (t > purge_time) {
-            /* next purge time is tomorrow */
-            purge_time = t + 24 * 60 * 60;
+            int slice_ms = xs_number_get(xs_dict_get_def(srv_config, "purge_slice_ms", "500"));
+            xs *q_item = xs_dict_new();
+
+            if (slice_ms > 0) {
+                /* incremental purge: run the next slice */
+                int secs = xs_number_get(xs_dict_get_def(srv_config, "purge_slice_seconds", "15"));
+
+                purge_time = t + (secs > 0 ? secs : 15);
+
+                q_item = xs_dict_append(q_item, "type", "purge_step");
+            }
+            else {
+                /* next purge time is tomorrow */
+                purge_time = t + 24 * 60 * 60;
+
+                q_item = xs_dict_append(q_item, "type", "purge");
+            }
+
+            job_post(q_item, 0);
+        }
+
+        /* time to compact the queue log? */
+        if (t > compact_time) {
+            compact_time = t + 15 * 60;
 
             xs *q_item = xs_dict_new();
-            q_item = xs_dict_append(q_item, "type", "purge");
+            q_item = xs_dict_append(q_item, "type", "queue_log_compact");
             job_post(q_item, 0);
         }
 
@@ -875,28 +2621,35 @@ static void *background_thread(void *arg)
             job_post(q_item, 0);
         }
 
-        if (cnt == 0) {
-            /* sleep 3 seconds */
-
+        if (cnt == 0 || __atomic_load_n(&queue_held, __ATOMIC_ACQUIRE)) {
             p_state->th_state[0] = THST_WAIT;
 
 #ifdef USE_POLL_FOR_SLEEP
             poll(NULL, 0, 3 * 1000);
 #else
-            struct timespec ts;
+            /* sleep until the next queue item is due or something new
+               is enqueued, but check at least every 3 seconds for the
+               items enqueued by other processes and the timers above */
+            time_t until = time(NULL) + 3;
+
+            if (purge_time < until)
+                until = purge_time;
 
-            clock_gettime(CLOCK_REALTIME, &ts);
-            ts.tv_sec += 3;
+            if (rss_time < until)
+                until = rss_time;
 
-            pthread_mutex_lock(&sleep_mutex);
-            while (pthread_cond_timedwait(&sleep_cond, &sleep_mutex, &ts) == 0);
-            pthread_mutex_unlock(&sleep_mutex);
+            if (compact_time < until)
+                until = compact_time;
+
+            qsched_wait(until);
 #endif
         }
     }
 
     p_state->th_state[0] = THST_STOP;
 
+    xs_curl_thread_cleanup();
+
     srv_log(xs_fmt("background thread stopped"));
 
     return NULL;
@@ -1011,9 +2764,7 @@ void httpd(void)
     int rs;
     pthread_t threads[MAX_THREADS] = {0};
     int n;
-    xs *sem_name = NULL;
     xs *shm_name = NULL;
-    sem_t anon_job_sem;
     xs *pidfile = xs_fmt("%s/server.pid", srv_basedir);
     int pidfd;
 
@@ -1077,24 +2828,26 @@ void httpd(void)
                         (int) r.rlim_cur, (int) r.rlim_max));
 
     /* initialize the job control engine */
-    pthread_mutex_init(&job_mutex, NULL);
-    sem_name = xs_fmt("/job_%d", getpid());
-    job_sem = sem_open(sem_name, O_CREAT, 0644, 0);
-
-    if (job_sem == NULL) {
-        /* error opening a named semaphore; try with an anonymous one */
-        if (sem_init(&anon_job_sem, 0, 0) != -1)
-            job_sem = &anon_job_sem;
-    }
-
-    if (job_sem == NULL) {
+    if (!job_pool_init(POOL_HTTP) || !job_pool_init(POOL_QUEUE)) {
         srv_log(xs_fmt("fatal error: cannot create semaphore -- cannot continue"));
         return;
     }
 
-    /* initialize sleep control */
-    pthread_mutex_init(&sleep_mutex, NULL);
-    pthread_cond_init(&sleep_cond, NULL);
+    /* load the queues into the scheduler */
+    qsched_rebuild();
+
+    /* route shared inbox messages only to related users */
+    rfollow_rebuild();
+
+    /* keep outgoing connections open among requests */
+    xs_curl_reuse(xs_number_get(xs_dict_get_def(srv_config, "outgoing_connection_cache", "8")),
+                  xs_type(xs_dict_get(srv_config, "disable_http2")) != XSTYPE_TRUE);
+
+    /* initialize the connection front end */
+    if (!p_state->use_fcgi && !http_conn_init()) {
+        srv_log(xs_fmt("fatal error: cannot initialize the connection front end -- cannot continue"));
+        return;
+    }
 
     p_state->n_threads = xs_number_get(xs_dict_get(srv_config, "num_threads"));
 
@@ -1108,10 +2861,33 @@ void httpd(void)
     if (p_state->n_threads < 4)
         p_state->n_threads = 4;
 
-    if (p_state->n_threads > MAX_THREADS)
-        p_state->n_threads = MAX_THREADS;
+    /* split the job threads between both pools */
+    int n_http  = xs_number_get(xs_dict_get(srv_config, "num_threads_http"));
+    int n_queue = xs_number_get(xs_dict_get(srv_config, "num_threads_queue"));
+
+    if (n_queue < 1)
+        n_queue = (p_state->n_threads - 1) / 2;
+
+    if (n_queue < 1)
+        n_queue = 1;
+
+    if (n_http < 1)
+        n_http = p_state->n_threads - 1 - n_queue;
+
+    if (n_http < 2)
+        n_http = 2;
+
+    if (1 + n_http + n_queue > MAX_THREADS) {
+        n_http  = (MAX_THREADS - 1) / 2;
+        n_queue = MAX_THREADS - 1 - n_http;
+    }
+
+    p_state->pool[POOL_HTTP].n_threads  = n_http;
+    p_state->pool[POOL_QUEUE].n_threads = n_queue;
+    p_state->n_threads = 1 + n_http + n_queue;
 
-    srv_debug(0, xs_fmt("using %d threads", p_state->n_threads));
+    srv_debug(0, xs_fmt("using %d threads (%d http, %d queue)",
+        p_state->n_threads, n_http, n_queue));
 
     /* thread #0 is the background thread */
     pthread_create(&threads[0], NULL, background_thread, NULL);
@@ -1122,12 +2898,15 @@ void httpd(void)
         pthread_create(&threads[n], NULL, job_thread, ptr++);
 
     if (setjmp(on_break) == 0) {
+        if (!p_state->use_fcgi)
+            http_conn_loop(rs);
+        else
         for (;;) {
             int cs = xs_socket_accept(rs);
 
             if (cs != -1) {
-                FILE *f = fdopen(cs, "r+");
-                xs *job = xs_data_new(&f, sizeof(FILE *));
+                http_job j = { .type = HTTP_JOB_CONN, .f = fdopen(cs, "r+") };
+                xs *job = xs_data_new(&j, sizeof(j));
                 job_post(job, 1);
             } else {
                 srv_log(xs_fmt("error: xs_socket_accept failed: %s", strerror(errno)));
@@ -1138,16 +2917,27 @@ void httpd(void)
 
     p_state->srv_running = 0;
 
+    /* wake up the background thread */
+    qsched_kick();
+
     /* send as many exit jobs as working threads */
-    for (n = 1; n < p_state->n_threads; n++)
-        job_post(xs_stock(XSTYPE_FALSE), 0);
+    for (n = 0; n < p_state->pool[POOL_HTTP].n_threads; n++)
+        _job_post(POOL_HTTP, xs_stock(XSTYPE_FALSE), 0);
+
+    for (n = 0; n < p_state->pool[POOL_QUEUE].n_threads; n++)
+        _job_post(POOL_QUEUE, xs_stock(XSTYPE_FALSE), 0);
 
     /* wait for all the threads to exit */
     for (n = 0; n < p_state->n_threads; n++)
         pthread_join(threads[n], NULL);
 
-    sem_close(job_sem);
-    sem_unlink(sem_name);
+    if ((n = lane_flush()) > 0)
+        srv_log(xs_fmt("%d deliveries waiting in lanes written back to the queue", n));
+
+    for (n = 0; n < N_POOLS; n++) {
+        sem_close(job_pools[n].sem);
+        sem_unlink(job_pools[n].sem_name);
+    }
 
     srv_state_op(&shm_name, 2);
 
@@ -196,6 +196,72 @@ int main(int argc, char *argv[])
         printf("uptime: %s\n", uptime);
         printf("job fifo size (cur): %d\n", ss.job_fifo_size);
         printf("job fifo size (peak): %d\n", ss.peak_job_fifo_size);
+
+        for (n = 0; n < N_POOLS; n++)
+            printf("%s pool: %d threads, %d busy, %d waiting jobs (peak %d)\n",
+                n == POOL_HTTP ? "http" : "queue", ss.pool[n].n_threads, ss.pool[n].busy,
+                ss.pool[n].fifo_size, ss.pool[n].peak_fifo_size);
+
+        printf("http connections: %d\n", ss.n_connections);
+        printf("http requests: %d (%d over reused connections)\n",
+            ss.n_requests, ss.n_reused_requests);
+        printf("open connections (cur): %d\n", ss.conns_open);
+        printf("open connections (peak): %d\n", ss.peak_conns_open);
+        printf("read timeouts: %d\n", ss.n_read_timeouts);
+        printf("compressed responses: %d (%d from cached variants, %lld bytes saved)\n",
+            ss.n_comp_responses, ss.n_comp_cached, ss.comp_bytes_saved);
+        printf("object cache: %d hits, %d misses, %d evictions\n",
+            ss.obj_cache_hits, ss.obj_cache_misses, ss.obj_cache_evictions);
+        printf("entry cache: %d hits, %d misses, %d evictions\n",
+            ss.entry_cache_hits, ss.entry_cache_misses, ss.entry_cache_evictions);
+        printf("key cache: %d hits, %d misses\n",
+            ss.key_cache_hits, ss.key_cache_misses);
+        printf("user cache: %d hits, %d misses\n",
+            ss.user_cache_hits, ss.user_cache_misses);
+        printf("user queue jobs (cur): %d\n", ss.user_queue_jobs);
+        printf("scheduled queue items: %d", ss.qsched_items);
+
+        if (ss.qsched_next > time(NULL)) {
+            xs *next = xs_str_time_diff(ss.qsched_next - time(NULL));
+            printf(" (next in %s)", next);
+        }
+
+        printf("\n");
+        printf("queue log: %d records appended, %d segments compacted\n",
+            ss.qlog_appends, ss.qlog_compacted);
+        printf("data locks: %d acquired, %d waited (%.3f ms total, %.3f ms peak)\n",
+            ss.data_lock_count, ss.data_lock_waits,
+            ss.data_lock_wait_us / 1000.0, ss.data_lock_peak_us / 1000.0);
+
+        if (ss.purge_start) {
+            xs *ago = xs_str_time_diff(time(NULL) - ss.purge_start);
+
+            printf("purge: cycle started %s ago, task %d/%d%s, "
+                "%d entries checked, %d deleted, %.1f s in %d slices (%.0f entries/s)\n",
+                ago, ss.purge_task, ss.purge_tasks, ss.purge_end ? " (done)" : "",
+                ss.purge_checked, ss.purge_deleted, ss.purge_busy_ms / 1000.0,
+                ss.purge_slices,
+                ss.purge_busy_ms ? ss.purge_checked * 1000.0 / ss.purge_busy_ms : 0.0);
+        }
+
+        for (n = 0; n < MAX_USER_QUEUE_STATS && ss.user_q[n].uid[0]; n++)
+            printf("user queue %s: depth %d, %d items, latency %d ms (peak %d ms)%s\n",
+                ss.user_q[n].uid, ss.user_q[n].depth, ss.user_q[n].n_items,
+                ss.user_q[n].last_ms, ss.user_q[n].peak_ms,
+                ss.user_q[n].busy ? " [busy]" : "");
+
+        for (n = 0; n < MAX_LANE_STATS; n++) {
+            if (ss.lane[n].host[0] == '\0')
+                continue;
+
+            int total = ss.lane[n].n_ok + ss.lane[n].n_err;
+
+            printf("lane %s: depth %d, in flight %d/%d, %d sent, %d%% errors, latency %d ms%s\n",
+                ss.lane[n].host, ss.lane[n].depth, ss.lane[n].in_flight, ss.lane[n].limit,
+                total, total ? ss.lane[n].n_err * 100 / total : 0, ss.lane[n].avg_ms,
+                ss.lane[n].open ? " [circuit open]" : "");
+        }
+
         char *th_states[] = { "stopped", "waiting", "input", "output" };
 
         for (n = 0; n < ss.n_threads; n++)
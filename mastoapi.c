@@ -47,7 +47,7 @@ int app_add(const char *id, const xs_dict *app)
     fn = xs_str_cat(fn, ".json");
 
     if ((f = fopen(fn, "w")) != NULL) {
-        xs_json_dump(app, 4, f);
+        xs_json_dump(app, storage_json_indent(), f);
         fclose(f);
     }
     else
@@ -110,7 +110,7 @@ int token_add(const char *id, const xs_dict *token)
     fn = xs_str_cat(fn, ".json");
 
     if ((f = fopen(fn, "w")) != NULL) {
-        xs_json_dump(token, 4, f);
+        xs_json_dump(token, storage_json_indent(), f);
         fclose(f);
     }
     else
@@ -3758,13 +3758,15 @@ int mastoapi_post_handler(const xs_dict *req, const char *q_path,
                                 if (xs_is_null(choices))
                                     choices = xs_dict_get(args, "choices");
 
-                                if (xs_type(choices) == XSTYPE_LIST) {
+                                if (xs_type(choices) == XSTYPE_LIST && xs_is_list(opts)) {
                                     const xs_str *v;
+                                    int n_opts;
+                                    const xs_val **opts_idx = xs_list_index(opts, &n_opts);
 
                                     int c = 0;
                                     while (xs_list_next(choices, &v, &c)) {
                                         int io           = atoi(v);
-                                        const xs_dict *o = xs_list_get(opts, io);
+                                        const xs_dict *o = io >= 0 && io < n_opts ? opts_idx[io] : NULL;
 
                                         if (o) {
                                             const char *name = xs_dict_get(o, "name");
@@ -3778,6 +3780,8 @@ int mastoapi_post_handler(const xs_dict *req, const char *q_path,
                                         }
                                     }
 
+                                    xs_free(opts_idx);
+
                                     out = mastoapi_poll(&snac, msg);
                                 }
                             }
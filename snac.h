@@ -13,10 +13,25 @@
 
 #define ISO_DATE_SPEC "%Y-%m-%dT%H:%M:%SZ"
 
+#ifdef __APPLE__
+/* Apple uses st_atimespec instead of st_atim etc */
+#define st_atim st_atimespec
+#define st_ctim st_ctimespec
+#define st_mtim st_mtimespec
+#endif
+
 #ifndef MAX_THREADS
 #define MAX_THREADS 256
 #endif
 
+#ifndef MAX_USER_QUEUE_STATS
+#define MAX_USER_QUEUE_STATS 64
+#endif
+
+#ifndef MAX_LANE_STATS
+#define MAX_LANE_STATS 32
+#endif
+
 #ifndef MAX_JSON_DEPTH
 #define MAX_JSON_DEPTH 8
 #endif
@@ -68,6 +83,29 @@ typedef struct {
     const char *tz;     /* configured timezone */
 } snac;
 
+typedef struct {
+    int fd;         /* file to be sent as the response body (-1: none) */
+    off_t offset;   /* offset of the first byte */
+    off_t size;     /* number of bytes */
+    xs_str *fn;     /* file name, if compressed variants can be stored
+                       next to it (NULL: none) */
+} t_file_body;
+
+typedef struct t_body_stream {
+    FILE *f;        /* the body is written here... */
+    xs_str *buf;    /* ...into this memory buffer */
+    size_t size;    /* ...of this size */
+    int tee;        /* keep a copy of the whole body */
+    xs_str *copy;   /* the copy */
+    xs_str *etag;   /* etag to be sent with the headers (NULL: none) */
+    int (*send)(struct t_body_stream *s, const char *data, int size);
+                    /* sends data to the client (NULL: not streamed) */
+    void *ctx;      /* sender context */
+    int sent;       /* bytes sent */
+} t_body_stream;
+
+enum { POOL_HTTP, POOL_QUEUE, N_POOLS };
+
 typedef struct {
     int s_size;             /* struct size (for double checking) */
     int srv_running;        /* server running on/off */
@@ -76,6 +114,67 @@ typedef struct {
     int job_fifo_size;      /* job fifo size */
     int peak_job_fifo_size; /* maximum job fifo size seen */
     int n_threads;          /* number of configured threads */
+    struct {
+        int n_threads;      /* threads in the pool */
+        int busy;           /* threads processing a job */
+        int fifo_size;      /* jobs waiting */
+        int peak_fifo_size; /* maximum jobs waiting seen */
+    } pool[N_POOLS];        /* job thread pools (http and queue) */
+    int n_connections;      /* accepted http connections */
+    int n_requests;         /* served http requests */
+    int n_reused_requests;  /* requests served over kept-alive connections */
+    int conns_open;         /* open connections in the front end */
+    int peak_conns_open;    /* maximum open connections seen */
+    int n_read_timeouts;    /* connections closed by the read deadline */
+    int n_comp_responses;   /* responses sent compressed */
+    int n_comp_cached;      /* ... from a cached compressed variant */
+    long long comp_bytes_saved; /* bytes saved by compression */
+    int obj_cache_hits;     /* parsed object cache hits */
+    int obj_cache_misses;   /* parsed object cache misses */
+    int obj_cache_evictions;/* parsed objects evicted from the cache */
+    int entry_cache_hits;   /* entry fragment cache hits */
+    int entry_cache_misses; /* entry fragment cache misses */
+    int entry_cache_evictions; /* entry fragments evicted from the cache */
+    int key_cache_hits;     /* parsed RSA key cache hits */
+    int key_cache_misses;   /* parsed RSA key cache misses */
+    int user_cache_hits;    /* opened user cache hits */
+    int user_cache_misses;  /* opened user cache misses */
+    int user_queue_jobs;    /* user queues being processed by job threads */
+    int qsched_items;       /* queue items waiting in the scheduler */
+    time_t qsched_next;     /* due time of the next one (0: none) */
+    int qlog_appends;       /* records appended to the queue log */
+    int qlog_compacted;     /* queue log segments deleted or rewritten */
+    int data_lock_count;    /* index and data file lock acquisitions */
+    int data_lock_waits;    /* acquisitions that had to wait */
+    long long data_lock_wait_us; /* total time waited, in microseconds */
+    int data_lock_peak_us;  /* maximum wait seen, in microseconds */
+    time_t purge_start;     /* start of the current purge cycle */
+    time_t purge_end;       /* end of the current purge cycle (0: running) */
+    int purge_tasks;        /* tasks in the purge cycle */
+    int purge_task;         /* tasks done */
+    int purge_checked;      /* entries checked in the purge cycle */
+    int purge_deleted;      /* entries deleted in the purge cycle */
+    int purge_busy_ms;      /* time spent purging in the cycle */
+    int purge_slices;       /* purge slices run in the cycle */
+    struct {
+        char uid[64];       /* user id (empty if unused) */
+        int depth;          /* ready items seen at the last dispatch */
+        int busy;           /* being processed right now */
+        int n_items;        /* total processed items */
+        int last_ms;        /* latency of the last run (dispatch to end) */
+        int peak_ms;        /* maximum latency seen */
+    } user_q[MAX_USER_QUEUE_STATS];
+    struct {
+        char host[64];      /* destination host (empty if unused) */
+        int tick;           /* last update (to reuse the oldest slot) */
+        int depth;          /* items waiting in the lane */
+        int in_flight;      /* deliveries being processed */
+        int limit;          /* current in flight limit */
+        int n_ok;           /* successful deliveries */
+        int n_err;          /* failed deliveries */
+        int avg_ms;         /* average delivery latency */
+        int open;           /* circuit breaker open */
+    } lane[MAX_LANE_STATS];
     enum { THST_STOP, THST_WAIT, THST_IN, THST_QUEUE } th_state[MAX_THREADS];
 } srv_state;
 
@@ -123,10 +222,12 @@ void srv_archive_qitem(const char *prefix, xs_dict *q_item);
 double mtime_nl(const char *fn, int *n_link);
 #define mtime(fn) mtime_nl(fn, NULL)
 double f_ctime(const char *fn);
+int storage_json_indent(void);
 
 int index_add_md5(const char *fn, const char *md5);
 int index_add(const char *fn, const char *id);
 int index_gc(const char *fn);
+int index_convert(const char *fn, int binary);
 int index_first(const char *fn, char md5[MD5_HEX_SIZE]);
 int index_len(const char *fn);
 xs_list *index_list(const char *fn, int max);
@@ -201,6 +302,12 @@ xs_list *local_list(snac *snac, int max);
 xs_str *instance_index_fn(void);
 xs_list *timeline_instance_list(int skip, int show);
 
+void rfollow_update(snac *user, const char *actor);
+void rfollow_tags_update(snac *user);
+void rfollow_rebuild(void);
+xs_list *rfollow_users(const char *actor);
+xs_list *rfollow_tag_users(const char *hashtag);
+
 int following_add(snac *snac, const char *actor, const xs_dict *msg);
 int following_del(snac *snac, const char *actor);
 int following_check(snac *snac, const char *actor);
@@ -262,15 +369,18 @@ int actor_get(const char *actor, xs_dict **data);
 int actor_get_refresh(snac *user, const char *actor, xs_dict **data);
 
 int static_get(snac *snac, const char *id, xs_val **data, int *size, const char *inm, xs_str **etag);
+int static_open(snac *snac, const char *id, t_file_body *file, const char *inm, xs_str **etag);
 void static_put(snac *snac, const char *id, const char *data, int size);
 void static_put_meta(snac *snac, const char *id, const char *str);
 xs_str *static_get_meta(snac *snac, const char *id);
 
 double history_mtime(snac *snac, const char *id);
 void history_add(snac *snac, const char *id, const char *content, int size,
-                    xs_str **etag);
+                    time_t mt, xs_str **etag);
 int history_get(snac *snac, const char *id, xs_str **content, int *size,
                 const char *inm, xs_str **etag);
+int history_open(snac *snac, const char *id, t_file_body *file,
+                const char *inm, xs_str **etag);
 int history_del(snac *snac, const char *id);
 xs_list *history_list(snac *snac);
 
@@ -310,6 +420,11 @@ void enqueue_shared_input(const xs_dict *msg, const xs_dict *req, int retries);
 void enqueue_output_raw(const char *keyid, const char *seckey,
                         const xs_dict *msg, const xs_str *inbox,
                         int retries, int p_status);
+xs_str *payload_add_raw(const char *keyid, const char *seckey, const xs_dict *msg);
+xs_str *payload_add(snac *snac, const xs_dict *msg);
+xs_dict *payload_get(const char *id);
+void enqueue_output_payload(const char *pl_id, const xs_str *inbox,
+                            int retries, int p_status);
 void enqueue_output(snac *snac, const xs_dict *msg,
                     const xs_str *inbox, int retries, int p_status);
 void enqueue_output_by_actor(snac *snac, const xs_dict *msg,
@@ -330,13 +445,29 @@ void enqueue_fsck(void);
 
 int was_question_voted(snac *user, const char *id);
 
+void qsched_add(const char *fn, const char *ntid);
+void qsched_rebuild(void);
+time_t qsched_collect(void);
+xs_list *qsched_ready_users(void);
+xs_list *qsched_take(const char *uid);
+void qsched_wait(time_t until);
+void qsched_kick(void);
+
+int queue_log_enabled(void);
+xs_str *queue_log_add(const xs_dict *qmsg);
+xs_dict *queue_log_live(void);
+void queue_log_compact(void);
+
 xs_list *user_queue(snac *snac);
-xs_list *queue(void);
+int user_queue_pending(const char *uid);
+xs_list *queue(int max);
 xs_dict *queue_get(const char *fn);
 xs_dict *dequeue(const char *fn);
+void queue_put_back(const xs_dict *q_item);
 
 void purge(snac *snac);
 void purge_all(void);
+int purge_step(void);
 
 xs_dict *http_signed_request_raw(const char *keyid, const char *seckey,
                             const char *method, const char *url,
@@ -353,6 +484,9 @@ int check_signature(const xs_dict *req, xs_str **err, xs_str **key_id);
 
 srv_state *srv_state_op(xs_str **fname, int op);
 void httpd(void);
+void body_stream_open(t_body_stream *s);
+int body_stream_flush(t_body_stream *s);
+xs_str *body_stream_close(t_body_stream *s);
 
 int webfinger_request_signed(snac *snac, const char *qs, xs_str **actor, xs_str **user);
 int webfinger_request(const char *qs, xs_str **actor, xs_str **user);
@@ -409,10 +543,11 @@ int is_msg_mine(snac *user, const char *id);
 int is_msg_public(const xs_dict *msg);
 int is_msg_from_private_user(const xs_dict *msg);
 int is_msg_for_me(snac *snac, const xs_dict *msg);
+xs_list *shared_input_users(const xs_dict *msg);
 
 int process_user_queue(snac *snac);
 void process_queue_item(xs_dict *q_item);
-int process_queue(void);
+int process_queue(int max);
 
 int activitypub_get_handler(const xs_dict *req, const char *q_path,
                             char **body, int *b_size, char **ctype);
@@ -430,10 +565,15 @@ xs_str *encode_html(const char *str);
 xs_str *html_timeline(snac *user, const xs_list *list, int read_only,
                       int skip, int show, int show_more,
                       const char *title, const char *page, int utl, const char *error, int terse);
+xs_str *html_timeline_stream(t_body_stream *s, snac *user, const xs_list *list, int read_only,
+                      int skip, int show, int show_more,
+                      const char *title, const char *page, int utl, const char *error, int terse);
 
 int html_get_handler(const xs_dict *req, const char *q_path,
                      char **body, int *b_size, char **ctype,
-                     xs_str **etag, xs_str **last_modified);
+                     xs_str **etag, xs_str **last_modified,
+                     xs_str **content_range, t_file_body *file,
+                     t_body_stream *stream);
 
 int html_post_handler(const xs_dict *req, const char *q_path,
                       char *payload, int p_size,
@@ -448,7 +588,8 @@ int deluser(snac *user);
 extern const char *snac_blurb;
 
 void job_post(const xs_val *job, int urgent);
-void job_wait(xs_val **job);
+void lane_result(const char *inbox, int status, int ms);
+int lane_blocked(const char *inbox);
 
 int oauth_get_handler(const xs_dict *req, const char *q_path,
                       char **body, int *b_size, char **ctype);
@@ -0,0 +1,152 @@
+/* snac - A simple, minimalistic ActivityPub instance */
+/* copyright (c) 2022 - 2026 grunfink et al. / MIT license */
+
+/* JSON parser benchmark: compares the stream (fgetc-based) parser
+   with the in-memory one over the objects stored in a snac instance.
+   Usage: tests/json_bench {basedir} [iterations] */
+
+#define XS_IMPLEMENTATION
+#include "../xs.h"
+#include "../xs_io.h"
+#include "../xs_json.h"
+#include "../xs_glob.h"
+
+#include <time.h>
+
+static xs_val *old_load(FILE *f)
+/* the stream parser */
+{
+    xs_val *v = NULL;
+    xstype t = xs_json_load_type(f);
+
+    if (t == XSTYPE_LIST) {
+        v = xs_list_new();
+        xs_json_load_array(f, MAX_JSON_DEPTH, &v);
+    }
+    else
+    if (t == XSTYPE_DICT) {
+        v = xs_dict_new();
+        xs_json_load_object(f, MAX_JSON_DEPTH, &v);
+    }
+
+    return v;
+}
+
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s {basedir} [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    int iters = argc > 2 ? atoi(argv[2]) : 10;
+    xs *spec  = xs_fmt("%s/object/" "*/" "*.json", argv[1]);
+    xs *files = xs_glob(spec, 0, 0);
+    xs *corpus = xs_list_new();
+    const char *fn;
+    long bytes = 0;
+    int diffs = 0;
+    int n;
+
+    /* load the corpus in memory */
+    xs_list_foreach(files, fn) {
+        FILE *f;
+
+        if ((f = fopen(fn, "r")) != NULL) {
+            xs *s = xs_readall(f);
+            fclose(f);
+
+            bytes += strlen(s);
+            corpus = xs_list_append(corpus, s);
+        }
+    }
+
+    if (xs_list_len(corpus) == 0) {
+        fprintf(stderr, "no objects found in %s\n", argv[1]);
+        return 1;
+    }
+
+    /* both parsers must give the same results */
+    const char *s;
+    xs_list_foreach(corpus, s) {
+        FILE *f = fmemopen((char *)s, strlen(s), "r");
+        xs *o = old_load(f);
+        xs *n = xs_json_loads(s);
+        fclose(f);
+
+        xs *j1 = o ? xs_json_dumps(o, 0) : xs_str_new("(null)");
+        xs *j2 = n ? xs_json_dumps(n, 0) : xs_str_new("(null)");
+
+        if (strcmp(j1, j2) != 0)
+            diffs++;
+    }
+
+    /* including the handling of values nested around the maximum depth */
+    for (n = MAX_JSON_DEPTH - 1; n <= MAX_JSON_DEPTH + 1; n++) {
+        xs *deep = xs_str_new("{\"a\":");
+        int i;
+
+        for (i = 0; i < n; i++)
+            deep = xs_str_cat(deep, "[");
+
+        deep = xs_str_cat(deep, "1");
+
+        for (i = 0; i < n; i++)
+            deep = xs_str_cat(deep, "]");
+
+        deep = xs_str_cat(deep, ",\"b\":2}");
+
+        FILE *f = fmemopen(deep, strlen(deep), "r");
+        xs *o = old_load(f);
+        xs *v = xs_json_loads(deep);
+        fclose(f);
+
+        xs *j1 = o ? xs_json_dumps(o, 0) : xs_str_new("(null)");
+        xs *j2 = v ? xs_json_dumps(v, 0) : xs_str_new("(null)");
+
+        if (strcmp(j1, j2) != 0) {
+            fprintf(stderr, "mismatch at depth %d: %s vs %s\n", n, j1, j2);
+            diffs++;
+        }
+    }
+
+    double t_old, t_new;
+
+    t_old = now();
+    for (n = 0; n < iters; n++) {
+        xs_list_foreach(corpus, s) {
+            FILE *f = fmemopen((char *)s, strlen(s), "r");
+            xs *v = old_load(f);
+            fclose(f);
+        }
+    }
+    t_old = now() - t_old;
+
+    t_new = now();
+    for (n = 0; n < iters; n++) {
+        xs_list_foreach(corpus, s) {
+            xs *v = xs_json_loads(s);
+        }
+    }
+    t_new = now() - t_new;
+
+    double mb = (double)bytes * iters / (1024 * 1024);
+
+    printf("objects: %d (%ld bytes), iterations: %d\n", xs_list_len(corpus), bytes, iters);
+    printf("stream parser:    %8.3f s (%8.2f MB/s)\n", t_old, mb / t_old);
+    printf("in-memory parser: %8.3f s (%8.2f MB/s)\n", t_new, mb / t_new);
+    printf("speedup: %.2fx, differences: %d\n", t_old / t_new, diffs);
+
+    return diffs != 0;
+}
@@ -0,0 +1,216 @@
+/* snac - A simple, minimalistic ActivityPub instance */
+/* copyright (c) 2022 - 2026 grunfink et al. / MIT license */
+
+/* Lookup benchmark: runs the dict and list accesses done when
+   building a Mastodon API status over the objects stored in a snac
+   instance, comparing hashed vs. sequential dict lookups and
+   xs_list_get() vs. xs_list_index() positional access.
+   Usage: tests/lookup_bench {basedir} [iterations] */
+
+#define XS_IMPLEMENTATION
+#include "../xs.h"
+#include "../xs_io.h"
+#include "../xs_json.h"
+#include "../xs_glob.h"
+
+#include <time.h>
+
+/* the keys read from a message by mastoapi_status() */
+static const char *status_keys[] = {
+    "id", "type", "actor", "attributedTo", "published", "updated",
+    "content", "sourceContent", "summary", "sensitive", "name",
+    "inReplyTo", "attachment", "tag", "to", "cc", "url", "context",
+    "oneOf", "anyOf", "endTime", "closed", "votersCount", NULL
+};
+
+/* the lists that are accessed by position */
+static const char *list_keys[] = { "to", "cc", "tag", "attachment", NULL };
+
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static const xs_val *seq_get(const xs_dict *d, const char *key)
+/* a dict lookup by sequential scan */
+{
+    const xs_str *k;
+    const xs_val *v;
+    int c = 0;
+
+    while (xs_dict_next(d, &k, &v, &c)) {
+        if (strcmp(k, key) == 0)
+            return v;
+    }
+
+    return NULL;
+}
+
+
+static long list_get_walk(const xs_list *l)
+/* positional access with xs_list_get() */
+{
+    long r = 0;
+    int n = xs_list_len(l);
+    int i;
+
+    for (i = 0; i < n; i++)
+        r += xs_size(xs_list_get(l, i));
+
+    return r;
+}
+
+
+static long list_index_walk(const xs_list *l)
+/* positional access with xs_list_index() */
+{
+    long r = 0;
+    int n, i;
+    const xs_val **idx = xs_list_index(l, &n);
+
+    for (i = 0; i < n; i++)
+        r += xs_size(idx[i]);
+
+    xs_free(idx);
+
+    return r;
+}
+
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s {basedir} [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    int iters = argc > 2 ? atoi(argv[2]) : 10;
+    xs *spec  = xs_fmt("%s/object/" "*/" "*.json", argv[1]);
+    xs *files = xs_glob(spec, 0, 0);
+    xs *corpus = xs_list_new();
+    const char *fn;
+    int diffs = 0;
+    int n, i;
+
+    /* load the corpus in memory */
+    xs_list_foreach(files, fn) {
+        FILE *f;
+
+        if ((f = fopen(fn, "r")) != NULL) {
+            xs *o = xs_json_load(f);
+            fclose(f);
+
+            if (xs_is_dict(o))
+                corpus = xs_list_append(corpus, o);
+        }
+    }
+
+    if (xs_list_len(corpus) == 0) {
+        fprintf(stderr, "no objects found in %s\n", argv[1]);
+        return 1;
+    }
+
+    /* a long list, where positional access really matters */
+    xs *big = xs_list_new();
+    for (i = 0; i < 2000; i++) {
+        xs *s = xs_fmt("https://example.com/users/%d", i);
+        big = xs_list_append(big, s);
+    }
+
+    const xs_dict *msg;
+    long r1 = 0, r2 = 0;
+
+    /* both methods must give the same results */
+    xs_list_foreach(corpus, msg) {
+        for (i = 0; status_keys[i]; i++) {
+            if (xs_dict_get(msg, status_keys[i]) != seq_get(msg, status_keys[i]))
+                diffs++;
+        }
+    }
+
+    double t_seq, t_hash, t_get, t_idx, t_bget, t_bidx;
+
+    t_seq = now();
+    for (n = 0; n < iters; n++) {
+        xs_list_foreach(corpus, msg) {
+            for (i = 0; status_keys[i]; i++)
+                r1 += seq_get(msg, status_keys[i]) != NULL;
+        }
+    }
+    t_seq = now() - t_seq;
+
+    t_hash = now();
+    for (n = 0; n < iters; n++) {
+        xs_list_foreach(corpus, msg) {
+            for (i = 0; status_keys[i]; i++)
+                r2 += xs_dict_get(msg, status_keys[i]) != NULL;
+        }
+    }
+    t_hash = now() - t_hash;
+
+    if (r1 != r2)
+        diffs++;
+
+    r1 = r2 = 0;
+
+    t_get = now();
+    for (n = 0; n < iters; n++) {
+        xs_list_foreach(corpus, msg) {
+            for (i = 0; list_keys[i]; i++) {
+                const xs_val *l = xs_dict_get(msg, list_keys[i]);
+
+                if (xs_is_list(l))
+                    r1 += list_get_walk(l);
+            }
+        }
+    }
+    t_get = now() - t_get;
+
+    t_idx = now();
+    for (n = 0; n < iters; n++) {
+        xs_list_foreach(corpus, msg) {
+            for (i = 0; list_keys[i]; i++) {
+                const xs_val *l = xs_dict_get(msg, list_keys[i]);
+
+                if (xs_is_list(l))
+                    r2 += list_index_walk(l);
+            }
+        }
+    }
+    t_idx = now() - t_idx;
+
+    if (r1 != r2)
+        diffs++;
+
+    r1 = r2 = 0;
+
+    t_bget = now();
+    for (n = 0; n < iters; n++)
+        r1 += list_get_walk(big);
+    t_bget = now() - t_bget;
+
+    t_bidx = now();
+    for (n = 0; n < iters; n++)
+        r2 += list_index_walk(big);
+    t_bidx = now() - t_bidx;
+
+    if (r1 != r2)
+        diffs++;
+
+    printf("objects: %d, iterations: %d\n", xs_list_len(corpus), iters);
+    printf("dict, sequential scan: %8.4f s\n", t_seq);
+    printf("dict, hashed lookup:   %8.4f s (%.2fx)\n", t_hash, t_seq / t_hash);
+    printf("lists, xs_list_get:    %8.4f s\n", t_get);
+    printf("lists, xs_list_index:  %8.4f s (%.2fx)\n", t_idx, t_get / t_idx);
+    printf("2000 items, get:       %8.4f s\n", t_bget);
+    printf("2000 items, index:     %8.4f s (%.2fx)\n", t_bidx, t_bget / t_bidx);
+    printf("differences: %d\n", diffs);
+
+    return diffs != 0;
+}
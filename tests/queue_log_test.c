@@ -0,0 +1,122 @@
+/* snac - A simple, minimalistic ActivityPub instance */
+/* copyright (c) 2022 - 2026 grunfink et al. / MIT license */
+
+/* Queue log compaction test: a child process (the 'previous run')
+   appends records to the queue log and marks most of them as done;
+   then this process, that has not appended anything yet (as right
+   after a restart), compacts the log and checks that the live records
+   survived. It writes to the queue of the instance, so use a scratch
+   copy of one.
+   Usage: tests/queue_log_test {basedir} */
+
+#include "../xs.h"
+#include "../xs_json.h"
+#include "../xs_time.h"
+
+#include "../snac.h"
+
+#include <sys/wait.h>
+#include <sys/time.h>
+
+#define N_RECORDS 20
+#define N_LIVE    2
+
+
+static int count_live(const char *mark, xs_str **seg)
+/* counts the live records with a mark, and returns the segment of one */
+{
+    xs *live = queue_log_live();
+    const xs_str *ref;
+    const xs_val *v;
+    int cnt = 0;
+
+    xs_dict_foreach(live, ref, v) {
+        xs *qmsg = queue_get(ref);
+
+        if (qmsg && xs_str_in(xs_dict_get_def(qmsg, "test_mark", ""), mark) != -1) {
+            cnt++;
+
+            if (seg != NULL) {
+                xs_free(*seg);
+                *seg = xs_str_new_sz(ref, strrchr(ref, ':') - ref);
+            }
+        }
+    }
+
+    return cnt;
+}
+
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s {basedir}\n", argv[0]);
+        return 1;
+    }
+
+    if (!srv_open(argv[1], 0)) {
+        fprintf(stderr, "error opening %s\n", argv[1]);
+        return 1;
+    }
+
+    xs *mark = tid(0);
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        /* the previous run */
+        xs *refs = xs_list_new();
+        int n;
+
+        for (n = 0; n < N_RECORDS; n++) {
+            xs *ntid = tid(3600);
+            xs *qmsg = xs_dict_new();
+            qmsg = xs_dict_append(qmsg, "type", "output");
+            qmsg = xs_dict_append(qmsg, "ntid", ntid);
+            qmsg = xs_dict_append(qmsg, "test_mark", mark);
+
+            xs *ref = queue_log_add(qmsg);
+
+            if (ref != NULL)
+                refs = xs_list_append(refs, ref);
+        }
+
+        for (n = 0; n < N_RECORDS - N_LIVE; n++) {
+            xs *qmsg = dequeue(xs_list_get(refs, n));
+        }
+
+        _exit(0);
+    }
+
+    waitpid(pid, NULL, 0);
+
+    /* after the 'restart' */
+    xs *seg = NULL;
+    int before = count_live(mark, &seg);
+    int errors = 0;
+
+    if (seg == NULL) {
+        fprintf(stderr, "no records were written\n");
+        return 1;
+    }
+
+    /* make the segment old enough to be compacted */
+    struct timeval tv[2] = { { time(NULL) - 2 * 3600, 0 }, { time(NULL) - 2 * 3600, 0 } };
+    utimes(seg, tv);
+
+    queue_log_compact();
+
+    int after = count_live(mark, NULL);
+
+    printf("live records before compaction: %d\n", before);
+    printf("live records after compaction:  %d\n", after);
+    printf("segment %s: %s\n", seg, mtime(seg) == 0.0 ? "compacted" : "kept");
+
+    if (before != N_LIVE || after != N_LIVE)
+        errors++;
+
+    printf("errors: %d\n", errors);
+
+    srv_free();
+
+    return errors != 0;
+}
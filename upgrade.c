@@ -9,6 +9,7 @@
 #include "snac.h"
 
 #include <sys/stat.h>
+#include <sys/time.h>
 
 
 int snac_upgrade(xs_str **error)
@@ -331,6 +332,103 @@ int snac_upgrade(xs_str **error)
         ret    = 0;
     }
 
+    if (ret) {
+        /* convert the indexes to the configured format */
+        int binary = xs_is_true(xs_dict_get(srv_config, "binary_indexes"));
+        const char *fmt = binary ? "binary" : "text";
+
+        if (strcmp(xs_dict_get_def(srv_config, "index_format", "text"), fmt) != 0) {
+            xs *users = user_list();
+            const char *uid;
+            int cnt = 0;
+
+            const char *specs[] = { "%s/public.idx", "%s/object/*/" "*_?.idx",
+                                    "%s/tag/*/" "*.idx", NULL };
+            int n;
+
+            for (n = 0; specs[n]; n++) {
+                xs *spec = xs_fmt(specs[n], srv_basedir);
+                xs *list = xs_glob(spec, 0, 0);
+                const char *fn;
+
+                xs_list_foreach(list, fn)
+                    cnt += index_convert(fn, binary);
+            }
+
+            xs_list_foreach(users, uid) {
+                snac user;
+
+                if (user_open(&user, uid)) {
+                    const char *uspecs[] = { "%s/" "*.idx", "%s/list/" "*.idx",
+                                             "%s/list/" "*.lst", NULL };
+
+                    for (n = 0; uspecs[n]; n++) {
+                        xs *spec = xs_fmt(uspecs[n], user.basedir);
+                        xs *list = xs_glob(spec, 0, 0);
+                        const char *fn;
+
+                        xs_list_foreach(list, fn) {
+                            /* notify.idx is not an md5 index */
+                            if (!xs_endswith(fn, "/notify.idx"))
+                                cnt += index_convert(fn, binary);
+                        }
+                    }
+
+                    user_free(&user);
+                }
+            }
+
+            srv_config = xs_dict_set(srv_config, "index_format", fmt);
+
+            srv_log(xs_fmt("%d indexes converted to %s format", cnt, fmt));
+            changed++;
+        }
+    }
+
+    if (ret) {
+        /* rewrite the objects in the configured JSON format */
+        const char *fmt = storage_json_indent() ? "indented" : "compact";
+
+        if (strcmp(xs_dict_get_def(srv_config, "json_format", "indented"), fmt) != 0) {
+            xs *spec = xs_fmt("%s/object/*/" "*.json", srv_basedir);
+            xs *list = xs_glob(spec, 0, 0);
+            const char *fn;
+            int cnt = 0;
+
+            xs_list_foreach(list, fn) {
+                struct stat st;
+                xs *obj = NULL;
+                FILE *f;
+
+                if (stat(fn, &st) == -1 || (f = fopen(fn, "r")) == NULL)
+                    continue;
+
+                obj = xs_json_load(f);
+                fclose(f);
+
+                /* rewrite in place, as timelines are hard links to it */
+                if (obj != NULL && (f = fopen(fn, "w")) != NULL) {
+                    xs_json_dump(obj, storage_json_indent(), f);
+                    fclose(f);
+
+                    /* keep the times, as they are used for purging */
+                    struct timeval tv[2] = {
+                        { st.st_atime, 0 },
+                        { st.st_mtime, 0 }
+                    };
+
+                    utimes(fn, tv);
+                    cnt++;
+                }
+            }
+
+            srv_config = xs_dict_set(srv_config, "json_format", fmt);
+
+            srv_log(xs_fmt("%d objects rewritten in %s JSON format", cnt, fmt));
+            changed++;
+        }
+    }
+
     if (changed) {
         /* upgrade the configuration file */
         xs *fn = xs_fmt("%s/server.json", srv_basedir);
@@ -102,6 +102,7 @@ int xs_list_cap(xs_list *list, int max);
 xs_list *xs_list_reverse(const xs_list *l);
 int xs_list_len(const xs_list *list);
 const xs_val *xs_list_get(const xs_list *list, int num);
+const xs_val **xs_list_index(const xs_list *list, int *count);
 xs_list *xs_list_del(xs_list *list, int num);
 xs_list *xs_list_insert(xs_list *list, int num, const xs_val *data);
 xs_list *xs_list_set(xs_list *list, int num, const xs_val *data);
@@ -936,6 +937,30 @@ const xs_val *xs_list_get(const xs_list *list, int num)
 }
 
 
+const xs_val **xs_list_index(const xs_list *list, int *count)
+/* returns an array of pointers to the list elements, for repeated
+   positional access; it must be freed and is invalid after any
+   modification of the list */
+{
+    XS_ASSERT_TYPE(list, XSTYPE_LIST);
+
+    const xs_val **idx = NULL;
+    const xs_val *v;
+    int n = 0;
+
+    xs_list_foreach(list, v) {
+        if ((n & 15) == 0)
+            idx = xs_realloc(idx, (n + 16) * sizeof(const xs_val *));
+
+        idx[n++] = v;
+    }
+
+    *count = n;
+
+    return idx;
+}
+
+
 xs_list *xs_list_del(xs_list *list, int num)
 /* deletes element #num */
 {
@@ -15,9 +15,80 @@ int xs_smtp_request(const char *url, const char *user, const char *pass,
 
 const char *xs_curl_strerr(int errnum);
 
+void xs_curl_reuse(int max_conns, int http2);
+void xs_curl_thread_cleanup(void);
+
 #ifdef XS_IMPLEMENTATION
 
 #include <curl/curl.h>
+#include <pthread.h>
+
+/* connection reuse: each thread keeps its own easy handle (and, with it,
+   its own connection cache), while the DNS and TLS session caches are
+   shared among all of them */
+static CURLSH *_xs_curl_share = NULL;
+static pthread_mutex_t _xs_curl_locks[CURL_LOCK_DATA_LAST];
+static long _xs_curl_max_conns = 0;
+static long _xs_curl_http_version = CURL_HTTP_VERSION_NONE;
+static __thread CURL *_xs_curl_handle = NULL;
+
+
+static void _xs_curl_lock(CURL *handle, curl_lock_data data,
+                          curl_lock_access access, void *userptr)
+{
+    (void)handle;
+    (void)access;
+    (void)userptr;
+
+    pthread_mutex_lock(&_xs_curl_locks[data]);
+}
+
+
+static void _xs_curl_unlock(CURL *handle, curl_lock_data data, void *userptr)
+{
+    (void)handle;
+    (void)userptr;
+
+    pthread_mutex_unlock(&_xs_curl_locks[data]);
+}
+
+
+void xs_curl_reuse(int max_conns, int http2)
+/* enables connection reuse (must be called before starting any thread) */
+{
+    int n;
+
+    /* HTTP/2 over TLS if the server supports it, or HTTP/1.1 only */
+    _xs_curl_http_version = http2 ? CURL_HTTP_VERSION_2TLS : CURL_HTTP_VERSION_1_1;
+
+    if (_xs_curl_share != NULL || max_conns <= 0)
+        return;
+
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+
+    for (n = 0; n < CURL_LOCK_DATA_LAST; n++)
+        pthread_mutex_init(&_xs_curl_locks[n], NULL);
+
+    if ((_xs_curl_share = curl_share_init()) == NULL)
+        return;
+
+    curl_share_setopt(_xs_curl_share, CURLSHOPT_LOCKFUNC,   _xs_curl_lock);
+    curl_share_setopt(_xs_curl_share, CURLSHOPT_UNLOCKFUNC, _xs_curl_unlock);
+    curl_share_setopt(_xs_curl_share, CURLSHOPT_SHARE,      CURL_LOCK_DATA_DNS);
+    curl_share_setopt(_xs_curl_share, CURLSHOPT_SHARE,      CURL_LOCK_DATA_SSL_SESSION);
+
+    _xs_curl_max_conns = max_conns;
+}
+
+
+void xs_curl_thread_cleanup(void)
+/* closes the connections kept by this thread */
+{
+    if (_xs_curl_handle != NULL) {
+        curl_easy_cleanup(_xs_curl_handle);
+        _xs_curl_handle = NULL;
+    }
+}
 
 static size_t _header_callback(char *buffer, size_t size,
                                size_t nitems, xs_dict **userdata)
@@ -106,7 +177,20 @@ xs_dict *xs_http_request(const char *method, const char *url,
 
     response = xs_dict_new();
 
-    curl = curl_easy_init();
+    if (_xs_curl_share != NULL) {
+        /* reuse this thread's handle, keeping its open connections */
+        if (_xs_curl_handle == NULL)
+            _xs_curl_handle = curl_easy_init();
+        else
+            curl_easy_reset(_xs_curl_handle);
+
+        curl = _xs_curl_handle;
+
+        curl_easy_setopt(curl, CURLOPT_SHARE,       _xs_curl_share);
+        curl_easy_setopt(curl, CURLOPT_MAXCONNECTS, _xs_curl_max_conns);
+    }
+    else
+        curl = curl_easy_init();
 
     curl_easy_setopt(curl, CURLOPT_URL, url);
 
@@ -118,6 +202,9 @@ xs_dict *xs_http_request(const char *method, const char *url,
 #ifdef FORCE_HTTP_1_1
     /* force HTTP/1.1 */
     curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+#else
+    if (_xs_curl_http_version != CURL_HTTP_VERSION_NONE)
+        curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, _xs_curl_http_version);
 #endif
 
     /* obey redirections */
@@ -168,7 +255,8 @@ xs_dict *xs_http_request(const char *method, const char *url,
 
     curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &lstatus);
 
-    curl_easy_cleanup(curl);
+    if (curl != _xs_curl_handle)
+        curl_easy_cleanup(curl);
 
     curl_slist_free_all(list);
 
@@ -14,6 +14,9 @@
 
  xs_dict *xs_fcgi_request(FILE *f, xs_str **payload, int *p_size, int *id);
  void xs_fcgi_response(FILE *f, int status, const xs_dict *headers, const xs_str *body, int b_size, int id);
+ int xs_fcgi_response_file(FILE *f, int status, const xs_dict *headers, int fd, off_t offset, off_t size, int id);
+ int xs_fcgi_response_start(FILE *f, int status, const xs_dict *headers, int id);
+ int xs_fcgi_response_chunk(FILE *f, const char *data, int size, int id);
 
 
 #ifdef XS_IMPLEMENTATION
@@ -290,20 +293,13 @@ end:
 }
 
 
-void xs_fcgi_response(FILE *f, int status, const xs_dict *headers, const xs_str *body, int b_size, int fcgi_id)
-/* writes an FCGI response */
+static xs_str *_xs_fcgi_response_headers(int status, const xs_dict *headers, off_t b_size)
+/* creates the headers of an FCGI response */
 {
-    struct fcgi_record_header hdr = {0};
-    struct fcgi_end_request ereq = {0};
-    xs *out = xs_str_new(NULL);
+    xs_str *out = xs_str_new(NULL);
     const xs_str *k;
     const xs_str *v;
 
-    /* no previous id? it's an error */
-    if (fcgi_id == -1)
-        return;
-
-    /* create the headers */
     {
         xs *s1 = xs_fmt("status: %d\r\n", status);
         out = xs_str_cat(out, s1);
@@ -315,22 +311,21 @@ void xs_fcgi_response(FILE *f, int status, const xs_dict *headers, const xs_str
     }
 
     if (b_size > 0) {
-        xs *s1 = xs_fmt("content-length: %d\r\n", b_size);
+        xs *s1 = xs_fmt("content-length: %lld\r\n", (long long)b_size);
         out = xs_str_cat(out, s1);
     }
 
     out = xs_str_cat(out, "\r\n");
 
-    /* everything is text by now */
-    int size = strlen(out);
+    return out;
+}
 
-    /* add the body */
-    if (body != NULL && b_size > 0) {
-        out = xs_append_m(out, body, b_size);
-        size += b_size;
-    }
 
-    /* now send all the STDOUT in packets */
+static int _xs_fcgi_stdout(FILE *f, const char *data, int size, int fcgi_id)
+/* sends data as STDOUT packets */
+{
+    struct fcgi_record_header hdr = {0};
+
     hdr.version = FCGI_VERSION_1;
     hdr.type    = FCGI_STDOUT;
     hdr.id      = fcgi_id;
@@ -345,12 +340,26 @@ void xs_fcgi_response(FILE *f, int status, const xs_dict *headers, const xs_str
         hdr.content_len = htons(sz);
 
         /* write or fail */
-        if (!fwrite(&hdr, sizeof(hdr), 1, f) || fwrite(out + offset, 1, sz, f) != sz)
-            return;
+        if (!fwrite(&hdr, sizeof(hdr), 1, f) || fwrite(data + offset, 1, sz, f) != sz)
+            return -1;
 
         offset += sz;
     }
 
+    return 0;
+}
+
+
+static void _xs_fcgi_end(FILE *f, int fcgi_id)
+/* completes an FCGI response */
+{
+    struct fcgi_record_header hdr = {0};
+    struct fcgi_end_request ereq = {0};
+
+    hdr.version = FCGI_VERSION_1;
+    hdr.type    = FCGI_STDOUT;
+    hdr.id      = fcgi_id;
+
     /* final STDOUT packet with 0 size */
     hdr.content_len = 0;
     if (!fwrite(&hdr, sizeof(hdr), 1, f))
@@ -368,6 +377,108 @@ void xs_fcgi_response(FILE *f, int status, const xs_dict *headers, const xs_str
 }
 
 
+void xs_fcgi_response(FILE *f, int status, const xs_dict *headers, const xs_str *body, int b_size, int fcgi_id)
+/* writes an FCGI response */
+{
+    /* no previous id? it's an error */
+    if (fcgi_id == -1)
+        return;
+
+    /* create the headers */
+    xs *out = _xs_fcgi_response_headers(status, headers, b_size);
+
+    /* everything is text by now */
+    int size = strlen(out);
+
+    /* add the body */
+    if (body != NULL && b_size > 0) {
+        out = xs_append_m(out, body, b_size);
+        size += b_size;
+    }
+
+    /* now send all the STDOUT in packets */
+    if (_xs_fcgi_stdout(f, out, size, fcgi_id) == -1)
+        return;
+
+    _xs_fcgi_end(f, fcgi_id);
+}
+
+
+int xs_fcgi_response_file(FILE *f, int status, const xs_dict *headers, int fd, off_t offset, off_t size, int fcgi_id)
+/* writes an FCGI response with size bytes from offset of an open file
+   as the body (headers only if fd is -1), read in bounded chunks.
+   Returns -1 if the body could not be sent completely */
+{
+    int ret = 0;
+
+    /* no previous id? it's an error */
+    if (fcgi_id == -1)
+        return -1;
+
+    xs *out = _xs_fcgi_response_headers(status, headers, size);
+
+    if (_xs_fcgi_stdout(f, out, strlen(out), fcgi_id) == -1)
+        return -1;
+
+    if (fd != -1) {
+        char buf[0xffff];
+
+        while (size > 0) {
+            ssize_t r = pread(fd, buf, size > (off_t)sizeof(buf) ? (off_t)sizeof(buf) : size, offset);
+
+            if (r == -1 && errno == EINTR)
+                continue;
+
+            if (r <= 0 || _xs_fcgi_stdout(f, buf, r, fcgi_id) == -1) {
+                ret = -1;
+                break;
+            }
+
+            offset += r;
+            size   -= r;
+        }
+    }
+
+    /* the response is always completed; the receiver will
+       see the content length mismatch if it failed */
+    _xs_fcgi_end(f, fcgi_id);
+
+    return ret;
+}
+
+
+int xs_fcgi_response_start(FILE *f, int status, const xs_dict *headers, int fcgi_id)
+/* writes the headers of an FCGI response whose body
+   will be sent in chunks. Returns -1 on error */
+{
+    /* no previous id? it's an error */
+    if (fcgi_id == -1)
+        return -1;
+
+    xs *out = _xs_fcgi_response_headers(status, headers, 0);
+
+    if (_xs_fcgi_stdout(f, out, strlen(out), fcgi_id) == -1)
+        return -1;
+
+    return fflush(f) == EOF ? -1 : 0;
+}
+
+
+int xs_fcgi_response_chunk(FILE *f, const char *data, int size, int fcgi_id)
+/* writes a chunk of the body of an FCGI response (a size
+   of 0 completes it). Returns -1 on error */
+{
+    if (size > 0) {
+        if (_xs_fcgi_stdout(f, data, size, fcgi_id) == -1)
+            return -1;
+    }
+    else
+        _xs_fcgi_end(f, fcgi_id);
+
+    return fflush(f) == EOF ? -1 : 0;
+}
+
+
 #endif /* XS_IMPLEMENTATION */
 
 #endif /* XS_URL_H */
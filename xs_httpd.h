@@ -7,10 +7,20 @@
 xs_dict *xs_httpd_request(FILE *f, xs_str **payload, int *p_size);
 void xs_httpd_response(FILE *f, int status, const char *status_text,
                         const xs_dict *headers, const xs_val *body, int b_size);
+int xs_httpd_response_file(FILE *f, int status, const char *status_text,
+                        const xs_dict *headers, int fd, off_t offset, off_t size);
+int xs_httpd_response_start(FILE *f, int status, const char *status_text,
+                        const xs_dict *headers);
+int xs_httpd_response_chunk(FILE *f, const char *data, int size);
+int xs_httpd_range(const char *range, off_t size, off_t *start, off_t *len);
 
 
 #ifdef XS_IMPLEMENTATION
 
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
 xs_dict *xs_httpd_request(FILE *f, xs_str **payload, int *p_size)
 /* processes an httpd connection */
 {
@@ -20,7 +30,14 @@ xs_dict *xs_httpd_request(FILE *f, xs_str **payload, int *p_size)
     const char *v;
     char *saveptr;
 
-    xs_socket_timeout(fileno(f), 2.0, 0.0);
+    /* in-memory streams (already read requests) don't have a descriptor */
+    int fd = fileno(f);
+
+    /* don't inherit errors from previous requests or from fileno() */
+    errno = 0;
+
+    if (fd != -1)
+        xs_socket_timeout(fd, 2.0, 0.0);
 
     /* read the first line and split it */
     l1 = xs_strip_i(xs_readline(f));
@@ -80,7 +97,8 @@ xs_dict *xs_httpd_request(FILE *f, xs_str **payload, int *p_size)
         req = xs_dict_append(req, xs_tolower_i(l), cnt);
     }
 
-    xs_socket_timeout(fileno(f), 5.0, 0.0);
+    if (fd != -1)
+        xs_socket_timeout(fd, 5.0, 0.0);
 
     if ((v = xs_dict_get(req, "content-length")) != NULL) {
         /* if it has a payload, load it */
@@ -138,9 +156,9 @@ xs_dict *xs_httpd_request(FILE *f, xs_str **payload, int *p_size)
 }
 
 
-void xs_httpd_response(FILE *f, int status, const char *status_text,
-                        const xs_dict *headers, const xs_val *body, int b_size)
-/* sends an httpd response */
+static void _xs_httpd_response_headers(FILE *f, int status, const char *status_text,
+                        const xs_dict *headers, off_t b_size)
+/* sends the status line and headers of an httpd response */
 {
     fprintf(f, "HTTP/1.1 %d %s\r\n", status, status_text ? status_text : "");
 
@@ -151,16 +169,166 @@ void xs_httpd_response(FILE *f, int status, const char *status_text,
         fprintf(f, "%s: %s\r\n", k, v);
     }
 
-    if (b_size != 0)
-        fprintf(f, "content-length: %d\r\n", b_size);
+    /* always send it (unless forbidden or chunked), as persistent
+       connections need it to know where the body ends */
+    if (b_size < 0)
+        fprintf(f, "transfer-encoding: chunked\r\n");
+    else
+    if (b_size != 0 || (status >= 200 && status != 204 && status != 304))
+        fprintf(f, "content-length: %lld\r\n", (long long)b_size);
 
     fprintf(f, "\r\n");
+}
+
+
+void xs_httpd_response(FILE *f, int status, const char *status_text,
+                        const xs_dict *headers, const xs_val *body, int b_size)
+/* sends an httpd response */
+{
+    _xs_httpd_response_headers(f, status, status_text, headers, b_size);
 
     if (body != NULL && b_size != 0)
         fwrite(body, b_size, 1, f);
 }
 
 
+int xs_httpd_response_file(FILE *f, int status, const char *status_text,
+                        const xs_dict *headers, int fd, off_t offset, off_t size)
+/* sends an httpd response with size bytes from offset of an open file
+   as the body (headers only if fd is -1). The body doesn't go through
+   the FILE buffer nor through user space, if possible. Returns -1 if
+   the body could not be sent completely */
+{
+    _xs_httpd_response_headers(f, status, status_text, headers, size);
+
+    if (fflush(f) == EOF)
+        return -1;
+
+    if (fd == -1)
+        return 0;
+
+    int o = fileno(f);
+
+    while (size > 0) {
+        ssize_t r;
+
+#ifdef __linux__
+        r = sendfile(o, fd, &offset, size > 0x40000000 ? 0x40000000 : size);
+#else
+        char buf[65536];
+
+        if ((r = pread(fd, buf, size > (off_t)sizeof(buf) ? (off_t)sizeof(buf) : size, offset)) > 0) {
+            ssize_t w, n = 0;
+
+            while (n < r && (w = write(o, buf + n, r - n)) > 0)
+                n += w;
+
+            if (n < r)
+                r = -1;
+            else
+                offset += r;
+        }
+#endif
+
+        if (r == -1 && errno == EINTR)
+            continue;
+
+        if (r <= 0)
+            return -1;
+
+        size -= r;
+    }
+
+    return 0;
+}
+
+
+int xs_httpd_response_start(FILE *f, int status, const char *status_text,
+                        const xs_dict *headers)
+/* sends the status line and headers of an httpd response whose
+   body will be sent in chunks. Returns -1 on error */
+{
+    _xs_httpd_response_headers(f, status, status_text, headers, -1);
+
+    return fflush(f) == EOF ? -1 : 0;
+}
+
+
+int xs_httpd_response_chunk(FILE *f, const char *data, int size)
+/* sends a chunk of the body (a size of 0 ends it). Returns -1 on error */
+{
+    if (size > 0) {
+        fprintf(f, "%x\r\n", size);
+        fwrite(data, size, 1, f);
+        fprintf(f, "\r\n");
+    }
+    else
+        fprintf(f, "0\r\n\r\n");
+
+    return fflush(f) == EOF ? -1 : 0;
+}
+
+
+int xs_httpd_range(const char *range, off_t size, off_t *start, off_t *len)
+/* parses a Range header for a body of size bytes. Returns 1 if it's a
+   valid single range (start and len are set), -1 if it cannot be
+   satisfied, or 0 if it must be ignored (the full body is sent) */
+{
+    long long a, b;
+    char c;
+
+    if (!xs_startswith(range, "bytes="))
+        return 0;
+
+    range += 6;
+
+    /* multiple ranges are not supported */
+    if (strchr(range, ',') != NULL)
+        return 0;
+
+    if (sscanf(range, "-%lld%c", &b, &c) == 1) {
+        /* suffix: the last b bytes */
+        if (b <= 0 || size == 0)
+            return -1;
+
+        if (b > size)
+            b = size;
+
+        *start = size - b;
+        *len   = b;
+    }
+    else
+    if (sscanf(range, "%lld-%lld%c", &a, &b, &c) == 2) {
+        if (a < 0 || a > b)
+            return 0;
+
+        if (a >= size)
+            return -1;
+
+        if (b >= size)
+            b = size - 1;
+
+        *start = a;
+        *len   = b - a + 1;
+    }
+    else
+    if (sscanf(range, "%lld-%c", &a, &c) == 1 && range[strlen(range) - 1] == '-') {
+        if (a < 0)
+            return 0;
+
+        if (a >= size)
+            return -1;
+
+        *start = a;
+        *len   = size - a;
+    }
+    else
+        return 0;
+
+    return 1;
+}
+
+
 #endif /* XS_IMPLEMENTATION */
 
 #endif /* XS_HTTPD_H */
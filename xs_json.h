@@ -29,6 +29,9 @@ int xs_json_load_object(FILE *f, int maxdepth, xs_dict **d);
 /** IMPLEMENTATION **/
 
 #include "xs_unicode.h"
+#include "xs_hex.h"
+
+#include <sys/stat.h>
 
 /** JSON dumps **/
 
@@ -558,41 +561,322 @@ xstype xs_json_load_type(FILE *f)
 }
 
 
-xs_val *xs_json_load_full(FILE *f, int maxdepth)
-/* loads a JSON file */
+/** in-memory JSON loads **/
+
+/* This parses a whole JSON buffer from memory, much faster than the
+   fgetc()-based lexer above (that is kept for the iterator interface).
+   Both give the same results */
+
+typedef struct {
+    const char *p;      /* current position */
+    const char *e;      /* end of buffer (must have a trailing NUL) */
+} xs_json_mem;
+
+
+static void _xs_json_mem_blanks(xs_json_mem *m)
+{
+    while (m->p < m->e && (*m->p == ' ' || *m->p == '\t' || *m->p == '\n' || *m->p == '\r'))
+        m->p++;
+}
+
+
+static int _xs_json_mem_hex4(xs_json_mem *m, unsigned int *cp)
+/* reads up to 4 hex digits */
+{
+    int n;
+
+    *cp = 0;
+
+    for (n = 0; n < 4 && m->p < m->e && xs_is_hex_digit(*m->p); n++) {
+        char c = *m->p++;
+
+        *cp = *cp * 16 + (c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+    }
+
+    return n > 0;
+}
+
+
+static xs_str *_xs_json_mem_string(xs_json_mem *m)
+/* parses a string (after the opening quote) */
+{
+    /* characters that end a run of plain ones */
+    static const char stop[] = "\"\\"
+        "\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f"
+        "\x10\x11\x12\x13\x14\x15\x16\x17\x18\x19\x1a\x1b\x1c\x1d\x1e\x1f";
+    char *v = NULL;
+    int sz = 0;
+    int al = 0;
+
+    for (;;) {
+        size_t n = strcspn(m->p, stop);
+
+        if (m->p + n > m->e)
+            n = m->e - m->p;
+
+        /* room for the run plus an eventual codepoint and the NUL */
+        if (sz + (int)n + 5 > al) {
+            al = (sz + n + 5) * 2;
+            v  = xs_realloc(v, al);
+        }
+
+        memcpy(v + sz, m->p, n);
+        sz += n;
+        m->p += n;
+
+        if (m->p >= m->e)
+            break;
+
+        unsigned char c = *m->p++;
+
+        if (c == '"') {
+            v[sz] = '\0';
+
+            /* don't waste the extra room */
+            return xs_realloc(v, _xs_blk_size(sz + 1));
+        }
+
+        if (c == '\\') {
+            unsigned int cp = m->p < m->e ? (unsigned char)*m->p++ : 0;
+
+            switch (cp) {
+            case 'n': cp = '\n'; break;
+            case 'r': cp = '\r'; break;
+            case 't': cp = '\t'; break;
+            case '"': cp = '"'; break;
+            case '\\': cp = '\\'; break;
+            case '/': cp = '/'; break;
+            case 'u': /* Unicode codepoint as an hex char */
+                if (!_xs_json_mem_hex4(m, &cp))
+                    return xs_free(v);
+
+                if (xs_is_surrogate(cp)) {
+                    /* \u must follow */
+                    unsigned int p2;
+
+                    if (m->e - m->p < 2 || m->p[0] != '\\' || m->p[1] != 'u')
+                        return xs_free(v);
+
+                    m->p += 2;
+
+                    if (!_xs_json_mem_hex4(m, &p2))
+                        return xs_free(v);
+
+                    cp = xs_surrogate_dec(cp, p2);
+                }
+
+                /* replace dangerous control codes with their visual representations */
+                if (cp == 0 || (cp < ' ' && !strchr("\r\n\t", cp)))
+                    cp += 0x2400;
+
+                break;
+
+            default:
+                return xs_free(v);
+            }
+
+            sz += xs_utf8_enc(v + sz, cp);
+        }
+        else {
+            /* a control character (or an embedded NUL) */
+            sz += xs_utf8_enc(v + sz, c + 0x2400);
+        }
+    }
+
+    /* unterminated */
+    return xs_free(v);
+}
+
+
+static xs_val *_xs_json_mem_value(xs_json_mem *m, int maxdepth, int *err)
+/* parses a value. Opening a list or object beyond maxdepth is an error,
+   as it is for the stream parser */
 {
     xs_val *v = NULL;
-    xstype t = xs_json_load_type(f);
 
-    if (t == XSTYPE_LIST) {
-        v = xs_list_new();
-        xs_json_load_array(f, maxdepth, &v);
+    _xs_json_mem_blanks(m);
+
+    if (m->p >= m->e) {
+        *err = 1;
+        return NULL;
+    }
+
+    char c = *m->p++;
+
+    if (c == '[' || c == '{') {
+        int obj = c == '{';
+        char close = obj ? '}' : ']';
+        int cnt = 0;
+        int done = 0;
+
+        if (maxdepth < 0) {
+            *err = 1;
+            return NULL;
+        }
+
+        v = obj ? xs_dict_new() : xs_list_new();
+
+        for (;;) {
+            xs *k = NULL;
+
+            _xs_json_mem_blanks(m);
+
+            if (m->p < m->e && *m->p == close) {
+                m->p++;
+                done = 1;
+                break;
+            }
+
+            if (cnt > 0) {
+                if (m->p >= m->e || *m->p != ',')
+                    break;
+
+                m->p++;
+                _xs_json_mem_blanks(m);
+            }
+
+            if (obj) {
+                if (m->p >= m->e || *m->p != '"')
+                    break;
+
+                m->p++;
+
+                if ((k = _xs_json_mem_string(m)) == NULL)
+                    break;
+
+                _xs_json_mem_blanks(m);
+
+                if (m->p >= m->e || *m->p != ':')
+                    break;
+
+                m->p++;
+            }
+
+            xs *e = _xs_json_mem_value(m, maxdepth - 1, err);
+
+            if (*err)
+                break;
+
+            if (e) {
+                if (obj)
+                    v = xs_dict_append(v, k, e);
+                else
+                    v = xs_list_append(v, e);
+            }
+
+            cnt++;
+        }
+
+        if (!done || *err) {
+            *err = 1;
+            v = xs_free(v);
+        }
     }
     else
-    if (t == XSTYPE_DICT) {
-        v = xs_dict_new();
-        xs_json_load_object(f, maxdepth, &v);
+    if (c == '"') {
+        if ((v = _xs_json_mem_string(m)) == NULL)
+            *err = 1;
     }
+    else
+    if (c == '-' || (c >= '0' && c <= '9') || c == '.') {
+        char *end;
+        double d = strtod(m->p - 1, &end);
+
+        if (end == m->p - 1)
+            *err = 1;
+        else {
+            m->p = end;
+            v = xs_number_new(d);
+        }
+    }
+    else
+    if (c == 't' && m->e - m->p >= 3 && memcmp(m->p, "rue", 3) == 0) {
+        m->p += 3;
+        v = xs_val_new(XSTYPE_TRUE);
+    }
+    else
+    if (c == 'f' && m->e - m->p >= 4 && memcmp(m->p, "alse", 4) == 0) {
+        m->p += 4;
+        v = xs_val_new(XSTYPE_FALSE);
+    }
+    else
+    if (c == 'n' && m->e - m->p >= 3 && memcmp(m->p, "ull", 3) == 0) {
+        m->p += 3;
+        v = xs_val_new(XSTYPE_NULL);
+    }
+    else
+        *err = 1;
 
     return v;
 }
 
 
-xs_val *xs_json_loads_full(const xs_str *json, int maxdepth)
-/* loads a string in JSON format and converts to a multiple data */
+static xs_val *_xs_json_loads_mem(const char *json, int size, int maxdepth, int *consumed)
+/* loads a JSON list or object from a NUL-terminated buffer */
 {
-    FILE *f;
+    xs_json_mem m = { json, json + size };
     xs_val *v = NULL;
+    int err = 0;
 
-    if ((f = fmemopen((char *)json, strlen(json), "r")) != NULL) {
-        v = xs_json_load_full(f, maxdepth);
-        fclose(f);
-    }
+    _xs_json_mem_blanks(&m);
+
+    /* only lists and objects are accepted at the top level */
+    if (m.p < m.e && (*m.p == '[' || *m.p == '{'))
+        v = _xs_json_mem_value(&m, maxdepth, &err);
+
+    if (err)
+        v = xs_free(v);
+
+    if (consumed)
+        *consumed = m.p - json;
 
     return v;
 }
 
 
+xs_val *xs_json_load_full(FILE *f, int maxdepth)
+/* loads a JSON file */
+{
+    xs_val *v = NULL;
+    long pos = ftell(f);
+    struct stat st;
+    xs_str *s;
+    int size = 0;
+    int n;
+
+    /* read the rest of the stream, in just one block if possible */
+    if (pos != -1 && fstat(fileno(f), &st) != -1 && S_ISREG(st.st_mode) && st.st_size > pos)
+        size = st.st_size - pos;
+
+    s = xs_realloc(NULL, _xs_blk_size(size + 1));
+    size = fread(s, 1, size, f);
+
+    do {
+        s = xs_realloc(s, _xs_blk_size(size + 16384 + 1));
+        size += (n = fread(s + size, 1, 16384, f));
+    } while (n > 0);
+
+    s[size] = '\0';
+
+    v = _xs_json_loads_mem(s, size, maxdepth, &n);
+
+    /* leave the stream after the loaded value, as the lexer did */
+    if (pos != -1)
+        fseek(f, pos + n, SEEK_SET);
+
+    xs_free(s);
+
+    return v;
+}
+
+
+xs_val *xs_json_loads_full(const xs_str *json, int maxdepth)
+/* loads a string in JSON format and converts to a multiple data */
+{
+    return _xs_json_loads_mem(json, strlen(json), maxdepth, NULL);
+}
+
+
 #endif /* XS_IMPLEMENTATION */
 
 #endif /* _XS_JSON_H */
@@ -22,6 +22,11 @@ xs_val *xs_base64_dec(const xs_str *data, int *size);
 xs_dict *xs_evp_genkey(int bits);
 xs_str *xs_evp_sign(const char *secret, const char *mem, int size);
 int xs_evp_verify(const char *pubkey, const char *mem, int size, const char *b64sig);
+void *xs_evp_key_load(const char *pem, int secret);
+void *xs_evp_key_ref(void *pkey);
+void xs_evp_key_free(void *pkey);
+xs_str *xs_evp_sign_key(void *pkey, const char *mem, int size);
+int xs_evp_verify_key(void *pkey, const char *mem, int size, const char *b64sig);
 
 
 #ifdef XS_IMPLEMENTATION
@@ -157,20 +162,51 @@ xs_dict *xs_evp_genkey(int bits)
 }
 
 
-xs_str *xs_evp_sign(const char *secret, const char *mem, int size)
-/* signs a memory block (secret is in PEM format) */
+void *xs_evp_key_load(const char *pem, int secret)
+/* parses a PEM key (secret or public), to be used many times */
+{
+    BIO *b = BIO_new_mem_buf(pem, strlen(pem));
+    EVP_PKEY *pkey;
+
+    if (secret)
+        pkey = PEM_read_bio_PrivateKey(b, NULL, NULL, NULL);
+    else
+        pkey = PEM_read_bio_PUBKEY(b, NULL, NULL, NULL);
+
+    BIO_free(b);
+
+    return pkey;
+}
+
+
+void *xs_evp_key_ref(void *pkey)
+/* adds a reference to a parsed key */
+{
+    if (pkey != NULL)
+        EVP_PKEY_up_ref(pkey);
+
+    return pkey;
+}
+
+
+void xs_evp_key_free(void *pkey)
+/* drops a reference to a parsed key */
+{
+    EVP_PKEY_free(pkey);
+}
+
+
+xs_str *xs_evp_sign_key(void *pkey, const char *mem, int size)
+/* signs a memory block with a parsed secret key */
 {
     xs_str *signature = NULL;
-    BIO *b;
     unsigned char *sig;
     unsigned int sig_len;
-    EVP_PKEY *pkey;
     EVP_MD_CTX *mdctx;
     const EVP_MD *md;
 
-    /* un-PEM the key */
-    b = BIO_new_mem_buf(secret, strlen(secret));
-    pkey = PEM_read_bio_PrivateKey(b, NULL, NULL, NULL);
+    if (pkey == NULL)
+        return NULL;
 
     /* I've learnt all these magical incantations by watching
        the Python module code and the OpenSSL manual pages */
@@ -190,48 +226,63 @@ xs_str *xs_evp_sign(const char *secret, const char *mem, int size)
         signature = xs_base64_enc((char *)sig, sig_len);
 
     EVP_MD_CTX_free(mdctx);
-    EVP_PKEY_free(pkey);
-    BIO_free(b);
     xs_free(sig);
 
     return signature;
 }
 
 
-int xs_evp_verify(const char *pubkey, const char *mem, int size, const char *b64sig)
-/* verifies a base64 block, returns non-zero on ok */
+xs_str *xs_evp_sign(const char *secret, const char *mem, int size)
+/* signs a memory block (secret is in PEM format) */
+{
+    void *pkey = xs_evp_key_load(secret, 1);
+    xs_str *signature = xs_evp_sign_key(pkey, mem, size);
+
+    xs_evp_key_free(pkey);
+
+    return signature;
+}
+
+
+int xs_evp_verify_key(void *pkey, const char *mem, int size, const char *b64sig)
+/* verifies a base64 block with a parsed public key, returns non-zero on ok */
 {
     int r = 0;
-    BIO *b;
-    EVP_PKEY *pkey;
     EVP_MD_CTX *mdctx;
     const EVP_MD *md;
 
-    /* un-PEM the key */
-    b = BIO_new_mem_buf(pubkey, strlen(pubkey));
-    pkey = PEM_read_bio_PUBKEY(b, NULL, NULL, NULL);
+    if (pkey == NULL)
+        return 0;
 
     md = EVP_get_digestbyname("sha256");
     mdctx = EVP_MD_CTX_new();
 
-    if (pkey != NULL) {
-        xs *sig = NULL;
-        int s_size;
+    xs *sig = NULL;
+    int s_size;
 
-        /* de-base64 */
-        sig = xs_base64_dec(b64sig,  &s_size);
+    /* de-base64 */
+    sig = xs_base64_dec(b64sig,  &s_size);
 
-        if (sig != NULL) {
-            EVP_VerifyInit(mdctx, md);
-            EVP_VerifyUpdate(mdctx, mem, size);
+    if (sig != NULL) {
+        EVP_VerifyInit(mdctx, md);
+        EVP_VerifyUpdate(mdctx, mem, size);
 
-            r = EVP_VerifyFinal(mdctx, (unsigned char *)sig, s_size, pkey);
-        }
+        r = EVP_VerifyFinal(mdctx, (unsigned char *)sig, s_size, pkey);
     }
 
     EVP_MD_CTX_free(mdctx);
-    EVP_PKEY_free(pkey);
-    BIO_free(b);
+
+    return r;
+}
+
+
+int xs_evp_verify(const char *pubkey, const char *mem, int size, const char *b64sig)
+/* verifies a base64 block, returns non-zero on ok */
+{
+    void *pkey = xs_evp_key_load(pubkey, 0);
+    int r = xs_evp_verify_key(pkey, mem, size, b64sig);
+
+    xs_evp_key_free(pkey);
 
     return r;
 }